@@ -7,7 +7,70 @@
 ** Licensed under BSD3
 */
 
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "mpc.h"
+#include <time.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#else
+#include <process.h>
+#endif
+
+/*
+** Locks
+**
+** Guard the few tables shared between threads. On
+** Windows mpc starts no threads of its own and the
+** locks do nothing.
+*/
+
+#ifndef _WIN32
+typedef pthread_mutex_t mpc_lock_t;
+#define MPC_LOCK_INIT PTHREAD_MUTEX_INITIALIZER
+#else
+typedef int mpc_lock_t;
+#define MPC_LOCK_INIT 0
+#endif
+
+static void mpc_lock_init(mpc_lock_t *l) {
+#ifndef _WIN32
+    pthread_mutex_init(l, NULL);
+#else
+    *l = 0;
+#endif
+}
+
+static void mpc_lock_free(mpc_lock_t *l) {
+#ifndef _WIN32
+    pthread_mutex_destroy(l);
+#else
+    (void)l;
+#endif
+}
+
+static void mpc_lock(mpc_lock_t *l) {
+#ifndef _WIN32
+    pthread_mutex_lock(l);
+#else
+    (void)l;
+#endif
+}
+
+static void mpc_unlock(mpc_lock_t *l) {
+#ifndef _WIN32
+    pthread_mutex_unlock(l);
+#else
+    (void)l;
+#endif
+}
 
 /*
 ** State Type
@@ -64,18 +127,57 @@ static mpc_state_t mpc_state_new(void) {
 ** backtracking and make LL(1) grammars easy
 ** to parse for all input methods.
 **
+** Lastly there are Tokens, a String which has
+** been run through a lexer first. Each token is
+** one byte of `string` holding its kind, so
+** backtracking works on it as is, and positions
+** count tokens rather than bytes. No characters
+** can be read from it, so only tokens and the end
+** of input match. The text of each token is found
+** in `source`, and states only become rows and
+** columns of the source once they leave the input.
+**
 */
 
 enum {
     MPC_INPUT_STRING = 0,
     MPC_INPUT_FILE   = 1,
-    MPC_INPUT_PIPE   = 2
+    MPC_INPUT_PIPE   = 2,
+    MPC_INPUT_TOKENS = 3
 };
 
 enum {
     MPC_INPUT_MARKS_MIN = 32
 };
 
+/*
+** A regex automaton or first byte check builds no
+** errors as it goes. Instead each regex tried at the
+** furthest position failed at so far is recorded,
+** and a placeholder stands in the errors for those
+** its own parser would have made. Only if the errors
+** are wanted is that parser run from where the regex
+** was tried to give them. A placeholder is an expected
+** string of `MPC_INPUT_TRY_MARK` and a try number, and
+** stands for the errors the try merged then the one
+** it returned. A try straight after another at the
+** same position joins its group, as the placeholder
+** is still last in the errors, rather than adding
+** another. Tries need the input rewound, so aren't
+** used on pipes.
+*/
+
+#define MPC_INPUT_TRY_MARK '\001'
+
+typedef struct {
+    mpc_parser_t *p;
+    mpc_state_t state;
+    char last;
+    int backtrack;
+    int split;
+    long group;
+} mpc_input_try_t;
+
 enum {
     MPC_INPUT_MEM_NUM = 512
 };
@@ -84,6 +186,11 @@ typedef struct {
     char mem[64];
 } mpc_mem_t;
 
+typedef struct {
+    mpc_state_t state;
+    long length;
+} mpc_token_t;
+
 typedef struct {
 
     int type;
@@ -98,10 +205,45 @@ typedef struct {
     int backtrack;
     int marks_slots;
     int marks_num;
+    int marks_cut;
+    int marks_scope;
+    int cut;
+    int skip;
     mpc_state_t *marks;
 
+    int budget;
+    int exhausted;
+    long steps;
+    long steps_max;
+    long bytes;
+    long bytes_max;
+    double time_start;
+    double time_max;
+    mpc_state_t exhausted_state;
+
+    mpc_input_try_t *tries;
+    int tries_num;
+    int tries_slots;
+    long tries_base;
+    long tries_pos;
+
+    int hooks;
+    int hooked;
+    mpc_profile_t *profile;
+    FILE *trace;
+    double trace_start;
+    long trace_events;
+
+    mpc_parse_stats_t counts;
+    mpc_parse_stats_t *stats;
+    mpc_ast_arena_t *ast_arena;
+
     char *lasts;
     char last;
+    long reach;
+
+    char *source;
+    mpc_token_t *tokens;
 
     size_t mem_index;
     char mem_full[MPC_INPUT_MEM_NUM];
@@ -127,10 +269,33 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
     i->suppress = 0;
     i->backtrack = 1;
     i->marks_num = 0;
+    i->marks_cut = 0;
+    i->marks_scope = 0;
+    i->cut = 0;
+    i->skip = 0;
+    i->budget = 0;
+    i->exhausted = 0;
+    i->hooks = 0;
+    i->hooked = 0;
+    i->profile = NULL;
+    i->trace = NULL;
+    i->stats = NULL;
+    i->ast_arena = NULL;
+    memset(&i->counts, 0, sizeof(mpc_parse_stats_t));
+    i->tries = NULL;
+    i->tries_num = 0;
+    i->tries_slots = 0;
+    i->tries_base = 0;
+    i->tries_pos = -1;
+    i->steps = 0;
+    i->bytes = 0;
     i->marks_slots = MPC_INPUT_MARKS_MIN;
     i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
     i->lasts = malloc(sizeof(char) * i->marks_slots);
     i->last = '\0';
+    i->reach = 0;
+    i->source = NULL;
+    i->tokens = NULL;
 
     i->mem_index = 0;
     memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
@@ -157,10 +322,33 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
     i->suppress = 0;
     i->backtrack = 1;
     i->marks_num = 0;
+    i->marks_cut = 0;
+    i->marks_scope = 0;
+    i->cut = 0;
+    i->skip = 0;
+    i->budget = 0;
+    i->exhausted = 0;
+    i->hooks = 0;
+    i->hooked = 0;
+    i->profile = NULL;
+    i->trace = NULL;
+    i->stats = NULL;
+    i->ast_arena = NULL;
+    memset(&i->counts, 0, sizeof(mpc_parse_stats_t));
+    i->tries = NULL;
+    i->tries_num = 0;
+    i->tries_slots = 0;
+    i->tries_base = 0;
+    i->tries_pos = -1;
+    i->steps = 0;
+    i->bytes = 0;
     i->marks_slots = MPC_INPUT_MARKS_MIN;
     i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
     i->lasts = malloc(sizeof(char) * i->marks_slots);
     i->last = '\0';
+    i->reach = 0;
+    i->source = NULL;
+    i->tokens = NULL;
 
     i->mem_index = 0;
     memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
@@ -186,10 +374,33 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
     i->suppress = 0;
     i->backtrack = 1;
     i->marks_num = 0;
+    i->marks_cut = 0;
+    i->marks_scope = 0;
+    i->cut = 0;
+    i->skip = 0;
+    i->budget = 0;
+    i->exhausted = 0;
+    i->hooks = 0;
+    i->hooked = 0;
+    i->profile = NULL;
+    i->trace = NULL;
+    i->stats = NULL;
+    i->ast_arena = NULL;
+    memset(&i->counts, 0, sizeof(mpc_parse_stats_t));
+    i->tries = NULL;
+    i->tries_num = 0;
+    i->tries_slots = 0;
+    i->tries_base = 0;
+    i->tries_pos = -1;
+    i->steps = 0;
+    i->bytes = 0;
     i->marks_slots = MPC_INPUT_MARKS_MIN;
     i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
     i->lasts = malloc(sizeof(char) * i->marks_slots);
     i->last = '\0';
+    i->reach = 0;
+    i->source = NULL;
+    i->tokens = NULL;
 
     i->mem_index = 0;
     memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
@@ -214,10 +425,33 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
     i->suppress = 0;
     i->backtrack = 1;
     i->marks_num = 0;
+    i->marks_cut = 0;
+    i->marks_scope = 0;
+    i->cut = 0;
+    i->skip = 0;
+    i->budget = 0;
+    i->exhausted = 0;
+    i->hooks = 0;
+    i->hooked = 0;
+    i->profile = NULL;
+    i->trace = NULL;
+    i->stats = NULL;
+    i->ast_arena = NULL;
+    memset(&i->counts, 0, sizeof(mpc_parse_stats_t));
+    i->tries = NULL;
+    i->tries_num = 0;
+    i->tries_slots = 0;
+    i->tries_base = 0;
+    i->tries_pos = -1;
+    i->steps = 0;
+    i->bytes = 0;
     i->marks_slots = MPC_INPUT_MARKS_MIN;
     i->marks = malloc(sizeof(mpc_state_t) * i->marks_slots);
     i->lasts = malloc(sizeof(char) * i->marks_slots);
     i->last = '\0';
+    i->reach = 0;
+    i->source = NULL;
+    i->tokens = NULL;
 
     i->mem_index = 0;
     memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
@@ -229,11 +463,16 @@ static void mpc_input_delete(mpc_input_t *i) {
 
     free(i->filename);
 
-    if (i->type == MPC_INPUT_STRING) { free(i->string); }
+    if (i->trace) { fputs("\n]\n", i->trace); }
+
+    if (i->type == MPC_INPUT_STRING || i->type == MPC_INPUT_TOKENS) { free(i->string); }
     if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
 
     free(i->marks);
     free(i->lasts);
+    free(i->tries);
+    free(i->source);
+    free(i->tokens);
     free(i);
 }
 
@@ -247,7 +486,7 @@ static void *mpc_malloc(mpc_input_t *i, size_t n) {
     size_t j;
     char *p;
 
-    if (n > sizeof(mpc_mem_t)) { return malloc(n); }
+    if (n > sizeof(mpc_mem_t)) { i->counts.heap++; return malloc(n); }
 
     j = i->mem_index;
     do {
@@ -255,11 +494,13 @@ static void *mpc_malloc(mpc_input_t *i, size_t n) {
             p = (void*)(i->mem + i->mem_index);
             i->mem_full[i->mem_index] = 1;
             i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
+            i->counts.pool_hits++;
             return p;
         }
         i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
     } while (j != i->mem_index);
 
+    i->counts.pool_misses++;
     return malloc(n);
 }
 
@@ -283,6 +524,7 @@ static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
     if (!mpc_mem_ptr(i, p)) { return realloc(p, n); }
 
     if (n > sizeof(mpc_mem_t)) {
+        i->counts.heap++;
         q = malloc(n);
         memcpy(q, p, sizeof(mpc_mem_t));
         mpc_free(i, p);
@@ -311,6 +553,7 @@ static void mpc_input_mark(mpc_input_t *i) {
 
     if (i->backtrack < 1) { return; }
 
+    i->counts.marks++;
     i->marks_num++;
 
     if (i->marks_num > i->marks_slots) {
@@ -329,12 +572,15 @@ static void mpc_input_mark(mpc_input_t *i) {
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
-    int j;
+    int j, k;
 
     if (i->backtrack < 1) { return; }
 
+    k = i->state.pos - i->marks[0].pos;
     i->marks_num--;
 
+    if (i->marks_cut > i->marks_num) { i->marks_cut = i->marks_num; }
+
     if (i->marks_slots > i->marks_num + i->marks_num / 2
         &&  i->marks_slots > MPC_INPUT_MARKS_MIN) {
         i->marks_slots =
@@ -345,7 +591,7 @@ static void mpc_input_unmark(mpc_input_t *i) {
     }
 
     if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-        for (j = strlen(i->buffer) - 1; j >= 0; j--)
+        for (j = strlen(i->buffer) - 1; j >= k; j--)
             ungetc(i->buffer[j], i->file);
 
         free(i->buffer);
@@ -358,6 +604,11 @@ static void mpc_input_rewind(mpc_input_t *i) {
 
     if (i->backtrack < 1) { return; }
 
+    if (i->marks_num <= i->marks_cut) { i->cut = 1; }
+    if (i->state.pos > i->reach) { i->reach = i->state.pos; }
+
+    i->counts.rewinds++;
+
     i->state = i->marks[i->marks_num-1];
     i->last  = i->lasts[i->marks_num-1];
 
@@ -368,6 +619,156 @@ static void mpc_input_rewind(mpc_input_t *i) {
     mpc_input_unmark(i);
 }
 
+/*
+** Committing drops every backtracking point taken
+** since the innermost enclosing choice or rule was
+** entered. Those marks are collapsed onto the
+** current position. When there are no marks from
+** outside that scope a Pipe can also let go of the
+** input it has buffered so far.
+**
+** Rewinding to one of these collapsed marks
+** means a failure has happened after the commit.
+** Such a failure can't be recovered from inside the
+** scope, so the input is flagged and choices stop
+** trying other alternatives until the scope is left.
+*/
+
+static void mpc_input_commit(mpc_input_t *i) {
+
+    int j;
+    char *buffer;
+
+    if (i->backtrack < 1 || i->marks_num <= i->marks_scope) { return; }
+
+    if (i->type == MPC_INPUT_PIPE && i->buffer && i->marks_scope == 0) {
+        j = i->state.pos - i->marks[0].pos;
+        buffer = malloc(strlen(i->buffer + j) + 1);
+        strcpy(buffer, i->buffer + j);
+        free(i->buffer);
+        i->buffer = buffer;
+    }
+
+    for (j = i->marks_scope; j < i->marks_num; j++) {
+        i->marks[j] = i->state;
+        i->lasts[j] = i->last;
+    }
+
+    i->marks_cut = i->marks_num;
+}
+
+/*
+** Every choice and rule is a scope for the cuts
+** inside it. On the way out the input is put back
+** as the scope found it. If a cut inside failed the
+** position is rewound to where the scope began, so
+** the failure looks like any other to the parsers
+** around it. A Pipe can only go back that far when
+** there was a mark outside the scope holding on to
+** the input.
+*/
+
+typedef struct {
+    mpc_state_t state;
+    char last;
+    int cut;
+    int marks_cut;
+    int marks_scope;
+} mpc_input_scope_t;
+
+static void mpc_input_scope_enter(mpc_input_t *i, mpc_input_scope_t *s) {
+    s->state = i->state;
+    s->last = i->last;
+    s->cut = i->cut;
+    s->marks_cut = i->marks_cut;
+    s->marks_scope = i->marks_scope;
+    i->marks_scope = i->marks_num;
+}
+
+static void mpc_input_scope_leave(mpc_input_t *i, mpc_input_scope_t *s) {
+
+    if (i->cut && !s->cut && (i->type != MPC_INPUT_PIPE || i->marks_scope > 0)) {
+        i->state = s->state;
+        i->last = s->last;
+        if (i->type == MPC_INPUT_FILE) {
+            fseek(i->file, i->state.pos, SEEK_SET);
+        }
+    }
+
+    i->cut = s->cut;
+    i->marks_cut = s->marks_cut;
+    i->marks_scope = s->marks_scope;
+}
+
+/*
+** Times are read from the monotonic clock. Unlike
+** `clock`, which is the processor time of the whole
+** process, this only counts time this parse took
+** even when other threads are parsing alongside it.
+*/
+
+static double mpc_time(void) {
+    struct timespec t;
+#ifdef _WIN32
+    timespec_get(&t, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &t);
+#endif
+    return (double)t.tv_sec + 1e-9 * (double)t.tv_nsec;
+}
+
+/*
+** The budget is checked on entry to every parser.
+** The clock is only read once every so many steps
+** as it is more expensive than the counters. Once
+** the budget runs out the parse is cut, so every
+** parser fails from then on, even those which can't
+** otherwise fail such as `mpc_many`, and the parse
+** as a whole fails rather than returning what it
+** had matched so far.
+*/
+
+enum {
+    MPC_INPUT_CLOCK_STEPS = 256
+};
+
+static void mpc_input_budget(mpc_input_t *i, const mpc_parse_opts_t *opts) {
+    if (opts == NULL) { return; }
+    i->steps_max = opts->max_steps;
+    i->bytes_max = opts->max_bytes;
+    i->time_max = opts->max_time;
+    i->time_start = mpc_time();
+    i->budget = i->steps_max > 0 || i->bytes_max > 0 || opts->max_time > 0;
+    i->profile = opts->profile;
+    i->trace = opts->trace;
+    i->stats = opts->stats;
+    i->ast_arena = opts->ast_arena;
+    i->hooks = i->profile || i->trace;
+    if (i->trace) {
+        fputc('[', i->trace);
+        i->trace_start = mpc_time();
+        i->trace_events = 0;
+    }
+}
+
+static int mpc_input_exhausted(mpc_input_t *i) {
+
+    if (i->exhausted) { return 1; }
+
+    i->steps++;
+
+    if ((i->steps_max > 0 && i->steps > i->steps_max)
+    ||  (i->bytes_max > 0 && i->bytes > i->bytes_max)
+    ||  (i->time_max > 0 && i->steps % MPC_INPUT_CLOCK_STEPS == 0
+                         && mpc_time() - i->time_start > i->time_max)) {
+        i->exhausted = 1;
+        i->exhausted_state = i->state;
+        i->cut = 1;
+    }
+
+    return i->exhausted;
+}
+
 static int mpc_input_buffer_in_range(mpc_input_t *i) {
     return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
 }
@@ -383,6 +784,7 @@ static char mpc_input_getc(mpc_input_t *i) {
     switch (i->type) {
 
         case MPC_INPUT_STRING: return i->string[i->state.pos];
+        case MPC_INPUT_TOKENS: return '\0';
         case MPC_INPUT_FILE: c = fgetc(i->file); return c;
         case MPC_INPUT_PIPE:
 
@@ -406,6 +808,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
 
     switch (i->type) {
         case MPC_INPUT_STRING: return i->string[i->state.pos];
+        case MPC_INPUT_TOKENS: return '\0';
         case MPC_INPUT_FILE:
 
             c = fgetc(i->file);
@@ -444,7 +847,8 @@ static int mpc_input_terminated(mpc_input_t *i) {
 static int mpc_input_failure(mpc_input_t *i, char c) {
 
     switch (i->type) {
-        case MPC_INPUT_STRING: { break; }
+        case MPC_INPUT_STRING:
+        case MPC_INPUT_TOKENS: { break; }
         case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
         case MPC_INPUT_PIPE: {
 
@@ -471,6 +875,7 @@ static int mpc_input_success(mpc_input_t *i, char c, char **o) {
     }
 
     i->last = c;
+    i->bytes++;
     i->state.pos++;
     i->state.col++;
 
@@ -544,8 +949,10 @@ static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
     }
     mpc_input_unmark(i);
 
-    *o = mpc_malloc(i, strlen(c) + 1);
-    strcpy(*o, c);
+    if (o) {
+        *o = mpc_malloc(i, strlen(c) + 1);
+        strcpy(*o, c);
+    }
     return 1;
 }
 
@@ -563,7 +970,7 @@ static int mpc_input_eoi(mpc_input_t* i, char **o) {
     *o = NULL;
     if (i->state.term) {
         return 0;
-    } else if (mpc_input_terminated(i)) {
+    } else if (i->type == MPC_INPUT_TOKENS ? i->string[i->state.pos] == '\0' : mpc_input_terminated(i)) {
         i->state.term = 1;
         return 1;
     } else {
@@ -571,9 +978,38 @@ static int mpc_input_eoi(mpc_input_t* i, char **o) {
     }
 }
 
+static int mpc_input_token(mpc_input_t *i, char x, char **o) {
+
+    mpc_token_t *t;
+
+    if (i->type != MPC_INPUT_TOKENS || i->string[i->state.pos] != x) { return 0; }
+
+    t = &i->tokens[i->state.pos];
+    i->last = x;
+    i->bytes++;
+    i->state.pos++;
+
+    if (o) {
+        *o = mpc_malloc(i, t->length + 1);
+        memcpy(*o, i->source + t->state.pos, t->length);
+        (*o)[t->length] = '\0';
+    }
+
+    return 1;
+}
+
+/* Gives the position in the source of a state taken from a Token input */
+static mpc_state_t mpc_input_source_state(mpc_input_t *i, mpc_state_t s) {
+    mpc_state_t r;
+    if (i->type != MPC_INPUT_TOKENS || s.pos < 0) { return s; }
+    r = i->tokens[s.pos].state;
+    r.term = s.term;
+    return r;
+}
+
 static mpc_state_t *mpc_input_state_copy(mpc_input_t *i) {
     mpc_state_t *r = mpc_malloc(i, sizeof(mpc_state_t));
-    memcpy(r, &i->state, sizeof(mpc_state_t));
+    *r = mpc_input_source_state(i, i->state);
     return r;
 }
 
@@ -674,6 +1110,7 @@ char *mpc_err_string(mpc_err_t *x) {
 static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
     mpc_err_t *x;
     if (i->suppress) { return NULL; }
+    i->counts.errors++;
     x = mpc_malloc(i, sizeof(mpc_err_t));
     x->filename = mpc_malloc(i, strlen(i->filename) + 1);
     strcpy(x->filename, i->filename);
@@ -690,6 +1127,7 @@ static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
 static mpc_err_t *mpc_err_fail(mpc_input_t *i, const char *failure) {
     mpc_err_t *x;
     if (i->suppress) { return NULL; }
+    i->counts.errors++;
     x = mpc_malloc(i, sizeof(mpc_err_t));
     x->filename = mpc_malloc(i, strlen(i->filename) + 1);
     strcpy(x->filename, i->filename);
@@ -728,6 +1166,10 @@ static void mpc_err_delete_internal(mpc_input_t *i, mpc_err_t *x) {
 
 static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_t *x) {
     int j;
+    if (i->type == MPC_INPUT_TOKENS && x->state.pos >= 0) {
+        if (x->expected_num) { x->received = i->source[i->tokens[x->state.pos].state.pos]; }
+        x->state = mpc_input_source_state(i, x->state);
+    }
     for (j = 0; j < x->expected_num; j++) {
         x->expected[j] = mpc_export(i, x->expected[j]);
     }
@@ -880,8 +1322,46 @@ static mpc_err_t *mpc_err_count(mpc_input_t *i, mpc_err_t *x, int n) {
     return y;
 }
 
+/*
+** Merging gives the error which is further on, or both
+** expected lists at the same position. When that is
+** just one of the errors as it is, it is kept rather
+** than copied.
+*/
+
+static int mpc_err_keeps(mpc_err_t *x) {
+    return x->failure == NULL || x->expected_num == 0;
+}
+
 static mpc_err_t *mpc_err_merge(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
+
+    int j;
     mpc_err_t *errs[2];
+
+    if (x == NULL && (y == NULL || mpc_err_keeps(y))) { return y; }
+    if (y == NULL && mpc_err_keeps(x)) { return x; }
+
+    if (x && y && y->state.pos < x->state.pos && mpc_err_keeps(x)) {
+        mpc_err_delete_internal(i, y);
+        return x;
+    }
+
+    if (x && y && x->state.pos < y->state.pos && mpc_err_keeps(y)) {
+        mpc_err_delete_internal(i, x);
+        return y;
+    }
+
+    if (x && y && x->state.pos == y->state.pos && !x->failure && !y->failure) {
+        for (j = 0; j < y->expected_num; j++) {
+            if (!mpc_err_contains_expected(i, x, y->expected[j])) { break; }
+        }
+        if (j == y->expected_num) {
+            x->received = y->received;
+            mpc_err_delete_internal(i, y);
+            return x;
+        }
+    }
+
     errs[0] = x;
     errs[1] = y;
     return mpc_err_or(i, errs, 2);
@@ -925,7 +1405,14 @@ enum {
     MPC_TYPE_CHECK_WITH = 26,
 
     MPC_TYPE_SOI        = 27,
-    MPC_TYPE_EOI        = 28
+    MPC_TYPE_EOI        = 28,
+
+    MPC_TYPE_CUT        = 29,
+    MPC_TYPE_SKIP       = 30,
+
+    MPC_TYPE_REGEX      = 31,
+    MPC_TYPE_EXPR       = 32,
+    MPC_TYPE_TOKEN      = 33
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -937,7 +1424,7 @@ typedef struct { char x; char y; } mpc_pdata_range_t;
 typedef struct { int(*f)(char); } mpc_pdata_satisfy_t;
 typedef struct { char *x; } mpc_pdata_string_t;
 typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;
-typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_to_t;
+typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; int id; } mpc_pdata_apply_to_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_t f; char *e; } mpc_pdata_check_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_with_t f; void *d; char *e; } mpc_pdata_check_with_t;
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
@@ -945,6 +1432,9 @@ typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
 typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct mpc_re_body_t mpc_re_body_t;
+typedef struct { mpc_parser_t *x; unsigned char *t; int states; int classes; int flags; int depth; mpc_re_body_t *body; } mpc_pdata_regex_t;
+typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; unsigned char *ps; mpc_dtor_t dx; } mpc_pdata_expr_t;
 
 typedef union {
     mpc_pdata_fail_t fail;
@@ -964,13 +1454,16 @@ typedef union {
     mpc_pdata_repeat_t repeat;
     mpc_pdata_and_t and;
     mpc_pdata_or_t or;
+    mpc_pdata_regex_t regex;
+    mpc_pdata_expr_t expr;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
-    char *name;
-    mpc_pdata_t data;
     char type;
     char retained;
+    char frozen;
+    mpc_pdata_t data;
+    char *name;
 };
 
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
@@ -993,6 +1486,13 @@ static mpc_val_t *mpcf_input_strfold(mpc_input_t *i, int n, mpc_val_t **xs) {
     return xs[0];
 }
 
+static mpc_ast_t *mpc_ast_new_in(mpc_ast_arena_t *x, const char *tag, const char *contents);
+static mpc_ast_t *mpc_ast_fold(mpc_ast_arena_t *x, int n, mpc_ast_t **as);
+
+static mpc_val_t *mpcf_input_fold_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
+    return mpc_ast_fold(i->ast_arena, n, (mpc_ast_t**)xs);
+}
+
 static mpc_val_t *mpcf_input_state_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
     mpc_state_t *s = ((mpc_state_t**)xs)[0];
     mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
@@ -1004,6 +1504,7 @@ static mpc_val_t *mpcf_input_state_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
 
 static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t **xs) {
     int j;
+    if (i->skip)             { return NULL; }
     if (f == mpcf_null)      { return mpcf_null(n, xs); }
     if (f == mpcf_fst)       { return mpcf_fst(n, xs); }
     if (f == mpcf_snd)       { return mpcf_snd(n, xs); }
@@ -1013,6 +1514,7 @@ static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t
     if (f == mpcf_trd_free)  { return mpcf_input_trd_free(i, n, xs); }
     if (f == mpcf_strfold)   { return mpcf_input_strfold(i, n, xs); }
     if (f == mpcf_state_ast) { return mpcf_input_state_ast(i, n, xs); }
+    if (f == mpcf_fold_ast && i->ast_arena) { return mpcf_input_fold_ast(i, n, xs); }
     for (j = 0; j < n; j++) { xs[j] = mpc_export(i, xs[j]); }
     return f(j, xs);
 }
@@ -1023,7 +1525,7 @@ static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
 }
 
 static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
-    mpc_ast_t *a = mpc_ast_new("", c);
+    mpc_ast_t *a = mpc_ast_new_in(i->ast_arena, "", c);
     mpc_free(i, c);
     return a;
 }
@@ -1034,3032 +1536,9234 @@ static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x) {
     return f(mpc_export(i, x));
 }
 
-static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t *x, mpc_val_t *d) {
-    return f(mpc_export(i, x), d);
+static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, const mpc_pdata_apply_to_t *d, mpc_val_t *x) {
+    x = d->f(mpc_export(i, x), d->d);
+    return d->id ? mpc_ast_add_tag_id(x, d->id) : x;
 }
 
 static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
+    if (d == NULL) { return; }
     if (d == free) { mpc_free(i, x); return; }
     d(mpc_export(i, x));
 }
 
+/*
+** Once input is committed a failing repetition can't
+** hand back what it has collected so far. For the
+** built-in folds the type of each element is known
+** so it can be released here instead. Any other fold
+** is given the elements, as a fold owns its inputs,
+** and what it makes is released with the destructor
+** the repetition's parent gave for its output.
+*/
+
+static mpc_dtor_t mpc_parse_fold_dtor(mpc_fold_t f) {
+    if (f == mpcf_strfold)  { return free; }
+    if (f == mpcf_all_free) { return free; }
+    if (f == mpcf_fold_ast) { return (mpc_dtor_t)mpc_ast_delete; }
+    return NULL;
+}
+
+static void mpc_parse_fold_release(mpc_input_t *i, mpc_pdata_repeat_t *d, int n, mpc_result_t *xs) {
+
+    int j;
+    mpc_dtor_t dx = mpc_parse_fold_dtor(d->f);
+
+    if (dx) {
+        for (j = 0; j < n; j++) { mpc_parse_dtor(i, dx, xs[j].output); }
+    } else if (n > 0) {
+        mpc_parse_dtor(i, d->dx, mpc_parse_fold(i, d->f, n, (mpc_val_t**)xs));
+    }
+}
+
+/*
+** Regexes compiled to an automaton by `mpc_re_mode`
+** are matched against string input here in a single
+** pass. The table starts with the set of bytes a match
+** can begin with. If there is an automaton the byte
+** classes follow, then which states accept, then the
+** transitions. State 0 is dead and state 1 is the
+** start. The longest match is exactly what the regex's
+** own parser would find.
+*/
+
 enum {
-    MPC_PARSE_STACK_MIN = 4
+    MPC_RE_DFA_SOI      = 1,
+    MPC_RE_DFA_SOI_LINE = 2,
+    MPC_RE_DFA_EOI      = 4,
+    MPC_RE_DFA_EOI_LINE = 8,
+    MPC_RE_DFA_FIRST    = 16
 };
 
-#define MPC_SUCCESS(x) r->output = x; return 1
-#define MPC_FAILURE(x) r->error = x; return 0
-#define MPC_PRIMITIVE(x) \
-  if (x) { MPC_SUCCESS(r->output); } \
-  else { MPC_FAILURE(NULL); }
-
-#define MPC_MAX_RECURSION_DEPTH 1000
+static size_t mpc_re_dfa_size(const mpc_pdata_regex_t *d) {
+    if (d->states == 0) { return 32; }
+    return 32 + 256 + (size_t)d->states + (size_t)d->states * (size_t)d->classes;
+}
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+/*
+** Regexes which can't match nothing fail straight away
+** when the next byte can't begin a match, which is
+** most of the time for a regex tried as one of many
+** alternatives at every token.
+*/
 
-    int j = 0, k = 0;
-    mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
-    mpc_result_t *results;
-    int results_slots = MPC_PARSE_STACK_MIN;
+static int mpc_input_regex_first(mpc_input_t *i, const mpc_pdata_regex_t *d) {
+    unsigned char c;
+    if (!(d->flags & MPC_RE_DFA_FIRST)) { return 1; }
+    c = (unsigned char)mpc_input_peekc(i);
+    return (d->t[c / 8] >> (c % 8)) & 1;
+}
 
-    if (depth == MPC_MAX_RECURSION_DEPTH)
-    {
-        MPC_FAILURE(mpc_err_fail(i, "Maximum recursion depth exceeded!"));
+static void mpc_state_advance(mpc_state_t *s, const char *c, long n) {
+    long j;
+    for (j = 0; j < n; j++) {
+        if (c[j] == '\n') {
+            s->col = 0;
+            s->row++;
+        } else {
+            s->col++;
+        }
     }
+    s->pos += n;
+}
 
-    switch (p->type) {
+/*
+** Records a regex tried at `s` which got as far as
+** `far` before it failed or stopped matching. If it
+** failed a placeholder error is returned, and if not
+** one is merged, unless the try joined a group whose
+** placeholder is already there. Nothing needs to be
+** recorded when the regex didn't get as far as the
+** errors already found, as its own would be dropped.
+*/
 
-        /* Basic Parsers */
+enum {
+    MPC_INPUT_TRIES_MIN = 8
+};
 
-        case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
-        case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
-        case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
-        case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
-        case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
-        case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
-        case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
-        case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
-        case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
-        case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
+static mpc_err_t *mpc_input_try(mpc_input_t *i, mpc_parser_t *p, mpc_err_t **e,
+                                mpc_state_t s, char last, long far, int failed) {
 
-            /* Other parsers */
+    mpc_input_try_t *t;
+    mpc_err_t *x;
+    char mark[32];
+    char received;
+    long id;
 
-        case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
-        case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-        case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
-        case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
-        case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
-        case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
+    if (i->suppress || (*e && far < (*e)->state.pos)) { return NULL; }
 
-            /* Application Parsers */
+    /* Tries behind this one can't be in the final error */
+    if (far > i->tries_pos) {
+        i->tries_base += i->tries_num;
+        i->tries_num = 0;
+        i->tries_pos = far;
+    }
 
-        case MPC_TYPE_APPLY:
-            if (mpc_parse_run(i, p->data.apply.x, r, e, depth+1)) {
-                MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
-            } else {
-                MPC_FAILURE(r->output);
-            }
+    if (i->tries_num == i->tries_slots) {
+        i->tries_slots = i->tries_slots ? i->tries_slots * 2 : MPC_INPUT_TRIES_MIN;
+        i->tries = realloc(i->tries, sizeof(mpc_input_try_t) * i->tries_slots);
+    }
 
-        case MPC_TYPE_APPLY_TO:
-            if (mpc_parse_run(i, p->data.apply_to.x, r, e, depth+1)) {
-                MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
-            } else {
-                MPC_FAILURE(r->error);
-            }
+    id = i->tries_base + i->tries_num;
+    t = &i->tries[i->tries_num++];
+    t->p = p;
+    t->state = s;
+    t->last = last;
+    t->backtrack = i->backtrack;
+    t->split = 0;
+    t->group = id;
+
+    if (i->tries_num > 1 && *e && (*e)->state.pos == far && (*e)->expected_num > 0) {
+        sprintf(mark, "%c%li", MPC_INPUT_TRY_MARK, t[-1].group);
+        if (strcmp((*e)->expected[(*e)->expected_num-1], mark) == 0) { t->group = t[-1].group; }
+    }
 
-        case MPC_TYPE_CHECK:
-            if (mpc_parse_run(i, p->data.check.x, r, e, depth+1)) {
-                if (p->data.check.f(&r->output)) {
-                    MPC_SUCCESS(r->output);
-                } else {
-                    mpc_parse_dtor(i, p->data.check.dx, r->output);
-                    MPC_FAILURE(mpc_err_fail(i, p->data.check.e));
-                }
-            } else {
-                MPC_FAILURE(r->error);
-            }
+    if (t->group != id && !failed) { return NULL; }
+    sprintf(mark, "%c%li", MPC_INPUT_TRY_MARK, t->group);
 
-        case MPC_TYPE_CHECK_WITH:
-            if (mpc_parse_run(i, p->data.check_with.x, r, e, depth+1)) {
-                if (p->data.check_with.f(&r->output, p->data.check_with.d)) {
-                    MPC_SUCCESS(r->output);
-                } else {
-                    mpc_parse_dtor(i, p->data.check.dx, r->output);
-                    MPC_FAILURE(mpc_err_fail(i, p->data.check_with.e));
-                }
-            } else {
-                MPC_FAILURE(r->error);
-            }
+    if (far > s.pos) {
+        mpc_state_advance(&s, i->string + s.pos, far - s.pos);
+        received = i->string[far];
+    } else {
+        received = mpc_input_peekc(i);
+    }
 
-        case MPC_TYPE_EXPECT:
-            mpc_input_suppress_enable(i);
-            if (mpc_parse_run(i, p->data.expect.x, r, e, depth+1)) {
-                mpc_input_suppress_disable(i);
-                MPC_SUCCESS(r->output);
-            } else {
-                mpc_input_suppress_disable(i);
-                MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
-            }
+    x = mpc_err_new(i, mark);
+    x->state = s;
+    x->received = received;
 
-        case MPC_TYPE_PREDICT:
-            mpc_input_backtrack_disable(i);
-            if (mpc_parse_run(i, p->data.predict.x, r, e, depth+1)) {
-                mpc_input_backtrack_enable(i);
-                MPC_SUCCESS(r->output);
-            } else {
-                mpc_input_backtrack_enable(i);
-                MPC_FAILURE(r->error);
-            }
+    if (failed) { return x; }
+    *e = mpc_err_merge(i, *e, x);
+    return NULL;
+}
 
-            /* Optional Parsers */
+static int mpc_input_regex(mpc_input_t *i, mpc_parser_t *p, mpc_err_t **e, mpc_err_t **x, char **o) {
 
-            /* TODO: Update Not Error Message */
+    const mpc_pdata_regex_t *d = &p->data.regex;
+    const unsigned char *s = (const unsigned char*)i->string + i->state.pos;
+    const unsigned char *classes = d->t + 32;
+    const unsigned char *accept = classes + 256;
+    const unsigned char *next = accept + d->states;
+    mpc_state_t start = i->state;
+    char last = i->last;
+    long j, n = -1;
+    int state = 1, term = 0;
 
-        case MPC_TYPE_NOT:
-            mpc_input_mark(i);
-            mpc_input_suppress_enable(i);
-            if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-                mpc_input_rewind(i);
-                mpc_input_suppress_disable(i);
-                mpc_parse_dtor(i, p->data.not.dx, r->output);
-                MPC_FAILURE(mpc_err_new(i, "opposite"));
-            } else {
-                mpc_input_unmark(i);
-                mpc_input_suppress_disable(i);
-                MPC_SUCCESS(p->data.not.lf());
-            }
+    if ((d->flags & MPC_RE_DFA_SOI) && i->last != '\0'
+    && !((d->flags & MPC_RE_DFA_SOI_LINE) && i->last == '\n')) {
+        *x = mpc_input_try(i, p, e, start, last, start.pos, 1);
+        return 0;
+    }
 
-        case MPC_TYPE_MAYBE:
-            if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-                MPC_SUCCESS(r->output);
-            } else {
-                *e = mpc_err_merge(i, *e, r->error);
-                MPC_SUCCESS(p->data.not.lf());
-            }
+    if (accept[state]) { n = 0; }
+    for (j = 0; s[j] != '\0'; j++) {
+        state = next[state * d->classes + classes[s[j]]];
+        if (state == 0) { break; }
+        if (accept[state]) { n = j + 1; }
+    }
 
-            /* Repeat Parsers */
+    if (i->state.pos + j + 1 > i->reach) { i->reach = i->state.pos + j + 1; }
 
-        case MPC_TYPE_MANY:
+    /* All that was scanned counts as read, as it would without the table */
+    if (n < 0) {
+        i->bytes += j;
+        *x = mpc_input_try(i, p, e, start, last, start.pos + j, 1);
+        return 0;
+    }
 
-            results = results_stk;
+    if (d->flags & MPC_RE_DFA_EOI) {
+        if (s[n] == '\n' && ((d->flags & MPC_RE_DFA_EOI_LINE) || s[n+1] == '\0')) {
+            term = !(d->flags & MPC_RE_DFA_EOI_LINE);
+            n++;
+        } else if (s[n] == '\0' && !i->state.term) {
+            term = 1;
+        } else {
+            /* A newline is read before looking for the end */
+            if (s[n] == '\n' && j == n) { j++; }
+            i->bytes += j;
+            *x = mpc_input_try(i, p, e, start, last, start.pos + j, 1);
+            return 0;
+        }
+    }
 
-            while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-                j++;
-                if (j == MPC_PARSE_STACK_MIN) {
-                    results_slots = j + j / 2;
-                    results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-                    memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-                } else if (j >= results_slots) {
-                    results_slots = j + j / 2;
-                    results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-                }
-            }
+    mpc_state_advance(&i->state, (const char*)s, n);
+    if (n > 0) { i->last = (char)s[n-1]; }
+    i->bytes += j > n ? j : n;
+    if (term) { i->state.term = 1; }
 
-            *e = mpc_err_merge(i, *e, results[j].error);
+    if (o) {
+        *o = mpc_malloc(i, n + 1);
+        memcpy(*o, s, n);
+        (*o)[n] = '\0';
+    }
 
-            MPC_SUCCESS(
-                    mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-                    if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+    mpc_input_try(i, p, e, start, last, start.pos + (j > n ? j : n), 0);
+    return 1;
+}
 
-        case MPC_TYPE_MANY1:
+/*
+** If a parser can never fail, as far as can be
+** told by looking a few levels down its children.
+*/
 
-            results = results_stk;
+enum {
+    MPC_PARSE_INFALLIBLE_DEPTH = 16
+};
 
-            while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-                j++;
-                if (j == MPC_PARSE_STACK_MIN) {
-                    results_slots = j + j / 2;
-                    results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-                    memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-                } else if (j >= results_slots) {
-                    results_slots = j + j / 2;
-                    results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-                }
-            }
+static int mpc_parse_infallible(mpc_parser_t *p, int depth) {
 
-            if (j == 0) {
-                MPC_FAILURE(
-                        mpc_err_many1(i, results[j].error);
-                        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-            } else {
+    int j;
 
-                *e = mpc_err_merge(i, *e, results[j].error);
+    if (depth == MPC_PARSE_INFALLIBLE_DEPTH) { return 0; }
 
-                MPC_SUCCESS(
-                        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-                        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+    switch (p->type) {
+        case MPC_TYPE_PASS:
+        case MPC_TYPE_LIFT:
+        case MPC_TYPE_LIFT_VAL:
+        case MPC_TYPE_STATE:
+        case MPC_TYPE_CUT:
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MAYBE:    return 1;
+        case MPC_TYPE_EXPECT:   return mpc_parse_infallible(p->data.expect.x, depth+1);
+        case MPC_TYPE_APPLY:
+        case MPC_TYPE_SKIP:     return mpc_parse_infallible(p->data.apply.x, depth+1);
+        case MPC_TYPE_APPLY_TO: return mpc_parse_infallible(p->data.apply_to.x, depth+1);
+        case MPC_TYPE_PREDICT:  return mpc_parse_infallible(p->data.predict.x, depth+1);
+        case MPC_TYPE_REGEX:    return mpc_parse_infallible(p->data.regex.x, depth+1);
+        case MPC_TYPE_EXPR:     return mpc_parse_infallible(p->data.expr.xs[0], depth+1);
+        case MPC_TYPE_AND:
+            for (j = 0; j < p->data.and.n; j++) {
+                if (!mpc_parse_infallible(p->data.and.xs[j], depth+1)) { return 0; }
+            }
+            return 1;
+        case MPC_TYPE_OR:
+            if (p->data.or.n == 0) { return 1; }
+            for (j = 0; j < p->data.or.n; j++) {
+                if (mpc_parse_infallible(p->data.or.xs[j], depth+1)) { return 1; }
             }
+            return 0;
+        default: return 0;
+    }
+}
 
-        case MPC_TYPE_COUNT:
+enum {
+    MPC_PARSE_STACK_MIN = 4
+};
 
-            results = p->data.repeat.n > MPC_PARSE_STACK_MIN
-                      ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
-                      : results_stk;
+#define MPC_SUCCESS(x) r->output = x; return 1
+#define MPC_FAILURE(x) r->error = x; return 0
+#define MPC_PRIMITIVE(x) \
+  if (x) { MPC_SUCCESS(i->skip ? NULL : r->output); } \
+  else { MPC_FAILURE(NULL); }
+#define MPC_OUTPUT (i->skip ? NULL : (char**)&r->output)
 
-            while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-                j++;
-                if (j == p->data.repeat.n) { break; }
-            }
+#define MPC_MAX_RECURSION_DEPTH 1000
 
-            if (j == p->data.repeat.n) {
-                MPC_SUCCESS(
-                        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-                        if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-            } else {
-                for (k = 0; k < j; k++) {
-                    mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
-                }
-                MPC_FAILURE(
-                        mpc_err_count(i, results[j].error, p->data.repeat.n);
-                        if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-            }
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth);
 
-            /* Combinatory Parsers */
+/*
+** Runs the parser of a regex recorded by `mpc_input_try`
+** from where it was tried, giving the errors it would
+** have merged in `m` and the one it would have returned.
+** None of a regex's parsers are user callbacks, and
+** nothing is counted, profiled or traced, so this
+** leaves no sign it was ever run.
+*/
 
-        case MPC_TYPE_OR:
+static mpc_err_t *mpc_input_try_run(mpc_input_t *i, mpc_input_try_t *t, mpc_err_t **m) {
 
-            if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+    mpc_parse_stats_t counts = i->counts;
+    mpc_state_t state = i->state;
+    mpc_result_t r;
+    char last = i->last;
+    long bytes = i->bytes, reach = i->reach;
+    int suppress = i->suppress, backtrack = i->backtrack, cut = i->cut;
+    int marks_cut = i->marks_cut, marks_scope = i->marks_scope;
+    int skip = i->skip, hooks = i->hooks;
+
+    i->state = t->state;
+    i->last = t->last;
+    i->backtrack = t->backtrack;
+    i->suppress = 0;
+    i->cut = 0;
+    i->marks_cut = 0;
+    i->marks_scope = i->marks_num;
+    i->skip = 0;
+    i->hooks = 0;
+    if (i->type == MPC_INPUT_FILE) { fseek(i->file, i->state.pos, SEEK_SET); }
+
+    *m = NULL;
+    if (mpc_parse_run(i, t->p->data.regex.x, &r, m, 0)) {
+        mpc_free(i, r.output);
+        r.error = NULL;
+    }
 
-            results = p->data.or.n > MPC_PARSE_STACK_MIN
-                      ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-                      : results_stk;
+    i->state = state;
+    i->last = last;
+    i->backtrack = backtrack;
+    i->suppress = suppress;
+    i->cut = cut;
+    i->marks_cut = marks_cut;
+    i->marks_scope = marks_scope;
+    i->skip = skip;
+    i->hooks = hooks;
+    i->counts = counts;
+    i->bytes = bytes;
+    i->reach = reach;
+    if (i->type == MPC_INPUT_FILE) { fseek(i->file, i->state.pos, SEEK_SET); }
 
-            for (j = 0; j < p->data.or.n; j++) {
-                if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e, depth+1)) {
-                    MPC_SUCCESS(results[j].output;
-                                        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-                } else {
-                    *e = mpc_err_merge(i, *e, results[j].error);
-                }
-            }
+    return r.error;
+}
 
-            MPC_FAILURE(NULL;
-                                if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+/*
+** A repetition changes the error it is returned, so a
+** placeholder for the last try can't stand in for it.
+** Instead that try is run now, merging the errors it
+** would have merged and returning the one it would
+** have returned, and left out of its group.
+*/
 
-        case MPC_TYPE_AND:
+static mpc_err_t *mpc_input_try_split(mpc_input_t *i, mpc_err_t **e, mpc_err_t *x) {
 
-            if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+    mpc_input_try_t *t;
+    mpc_err_t *m, *y;
 
-            results = p->data.or.n > MPC_PARSE_STACK_MIN
-                      ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-                      : results_stk;
+    if (x == NULL || x->expected_num != 1 || x->expected[0][0] != MPC_INPUT_TRY_MARK
+    ||  i->tries_num == 0) { return x; }
 
-            mpc_input_mark(i);
-            for (j = 0; j < p->data.and.n; j++) {
-                if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e, depth+1)) {
-                    mpc_input_rewind(i);
-                    for (k = 0; k < j; k++) {
-                        mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
-                    }
-                    MPC_FAILURE(results[j].error;
-                                        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-                }
-            }
-            mpc_input_unmark(i);
-            MPC_SUCCESS(
-                    mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
-                    if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+    t = &i->tries[i->tries_num-1];
+    t->split = 1;
+    y = mpc_input_try_run(i, t, &m);
+    *e = mpc_err_merge(i, *e, m);
+    mpc_err_delete_internal(i, x);
+    return y;
+}
 
-            /* End */
+/*
+** Replaces the placeholders in an error with the errors
+** their tries would have made, in the order they would
+** have been added. As in `mpc_err_or` only those as far
+** on as the furthest are kept.
+*/
 
-        default:
+static mpc_err_t *mpc_err_resolve(mpc_input_t *i, mpc_err_t *x) {
 
-        MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+    int j, k, n = 0, marks = 0;
+    int *ends;
+    long pos = -1, g;
+    mpc_err_t **ys = NULL, *y;
+
+    if (x == NULL || x->failure) { return x; }
+
+    for (j = 0; j < x->expected_num; j++) {
+        if (x->expected[j][0] == MPC_INPUT_TRY_MARK) { marks++; }
     }
 
-    return 0;
+    if (marks == 0) { return x; }
 
-}
+    ends = mpc_malloc(i, sizeof(int) * x->expected_num);
+    for (j = 0; j < x->expected_num; j++) {
 
-#undef MPC_SUCCESS
-#undef MPC_FAILURE
-#undef MPC_PRIMITIVE
+        if (x->expected[j][0] != MPC_INPUT_TRY_MARK) {
+            if (x->state.pos > pos) { pos = x->state.pos; }
+            ends[j] = n;
+            continue;
+        }
 
-int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
-    int x;
-    mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
-    e->state = mpc_state_invalid();
-    x = mpc_parse_run(i, p, r, &e, 0);
-    if (x) {
-        mpc_err_delete_internal(i, e);
-        r->output = mpc_export(i, r->output);
-    } else {
-        r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
+        g = strtol(x->expected[j] + 1, NULL, 10);
+        for (k = (int)(g - i->tries_base); k >= 0 && k < i->tries_num; k++) {
+            if (i->tries[k].group != g) { break; }
+            if (i->tries[k].split) { continue; }
+            ys = mpc_realloc(i, ys, sizeof(mpc_err_t*) * (n + 2));
+            ys[n+1] = mpc_input_try_run(i, &i->tries[k], &ys[n]);
+            if (ys[n] && ys[n]->state.pos > pos) { pos = ys[n]->state.pos; }
+            if (ys[n+1] && ys[n+1]->state.pos > pos) { pos = ys[n+1]->state.pos; }
+            n += 2;
+        }
+        ends[j] = n;
     }
-    return x;
-}
 
-int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
-    int x;
-    mpc_input_t *i = mpc_input_new_string(filename, string);
-    x = mpc_parse_input(i, p, r);
-    mpc_input_delete(i);
-    return x;
-}
-
-int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
-    int x;
-    mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
-    x = mpc_parse_input(i, p, r);
-    mpc_input_delete(i);
-    return x;
-}
+    y = mpc_malloc(i, sizeof(mpc_err_t));
+    y->state = x->state;
+    y->expected_num = 0;
+    y->expected = NULL;
+    y->failure = NULL;
+    y->received = x->received;
+    y->filename = mpc_malloc(i, strlen(x->filename) + 1);
+    strcpy(y->filename, x->filename);
 
-int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
-    int x;
-    mpc_input_t *i = mpc_input_new_file(filename, file);
-    x = mpc_parse_input(i, p, r);
-    mpc_input_delete(i);
-    return x;
-}
+    for (j = 0, n = 0; j < x->expected_num; j++) {
 
-int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
-    int x;
-    mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
-    x = mpc_parse_input(i, p, r);
-    mpc_input_delete(i);
-    return x;
-}
+        if (x->expected[j][0] != MPC_INPUT_TRY_MARK) {
+            if (x->state.pos == pos && !mpc_err_contains_expected(i, y, x->expected[j])) {
+                mpc_err_add_expected(i, y, x->expected[j]);
+            }
+            continue;
+        }
 
-int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+        for (; n < ends[j]; n++) {
+            if (ys[n] == NULL) { continue; }
+            if (ys[n]->state.pos == pos) {
+                y->state = ys[n]->state;
+                y->received = ys[n]->received;
+                for (k = 0; k < ys[n]->expected_num; k++) {
+                    if (!mpc_err_contains_expected(i, y, ys[n]->expected[k])) {
+                        mpc_err_add_expected(i, y, ys[n]->expected[k]);
+                    }
+                }
+            }
+            mpc_err_delete_internal(i, ys[n]);
+        }
+    }
 
-    FILE *f = fopen(filename, "rb");
-    int res;
+    mpc_free(i, ys);
+    mpc_free(i, ends);
+    mpc_err_delete_internal(i, x);
 
-    if (f == NULL) {
-        r->output = NULL;
-        r->error = mpc_err_file(filename, "Unable to open file!");
-        return 0;
+    if (pos < 0) {
+        mpc_err_delete_internal(i, y);
+        return NULL;
     }
 
-    res = mpc_parse_file(filename, f, p, r);
-    fclose(f);
-    return res;
+    return y;
 }
 
 /*
-** Building a Parser
+** Expressions are parsed by precedence climbing in a
+** single pass, without recursion. Operands and
+** operators go on one stack, with a frame for each
+** run of operators still waiting to be folded. An
+** operator first folds every frame above its level,
+** then joins the top frame if that is at its level
+** and it is left associative, and otherwise opens a
+** new frame from the operand before it. So a run of
+** left associative operators is folded once, giving
+** the flat `a + b - c` a rule per level would give.
+** The table holds each operator's level times two,
+** plus one when it is right associative.
 */
 
-static void mpc_undefine_unretained(mpc_parser_t *p, int force);
+static void *mpc_parse_expr_grow(mpc_input_t *i, void *xs, void *stk, int *max, int num, size_t size) {
+    if (num < *max) { return xs; }
+    *max = *max * 2;
+    if (xs != stk) { return mpc_realloc(i, xs, size * *max); }
+    xs = mpc_malloc(i, size * *max);
+    memcpy(xs, stk, size * num);
+    return xs;
+}
 
-static void mpc_undefine_or(mpc_parser_t *p) {
+static int mpc_parse_expr(mpc_input_t *i, mpc_pdata_expr_t *d, mpc_result_t *r, mpc_err_t **e, int depth) {
 
-    int i;
-    for (i = 0; i < p->data.or.n; i++) {
-        mpc_undefine_unretained(p->data.or.xs[i], 0);
+    int j, k, ok = 1;
+    int vs_num = 0, vs_max = MPC_PARSE_STACK_MIN * 2;
+    int fs_num = 0, fs_max = MPC_PARSE_STACK_MIN;
+    mpc_val_t *vs_stk[MPC_PARSE_STACK_MIN * 2], **vs = vs_stk;
+    int fs_stk[MPC_PARSE_STACK_MIN], *fs = fs_stk;
+    mpc_result_t x, y;
+
+    if (!mpc_parse_run(i, d->xs[0], &x, e, depth+1)) {
+        r->error = x.error;
+        return 0;
     }
-    free(p->data.or.xs);
+    vs[vs_num++] = x.output;
 
-}
+    /* Each frame is the index of its first operand and its level */
+    while (1) {
 
-static void mpc_undefine_and(mpc_parser_t *p) {
+        mpc_input_mark(i);
 
-    int i;
-    for (i = 0; i < p->data.and.n; i++) {
-        mpc_undefine_unretained(p->data.and.xs[i], 0);
-    }
-    free(p->data.and.xs);
-    free(p->data.and.dxs);
+        for (j = 1; j <= d->n; j++) {
+            if (mpc_parse_run(i, d->xs[j], &x, e, depth+1)) { break; }
+            *e = mpc_err_merge(i, *e, x.error);
+            if (i->cut) { j = d->n + 1; break; }
+        }
 
-}
+        if (j > d->n) {
+            mpc_input_unmark(i);
+            if (i->cut) { ok = 0; y.error = NULL; }
+            break;
+        }
 
-static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
+        if (!mpc_parse_run(i, d->xs[0], &y, e, depth+1)) {
+            mpc_input_rewind(i);
+            mpc_parse_dtor(i, d->dx, x.output);
+            if (i->cut) { ok = 0; break; }
+            *e = mpc_err_merge(i, *e, y.error);
+            break;
+        }
 
-    if (p->retained && !force) { return; }
+        mpc_input_unmark(i);
 
-    switch (p->type) {
+        while (fs_num > 0 && fs[fs_num-1] % 256 / 2 > d->ps[j-1] / 2) {
+            k = fs[--fs_num] / 256;
+            vs[k] = mpc_parse_fold(i, d->f, vs_num - k, vs + k);
+            vs_num = k + 1;
+        }
 
-        case MPC_TYPE_FAIL: free(p->data.fail.m); break;
+        if (fs_num == 0 || fs[fs_num-1] % 256 / 2 != d->ps[j-1] / 2 || d->ps[j-1] % 2) {
+            fs = mpc_parse_expr_grow(i, fs, fs_stk, &fs_max, fs_num, sizeof(int));
+            fs[fs_num++] = (vs_num - 1) * 256 + d->ps[j-1];
+        }
 
-        case MPC_TYPE_ONEOF:
-        case MPC_TYPE_NONEOF:
-        case MPC_TYPE_STRING:
-            free(p->data.string.x);
-            break;
+        vs = mpc_parse_expr_grow(i, vs, vs_stk, &vs_max, vs_num + 1, sizeof(mpc_val_t*));
+        vs[vs_num++] = x.output;
+        vs[vs_num++] = y.output;
+    }
 
-        case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
-        case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
-        case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    if (ok) {
+        while (fs_num > 0) {
+            k = fs[--fs_num] / 256;
+            vs[k] = mpc_parse_fold(i, d->f, vs_num - k, vs + k);
+            vs_num = k + 1;
+        }
+        r->output = vs[0];
+    } else {
+        for (k = 0; k < vs_num; k++) { mpc_parse_dtor(i, d->dx, vs[k]); }
+        r->error = y.error;
+    }
 
-        case MPC_TYPE_MAYBE:
-        case MPC_TYPE_NOT:
-            mpc_undefine_unretained(p->data.not.x, 0);
-            break;
+    if (vs != vs_stk) { mpc_free(i, vs); }
+    if (fs != fs_stk) { mpc_free(i, fs); }
+    return ok;
+}
 
-        case MPC_TYPE_EXPECT:
-            mpc_undefine_unretained(p->data.expect.x, 0);
-            free(p->data.expect.m);
-            break;
+/*
+** Profiling and Tracing
+**
+** When the input has a profile or a trace every
+** node goes through `mpc_parse_hooked`, which calls
+** back into `mpc_parse_run` with `hooked` set so that
+** the node itself is then run as normal.
+**
+** The counts for each node are kept in an open
+** addressed table keyed on the node's address. Time
+** spent in children is collected in `children` so
+** each node is only charged for its own work. Times
+** are from `mpc_time`. What the probes themselves
+** cost is measured once when the profile is made:
+** `clock` is what a read of the clock adds to a
+** node's own time, and `probe` what a whole child
+** probe adds to its parent's. Both are taken off
+** and charged to no one.
+**
+** A trace gets a begin and an end event, in Chrome's
+** trace event format, for every named rule, so rules
+** nest as spans in a flame chart. They go through the
+** file's own buffering. Times are from `mpc_time`,
+** in microseconds since the parse began, so spans
+** are wall time even with other threads parsing.
+*/
 
-        case MPC_TYPE_MANY:
-        case MPC_TYPE_MANY1:
-        case MPC_TYPE_COUNT:
-            mpc_undefine_unretained(p->data.repeat.x, 0);
-            break;
+typedef struct {
+    mpc_parser_t *p;
+    long calls;
+    long successes;
+    long failures;
+    long rewinds;
+    long bytes;
+    double time;
+} mpc_profile_node_t;
+
+struct mpc_profile_t {
+    int flags;
+    int num;
+    int slots;
+    mpc_profile_node_t *nodes;
+    double children;
+    double clock;
+    double probe;
+};
 
-        case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
-        case MPC_TYPE_AND: mpc_undefine_and(p); break;
+enum {
+    MPC_PROFILE_SLOTS_MIN = 64,
+    MPC_PROFILE_PROBES    = 1024
+};
 
-        case MPC_TYPE_CHECK:
-            mpc_undefine_unretained(p->data.check.x, 0);
-            free(p->data.check.e);
-            break;
+static void mpc_profile_probe(mpc_profile_t *x);
+
+mpc_profile_t *mpc_profile_new(int flags) {
+    mpc_profile_t *x = malloc(sizeof(mpc_profile_t));
+    x->flags = flags;
+    x->num = 0;
+    x->slots = MPC_PROFILE_SLOTS_MIN;
+    x->nodes = calloc(x->slots, sizeof(mpc_profile_node_t));
+    x->children = 0;
+    x->clock = 0;
+    x->probe = 0;
+    if (flags & MPC_PROFILE_TIME) { mpc_profile_probe(x); }
+    return x;
+}
 
-        case MPC_TYPE_CHECK_WITH:
-            mpc_undefine_unretained(p->data.check_with.x, 0);
-            free(p->data.check_with.e);
-            break;
+void mpc_profile_delete(mpc_profile_t *x) {
+    free(x->nodes);
+    free(x);
+}
 
-        default: break;
-    }
+static mpc_profile_node_t *mpc_profile_slot(mpc_profile_node_t *nodes, int slots, mpc_parser_t *p) {
+    unsigned long h = (unsigned long)(size_t)p;
+    int j = (int)(((h >> 4) * 2654435761UL) & (unsigned long)(slots-1));
+    while (nodes[j].p && nodes[j].p != p) { j = (j+1) & (slots-1); }
+    return &nodes[j];
+}
 
-    if (!force) {
-        free(p->name);
-        free(p);
+static mpc_profile_node_t *mpc_profile_find(mpc_profile_t *x, mpc_parser_t *p) {
+
+    int j;
+    mpc_profile_node_t *n, *nodes;
+
+    n = mpc_profile_slot(x->nodes, x->slots, p);
+    if (n->p) { return n; }
+
+    /* Keep the table at most half full */
+    if ((x->num + 1) * 2 > x->slots) {
+        nodes = x->nodes;
+        x->slots *= 2;
+        x->nodes = calloc(x->slots, sizeof(mpc_profile_node_t));
+        for (j = 0; j < x->slots / 2; j++) {
+            if (nodes[j].p) { *mpc_profile_slot(x->nodes, x->slots, nodes[j].p) = nodes[j]; }
+        }
+        free(nodes);
+        n = mpc_profile_slot(x->nodes, x->slots, p);
     }
 
+    x->num++;
+    n->p = p;
+    return n;
 }
 
-void mpc_delete(mpc_parser_t *p) {
-    if (p->retained) {
+static void mpc_trace_event(mpc_input_t *i, mpc_parser_t *p, char ph) {
 
-        if (p->type != MPC_TYPE_UNDEFINED) {
-            mpc_undefine_unretained(p, 0);
-        }
+    const char *c;
 
-        free(p->name);
-        free(p);
+    fputs(i->trace_events++ ? ",\n" : "\n", i->trace);
+    fputs("{\"name\":\"", i->trace);
 
-    } else {
-        mpc_undefine_unretained(p, 0);
+    for (c = p->name; *c; c++) {
+        if (*c == '"' || *c == '\\') { fputc('\\', i->trace); }
+        if ((unsigned char)*c < 0x20) { fprintf(i->trace, "\\u%04x", *c); continue; }
+        fputc(*c, i->trace);
     }
-}
 
-static void mpc_soft_delete(mpc_val_t *x) {
-    mpc_undefine_unretained(x, 0);
+    fprintf(i->trace, "\",\"ph\":\"%c\",\"pid\":1,\"tid\":1,\"ts\":%.0f,\"args\":{\"pos\":%li",
+        ph, 1e6 * (mpc_time() - i->trace_start), i->state.pos);
 }
 
-static mpc_parser_t *mpc_undefined(void) {
-    mpc_parser_t *p = calloc(1, sizeof(mpc_parser_t));
-    p->retained = 0;
-    p->type = MPC_TYPE_UNDEFINED;
-    p->name = NULL;
-    return p;
+static void mpc_profile_count(mpc_profile_t *prof, mpc_parser_t *p, int x, long bytes, double time) {
+    /* Found after the run as children may have grown the table */
+    mpc_profile_node_t *n = mpc_profile_find(prof, p);
+    n->calls++;
+    n->bytes += bytes;
+    n->time += time;
+    if (x) { n->successes++; }
+    else   { n->failures++; if (bytes > 0) { n->rewinds++; } }
 }
 
-mpc_parser_t *mpc_new(const char *name) {
-    mpc_parser_t *p = mpc_undefined();
-    p->retained = 1;
-    p->name = realloc(p->name, strlen(name) + 1);
-    strcpy(p->name, name);
-    return p;
-}
+static void mpc_profile_probe(mpc_profile_t *x) {
 
-mpc_parser_t *mpc_copy(mpc_parser_t *a) {
-    int i = 0;
-    mpc_parser_t *p;
+    int j;
+    double start;
+    mpc_parser_t p;
+    mpc_profile_t *t = mpc_profile_new(MPC_PROFILE_DEFAULT);
 
-    if (a->retained) { return a; }
+    start = mpc_time();
+    for (j = 0; j < MPC_PROFILE_PROBES; j++) { mpc_time(); }
+    x->clock = (mpc_time() - start) / (MPC_PROFILE_PROBES + 1);
 
-    p = mpc_undefined();
-    p->retained = a->retained;
-    p->type = a->type;
-    p->data = a->data;
+    /* A child's probe is a read and a count, in its parent's time */
+    start = mpc_time();
+    for (j = 0; j < MPC_PROFILE_PROBES; j++) { mpc_profile_count(t, &p, 0, 0, mpc_time() - start); }
+    x->probe = (mpc_time() - start) / MPC_PROFILE_PROBES;
 
-    if (a->name) {
-        p->name = malloc(strlen(a->name)+1);
-        strcpy(p->name, a->name);
-    }
+    mpc_profile_delete(t);
+}
 
-    switch (a->type) {
+/*
+** A rule is a scope for the cuts inside it. It goes
+** through here, which also calls back into
+** `mpc_parse_run` with `hooked` set. A rule that is a
+** choice is already a scope of its own.
+*/
 
-        case MPC_TYPE_FAIL:
-            p->data.fail.m = malloc(strlen(a->data.fail.m)+1);
-            strcpy(p->data.fail.m, a->data.fail.m);
-            break;
+static int mpc_parse_scoped(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
 
-        case MPC_TYPE_ONEOF:
-        case MPC_TYPE_NONEOF:
-        case MPC_TYPE_STRING:
-            p->data.string.x = malloc(strlen(a->data.string.x)+1);
-            strcpy(p->data.string.x, a->data.string.x);
-            break;
+    int x;
+    mpc_input_scope_t s;
 
-        case MPC_TYPE_APPLY:    p->data.apply.x    = mpc_copy(a->data.apply.x);    break;
-        case MPC_TYPE_APPLY_TO: p->data.apply_to.x = mpc_copy(a->data.apply_to.x); break;
-        case MPC_TYPE_PREDICT:  p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
+    mpc_input_scope_enter(i, &s);
+    i->hooked = 1;
+    x = mpc_parse_run(i, p, r, e, depth);
+    mpc_input_scope_leave(i, &s);
 
-        case MPC_TYPE_MAYBE:
-        case MPC_TYPE_NOT:
-            p->data.not.x = mpc_copy(a->data.not.x);
-            break;
+    return x;
+}
 
-        case MPC_TYPE_EXPECT:
-            p->data.expect.x = mpc_copy(a->data.expect.x);
-            p->data.expect.m = malloc(strlen(a->data.expect.m)+1);
-            strcpy(p->data.expect.m, a->data.expect.m);
-            break;
+static int mpc_parse_hooked(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
 
-        case MPC_TYPE_MANY:
-        case MPC_TYPE_MANY1:
-        case MPC_TYPE_COUNT:
-            p->data.repeat.x = mpc_copy(a->data.repeat.x);
-            break;
+    int x;
+    long bytes = i->bytes;
+    double start = 0, outer = 0, inner = 0, elapsed = 0;
+    mpc_profile_t *prof = i->profile;
+    int timed = prof && prof->flags & MPC_PROFILE_TIME;
+    int traced = i->trace && p->name;
+
+    if (traced) {
+        mpc_trace_event(i, p, 'B');
+        fputs("}}", i->trace);
+    }
 
-        case MPC_TYPE_OR:
-            p->data.or.xs = malloc(a->data.or.n * sizeof(mpc_parser_t*));
-            for (i = 0; i < a->data.or.n; i++) {
-                p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
-            }
-            break;
-        case MPC_TYPE_AND:
-            p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
-            for (i = 0; i < a->data.and.n; i++) {
-                p->data.and.xs[i] = mpc_copy(a->data.and.xs[i]);
-            }
-            p->data.and.dxs = malloc((a->data.and.n-1) * sizeof(mpc_dtor_t));
-            for (i = 0; i < a->data.and.n-1; i++) {
-                p->data.and.dxs[i] = a->data.and.dxs[i];
-            }
-            break;
+    if (timed) {
+        outer = prof->children;
+        prof->children = 0;
+        start = mpc_time();
+    }
 
-        case MPC_TYPE_CHECK:
-            p->data.check.x      = mpc_copy(a->data.check.x);
-            p->data.check.e      = malloc(strlen(a->data.check.e)+1);
-            strcpy(p->data.check.e, a->data.check.e);
-            break;
-        case MPC_TYPE_CHECK_WITH:
-            p->data.check_with.x = mpc_copy(a->data.check_with.x);
-            p->data.check_with.e = malloc(strlen(a->data.check_with.e)+1);
-            strcpy(p->data.check_with.e, a->data.check_with.e);
-            break;
+    if (p->name && p->type != MPC_TYPE_OR) {
+        x = mpc_parse_scoped(i, p, r, e, depth);
+    } else {
+        i->hooked = 1;
+        x = mpc_parse_run(i, p, r, e, depth);
+    }
 
-        default: break;
+    if (timed) {
+        elapsed = mpc_time() - start;
+        inner = prof->children;
+        prof->children = outer + elapsed + prof->probe;
+        elapsed -= prof->clock;
     }
 
+    if (prof) { mpc_profile_count(prof, p, x, i->bytes - bytes, elapsed - inner); }
 
-    return p;
-}
+    if (traced) {
+        mpc_trace_event(i, p, 'E');
+        fprintf(i->trace, x ? ",\"ok\":true,\"read\":%li}}" : ",\"ok\":false,\"rewound\":%li}}", i->bytes - bytes);
+    }
 
-mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
-    mpc_undefine_unretained(p, 1);
-    p->type = MPC_TYPE_UNDEFINED;
-    return p;
+    return x;
 }
 
-mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
 
-    if (p->retained) {
-        p->type = a->type;
-        p->data = a->data;
-    } else {
-        mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
-        p->type = a2->type;
-        p->data = a2->data;
-        free(a2);
+    int j = 0, k = 0;
+    mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
+    mpc_result_t *results;
+    int results_slots = MPC_PARSE_STACK_MIN;
+    mpc_input_scope_t scope;
+
+    if (i->hooked) {
+        i->hooked = 0;
+    } else if (i->hooks) {
+        return mpc_parse_hooked(i, p, r, e, depth);
+    } else if (p->name && p->type != MPC_TYPE_OR) {
+        return mpc_parse_scoped(i, p, r, e, depth);
     }
 
-    free(a);
-    return p;
-}
-
-void mpc_cleanup(int n, ...) {
-    int i;
-    mpc_parser_t **list = malloc(sizeof(mpc_parser_t*) * n);
+    if (depth > i->counts.depth) { i->counts.depth = depth; }
 
-    va_list va;
-    va_start(va, n);
-    for (i = 0; i < n; i++) { list[i] = va_arg(va, mpc_parser_t*); }
-    for (i = 0; i < n; i++) { mpc_undefine(list[i]); }
-    for (i = 0; i < n; i++) { mpc_delete(list[i]); }
-    va_end(va);
+    if (depth == MPC_MAX_RECURSION_DEPTH)
+    {
+        MPC_FAILURE(mpc_err_fail(i, "Maximum recursion depth exceeded!"));
+    }
 
-    free(list);
-}
+    if (i->budget && mpc_input_exhausted(i)) {
+        MPC_FAILURE(NULL);
+    }
 
-mpc_parser_t *mpc_pass(void) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_PASS;
-    return p;
-}
+    switch (p->type) {
 
-mpc_parser_t *mpc_fail(const char *m) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_FAIL;
-    p->data.fail.m = malloc(strlen(m) + 1);
-    strcpy(p->data.fail.m, m);
-    return p;
-}
+        /* Basic Parsers */
 
-/*
-** As `snprintf` is not ANSI standard this
-** function `mpc_failf` should be considered
-** unsafe.
-**
-** You have a few options if this is going to be
-** trouble.
-**
-** - Ensure the format string does not exceed
-**   the buffer length using precision specifiers
-**   such as `%.512s`.
-**
-** - Patch this function in your code base to
-**   use `snprintf` or whatever variant your
-**   system supports.
-**
-** - Avoid it altogether.
-**
-*/
+        case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, MPC_OUTPUT));
+        case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, MPC_OUTPUT));
+        case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, MPC_OUTPUT));
+        case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, MPC_OUTPUT));
+        case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, MPC_OUTPUT));
+        case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, MPC_OUTPUT));
+        case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, MPC_OUTPUT));
+        case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
+        case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
+        case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
+        case MPC_TYPE_TOKEN:   MPC_PRIMITIVE(mpc_input_token(i, p->data.single.x, MPC_OUTPUT));
 
-mpc_parser_t *mpc_failf(const char *fmt, ...) {
+            /* Other parsers */
 
-    va_list va;
-    char *buffer;
+        case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
+        case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
+        case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
+        case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
+        case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
+        case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
+        case MPC_TYPE_CUT:       mpc_input_commit(i); MPC_SUCCESS(NULL);
 
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_FAIL;
+            /* Application Parsers */
+
+        case MPC_TYPE_APPLY:
+            if (mpc_parse_run(i, p->data.apply.x, r, e, depth+1)) {
+                MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
+            } else {
+                MPC_FAILURE(r->output);
+            }
+
+        case MPC_TYPE_SKIP:
+            i->skip++;
+            if (mpc_parse_run(i, p->data.apply.x, r, e, depth+1)) {
+                i->skip--;
+                MPC_SUCCESS(NULL);
+            } else {
+                i->skip--;
+                MPC_FAILURE(r->error);
+            }
+
+        case MPC_TYPE_APPLY_TO:
+            if (mpc_parse_run(i, p->data.apply_to.x, r, e, depth+1)) {
+                MPC_SUCCESS(mpc_parse_apply_to(i, &p->data.apply_to, r->output));
+            } else {
+                MPC_FAILURE(r->error);
+            }
+
+        case MPC_TYPE_REGEX:
+            if (!i->budget && i->type != MPC_INPUT_PIPE) {
+                if (p->data.regex.states
+                &&  i->type == MPC_INPUT_STRING && i->backtrack > 0
+                &&  depth + p->data.regex.depth < MPC_MAX_RECURSION_DEPTH) {
+                    if (mpc_input_regex(i, p, e, &r->error, MPC_OUTPUT)) {
+                        MPC_SUCCESS(i->skip ? NULL : r->output);
+                    } else {
+                        MPC_FAILURE(r->error);
+                    }
+                }
+                if (!mpc_input_regex_first(i, &p->data.regex)) {
+                    MPC_FAILURE(mpc_input_try(i, p, e, i->state, i->last, i->state.pos, 1));
+                }
+            }
+            if (mpc_parse_run(i, p->data.regex.x, r, e, depth+1)) {
+                MPC_SUCCESS(r->output);
+            } else {
+                MPC_FAILURE(r->error);
+            }
+
+        case MPC_TYPE_CHECK:
+            if (mpc_parse_run(i, p->data.check.x, r, e, depth+1)) {
+                if (p->data.check.f(&r->output)) {
+                    MPC_SUCCESS(r->output);
+                } else {
+                    mpc_parse_dtor(i, p->data.check.dx, r->output);
+                    MPC_FAILURE(mpc_err_fail(i, p->data.check.e));
+                }
+            } else {
+                MPC_FAILURE(r->error);
+            }
+
+        case MPC_TYPE_CHECK_WITH:
+            if (mpc_parse_run(i, p->data.check_with.x, r, e, depth+1)) {
+                if (p->data.check_with.f(&r->output, p->data.check_with.d)) {
+                    MPC_SUCCESS(r->output);
+                } else {
+                    mpc_parse_dtor(i, p->data.check.dx, r->output);
+                    MPC_FAILURE(mpc_err_fail(i, p->data.check_with.e));
+                }
+            } else {
+                MPC_FAILURE(r->error);
+            }
+
+        case MPC_TYPE_EXPECT:
+            mpc_input_suppress_enable(i);
+            if (mpc_parse_run(i, p->data.expect.x, r, e, depth+1)) {
+                mpc_input_suppress_disable(i);
+                MPC_SUCCESS(r->output);
+            } else {
+                mpc_input_suppress_disable(i);
+                MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
+            }
+
+        case MPC_TYPE_PREDICT:
+            mpc_input_backtrack_disable(i);
+            if (mpc_parse_run(i, p->data.predict.x, r, e, depth+1)) {
+                mpc_input_backtrack_enable(i);
+                MPC_SUCCESS(r->output);
+            } else {
+                mpc_input_backtrack_enable(i);
+                MPC_FAILURE(r->error);
+            }
+
+            /* Optional Parsers */
+
+            /* TODO: Update Not Error Message */
+
+        case MPC_TYPE_NOT:
+            mpc_input_mark(i);
+            mpc_input_suppress_enable(i);
+            if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
+                mpc_input_rewind(i);
+                mpc_input_suppress_disable(i);
+                mpc_parse_dtor(i, p->data.not.dx, r->output);
+                MPC_FAILURE(mpc_err_new(i, "opposite"));
+            } else if (i->cut) {
+                mpc_input_unmark(i);
+                mpc_input_suppress_disable(i);
+                MPC_FAILURE(r->error);
+            } else {
+                mpc_input_unmark(i);
+                mpc_input_suppress_disable(i);
+                MPC_SUCCESS(i->skip ? NULL : p->data.not.lf());
+            }
+
+        case MPC_TYPE_MAYBE:
+            if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
+                MPC_SUCCESS(r->output);
+            } else if (i->cut) {
+                MPC_FAILURE(r->error);
+            } else {
+                *e = mpc_err_merge(i, *e, r->error);
+                MPC_SUCCESS(i->skip ? NULL : p->data.not.lf());
+            }
+
+            /* Repeat Parsers */
+
+        case MPC_TYPE_MANY:
+
+            results = results_stk;
+
+            while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
+                j++;
+                if (j == MPC_PARSE_STACK_MIN) {
+                    results_slots = j + j / 2;
+                    results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
+                    memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
+                } else if (j >= results_slots) {
+                    results_slots = j + j / 2;
+                    results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
+                }
+            }
+
+            if (i->cut) {
+                mpc_parse_fold_release(i, &p->data.repeat, j, results);
+                MPC_FAILURE(results[j].error;
+                        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+            }
+
+            *e = mpc_err_merge(i, *e, results[j].error);
+
+            MPC_SUCCESS(
+                    mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
+                    if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+
+        case MPC_TYPE_MANY1:
+
+            results = results_stk;
+
+            while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
+                j++;
+                if (j == MPC_PARSE_STACK_MIN) {
+                    results_slots = j + j / 2;
+                    results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
+                    memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
+                } else if (j >= results_slots) {
+                    results_slots = j + j / 2;
+                    results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
+                }
+            }
+
+            if (i->cut) {
+                mpc_parse_fold_release(i, &p->data.repeat, j, results);
+                MPC_FAILURE(results[j].error;
+                        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+            }
+
+            if (j == 0) {
+                MPC_FAILURE(
+                        mpc_err_many1(i, mpc_input_try_split(i, e, results[j].error));
+                        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+            } else {
+
+                *e = mpc_err_merge(i, *e, results[j].error);
+
+                MPC_SUCCESS(
+                        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
+                        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+            }
+
+        case MPC_TYPE_COUNT:
+
+            results = p->data.repeat.n > MPC_PARSE_STACK_MIN
+                      ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
+                      : results_stk;
+
+            while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
+                j++;
+                if (j == p->data.repeat.n) { break; }
+            }
+
+            if (j == p->data.repeat.n) {
+                MPC_SUCCESS(
+                        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
+                        if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+            } else {
+                for (k = 0; k < j; k++) {
+                    mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
+                }
+                MPC_FAILURE(
+                        mpc_err_count(i, mpc_input_try_split(i, e, results[j].error), p->data.repeat.n);
+                        if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+            }
+
+            /* Combinatory Parsers */
+
+        case MPC_TYPE_OR:
+
+            if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+
+            results = p->data.or.n > MPC_PARSE_STACK_MIN
+                      ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
+                      : results_stk;
+
+            mpc_input_scope_enter(i, &scope);
+            for (j = 0; j < p->data.or.n; j++) {
+                if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e, depth+1)) {
+                    mpc_input_scope_leave(i, &scope);
+                    MPC_SUCCESS(results[j].output;
+                                        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+                } else {
+                    *e = mpc_err_merge(i, *e, results[j].error);
+                }
+                if (i->cut) { break; }
+            }
+            mpc_input_scope_leave(i, &scope);
+
+            MPC_FAILURE(NULL;
+                                if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+
+        case MPC_TYPE_AND:
+
+            if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+
+            results = p->data.or.n > MPC_PARSE_STACK_MIN
+                      ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
+                      : results_stk;
+
+            mpc_input_mark(i);
+            for (j = 0; j < p->data.and.n; j++) {
+                if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e, depth+1)) {
+                    mpc_input_rewind(i);
+                    for (k = 0; k < j; k++) {
+                        mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
+                    }
+                    MPC_FAILURE(results[j].error;
+                                        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+                }
+            }
+            mpc_input_unmark(i);
+            MPC_SUCCESS(
+                    mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
+                    if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+
+        case MPC_TYPE_EXPR: return mpc_parse_expr(i, &p->data.expr, r, e, depth);
+
+            /* End */
+
+        default:
+
+        MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+    }
+
+    return 0;
+
+}
+
+#undef MPC_SUCCESS
+#undef MPC_FAILURE
+#undef MPC_PRIMITIVE
+#undef MPC_OUTPUT
+
+int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+    int x;
+    mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
+    e->state = mpc_state_invalid();
+    i->tries_base += i->tries_num;
+    i->tries_num = 0;
+    i->tries_pos = -1;
+    x = mpc_parse_run(i, p, r, &e, 0);
+    if (x) {
+        mpc_err_delete_internal(i, e);
+        r->output = mpc_export(i, r->output);
+    } else if (i->exhausted) {
+        mpc_err_delete_internal(i, mpc_err_merge(i, e, r->error));
+        i->state = i->exhausted_state;
+        r->error = mpc_err_export(i, mpc_err_fail(i, "Parse budget exhausted!"));
+    } else {
+        e = mpc_err_resolve(i, mpc_err_merge(i, e, r->error));
+        if (e == NULL) {
+            e = mpc_err_fail(i, "Unknown Error");
+            e->state = mpc_state_invalid();
+        }
+        r->error = mpc_err_export(i, e);
+    }
+    if (i->stats) {
+        *i->stats = i->counts;
+        i->stats->bytes = i->bytes;
+    }
+    return x;
+}
+
+int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+    int x;
+    mpc_input_t *i = mpc_input_new_string(filename, string);
+    x = mpc_parse_input(i, p, r);
+    mpc_input_delete(i);
+    return x;
+}
+
+static int mpc_parse_cached(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r, const mpc_parse_opts_t *opts);
+
+int mpc_parse_ex(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r, const mpc_parse_opts_t *opts) {
+    int x;
+    mpc_input_t *i;
+    if (opts && opts->ast_cache) { return mpc_parse_cached(filename, string, p, r, opts); }
+    i = mpc_input_new_string(filename, string);
+    mpc_input_budget(i, opts);
+    x = mpc_parse_input(i, p, r);
+    mpc_input_delete(i);
+    return x;
+}
+
+int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+    int x;
+    mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
+    x = mpc_parse_input(i, p, r);
+    mpc_input_delete(i);
+    return x;
+}
+
+int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
+    int x;
+    mpc_input_t *i = mpc_input_new_file(filename, file);
+    x = mpc_parse_input(i, p, r);
+    mpc_input_delete(i);
+    return x;
+}
+
+int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
+    int x;
+    mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
+    x = mpc_parse_input(i, p, r);
+    mpc_input_delete(i);
+    return x;
+}
+
+int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+
+    FILE *f = fopen(filename, "rb");
+    int res;
+
+    if (f == NULL) {
+        r->output = NULL;
+        r->error = mpc_err_file(filename, "Unable to open file!");
+        return 0;
+    }
+
+    res = mpc_parse_file(filename, f, p, r);
+    fclose(f);
+    return res;
+}
+
+/*
+** Rather than collecting a repetition of items
+** into one result each item is handed over as
+** soon as it has been parsed. The input is read
+** as a pipe, so once an item is done there are
+** no marks left and its buffered input is freed,
+** keeping memory use independent of input size.
+*/
+
+int mpc_parse_each(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_each_t f, void *d, mpc_result_t *r) {
+
+    int x = 1;
+    long pos;
+    mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
+
+    while (!mpc_input_terminated(i)) {
+        pos = i->state.pos;
+        if (!mpc_parse_input(i, p, r)) { x = 0; break; }
+        if (!f(r->output, d)) { break; }
+        if (i->state.pos == pos) {
+            r->error = mpc_err_export(i, mpc_err_fail(i, "Parser consumed no input!"));
+            x = 0;
+            break;
+        }
+    }
+
+    if (x) { r->output = NULL; }
+
+    mpc_input_delete(i);
+    return x;
+}
+
+/*
+** Incremental Parsing
+*/
+
+/*
+** Every item remembers the furthest position read
+** while parsing it, as tracked by the input in
+** `reach`. An item which read nothing at or beyond
+** the start of an edit parses the same as before so
+** is kept. Parsing resumes from the first item that
+** did, and stops as soon as an item ends exactly
+** where one of the old items after the edit begins.
+** From there on the text, along with the character
+** before it, is unchanged so the old items are too.
+**
+** Items after the edit only have their positions
+** moved. The states inside their trees are moved
+** when the item is next asked for, so the work
+** done for an edit doesn't grow with the file.
+*/
+
+typedef struct {
+    mpc_ast_t *ast;
+    mpc_state_t start;
+    mpc_state_t end;
+    mpc_state_t parsed;
+    long reach;
+} mpc_incr_item_t;
+
+struct mpc_incr_t {
+    mpc_input_t *i;
+    mpc_parser_t *p;
+    long length;
+    int items_num;
+    int items_slots;
+    int valid;
+    mpc_incr_item_t *items;
+    mpc_err_t *error;
+};
+
+enum {
+    MPC_INCR_DONE   = 0,
+    MPC_INCR_RESYNC = 1,
+    MPC_INCR_FAILED = 2
+};
+
+/* Moves a state after an edit spanning `from` in the old text and `to` in the new */
+static void mpc_incr_move(mpc_state_t *s, const mpc_state_t *from, const mpc_state_t *to) {
+    if (s->row == from->row) { s->col += to->col - from->col; }
+    s->row += to->row - from->row;
+    s->pos += to->pos - from->pos;
+}
+
+static void mpc_incr_ast_move(mpc_ast_t *a, const mpc_state_t *from, const mpc_state_t *to) {
+    int j;
+    if (a->state.pos >= from->pos) { mpc_incr_move(&a->state, from, to); }
+    for (j = 0; j < a->children_num; j++) {
+        mpc_incr_ast_move(a->children[j], from, to);
+    }
+}
+
+static void mpc_incr_reserve(mpc_incr_t *x, int n) {
+    if (n <= x->items_slots) { return; }
+    while (x->items_slots < n) { x->items_slots = x->items_slots ? x->items_slots * 2 : 16; }
+    x->items = realloc(x->items, sizeof(mpc_incr_item_t) * x->items_slots);
+}
+
+/*
+** Parses items from `s` into the place of the old
+** items from `k`, skipping those before `c` which
+** the edit has already deleted.
+*/
+
+static void mpc_incr_run(mpc_incr_t *x, int k, mpc_state_t s, int c) {
+
+    mpc_input_t *i = x->i;
+    mpc_incr_item_t *fresh = NULL;
+    mpc_result_t r;
+    int j, end, valid, outcome;
+    int fresh_num = 0, fresh_slots = 0;
+
+    while (1) {
+
+        if (i->string[s.pos] == '\0') { outcome = MPC_INCR_DONE; break; }
+
+        while (c < x->items_num && x->items[c].start.pos < s.pos) {
+            mpc_ast_delete(x->items[c].ast);
+            c++;
+        }
+
+        if (c < x->items_num && x->items[c].start.pos == s.pos) {
+            outcome = MPC_INCR_RESYNC;
+            break;
+        }
+
+        i->state = s;
+        i->last = s.pos > 0 ? i->string[s.pos-1] : '\0';
+        i->cut = 0;
+        i->marks_cut = 0;
+        i->marks_scope = 0;
+        i->reach = s.pos;
+
+        if (!mpc_parse_input(i, x->p, &r)) { outcome = MPC_INCR_FAILED; break; }
+
+        if (fresh_num == fresh_slots) {
+            fresh_slots = fresh_slots ? fresh_slots * 2 : 16;
+            fresh = realloc(fresh, sizeof(mpc_incr_item_t) * fresh_slots);
+        }
+
+        fresh[fresh_num].ast = r.output;
+        fresh[fresh_num].start = s;
+        fresh[fresh_num].end = i->state;
+        fresh[fresh_num].parsed = s;
+        fresh[fresh_num].reach = i->reach > i->state.pos ? i->reach : i->state.pos;
+        fresh_num++;
+
+        if (i->state.pos == s.pos) { outcome = MPC_INCR_DONE; break; }
+        s = i->state;
+    }
+
+    /*
+    ** Old items left after a failure are kept only if
+    ** they were going to parse through to the end of
+    ** the text, and may be resynchronised with later.
+    */
+
+    switch (outcome) {
+        case MPC_INCR_RESYNC:
+            end = c;
+            break;
+        case MPC_INCR_FAILED:
+            end = x->error && c < x->valid ? x->valid : c;
+            break;
+        default:
+            end = x->items_num;
+            break;
+    }
+
+    for (j = c; j < end; j++) { mpc_ast_delete(x->items[j].ast); }
+
+    if (outcome == MPC_INCR_RESYNC && c < x->valid) {
+        valid = k + fresh_num + (x->valid - c);
+    } else {
+        valid = k + fresh_num;
+        if (outcome != MPC_INCR_FAILED) { valid += x->items_num - end; }
+        if (x->error) { mpc_err_delete(x->error); }
+        x->error = outcome == MPC_INCR_FAILED ? r.error : NULL;
+    }
+
+    mpc_incr_reserve(x, k + fresh_num + (x->items_num - end));
+    if (end < x->items_num) {
+        memmove(x->items + k + fresh_num, x->items + end, sizeof(mpc_incr_item_t) * (x->items_num - end));
+    }
+    if (fresh_num) { memcpy(x->items + k, fresh, sizeof(mpc_incr_item_t) * fresh_num); }
+    x->items_num = k + fresh_num + (x->items_num - end);
+    x->valid = valid;
+
+    free(fresh);
+}
+
+mpc_incr_t *mpc_incr_new(const char *filename, const char *string, mpc_parser_t *p) {
+    mpc_incr_t *x = malloc(sizeof(mpc_incr_t));
+    x->i = mpc_input_new_string(filename, string);
+    x->p = p;
+    x->length = strlen(string);
+    x->items_num = 0;
+    x->items_slots = 0;
+    x->valid = 0;
+    x->items = NULL;
+    x->error = NULL;
+    mpc_incr_run(x, 0, mpc_state_new(), 0);
+    return x;
+}
+
+void mpc_incr_delete(mpc_incr_t *x) {
+    int j;
+    for (j = 0; j < x->items_num; j++) { mpc_ast_delete(x->items[j].ast); }
+    if (x->error) { mpc_err_delete(x->error); }
+    mpc_input_delete(x->i);
+    free(x->items);
+    free(x);
+}
+
+int mpc_incr_edit(mpc_incr_t *x, long pos, long deleted, const char *inserted) {
+
+    mpc_state_t s, from, to;
+    long inserted_len = strlen(inserted);
+    char *text;
+    int j, k, c;
+
+    if (pos < 0) { pos = 0; }
+    if (pos > x->length) { pos = x->length; }
+    if (deleted < 0) { deleted = 0; }
+    if (deleted > x->length - pos) { deleted = x->length - pos; }
+
+    for (k = 0; k < x->valid; k++) {
+        if (x->items[k].reach >= pos) { break; }
+        if (x->items[k].end.pos == x->items[k].start.pos) { break; }
+    }
+
+    s = k > 0 ? x->items[k-1].end : mpc_state_new();
+    s.term = 0;
+
+    text = x->i->string;
+    from = s;
+    mpc_state_advance(&from, text + from.pos, pos - from.pos);
+    to = from;
+    mpc_state_advance(&from, text + pos, deleted);
+    mpc_state_advance(&to, inserted, inserted_len);
+
+    if (inserted_len > deleted) {
+        text = realloc(text, x->length - deleted + inserted_len + 1);
+    }
+    memmove(text + pos + inserted_len, text + pos + deleted, x->length - pos - deleted + 1);
+    memcpy(text + pos, inserted, inserted_len);
+    x->i->string = text;
+    x->length += inserted_len - deleted;
+
+    for (c = k; c < x->items_num && x->items[c].start.pos <= from.pos; c++) {
+        mpc_ast_delete(x->items[c].ast);
+    }
+
+    for (j = c; j < x->items_num; j++) {
+        mpc_incr_move(&x->items[j].start, &from, &to);
+        mpc_incr_move(&x->items[j].end, &from, &to);
+        x->items[j].reach += to.pos - from.pos;
+    }
+
+    if (x->error && x->error->state.pos > from.pos) {
+        mpc_incr_move(&x->error->state, &from, &to);
+    }
+
+    mpc_incr_run(x, k, s, c);
+
+    return x->error == NULL;
+}
+
+int mpc_incr_num(mpc_incr_t *x) {
+    return x->valid;
+}
+
+mpc_ast_t *mpc_incr_item(mpc_incr_t *x, int n) {
+    mpc_incr_item_t *t = &x->items[n];
+    if (t->parsed.pos != t->start.pos
+    ||  t->parsed.row != t->start.row
+    ||  t->parsed.col != t->start.col) {
+        mpc_incr_ast_move(t->ast, &t->parsed, &t->start);
+        t->parsed = t->start;
+    }
+    return t->ast;
+}
+
+mpc_err_t *mpc_incr_error(mpc_incr_t *x) {
+    return x->error;
+}
+
+const char *mpc_incr_string(mpc_incr_t *x) {
+    return x->i->string;
+}
+
+/*
+** Token Input
+*/
+
+/*
+** A lexer tries every kind at each position and
+** takes the longest match, the earliest kind
+** winning a tie. Kinds are stored in the token
+** input offset by one so that no token is ever
+** mistaken for the terminating zero.
+*/
+
+enum {
+    MPC_LEX_KINDS_MAX = 255
+};
+
+struct mpc_lexer_t {
+    int n;
+    int *flags;
+    char **patterns;
+    mpc_parser_t **xs;
+};
+
+mpc_lexer_t *mpc_lexer_new(int n, ...) {
+
+    int j;
+    va_list va;
+    const char *pattern;
+    mpc_lexer_t *l = malloc(sizeof(mpc_lexer_t));
+
+    l->n = n;
+    l->flags = malloc(sizeof(int) * n);
+    l->patterns = malloc(sizeof(char*) * n);
+    l->xs = malloc(sizeof(mpc_parser_t*) * n);
+
+    va_start(va, n);
+    for (j = 0; j < n; j++) {
+        l->flags[j] = va_arg(va, int);
+        pattern = va_arg(va, const char*);
+        l->patterns[j] = malloc(strlen(pattern) + 1);
+        strcpy(l->patterns[j], pattern);
+        l->xs[j] = l->flags[j] & MPC_LEX_REGEX ? mpc_re(l->patterns[j]) : mpc_string(l->patterns[j]);
+    }
+    va_end(va);
+
+    return l;
+}
+
+void mpc_lexer_delete(mpc_lexer_t *l) {
+    int j;
+    for (j = 0; j < l->n; j++) {
+        free(l->patterns[j]);
+        mpc_delete(l->xs[j]);
+    }
+    free(l->flags);
+    free(l->patterns);
+    free(l->xs);
+    free(l);
+}
+
+/*
+** Turns a String input into a Token input, or fails
+** with the error at the first character which no
+** kind matches.
+*/
+
+static int mpc_input_lex(mpc_input_t *i, const mpc_lexer_t *l, mpc_err_t **e) {
+
+    int j, best;
+    long n, best_length;
+    char last, best_last = '\0';
+    char *kinds = malloc(1);
+    mpc_token_t *tokens = malloc(sizeof(mpc_token_t));
+    long num = 0, max = 1;
+    mpc_state_t s, best_state;
+    mpc_result_t r;
+
+    best_state = i->state;
+    mpc_input_suppress_enable(i);
+
+    while (!mpc_input_terminated(i)) {
+
+        s = i->state;
+        last = i->last;
+        best = -1;
+        best_length = 0;
+
+        for (j = 0; j < l->n; j++) {
+
+            if (!(l->flags[j] & MPC_LEX_REGEX)) {
+                n = strlen(l->patterns[j]);
+                if (n > best_length && strncmp(i->string + s.pos, l->patterns[j], n) == 0) {
+                    best = j;
+                    best_length = n;
+                }
+                continue;
+            }
+
+            if (mpc_parse_run(i, l->xs[j], &r, e, 0)) {
+                if (i->state.pos - s.pos > best_length) {
+                    best = j;
+                    best_length = i->state.pos - s.pos;
+                    best_state = i->state;
+                    best_last = i->last;
+                }
+                mpc_parse_dtor(i, free, r.output);
+            }
+            i->state = s;
+            i->last = last;
+        }
+
+        if (best < 0) { break; }
+
+        if (l->flags[best] & MPC_LEX_REGEX) {
+            i->state = best_state;
+            i->last = best_last;
+            i->state.term = 0;
+        } else {
+            mpc_state_advance(&i->state, i->string + s.pos, best_length);
+            i->last = i->string[i->state.pos-1];
+        }
+
+        if (l->flags[best] & MPC_LEX_SKIP) { continue; }
+
+        if (num + 1 == max) {
+            max *= 2;
+            kinds = realloc(kinds, max);
+            tokens = realloc(tokens, sizeof(mpc_token_t) * max);
+        }
+        kinds[num] = (char)(best + 1);
+        tokens[num].state = s;
+        tokens[num].length = best_length;
+        num++;
+    }
+
+    mpc_input_suppress_disable(i);
+
+    if (!mpc_input_terminated(i)) {
+        *e = mpc_err_new(i, "token");
+        free(kinds);
+        free(tokens);
+        return 0;
+    }
+
+    kinds[num] = '\0';
+    tokens[num].state = i->state;
+    tokens[num].length = 0;
+
+    i->type = MPC_INPUT_TOKENS;
+    i->source = i->string;
+    i->string = kinds;
+    i->tokens = tokens;
+    i->state = mpc_state_new();
+    i->last = '\0';
+    i->bytes = 0;
+
+    return 1;
+}
+
+int mpc_parse_tokens(const char *filename, const char *string, const mpc_lexer_t *l, mpc_parser_t *p, mpc_result_t *r) {
+
+    int x;
+    mpc_err_t *e = NULL;
+    mpc_input_t *i;
+
+    if (l->n > MPC_LEX_KINDS_MAX) {
+        r->error = mpc_err_file(filename, "Too many token kinds!");
+        return 0;
+    }
+
+    i = mpc_input_new_string(filename, string);
+
+    if (!mpc_input_lex(i, l, &e)) {
+        r->error = mpc_err_export(i, e);
+        mpc_input_delete(i);
+        return 0;
+    }
+
+    x = mpc_parse_input(i, p, r);
+    mpc_input_delete(i);
+    return x;
+}
+
+/*
+** Parsing Many
+*/
+
+/*
+** A parse only ever reads from the parser it is
+** given. All of its mutable state lives in the
+** `mpc_input_t` made for that call, so any number
+** of threads can parse with the same grammar at
+** once as long as nobody is defining, optimising
+** or deleting it at the same time.
+**
+** Workers pull the index of the next input from a
+** shared counter so a few slow inputs don't hold
+** up the rest of the batch.
+*/
+
+typedef struct {
+    const char *filename;
+    const char **strings;
+    mpc_parser_t *p;
+    mpc_result_t *rs;
+    int *oks;
+    int n;
+    int next;
+    mpc_lock_t lock;
+} mpc_parse_many_t;
+
+static int mpc_parse_many_next(mpc_parse_many_t *m) {
+    int j;
+    mpc_lock(&m->lock);
+    j = m->next++;
+    mpc_unlock(&m->lock);
+    return j;
+}
+
+static void *mpc_parse_many_worker(void *x) {
+    mpc_parse_many_t *m = x;
+    int j;
+    while ((j = mpc_parse_many_next(m)) < m->n) {
+        m->oks[j] = mpc_parse(m->filename, m->strings[j], m->p, &m->rs[j]);
+    }
+    return NULL;
+}
+
+int mpc_parse_many(const char *filename, const char **strings, int n, mpc_parser_t *p, mpc_result_t *rs, int *oks, int threads) {
+
+    int j, x = 0;
+    mpc_parse_many_t m;
+#ifndef _WIN32
+    pthread_t *ts;
+#endif
+
+    m.filename = filename;
+    m.strings = strings;
+    m.p = p;
+    m.rs = rs;
+    m.oks = oks;
+    m.n = n;
+    m.next = 0;
+    mpc_lock_init(&m.lock);
+
+    if (threads > n) { threads = n; }
+
+#ifndef _WIN32
+    if (threads > 1) {
+
+        ts = malloc(sizeof(pthread_t) * threads);
+
+        for (j = 0; j < threads; j++) {
+            if (pthread_create(&ts[j], NULL, mpc_parse_many_worker, &m) != 0) { break; }
+        }
+
+        /* If no thread could be started do the work here */
+        if (j == 0) { mpc_parse_many_worker(&m); }
+
+        threads = j;
+        for (j = 0; j < threads; j++) {
+            pthread_join(ts[j], NULL);
+        }
+
+        free(ts);
+
+    } else
+#endif
+    {
+        mpc_parse_many_worker(&m);
+    }
+
+    mpc_lock_free(&m.lock);
+
+    for (j = 0; j < n; j++) { x += oks[j]; }
+    return x;
+}
+
+/*
+** Building a Parser
+*/
+
+static void mpc_undefine_unretained(mpc_parser_t *p, int force);
+static void mpc_save_hash_forget(void);
+
+static void mpc_undefine_or(mpc_parser_t *p) {
+
+    int i;
+    for (i = 0; i < p->data.or.n; i++) {
+        mpc_undefine_unretained(p->data.or.xs[i], 0);
+    }
+    free(p->data.or.xs);
+
+}
+
+static void mpc_undefine_and(mpc_parser_t *p) {
+
+    int i;
+    for (i = 0; i < p->data.and.n; i++) {
+        mpc_undefine_unretained(p->data.and.xs[i], 0);
+    }
+    free(p->data.and.xs);
+    free(p->data.and.dxs);
+
+}
+
+static void mpc_undefine_expr(mpc_parser_t *p) {
+
+    int i;
+    for (i = 0; i <= p->data.expr.n; i++) {
+        mpc_undefine_unretained(p->data.expr.xs[i], 0);
+    }
+    free(p->data.expr.xs);
+    free(p->data.expr.ps);
+
+}
+
+static void mpc_re_retain(mpc_re_body_t *b);
+static int mpc_re_release(mpc_re_body_t *b);
+
+static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
+
+    if (p->frozen) { return; }
+    if (p->retained && !force) { return; }
+
+    switch (p->type) {
+
+        case MPC_TYPE_FAIL: free(p->data.fail.m); break;
+
+        case MPC_TYPE_ONEOF:
+        case MPC_TYPE_NONEOF:
+        case MPC_TYPE_STRING:
+            free(p->data.string.x);
+            break;
+
+        case MPC_TYPE_APPLY:
+        case MPC_TYPE_SKIP:     mpc_undefine_unretained(p->data.apply.x, 0);    break;
+        case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
+        case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+
+        case MPC_TYPE_REGEX:
+            if (p->data.regex.body && !mpc_re_release(p->data.regex.body)) { break; }
+            mpc_undefine_unretained(p->data.regex.x, 0);
+            free(p->data.regex.t);
+            break;
+
+        case MPC_TYPE_MAYBE:
+        case MPC_TYPE_NOT:
+            mpc_undefine_unretained(p->data.not.x, 0);
+            break;
+
+        case MPC_TYPE_EXPECT:
+            mpc_undefine_unretained(p->data.expect.x, 0);
+            free(p->data.expect.m);
+            break;
+
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+        case MPC_TYPE_COUNT:
+            mpc_undefine_unretained(p->data.repeat.x, 0);
+            break;
+
+        case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
+        case MPC_TYPE_AND: mpc_undefine_and(p); break;
+        case MPC_TYPE_EXPR: mpc_undefine_expr(p); break;
+
+        case MPC_TYPE_CHECK:
+            mpc_undefine_unretained(p->data.check.x, 0);
+            free(p->data.check.e);
+            break;
+
+        case MPC_TYPE_CHECK_WITH:
+            mpc_undefine_unretained(p->data.check_with.x, 0);
+            free(p->data.check_with.e);
+            break;
+
+        default: break;
+    }
+
+    if (!force) {
+        free(p->name);
+        free(p);
+    }
+
+}
+
+void mpc_delete(mpc_parser_t *p) {
+    mpc_save_hash_forget();
+    if (p->frozen) {
+        free(p);
+    } else if (p->retained) {
+
+        if (p->type != MPC_TYPE_UNDEFINED) {
+            mpc_undefine_unretained(p, 0);
+        }
+
+        free(p->name);
+        free(p);
+
+    } else {
+        mpc_undefine_unretained(p, 0);
+    }
+}
+
+static void mpc_soft_delete(mpc_val_t *x) {
+    mpc_undefine_unretained(x, 0);
+}
+
+static mpc_parser_t *mpc_undefined(void) {
+    mpc_parser_t *p = calloc(1, sizeof(mpc_parser_t));
+    p->retained = 0;
+    p->type = MPC_TYPE_UNDEFINED;
+    p->name = NULL;
+    return p;
+}
+
+mpc_parser_t *mpc_new(const char *name) {
+    mpc_parser_t *p = mpc_undefined();
+    p->retained = 1;
+    p->name = realloc(p->name, strlen(name) + 1);
+    strcpy(p->name, name);
+    return p;
+}
+
+mpc_parser_t *mpc_copy(mpc_parser_t *a) {
+    int i = 0;
+    mpc_parser_t *p;
+
+    if (a->retained) { return a; }
+
+    p = mpc_undefined();
+    p->retained = a->retained;
+    p->type = a->type;
+    p->data = a->data;
+
+    if (a->name) {
+        p->name = malloc(strlen(a->name)+1);
+        strcpy(p->name, a->name);
+    }
+
+    switch (a->type) {
+
+        case MPC_TYPE_FAIL:
+            p->data.fail.m = malloc(strlen(a->data.fail.m)+1);
+            strcpy(p->data.fail.m, a->data.fail.m);
+            break;
+
+        case MPC_TYPE_ONEOF:
+        case MPC_TYPE_NONEOF:
+        case MPC_TYPE_STRING:
+            p->data.string.x = malloc(strlen(a->data.string.x)+1);
+            strcpy(p->data.string.x, a->data.string.x);
+            break;
+
+        case MPC_TYPE_APPLY:
+        case MPC_TYPE_SKIP:     p->data.apply.x    = mpc_copy(a->data.apply.x);    break;
+        case MPC_TYPE_APPLY_TO: p->data.apply_to.x = mpc_copy(a->data.apply_to.x); break;
+        case MPC_TYPE_PREDICT:  p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
+
+        case MPC_TYPE_REGEX:
+            if (a->data.regex.body) { mpc_re_retain(a->data.regex.body); break; }
+            p->data.regex.x = mpc_copy(a->data.regex.x);
+            p->data.regex.t = malloc(mpc_re_dfa_size(&a->data.regex));
+            memcpy(p->data.regex.t, a->data.regex.t, mpc_re_dfa_size(&a->data.regex));
+            break;
+
+        case MPC_TYPE_MAYBE:
+        case MPC_TYPE_NOT:
+            p->data.not.x = mpc_copy(a->data.not.x);
+            break;
+
+        case MPC_TYPE_EXPECT:
+            p->data.expect.x = mpc_copy(a->data.expect.x);
+            p->data.expect.m = malloc(strlen(a->data.expect.m)+1);
+            strcpy(p->data.expect.m, a->data.expect.m);
+            break;
+
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+        case MPC_TYPE_COUNT:
+            p->data.repeat.x = mpc_copy(a->data.repeat.x);
+            break;
+
+        case MPC_TYPE_OR:
+            p->data.or.xs = malloc(a->data.or.n * sizeof(mpc_parser_t*));
+            for (i = 0; i < a->data.or.n; i++) {
+                p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
+            }
+            break;
+        case MPC_TYPE_AND:
+            p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
+            for (i = 0; i < a->data.and.n; i++) {
+                p->data.and.xs[i] = mpc_copy(a->data.and.xs[i]);
+            }
+            p->data.and.dxs = malloc((a->data.and.n-1) * sizeof(mpc_dtor_t));
+            for (i = 0; i < a->data.and.n-1; i++) {
+                p->data.and.dxs[i] = a->data.and.dxs[i];
+            }
+            break;
+
+        case MPC_TYPE_EXPR:
+            p->data.expr.xs = malloc((a->data.expr.n+1) * sizeof(mpc_parser_t*));
+            for (i = 0; i <= a->data.expr.n; i++) {
+                p->data.expr.xs[i] = mpc_copy(a->data.expr.xs[i]);
+            }
+            p->data.expr.ps = malloc(a->data.expr.n);
+            memcpy(p->data.expr.ps, a->data.expr.ps, a->data.expr.n);
+            break;
+
+        case MPC_TYPE_CHECK:
+            p->data.check.x      = mpc_copy(a->data.check.x);
+            p->data.check.e      = malloc(strlen(a->data.check.e)+1);
+            strcpy(p->data.check.e, a->data.check.e);
+            break;
+        case MPC_TYPE_CHECK_WITH:
+            p->data.check_with.x = mpc_copy(a->data.check_with.x);
+            p->data.check_with.e = malloc(strlen(a->data.check_with.e)+1);
+            strcpy(p->data.check_with.e, a->data.check_with.e);
+            break;
+
+        default: break;
+    }
+
+
+    return p;
+}
+
+mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
+    if (p->frozen) { return p; }
+    mpc_save_hash_forget();
+    mpc_undefine_unretained(p, 1);
+    p->type = MPC_TYPE_UNDEFINED;
+    return p;
+}
+
+mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
+
+    mpc_save_hash_forget();
+
+    if (p->retained) {
+        p->type = a->type;
+        p->data = a->data;
+    } else {
+        mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
+        p->type = a2->type;
+        p->data = a2->data;
+        free(a2);
+    }
+
+    free(a);
+    return p;
+}
+
+void mpc_cleanup(int n, ...) {
+    int i;
+    mpc_parser_t **list = malloc(sizeof(mpc_parser_t*) * n);
+
+    va_list va;
+    va_start(va, n);
+    for (i = 0; i < n; i++) { list[i] = va_arg(va, mpc_parser_t*); }
+    for (i = 0; i < n; i++) { mpc_undefine(list[i]); }
+    for (i = 0; i < n; i++) { mpc_delete(list[i]); }
+    va_end(va);
+
+    free(list);
+}
+
+mpc_parser_t *mpc_pass(void) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_PASS;
+    return p;
+}
+
+mpc_parser_t *mpc_fail(const char *m) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_FAIL;
+    p->data.fail.m = malloc(strlen(m) + 1);
+    strcpy(p->data.fail.m, m);
+    return p;
+}
+
+/*
+** As `snprintf` is not ANSI standard this
+** function `mpc_failf` should be considered
+** unsafe.
+**
+** You have a few options if this is going to be
+** trouble.
+**
+** - Ensure the format string does not exceed
+**   the buffer length using precision specifiers
+**   such as `%.512s`.
+**
+** - Patch this function in your code base to
+**   use `snprintf` or whatever variant your
+**   system supports.
+**
+** - Avoid it altogether.
+**
+*/
+
+mpc_parser_t *mpc_failf(const char *fmt, ...) {
+
+    va_list va;
+    char *buffer;
+
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_FAIL;
+
+    va_start(va, fmt);
+    buffer = malloc(2048);
+    if (!buffer) {
+        return NULL;
+    }
+    vsprintf(buffer, fmt, va);
+    va_end(va);
+
+    buffer = realloc(buffer, strlen(buffer) + 1);
+    p->data.fail.m = buffer;
+    return p;
+
+}
+
+mpc_parser_t *mpc_lift_val(mpc_val_t *x) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_LIFT_VAL;
+    p->data.lift.x = x;
+    return p;
+}
+
+mpc_parser_t *mpc_lift(mpc_ctor_t lf) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_LIFT;
+    p->data.lift.lf = lf;
+    return p;
+}
+
+mpc_parser_t *mpc_anchor(int(*f)(char,char)) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_ANCHOR;
+    p->data.anchor.f = f;
+    return mpc_expect(p, "anchor");
+}
+
+mpc_parser_t *mpc_state(void) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_STATE;
+    return p;
+}
+
+mpc_parser_t *mpc_cut(void) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_CUT;
+    return p;
+}
+
+mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_EXPECT;
+    p->data.expect.x = a;
+    p->data.expect.m = malloc(strlen(expected) + 1);
+    strcpy(p->data.expect.m, expected);
+    return p;
+}
+
+/*
+** As `snprintf` is not ANSI standard this
+** function `mpc_expectf` should be considered
+** unsafe.
+**
+** You have a few options if this is going to be
+** trouble.
+**
+** - Ensure the format string does not exceed
+**   the buffer length using precision specifiers
+**   such as `%.512s`.
+**
+** - Patch this function in your code base to
+**   use `snprintf` or whatever variant your
+**   system supports.
+**
+** - Avoid it altogether.
+**
+*/
+
+mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
+    va_list va;
+    char *buffer;
+
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_EXPECT;
 
     va_start(va, fmt);
     buffer = malloc(2048);
     if (!buffer) {
         return NULL;
     }
-    vsprintf(buffer, fmt, va);
-    va_end(va);
+    vsprintf(buffer, fmt, va);
+    va_end(va);
+
+    buffer = realloc(buffer, strlen(buffer) + 1);
+    p->data.expect.x = a;
+    p->data.expect.m = buffer;
+    return p;
+}
+
+/*
+** Basic Parsers
+*/
+
+mpc_parser_t *mpc_any(void) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_ANY;
+    return mpc_expect(p, "any character");
+}
+
+mpc_parser_t *mpc_char(char c) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_SINGLE;
+    p->data.single.x = c;
+    return mpc_expectf(p, "'%c'", c);
+}
+
+mpc_parser_t *mpc_range(char s, char e) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_RANGE;
+    p->data.range.x = s;
+    p->data.range.y = e;
+    return mpc_expectf(p, "character between '%c' and '%c'", s, e);
+}
+
+mpc_parser_t *mpc_oneof(const char *s) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_ONEOF;
+    p->data.string.x = malloc(strlen(s) + 1);
+    strcpy(p->data.string.x, s);
+    return mpc_expectf(p, "one of '%s'", s);
+}
+
+mpc_parser_t *mpc_noneof(const char *s) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_NONEOF;
+    p->data.string.x = malloc(strlen(s) + 1);
+    strcpy(p->data.string.x, s);
+    return mpc_expectf(p, "none of '%s'", s);
+
+}
+
+mpc_parser_t *mpc_satisfy(int(*f)(char)) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_SATISFY;
+    p->data.satisfy.f = f;
+    return mpc_expectf(p, "character satisfying function %p", f);
+}
+
+mpc_parser_t *mpc_string(const char *s) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_STRING;
+    p->data.string.x = malloc(strlen(s) + 1);
+    strcpy(p->data.string.x, s);
+    return mpc_expectf(p, "\"%s\"", s);
+}
+
+mpc_parser_t *mpc_token(const mpc_lexer_t *l, int kind) {
+
+    mpc_parser_t *p;
+
+    if (kind < 0 || kind >= l->n || kind >= MPC_LEX_KINDS_MAX) {
+        return mpc_failf("Unknown token kind %i!", kind);
+    }
+
+    p = mpc_undefined();
+    p->type = MPC_TYPE_TOKEN;
+    p->data.single.x = (char)(kind + 1);
+
+    return l->flags[kind] & MPC_LEX_REGEX
+        ? mpc_expectf(p, "/%s/", l->patterns[kind])
+        : mpc_expectf(p, "\"%s\"", l->patterns[kind]);
+}
+
+/*
+** Core Parsers
+*/
+
+mpc_parser_t *mpc_apply(mpc_parser_t *a, mpc_apply_t f) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_APPLY;
+    p->data.apply.x = a;
+    p->data.apply.f = f;
+    return p;
+}
+
+mpc_parser_t *mpc_apply_to(mpc_parser_t *a, mpc_apply_to_t f, void *x) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_APPLY_TO;
+    p->data.apply_to.x = a;
+    p->data.apply_to.f = f;
+    p->data.apply_to.d = x;
+    p->data.apply_to.id = 0;
+    return p;
+}
+
+/*
+** A repetition is told the destructor its parent has
+** for its output, so that what it has collected can
+** be released when a cut fails it.
+*/
+
+static void mpc_repeat_dtor(mpc_parser_t *a, mpc_dtor_t da) {
+    if ((a->type == MPC_TYPE_MANY || a->type == MPC_TYPE_MANY1) && a->data.repeat.dx == NULL) {
+        a->data.repeat.dx = da;
+    }
+}
+
+mpc_parser_t *mpc_check(mpc_parser_t *a, mpc_dtor_t da, mpc_check_t f, const char *e) {
+    mpc_parser_t  *p = mpc_undefined();
+    mpc_repeat_dtor(a, da);
+    p->type = MPC_TYPE_CHECK;
+    p->data.check.x = a;
+    p->data.check.dx = da;
+    p->data.check.f = f;
+    p->data.check.e = malloc(strlen(e) + 1);
+    strcpy(p->data.check.e, e);
+    return p;
+}
+
+mpc_parser_t *mpc_check_with(mpc_parser_t *a, mpc_dtor_t da, mpc_check_with_t f, void *x, const char *e) {
+    mpc_parser_t  *p = mpc_undefined();
+    mpc_repeat_dtor(a, da);
+    p->type = MPC_TYPE_CHECK_WITH;
+    p->data.check_with.x = a;
+    p->data.check_with.dx = da;
+    p->data.check_with.f = f;
+    p->data.check_with.d = x;
+    p->data.check_with.e = malloc(strlen(e) + 1);
+    strcpy(p->data.check_with.e, e);
+    return p;
+}
+
+mpc_parser_t *mpc_checkf(mpc_parser_t *a, mpc_dtor_t da, mpc_check_t f, const char *fmt, ...) {
+    va_list va;
+    char *buffer;
+    mpc_parser_t *p;
+
+    va_start(va, fmt);
+    buffer = malloc(2048);
+    vsprintf(buffer, fmt, va);
+    va_end(va);
+
+    p = mpc_check(a, da, f, buffer);
+    free(buffer);
+
+    return p;
+}
+
+mpc_parser_t *mpc_check_withf(mpc_parser_t *a, mpc_dtor_t da, mpc_check_with_t f, void *x, const char *fmt, ...) {
+    va_list va;
+    char *buffer;
+    mpc_parser_t *p;
+
+    va_start(va, fmt);
+    buffer = malloc(2048);
+    vsprintf(buffer, fmt, va);
+    va_end(va);
+
+    p = mpc_check_with(a, da, f, x, buffer);
+    free(buffer);
+
+    return p;
+}
+
+mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_PREDICT;
+    p->data.predict.x = a;
+    return p;
+}
+
+mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
+    mpc_parser_t *p = mpc_undefined();
+    mpc_repeat_dtor(a, da);
+    p->type = MPC_TYPE_NOT;
+    p->data.not.x = a;
+    p->data.not.dx = da;
+    p->data.not.lf = lf;
+    return p;
+}
+
+mpc_parser_t *mpc_not(mpc_parser_t *a, mpc_dtor_t da) {
+    return mpc_not_lift(a, da, mpcf_ctor_null);
+}
+
+mpc_parser_t *mpc_maybe_lift(mpc_parser_t *a, mpc_ctor_t lf) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_MAYBE;
+    p->data.not.x = a;
+    p->data.not.lf = lf;
+    return p;
+}
+
+mpc_parser_t *mpc_maybe(mpc_parser_t *a) {
+    return mpc_maybe_lift(a, mpcf_ctor_null);
+}
+
+mpc_parser_t *mpc_many(mpc_fold_t f, mpc_parser_t *a) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_MANY;
+    p->data.repeat.x = a;
+    p->data.repeat.f = f;
+    return p;
+}
+
+mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_MANY1;
+    p->data.repeat.x = a;
+    p->data.repeat.f = f;
+    return p;
+}
+
+mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_COUNT;
+    p->data.repeat.n = n;
+    p->data.repeat.f = f;
+    p->data.repeat.x = a;
+    p->data.repeat.dx = da;
+    mpc_repeat_dtor(a, da);
+    return p;
+}
+
+mpc_parser_t *mpc_or(int n, ...) {
+
+    int i;
+    va_list va;
+
+    mpc_parser_t *p = mpc_undefined();
+
+    p->type = MPC_TYPE_OR;
+    p->data.or.n = n;
+    p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+
+    va_start(va, n);
+    for (i = 0; i < n; i++) {
+        p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+    }
+    va_end(va);
+
+    return p;
+}
+
+mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
+
+    int i;
+    va_list va;
+
+    mpc_parser_t *p = mpc_undefined();
+
+    p->type = MPC_TYPE_AND;
+    p->data.and.n = n;
+    p->data.and.f = f;
+    p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
+    p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+
+    va_start(va, f);
+    for (i = 0; i < n; i++) {
+        p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+    }
+    for (i = 0; i < (n-1); i++) {
+        p->data.and.dxs[i] = va_arg(va, mpc_dtor_t);
+        mpc_repeat_dtor(p->data.and.xs[i], p->data.and.dxs[i]);
+    }
+    va_end(va);
+
+    return p;
+}
+
+/*
+** Each precedence is stored as its rank among those
+** given, so an operator's level and associativity
+** fit in a byte.
+*/
+
+enum {
+    MPC_EXPR_OPS_MAX = 127
+};
+
+static mpc_parser_t *mpc_expr_table(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da,
+                                    mpc_parser_t **ops, const int *precs, const int *assocs) {
+
+    int i, j, k, rank;
+    mpc_parser_t *p;
+
+    if (n < 0 || n > MPC_EXPR_OPS_MAX) {
+        mpc_soft_delete(a);
+        for (i = 0; i < n; i++) { mpc_soft_delete(ops[i]); }
+        return mpc_failf("Too many operators! At most %i are supported.", MPC_EXPR_OPS_MAX);
+    }
+
+    p = mpc_undefined();
+    p->type = MPC_TYPE_EXPR;
+    p->data.expr.n = n;
+    p->data.expr.f = f;
+    p->data.expr.dx = da;
+    p->data.expr.xs = malloc(sizeof(mpc_parser_t*) * (n+1));
+    p->data.expr.ps = malloc(n ? n : 1);
+    p->data.expr.xs[0] = a;
+
+    for (i = 0; i < n; i++) {
+        for (rank = 0, j = 0; j < n; j++) {
+            if (precs[j] >= precs[i]) { continue; }
+            for (k = 0; k < j && precs[k] != precs[j]; k++);
+            if (k == j) { rank++; }
+        }
+        p->data.expr.xs[i+1] = ops[i];
+        p->data.expr.ps[i] = (unsigned char)(rank * 2 + (assocs[i] == MPC_ASSOC_RIGHT));
+    }
+
+    return p;
+}
+
+static mpc_parser_t *mpc_expr_va(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da, va_list va) {
+
+    int i;
+    mpc_parser_t *p, **ops = malloc(sizeof(mpc_parser_t*) * (n > 0 ? n : 1));
+    int *precs = malloc(sizeof(int) * (n > 0 ? n : 1));
+    int *assocs = malloc(sizeof(int) * (n > 0 ? n : 1));
+
+    for (i = 0; i < n; i++) {
+        ops[i] = va_arg(va, mpc_parser_t*);
+        precs[i] = va_arg(va, int);
+        assocs[i] = va_arg(va, int);
+    }
+
+    p = mpc_expr_table(n, f, a, da, ops, precs, assocs);
+    free(ops);
+    free(precs);
+    free(assocs);
+    return p;
+}
+
+mpc_parser_t *mpc_expr(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da, ...) {
+    mpc_parser_t *p;
+    va_list va;
+    va_start(va, da);
+    p = mpc_expr_va(n, f, a, da, va);
+    va_end(va);
+    return p;
+}
+
+/*
+** Common Parsers
+*/
+
+mpc_parser_t *mpc_soi(void) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_SOI;
+    return mpc_expect(p, "start of input");
+}
+
+mpc_parser_t *mpc_eoi(void) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_EOI;
+    return mpc_expect(p, "end of input");
+}
+
+static int mpc_boundary_anchor(char prev, char next) {
+    const char* word = "abcdefghijklmnopqrstuvwxyz"
+                       "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                       "0123456789_";
+    if ( strchr(word, next) &&  prev == '\0') { return 1; }
+    if ( strchr(word, prev) &&  next == '\0') { return 1; }
+    if ( strchr(word, next) && !strchr(word, prev)) { return 1; }
+    if (!strchr(word, next) &&  strchr(word, prev)) { return 1; }
+    return 0;
+}
+
+static int mpc_boundary_newline_anchor(char prev, char next) {
+    (void)next;
+    return prev == '\n';
+}
+
+mpc_parser_t *mpc_boundary(void) { return mpc_expect(mpc_anchor(mpc_boundary_anchor), "word boundary"); }
+mpc_parser_t *mpc_boundary_newline(void) { return mpc_expect(mpc_anchor(mpc_boundary_newline_anchor), "start of newline"); }
+
+mpc_parser_t *mpc_whitespace(void) { return mpc_expect(mpc_oneof(" \f\n\r\t\v"), "whitespace"); }
+mpc_parser_t *mpc_whitespaces(void) { return mpc_expect(mpc_many(mpcf_strfold, mpc_whitespace()), "spaces"); }
+mpc_parser_t *mpc_blank(void) { return mpc_expect(mpc_apply(mpc_whitespaces(), mpcf_free), "whitespace"); }
+
+mpc_parser_t *mpc_newline(void) { return mpc_expect(mpc_char('\n'), "newline"); }
+mpc_parser_t *mpc_tab(void) { return mpc_expect(mpc_char('\t'), "tab"); }
+mpc_parser_t *mpc_escape(void) { return mpc_and(2, mpcf_strfold, mpc_char('\\'), mpc_any(), free); }
+
+mpc_parser_t *mpc_digit(void) { return mpc_expect(mpc_oneof("0123456789"), "digit"); }
+mpc_parser_t *mpc_hexdigit(void) { return mpc_expect(mpc_oneof("0123456789ABCDEFabcdef"), "hex digit"); }
+mpc_parser_t *mpc_octdigit(void) { return mpc_expect(mpc_oneof("01234567"), "oct digit"); }
+mpc_parser_t *mpc_digits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_digit()), "digits"); }
+mpc_parser_t *mpc_hexdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_hexdigit()), "hex digits"); }
+mpc_parser_t *mpc_octdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_octdigit()), "oct digits"); }
+
+mpc_parser_t *mpc_lower(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyz"), "lowercase letter"); }
+mpc_parser_t *mpc_upper(void) { return mpc_expect(mpc_oneof("ABCDEFGHIJKLMNOPQRSTUVWXYZ"), "uppercase letter"); }
+mpc_parser_t *mpc_alpha(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"), "letter"); }
+mpc_parser_t *mpc_underscore(void) { return mpc_expect(mpc_char('_'), "underscore"); }
+mpc_parser_t *mpc_alphanum(void) { return mpc_expect(mpc_or(3, mpc_alpha(), mpc_digit(), mpc_underscore()), "alphanumeric"); }
+
+mpc_parser_t *mpc_int(void) { return mpc_expect(mpc_apply(mpc_digits(), mpcf_int), "integer"); }
+mpc_parser_t *mpc_hex(void) { return mpc_expect(mpc_apply(mpc_hexdigits(), mpcf_hex), "hexadecimal"); }
+mpc_parser_t *mpc_oct(void) { return mpc_expect(mpc_apply(mpc_octdigits(), mpcf_oct), "octadecimal"); }
+mpc_parser_t *mpc_number(void) { return mpc_expect(mpc_or(3, mpc_int(), mpc_hex(), mpc_oct()), "number"); }
+
+mpc_parser_t *mpc_real(void) {
+
+    /* [+-]?\d+(\.\d+)?([eE][+-]?[0-9]+)? */
+
+    mpc_parser_t *p0, *p1, *p2, *p30, *p31, *p32, *p3;
+
+    p0 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
+    p1 = mpc_digits();
+    p2 = mpc_maybe_lift(mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_digits(), free), mpcf_ctor_str);
+    p30 = mpc_oneof("eE");
+    p31 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
+    p32 = mpc_digits();
+    p3 = mpc_maybe_lift(mpc_and(3, mpcf_strfold, p30, p31, p32, free, free), mpcf_ctor_str);
+
+    return mpc_expect(mpc_and(4, mpcf_strfold, p0, p1, p2, p3, free, free, free), "real");
+
+}
+
+mpc_parser_t *mpc_float(void) {
+    return mpc_expect(mpc_apply(mpc_real(), mpcf_float), "float");
+}
+
+mpc_parser_t *mpc_char_lit(void) {
+    return mpc_expect(mpc_between(mpc_or(2, mpc_escape(), mpc_any()), free, "'", "'"), "char");
+}
+
+mpc_parser_t *mpc_string_lit(void) {
+    mpc_parser_t *strchar = mpc_or(2, mpc_escape(), mpc_noneof("\""));
+    return mpc_expect(mpc_between(mpc_many(mpcf_strfold, strchar), free, "\"", "\""), "string");
+}
+
+mpc_parser_t *mpc_regex_lit(void) {
+    mpc_parser_t *regexchar = mpc_or(2, mpc_escape(), mpc_noneof("/"));
+    return mpc_expect(mpc_between(mpc_many(mpcf_strfold, regexchar), free, "/", "/"), "regex");
+}
+
+mpc_parser_t *mpc_ident(void) {
+    mpc_parser_t *p0, *p1;
+    p0 = mpc_or(2, mpc_alpha(), mpc_underscore());
+    p1 = mpc_many(mpcf_strfold, mpc_alphanum());
+    return mpc_and(2, mpcf_strfold, p0, p1, free);
+}
+
+/*
+** Useful Parsers
+*/
+
+mpc_parser_t *mpc_startwith(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_soi(), a, mpcf_dtor_null); }
+mpc_parser_t *mpc_endwith(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(2, mpcf_fst, a, mpc_eoi(), da); }
+mpc_parser_t *mpc_whole(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(3, mpcf_snd, mpc_soi(), a, mpc_eoi(), mpcf_dtor_null, da); }
+
+mpc_parser_t *mpc_stripl(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_blank(), a, mpcf_dtor_null); }
+mpc_parser_t *mpc_stripr(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
+mpc_parser_t *mpc_strip(mpc_parser_t *a) { return mpc_and(3, mpcf_snd, mpc_blank(), a, mpc_blank(), mpcf_dtor_null, mpcf_dtor_null); }
+mpc_parser_t *mpc_tok(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
+mpc_parser_t *mpc_sym(const char *s) { return mpc_tok(mpc_string(s)); }
+
+mpc_parser_t *mpc_total(mpc_parser_t *a, mpc_dtor_t da) { return mpc_whole(mpc_strip(a), da); }
+
+mpc_parser_t *mpc_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
+    return mpc_and(3, mpcf_snd_free,
+                   mpc_string(o), a, mpc_string(c),
+                   free, ad);
+}
+
+mpc_parser_t *mpc_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "(", ")"); }
+mpc_parser_t *mpc_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "<", ">"); }
+mpc_parser_t *mpc_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_between(a, ad, "{", "}"); }
+mpc_parser_t *mpc_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_between(a, ad, "[", "]"); }
+
+mpc_parser_t *mpc_tok_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
+    return mpc_and(3, mpcf_snd_free,
+                   mpc_sym(o), mpc_tok(a), mpc_sym(c),
+                   free, ad);
+}
+
+mpc_parser_t *mpc_tok_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "(", ")"); }
+mpc_parser_t *mpc_tok_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "<", ">"); }
+mpc_parser_t *mpc_tok_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_tok_between(a, ad, "{", "}"); }
+mpc_parser_t *mpc_tok_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_tok_between(a, ad, "[", "]"); }
+
+/*
+** Regular Expression Parsers
+*/
+
+/*
+** So here is a cute bootstrapping.
+**
+** I'm using the previously defined
+** mpc constructs and functions to
+** parse the user regex string and
+** construct a parser from it.
+**
+** As it turns out lots of the standard
+** mpc functions look a lot like `fold`
+** functions and so can be used indirectly
+** by many of the parsing functions to build
+** a parser directly - as we are parsing.
+**
+** This is certainly something that
+** would be less elegant/interesting
+** in a two-phase parser which first
+** builds an AST and then traverses it
+** to generate the object.
+**
+** This whole thing acts as a great
+** case study for how trivial it can be
+** to write a great parser in a few
+** lines of code using mpc.
+*/
+
+/*
+**
+**  ### Regular Expression Grammar
+**
+**      <regex> : <term> | (<term> "|" <regex>)
+**
+**      <term> : <factor>*
+**
+**      <factor> : <base>
+**               | <base> "*"
+**               | <base> "+"
+**               | <base> "?"
+**               | <base> "~"
+**               | <base> "{" <digits> "}"
+**
+**      <base> : <char>
+**             | "\" <char>
+**             | "(" <regex> ")"
+**             | "[" <range> "]"
+*/
+
+static mpc_val_t *mpcf_re_or(int n, mpc_val_t **xs) {
+    (void) n;
+    if (xs[1] == NULL) { return xs[0]; }
+    else { return mpc_or(2, xs[0], xs[1]); }
+}
+
+static mpc_val_t *mpcf_re_and(int n, mpc_val_t **xs) {
+    int i;
+    mpc_parser_t *p = mpc_lift(mpcf_ctor_str);
+    for (i = 0; i < n; i++) {
+        p = mpc_and(2, mpcf_strfold, p, xs[i], free);
+    }
+    return p;
+}
+
+static mpc_val_t *mpcf_re_repeat(int n, mpc_val_t **xs) {
+    int num;
+    (void) n;
+    if (xs[1] == NULL) { return xs[0]; }
+    switch(((char*)xs[1])[0])
+    {
+        case '*': { free(xs[1]); return mpc_many(mpcf_strfold, xs[0]); }; break;
+        case '+': { free(xs[1]); return mpc_many1(mpcf_strfold, xs[0]); }; break;
+        case '?': { free(xs[1]); return mpc_maybe_lift(xs[0], mpcf_ctor_str); }; break;
+        default:
+            num = *(int*)xs[1];
+            free(xs[1]);
+    }
+
+    return mpc_count(num, mpcf_strfold, xs[0], free);
+}
+
+static mpc_parser_t *mpc_re_escape_char(char c) {
+    switch (c) {
+        case 'a': return mpc_char('\a');
+        case 'f': return mpc_char('\f');
+        case 'n': return mpc_char('\n');
+        case 'r': return mpc_char('\r');
+        case 't': return mpc_char('\t');
+        case 'v': return mpc_char('\v');
+        case 'b': return mpc_and(2, mpcf_snd, mpc_boundary(), mpc_lift(mpcf_ctor_str), free);
+        case 'B': return mpc_not_lift(mpc_boundary(), free, mpcf_ctor_str);
+        case 'A': return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
+        case 'Z': return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free);
+        case 'd': return mpc_digit();
+        case 'D': return mpc_not_lift(mpc_digit(), free, mpcf_ctor_str);
+        case 's': return mpc_whitespace();
+        case 'S': return mpc_not_lift(mpc_whitespace(), free, mpcf_ctor_str);
+        case 'w': return mpc_alphanum();
+        case 'W': return mpc_not_lift(mpc_alphanum(), free, mpcf_ctor_str);
+        default: return NULL;
+    }
+}
+
+static mpc_val_t *mpcf_re_escape(mpc_val_t *x, void* data) {
+
+    int mode = *((int*)data);
+    char *s = x;
+    mpc_parser_t *p;
+
+    /* Any Character */
+    if (s[0] == '.') {
+        free(s);
+        if (mode & MPC_RE_DOTALL) {
+            return mpc_any();
+        } else {
+            return mpc_expect(mpc_noneof("\n"), "any character except a newline");
+        }
+    }
+
+    /* Start of Input */
+    if (s[0] == '^') {
+        free(s);
+        if (mode & MPC_RE_MULTILINE) {
+            return mpc_and(2, mpcf_snd, mpc_or(2, mpc_soi(), mpc_boundary_newline()), mpc_lift(mpcf_ctor_str), free);
+        } else {
+            return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
+        }
+    }
+
+    /* End of Input */
+    if (s[0] == '$') {
+        free(s);
+        if (mode & MPC_RE_MULTILINE) {
+            return mpc_or(2,
+                          mpc_newline(),
+                          mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free));
+        } else {
+            return mpc_or(2,
+                          mpc_and(2, mpcf_fst, mpc_newline(), mpc_eoi(), free),
+                          mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free));
+        }
+    }
+
+    /* Regex Escape */
+    if (s[0] == '\\') {
+        p = mpc_re_escape_char(s[1]);
+        p = (p == NULL) ? mpc_char(s[1]) : p;
+        free(s);
+        return p;
+    }
+
+    /* Regex Standard */
+    p = mpc_char(s[0]);
+    free(s);
+    return p;
+}
+
+static const char *mpc_re_range_escape_char(char c) {
+    switch (c) {
+        case '-': return "-";
+        case 'a': return "\a";
+        case 'f': return "\f";
+        case 'n': return "\n";
+        case 'r': return "\r";
+        case 't': return "\t";
+        case 'v': return "\v";
+        case 'b': return "\b";
+        case 'd': return "0123456789";
+        case 's': return " \f\n\r\t\v";
+        case 'w': return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+        default: return NULL;
+    }
+}
+
+static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+
+    mpc_parser_t *out;
+    size_t i, j;
+    size_t start, end;
+    const char *tmp = NULL;
+    const char *s = x;
+    int comp = s[0] == '^' ? 1 : 0;
+    char *range = calloc(1,1);
+
+    if (s[0] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
+    if (s[0] == '^' &&
+        s[1] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
+
+    for (i = comp; i < strlen(s); i++){
+
+        /* Regex Range Escape */
+        if (s[i] == '\\') {
+            tmp = mpc_re_range_escape_char(s[i+1]);
+            if (tmp != NULL) {
+                range = realloc(range, strlen(range) + strlen(tmp) + 1);
+                strcat(range, tmp);
+            } else {
+                range = realloc(range, strlen(range) + 1 + 1);
+                range[strlen(range) + 1] = '\0';
+                range[strlen(range) + 0] = s[i+1];
+            }
+            i++;
+        }
+
+            /* Regex Range...Range */
+        else if (s[i] == '-') {
+            if (s[i+1] == '\0' || i == 0) {
+                range = realloc(range, strlen(range) + strlen("-") + 1);
+                strcat(range, "-");
+            } else {
+                start = s[i-1]+1;
+                end = s[i+1]-1;
+                for (j = start; j <= end; j++) {
+                    range = realloc(range, strlen(range) + 1 + 1 + 1);
+                    range[strlen(range) + 1] = '\0';
+                    range[strlen(range) + 0] = (char)j;
+                }
+            }
+        }
+
+            /* Regex Range Normal */
+        else {
+            range = realloc(range, strlen(range) + 1 + 1);
+            range[strlen(range) + 1] = '\0';
+            range[strlen(range) + 0] = s[i];
+        }
+
+    }
+
+    out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+
+    free(x);
+    free(range);
+
+    return out;
+}
+
+/*
+** Regular Expression Automata
+**
+** The parser built for a regex matches it the PEG
+** way: alternatives are tried in order and repeats
+** never give back what they have consumed. For most
+** regexes written in practice, such as `[0-9]+` or
+** `-?[0-9]+(\.[0-9]+)?`, this finds exactly the
+** longest match, and then the regex can be run as a
+** deterministic automaton in one pass over the input.
+**
+** The automaton is the position automaton of the
+** parser tree, with one state for each character
+** test. It is only used when it is deterministic as
+** it stands, when any alternative able to match
+** nothing comes last, and when no repeat can match
+** nothing. Then the next character always picks the
+** same branch the parser would have taken. A leading
+** `^` and trailing `$` are checked either side of it.
+** Everything else, including `{n}` which doesn't give
+** back input when it fails part way, keeps using the
+** parser tree.
+*/
+
+enum {
+    MPC_RE_DFA_POSITIONS_MAX = 253
+};
+
+typedef struct {
+    unsigned char bits[32];
+} mpc_re_set_t;
+
+typedef struct {
+    mpc_re_set_t first;
+    mpc_re_set_t last;
+    int nullable;
+} mpc_re_frag_t;
+
+typedef struct {
+    int num;
+    int error;
+    mpc_re_set_t chars[MPC_RE_DFA_POSITIONS_MAX];
+    mpc_re_set_t follow[MPC_RE_DFA_POSITIONS_MAX];
+} mpc_re_build_t;
+
+static void mpc_re_set_add(mpc_re_set_t *s, int x) {
+    s->bits[x / 8] |= (unsigned char)(1 << (x % 8));
+}
+
+static int mpc_re_set_has(const mpc_re_set_t *s, int x) {
+    return (s->bits[x / 8] >> (x % 8)) & 1;
+}
+
+static void mpc_re_set_union(mpc_re_set_t *s, const mpc_re_set_t *t) {
+    int j;
+    for (j = 0; j < 32; j++) { s->bits[j] |= t->bits[j]; }
+}
+
+static int mpc_re_set_disjoint(const mpc_re_set_t *s, const mpc_re_set_t *t) {
+    int j;
+    for (j = 0; j < 32; j++) {
+        if (s->bits[j] & t->bits[j]) { return 0; }
+    }
+    return 1;
+}
+
+static void mpc_re_frag_empty(mpc_re_frag_t *r) {
+    memset(r, 0, sizeof(mpc_re_frag_t));
+    r->nullable = 1;
+}
+
+static int mpc_re_build_position(mpc_re_build_t *b, mpc_re_frag_t *r) {
+    int x;
+    memset(r, 0, sizeof(mpc_re_frag_t));
+    if (b->num == MPC_RE_DFA_POSITIONS_MAX) { b->error = 1; return -1; }
+    x = b->num++;
+    mpc_re_set_add(&r->first, x);
+    mpc_re_set_add(&r->last, x);
+    return x;
+}
+
+static int mpc_re_build_match(mpc_parser_t *p, char c) {
+    switch (p->type) {
+        case MPC_TYPE_ANY:     return 1;
+        case MPC_TYPE_SINGLE:  return c == p->data.single.x;
+        case MPC_TYPE_RANGE:   return c >= p->data.range.x && c <= p->data.range.y;
+        case MPC_TYPE_ONEOF:   return strchr(p->data.string.x, c) != 0;
+        case MPC_TYPE_NONEOF:  return strchr(p->data.string.x, c) == 0;
+        case MPC_TYPE_SATISFY: return p->data.satisfy.f(c);
+        default: return 0;
+    }
+}
+
+static void mpc_re_build_loop(mpc_re_build_t *b, const mpc_re_frag_t *r) {
+    int j;
+    for (j = 0; j < b->num; j++) {
+        if (mpc_re_set_has(&r->last, j)) { mpc_re_set_union(&b->follow[j], &r->first); }
+    }
+}
+
+static void mpc_re_build_seq(mpc_re_build_t *b, mpc_re_frag_t *r, const mpc_re_frag_t *x) {
+    int j;
+    for (j = 0; j < b->num; j++) {
+        if (mpc_re_set_has(&r->last, j)) { mpc_re_set_union(&b->follow[j], &x->first); }
+    }
+    if (r->nullable) { mpc_re_set_union(&r->first, &x->first); }
+    if (x->nullable) { mpc_re_set_union(&r->last, &x->last); } else { r->last = x->last; }
+    r->nullable = r->nullable && x->nullable;
+}
+
+static void mpc_re_build(mpc_re_build_t *b, mpc_parser_t *p, mpc_re_frag_t *r) {
+
+    int j, x;
+    const char *s;
+    mpc_re_frag_t y;
+
+    mpc_re_frag_empty(r);
+
+    if (b->error) { return; }
+    if (p->retained) { b->error = 1; return; }
+
+    switch (p->type) {
+
+        case MPC_TYPE_ANY:
+        case MPC_TYPE_SINGLE:
+        case MPC_TYPE_RANGE:
+        case MPC_TYPE_ONEOF:
+        case MPC_TYPE_NONEOF:
+        case MPC_TYPE_SATISFY:
+            x = mpc_re_build_position(b, r);
+            if (x < 0) { return; }
+            for (j = 1; j < 256; j++) {
+                if (mpc_re_build_match(p, (char)j)) { mpc_re_set_add(&b->chars[x], j); }
+            }
+            return;
+
+        case MPC_TYPE_STRING:
+            for (s = p->data.string.x; *s; s++) {
+                x = mpc_re_build_position(b, &y);
+                if (x < 0) { return; }
+                mpc_re_set_add(&b->chars[x], (unsigned char)*s);
+                mpc_re_build_seq(b, r, &y);
+            }
+            return;
+
+        case MPC_TYPE_LIFT:
+            if (p->data.lift.lf != mpcf_ctor_str) { b->error = 1; }
+            return;
+
+        case MPC_TYPE_EXPECT:
+            mpc_re_build(b, p->data.expect.x, r);
+            return;
+
+        case MPC_TYPE_MAYBE:
+            if (p->data.not.lf != mpcf_ctor_str) { b->error = 1; return; }
+            mpc_re_build(b, p->data.not.x, r);
+            r->nullable = 1;
+            return;
+
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+            if (p->data.repeat.f != mpcf_strfold) { b->error = 1; return; }
+            mpc_re_build(b, p->data.repeat.x, r);
+            if (r->nullable) { b->error = 1; return; }
+            mpc_re_build_loop(b, r);
+            r->nullable = p->type == MPC_TYPE_MANY;
+            return;
+
+        case MPC_TYPE_OR:
+            r->nullable = 0;
+            if (p->data.or.n == 0) { b->error = 1; return; }
+            for (j = 0; j < p->data.or.n; j++) {
+                if (r->nullable) { b->error = 1; return; }
+                mpc_re_build(b, p->data.or.xs[j], &y);
+                mpc_re_set_union(&r->first, &y.first);
+                mpc_re_set_union(&r->last, &y.last);
+                r->nullable = y.nullable;
+            }
+            return;
+
+        case MPC_TYPE_AND:
+            if (p->data.and.f != mpcf_strfold) { b->error = 1; return; }
+            for (j = 0; j < p->data.and.n; j++) {
+                mpc_re_build(b, p->data.and.xs[j], &y);
+                mpc_re_build_seq(b, r, &y);
+            }
+            return;
+
+        default:
+            b->error = 1;
+            return;
+    }
+}
+
+static int mpc_re_build_deterministic(mpc_re_build_t *b, const mpc_re_set_t *xs) {
+    int j;
+    mpc_re_set_t seen;
+    memset(&seen, 0, sizeof(mpc_re_set_t));
+    for (j = 0; j < b->num; j++) {
+        if (!mpc_re_set_has(xs, j)) { continue; }
+        if (!mpc_re_set_disjoint(&seen, &b->chars[j])) { return 0; }
+        mpc_re_set_union(&seen, &b->chars[j]);
+    }
+    return 1;
+}
+
+/* The anchors are recognised by the exact shape `mpcf_re_escape` gives them */
+
+static mpc_parser_t *mpc_re_dfa_unexpect(mpc_parser_t *p) {
+    while (p->type == MPC_TYPE_EXPECT) { p = p->data.expect.x; }
+    return p;
+}
+
+static int mpc_re_dfa_lift(mpc_parser_t *p) {
+    return p->type == MPC_TYPE_LIFT && p->data.lift.lf == mpcf_ctor_str;
+}
+
+static int mpc_re_dfa_newline(mpc_parser_t *p) {
+    p = mpc_re_dfa_unexpect(p);
+    return p->type == MPC_TYPE_SINGLE && p->data.single.x == '\n';
+}
+
+static int mpc_re_dfa_zero(mpc_parser_t *p, int type) {
+    return p->type == MPC_TYPE_AND && p->data.and.n == 2 && p->data.and.f == mpcf_snd
+        && mpc_re_dfa_unexpect(p->data.and.xs[0])->type == type
+        && mpc_re_dfa_lift(p->data.and.xs[1]);
+}
+
+static int mpc_re_dfa_soi(mpc_parser_t *p) {
+
+    mpc_parser_t *a, *b;
+
+    if (mpc_re_dfa_zero(p, MPC_TYPE_SOI)) { return MPC_RE_DFA_SOI; }
+    if (p->type != MPC_TYPE_AND || p->data.and.n != 2 || p->data.and.f != mpcf_snd
+    || !mpc_re_dfa_lift(p->data.and.xs[1])) { return 0; }
+
+    p = p->data.and.xs[0];
+    if (p->type != MPC_TYPE_OR || p->data.or.n != 2) { return 0; }
+    a = mpc_re_dfa_unexpect(p->data.or.xs[0]);
+    b = mpc_re_dfa_unexpect(p->data.or.xs[1]);
+    if (a->type == MPC_TYPE_SOI
+    &&  b->type == MPC_TYPE_ANCHOR && b->data.anchor.f == mpc_boundary_newline_anchor) {
+        return MPC_RE_DFA_SOI | MPC_RE_DFA_SOI_LINE;
+    }
+    return 0;
+}
+
+static int mpc_re_dfa_eoi(mpc_parser_t *p) {
+
+    mpc_parser_t *a;
+
+    if (p->type != MPC_TYPE_OR || p->data.or.n != 2
+    || !mpc_re_dfa_zero(p->data.or.xs[1], MPC_TYPE_EOI)) { return 0; }
+
+    a = p->data.or.xs[0];
+    if (mpc_re_dfa_newline(a)) { return MPC_RE_DFA_EOI | MPC_RE_DFA_EOI_LINE; }
+    if (a->type == MPC_TYPE_AND && a->data.and.n == 2 && a->data.and.f == mpcf_fst
+    &&  mpc_re_dfa_newline(a->data.and.xs[0])
+    &&  mpc_re_dfa_unexpect(a->data.and.xs[1])->type == MPC_TYPE_EOI) {
+        return MPC_RE_DFA_EOI;
+    }
+    return 0;
+}
+
+static int mpc_optimise_children(mpc_parser_t *p, mpc_parser_t ***xs);
+
+static int mpc_re_height(mpc_parser_t *p) {
+    int j, n, h = 0, k;
+    mpc_parser_t **xs;
+    n = mpc_optimise_children(p, &xs);
+    for (j = 0; j < n; j++) {
+        k = mpc_re_height(xs[j]);
+        h = k > h ? k : h;
+    }
+    return h + 1;
+}
+
+static unsigned char *mpc_re_dfa(mpc_parser_t *x, mpc_pdata_regex_t *d) {
+
+    int j, k, q, n, a, c, flags = 0, lifts = 1, states, classes = 1;
+    mpc_parser_t **xs;
+    mpc_re_build_t *b;
+    mpc_re_frag_t r, y;
+    const mpc_re_set_t *set;
+    unsigned char map[256], reps[256], *t, *accept, *next;
+    int remap[512];
+
+    if (x->retained) { return NULL; }
+
+    if (x->type == MPC_TYPE_AND && x->data.and.f == mpcf_strfold) {
+        xs = x->data.and.xs;
+        n = x->data.and.n;
+    } else {
+        xs = &x;
+        n = 1;
+    }
+
+    b = calloc(1, sizeof(mpc_re_build_t));
+    mpc_re_frag_empty(&r);
+
+    for (j = 0; j < n; j++) {
+
+        if (lifts && !(flags & MPC_RE_DFA_SOI) && (a = mpc_re_dfa_soi(xs[j]))) { flags |= a; continue; }
+        if (j == n-1 && (a = mpc_re_dfa_eoi(xs[j]))) { flags |= a; continue; }
+
+        lifts = lifts && mpc_re_dfa_lift(xs[j]);
+        mpc_re_build(b, xs[j], &y);
+        mpc_re_build_seq(b, &r, &y);
+    }
+
+    if (b->error || !mpc_re_build_deterministic(b, &r.first)) { free(b); return NULL; }
+    for (q = 0; q < b->num; q++) {
+        if (!mpc_re_build_deterministic(b, &b->follow[q])) { free(b); return NULL; }
+    }
+
+    /* Bytes no position tells apart share a class */
+
+    memset(map, 0, sizeof(map));
+    for (q = 0; q < b->num; q++) {
+        for (k = 0; k < 512; k++) { remap[k] = -1; }
+        for (c = 0, k = 0; c < 256; c++) {
+            a = map[c] * 2 + mpc_re_set_has(&b->chars[q], c);
+            if (remap[a] < 0) { remap[a] = k++; }
+            map[c] = (unsigned char)remap[a];
+        }
+        classes = k;
+    }
+
+    for (c = 255; c >= 0; c--) { reps[map[c]] = (unsigned char)c; }
+
+    states = b->num + 2;
+    t = malloc(256 + states + states * classes);
+    accept = t + 256;
+    next = accept + states;
+    memcpy(t, map, 256);
+
+    for (j = 0; j < states; j++) {
+        accept[j] = j == 0 ? 0 : j == 1 ? r.nullable : mpc_re_set_has(&r.last, j-2);
+        set = j == 0 ? NULL : j == 1 ? &r.first : &b->follow[j-2];
+        for (c = 0; c < classes; c++) {
+            next[j * classes + c] = 0;
+            for (q = 0; set && q < b->num; q++) {
+                if (mpc_re_set_has(set, q) && mpc_re_set_has(&b->chars[q], reps[c])) {
+                    next[j * classes + c] = (unsigned char)(q + 2);
+                }
+            }
+        }
+    }
+
+    free(b);
+
+    d->states = states;
+    d->classes = classes;
+    d->flags |= flags;
+    return t;
+}
+
+/*
+** The bytes any match must begin with, which can be
+** found for every regex. Parsers outside the usual
+** regex shapes are allowed to begin with anything.
+** Returns if the parser might match nothing.
+*/
+
+static int mpc_re_first(mpc_parser_t *p, mpc_re_set_t *first) {
+
+    int j, nullable;
+
+    if (p->retained) { memset(first->bits, 0xFF, 32); return 1; }
+
+    switch (p->type) {
+
+        case MPC_TYPE_ANY:
+        case MPC_TYPE_SINGLE:
+        case MPC_TYPE_RANGE:
+        case MPC_TYPE_ONEOF:
+        case MPC_TYPE_NONEOF:
+        case MPC_TYPE_SATISFY:
+            for (j = 1; j < 256; j++) {
+                if (mpc_re_build_match(p, (char)j)) { mpc_re_set_add(first, j); }
+            }
+            return 0;
+
+        case MPC_TYPE_STRING:
+            if (p->data.string.x[0] == '\0') { return 1; }
+            mpc_re_set_add(first, (unsigned char)p->data.string.x[0]);
+            return 0;
+
+        case MPC_TYPE_FAIL: return 0;
+
+        case MPC_TYPE_PASS:
+        case MPC_TYPE_LIFT:
+        case MPC_TYPE_LIFT_VAL:
+        case MPC_TYPE_ANCHOR:
+        case MPC_TYPE_SOI:
+        case MPC_TYPE_EOI:
+        case MPC_TYPE_NOT:
+            return 1;
+
+        case MPC_TYPE_EXPECT: return mpc_re_first(p->data.expect.x, first);
+        case MPC_TYPE_MANY1:  return mpc_re_first(p->data.repeat.x, first);
+
+        case MPC_TYPE_MAYBE:  mpc_re_first(p->data.not.x, first);    return 1;
+        case MPC_TYPE_MANY:   mpc_re_first(p->data.repeat.x, first); return 1;
+
+        case MPC_TYPE_COUNT:
+            if (p->data.repeat.n == 0) { return 1; }
+            return mpc_re_first(p->data.repeat.x, first);
+
+        case MPC_TYPE_OR:
+            for (nullable = 0, j = 0; j < p->data.or.n; j++) {
+                nullable = mpc_re_first(p->data.or.xs[j], first) || nullable;
+            }
+            return nullable || p->data.or.n == 0;
+
+        case MPC_TYPE_AND:
+            for (j = 0; j < p->data.and.n; j++) {
+                if (!mpc_re_first(p->data.and.xs[j], first)) { return 0; }
+            }
+            return 1;
+
+        default:
+            memset(first->bits, 0xFF, 32);
+            return 1;
+    }
+}
+
+static mpc_parser_t *mpc_re_node(mpc_parser_t *x) {
+
+    mpc_pdata_regex_t d;
+    mpc_re_set_t first;
+    unsigned char *t;
+    mpc_parser_t *p;
+
+    memset(&d, 0, sizeof(mpc_pdata_regex_t));
+    memset(&first, 0, sizeof(mpc_re_set_t));
+
+    t = mpc_re_dfa(x, &d);
+    if (!mpc_re_first(x, &first)) { d.flags |= MPC_RE_DFA_FIRST; }
+    if (t == NULL && !(d.flags & MPC_RE_DFA_FIRST)) { return x; }
+
+    d.x = x;
+    d.depth = mpc_re_height(x);
+    d.t = malloc(mpc_re_dfa_size(&d));
+    memcpy(d.t, first.bits, 32);
+    if (t) { memcpy(d.t + 32, t, mpc_re_dfa_size(&d) - 32); }
+    free(t);
+
+    p = mpc_undefined();
+    p->type = MPC_TYPE_REGEX;
+    p->data.regex = d;
+    return p;
+}
+
+/*
+** Regular Expression Cache
+**
+** The meta-grammar is built the first time each mode
+** needs it and then kept until `mpc_re_cleanup`. It
+** is deleted outside the lock, as deleting takes it
+** for any regexes a parser holds. Compiled regexes are kept
+** in `mpc_re_cache`, a chained hash table keyed by
+** pattern and mode, so a pattern is only compiled
+** once however many times it is asked for. Every
+** parser returned for it shares one body, which is
+** freed along with its entry when the last of them
+** is deleted. The lock guards both tables so regexes
+** can be made and deleted from several threads.
+*/
+
+struct mpc_re_body_t {
+    int refs;
+    int mode;
+    char *re;
+    mpc_re_body_t *next;
+    mpc_pdata_regex_t regex;
+};
+
+static mpc_lock_t mpc_re_lock = MPC_LOCK_INIT;
+static mpc_parser_t *mpc_re_grammars[4][6];
+static int mpc_re_modes[4] = { 0, 1, 2, 3 };
+static mpc_re_body_t **mpc_re_cache = NULL;
+static int mpc_re_cache_num = 0;
+static int mpc_re_cache_max = 0;
+
+static unsigned long mpc_hash(const char *x) {
+    unsigned long h = 2166136261UL;
+    while (*x) { h = ((h ^ (unsigned char)*x) * 16777619UL) & 0xFFFFFFFFUL; x++; }
+    return h;
+}
+
+static mpc_re_body_t **mpc_re_cache_slot(const char *re, int mode) {
+    mpc_re_body_t **b = &mpc_re_cache[(mpc_hash(re) + (unsigned long)mode) & (mpc_re_cache_max-1)];
+    while (*b && ((*b)->mode != mode || strcmp((*b)->re, re) != 0)) { b = &(*b)->next; }
+    return b;
+}
+
+static void mpc_re_cache_insert(mpc_re_body_t *b) {
+
+    int i;
+    mpc_re_body_t **old, *c, *n;
+
+    /* Keep chains short on average */
+    if (mpc_re_cache_num + 1 > mpc_re_cache_max) {
+        old = mpc_re_cache;
+        i = mpc_re_cache_max;
+        mpc_re_cache_max = mpc_re_cache_max ? mpc_re_cache_max * 2 : 64;
+        mpc_re_cache = calloc(mpc_re_cache_max, sizeof(mpc_re_body_t*));
+        while (i--) {
+            for (c = old[i]; c; c = n) {
+                n = c->next;
+                c->next = NULL;
+                *mpc_re_cache_slot(c->re, c->mode) = c;
+            }
+        }
+        free(old);
+    }
+
+    *mpc_re_cache_slot(b->re, b->mode) = b;
+    mpc_re_cache_num++;
+}
+
+static void mpc_re_retain(mpc_re_body_t *b) {
+    mpc_lock(&mpc_re_lock);
+    b->refs++;
+    mpc_unlock(&mpc_re_lock);
+}
+
+/* Returns if this was the last reference, leaving the body's parser and table to the caller */
+static int mpc_re_release(mpc_re_body_t *b) {
+
+    int last;
+
+    mpc_lock(&mpc_re_lock);
+    last = --b->refs == 0;
+    if (last) {
+        *mpc_re_cache_slot(b->re, b->mode) = b->next;
+        if (--mpc_re_cache_num == 0) {
+            free(mpc_re_cache);
+            mpc_re_cache = NULL;
+            mpc_re_cache_max = 0;
+        }
+        free(b->re);
+        free(b);
+    }
+    mpc_unlock(&mpc_re_lock);
+
+    return last;
+}
+
+static void mpc_re_grammar(int *mode, mpc_parser_t **g) {
+
+    mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose;
+
+    Regex  = mpc_new("regex");
+    Term   = mpc_new("term");
+    Factor = mpc_new("factor");
+    Base   = mpc_new("base");
+    Range  = mpc_new("range");
+
+    mpc_define(Regex, mpc_and(2, mpcf_re_or,
+                              Term,
+                              mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_char('|'), Regex, free)),
+                              (mpc_dtor_t)mpc_delete
+    ));
+
+    mpc_define(Term, mpc_many(mpcf_re_and, Factor));
+
+    mpc_define(Factor, mpc_and(2, mpcf_re_repeat,
+                               Base,
+                               mpc_or(5,
+                                      mpc_char('*'), mpc_char('+'), mpc_char('?'),
+                                      mpc_brackets(mpc_int(), free),
+                                      mpc_pass()),
+                               (mpc_dtor_t)mpc_delete
+    ));
+
+    mpc_define(Base, mpc_or(4,
+                            mpc_parens(Regex, (mpc_dtor_t)mpc_delete),
+                            mpc_squares(Range, (mpc_dtor_t)mpc_delete),
+                            mpc_apply_to(mpc_escape(), mpcf_re_escape, mode),
+                            mpc_apply_to(mpc_noneof(")|"), mpcf_re_escape, mode)
+    ));
+
+    mpc_define(Range, mpc_apply(
+            mpc_many(mpcf_strfold, mpc_or(2, mpc_escape(), mpc_noneof("]"))),
+            mpcf_re_range
+    ));
+
+    RegexEnclose = mpc_whole(mpc_predictive(Regex), (mpc_dtor_t)mpc_delete);
+
+    mpc_optimise(RegexEnclose);
+    mpc_optimise(Regex);
+    mpc_optimise(Term);
+    mpc_optimise(Factor);
+    mpc_optimise(Base);
+    mpc_optimise(Range);
+
+    g[0] = RegexEnclose; g[1] = Regex; g[2] = Term;
+    g[3] = Factor; g[4] = Base; g[5] = Range;
+}
+
+mpc_parser_t *mpc_re(const char *re) {
+    return mpc_re_mode(re, MPC_RE_DEFAULT);
+}
+
+mpc_parser_t *mpc_re_mode(const char *re, int mode) {
+
+    char *err_msg;
+    mpc_parser_t *err_out, *p;
+    mpc_result_t r;
+    mpc_re_body_t *b;
+
+    mode &= MPC_RE_MULTILINE | MPC_RE_DOTALL;
+
+    mpc_lock(&mpc_re_lock);
+
+    b = mpc_re_cache_max ? *mpc_re_cache_slot(re, mode) : NULL;
+    if (b) {
+        b->refs++;
+        mpc_unlock(&mpc_re_lock);
+        p = mpc_undefined();
+        p->type = MPC_TYPE_REGEX;
+        p->data.regex = b->regex;
+        return p;
+    }
+
+    if (mpc_re_grammars[mode][0] == NULL) {
+        mpc_re_grammar(&mpc_re_modes[mode], mpc_re_grammars[mode]);
+    }
+
+    if(!mpc_parse("<mpc_re_compiler>", re, mpc_re_grammars[mode][0], &r)) {
+        err_msg = mpc_err_string(r.error);
+        err_out = mpc_failf("Invalid Regex: %s", err_msg);
+        mpc_err_delete(r.error);
+        free(err_msg);
+        r.output = err_out;
+    }
+
+    mpc_optimise(r.output);
+
+    /* Only regexes wrapped with a table are shared */
+    p = mpc_re_node(r.output);
+    if (p->type == MPC_TYPE_REGEX) {
+        b = malloc(sizeof(mpc_re_body_t));
+        b->refs = 1;
+        b->mode = mode;
+        b->re = malloc(strlen(re) + 1);
+        strcpy(b->re, re);
+        b->next = NULL;
+        p->data.regex.body = b;
+        b->regex = p->data.regex;
+        mpc_re_cache_insert(b);
+    }
+
+    mpc_unlock(&mpc_re_lock);
+
+    return p;
+
+}
+
+void mpc_re_cleanup(void) {
+
+    int j;
+    mpc_parser_t *g[4][6];
+
+    mpc_lock(&mpc_re_lock);
+    memcpy(g, mpc_re_grammars, sizeof(g));
+    memset(mpc_re_grammars, 0, sizeof(mpc_re_grammars));
+    mpc_unlock(&mpc_re_lock);
+
+    for (j = 0; j < 4; j++) {
+        if (g[j][0] == NULL) { continue; }
+        mpc_delete(g[j][0]);
+        mpc_cleanup(5, g[j][1], g[j][2], g[j][3], g[j][4], g[j][5]);
+    }
+}
+
+/*
+** Common Fold Functions
+*/
+
+void mpcf_dtor_null(mpc_val_t *x) { (void) x; return; }
+
+mpc_val_t *mpcf_ctor_null(void) { return NULL; }
+mpc_val_t *mpcf_ctor_str(void) { return calloc(1, 1); }
+mpc_val_t *mpcf_free(mpc_val_t *x) { free(x); return NULL; }
+
+mpc_val_t *mpcf_int(mpc_val_t *x) {
+    int *y = malloc(sizeof(int));
+    *y = strtol(x, NULL, 10);
+    free(x);
+    return y;
+}
+
+mpc_val_t *mpcf_hex(mpc_val_t *x) {
+    int *y = malloc(sizeof(int));
+    *y = strtol(x, NULL, 16);
+    free(x);
+    return y;
+}
+
+mpc_val_t *mpcf_oct(mpc_val_t *x) {
+    int *y = malloc(sizeof(int));
+    *y = strtol(x, NULL, 8);
+    free(x);
+    return y;
+}
+
+mpc_val_t *mpcf_float(mpc_val_t *x) {
+    float *y = malloc(sizeof(float));
+    *y = strtod(x, NULL);
+    free(x);
+    return y;
+}
+
+mpc_val_t *mpcf_strtriml(mpc_val_t *x) {
+    char *s = x;
+    while (isspace((unsigned char)*s)) {
+        memmove(s, s+1, strlen(s));
+    }
+    return s;
+}
+
+mpc_val_t *mpcf_strtrimr(mpc_val_t *x) {
+    char *s = x;
+    size_t l = strlen(s);
+    while (l > 0 && isspace((unsigned char)s[l-1])) {
+        s[l-1] = '\0'; l--;
+    }
+    return s;
+}
+
+mpc_val_t *mpcf_strtrim(mpc_val_t *x) {
+    return mpcf_strtriml(mpcf_strtrimr(x));
+}
+
+static const char mpc_escape_input_c[]  = {
+        '\a', '\b', '\f', '\n', '\r',
+        '\t', '\v', '\\', '\'', '\"', '\0'};
+
+static const char *mpc_escape_output_c[] = {
+        "\\a", "\\b", "\\f", "\\n", "\\r", "\\t",
+        "\\v", "\\\\", "\\'", "\\\"", "\\0", NULL};
+
+static const char mpc_escape_input_raw_re[] = { '/' };
+static const char *mpc_escape_output_raw_re[] = { "\\/", NULL };
+
+static const char mpc_escape_input_raw_cstr[] = { '"' };
+static const char *mpc_escape_output_raw_cstr[] = { "\\\"", NULL };
+
+static const char mpc_escape_input_raw_cchar[] = { '\'' };
+static const char *mpc_escape_output_raw_cchar[] = { "\\'", NULL };
+
+static mpc_val_t *mpcf_escape_new(mpc_val_t *x, const char *input, const char **output) {
+
+    int i;
+    int found;
+    char buff[2];
+    char *s = x;
+    char *y = calloc(1, 1);
+
+    while (*s) {
+
+        i = 0;
+        found = 0;
+
+        while (output[i]) {
+            if (*s == input[i]) {
+                y = realloc(y, strlen(y) + strlen(output[i]) + 1);
+                strcat(y, output[i]);
+                found = 1;
+                break;
+            }
+            i++;
+        }
+
+        if (!found) {
+            y = realloc(y, strlen(y) + 2);
+            buff[0] = *s; buff[1] = '\0';
+            strcat(y, buff);
+        }
+
+        s++;
+    }
+
+
+    return y;
+}
+
+static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, const char *input, const char **output) {
+
+    int i;
+    int found = 0;
+    char buff[2];
+    char *s = x;
+    char *y = calloc(1, 1);
+
+    while (*s) {
+
+        i = 0;
+        found = 0;
+
+        while (output[i]) {
+            if ((*(s+0)) == output[i][0] &&
+                (*(s+1)) == output[i][1]) {
+                y = realloc(y, strlen(y) + 1 + 1);
+                buff[0] = input[i]; buff[1] = '\0';
+                strcat(y, buff);
+                found = 1;
+                s++;
+                break;
+            }
+            i++;
+        }
+
+        if (!found) {
+            y = realloc(y, strlen(y) + 1 + 1);
+            buff[0] = *s; buff[1] = '\0';
+            strcat(y, buff);
+        }
+
+        if (*s == '\0') { break; }
+        else { s++; }
+    }
+
+    return y;
+
+}
+
+mpc_val_t *mpcf_escape(mpc_val_t *x) {
+    mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_c, mpc_escape_output_c);
+    free(x);
+    return y;
+}
+
+mpc_val_t *mpcf_unescape(mpc_val_t *x) {
+    mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_c, mpc_escape_output_c);
+    free(x);
+    return y;
+}
+
+mpc_val_t *mpcf_escape_regex(mpc_val_t *x) {
+    mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
+    free(x);
+    return y;
+}
+
+mpc_val_t *mpcf_unescape_regex(mpc_val_t *x) {
+    mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
+    free(x);
+    return y;
+}
+
+mpc_val_t *mpcf_escape_string_raw(mpc_val_t *x) {
+    mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
+    free(x);
+    return y;
+}
+
+mpc_val_t *mpcf_unescape_string_raw(mpc_val_t *x) {
+    mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
+    free(x);
+    return y;
+}
+
+mpc_val_t *mpcf_escape_char_raw(mpc_val_t *x) {
+    mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
+    free(x);
+    return y;
+}
+
+mpc_val_t *mpcf_unescape_char_raw(mpc_val_t *x) {
+    mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
+    free(x);
+    return y;
+}
+
+mpc_val_t *mpcf_null(int n, mpc_val_t** xs) { (void) n; (void) xs; return NULL; }
+mpc_val_t *mpcf_fst(int n, mpc_val_t **xs) { (void) n; return xs[0]; }
+mpc_val_t *mpcf_snd(int n, mpc_val_t **xs) { (void) n; return xs[1]; }
+mpc_val_t *mpcf_trd(int n, mpc_val_t **xs) { (void) n; return xs[2]; }
+
+static mpc_val_t *mpcf_nth_free(int n, mpc_val_t **xs, int x) {
+    int i;
+    for (i = 0; i < n; i++) {
+        if (i != x) { free(xs[i]); }
+    }
+    return xs[x];
+}
+
+mpc_val_t *mpcf_fst_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 0); }
+mpc_val_t *mpcf_snd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 1); }
+mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2); }
+mpc_val_t *mpcf_all_free(int n, mpc_val_t** xs) {
+    int i;
+    for (i = 0; i < n; i++) {
+        free(xs[i]);
+    }
+    return NULL;
+}
+
+mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
+    int i;
+    size_t l = 0;
+
+    if (n == 0) { return calloc(1, 1); }
+
+    for (i = 0; i < n; i++) { l += strlen(xs[i]); }
+
+    xs[0] = realloc(xs[0], l + 1);
+
+    for (i = 1; i < n; i++) {
+        strcat(xs[0], xs[i]); free(xs[i]);
+    }
+
+    return xs[0];
+}
+
+/*
+** Printing
+*/
+
+static void mpc_print_unretained(mpc_parser_t *p, int force) {
+
+    /* TODO: Print Everything Escaped */
+
+    int i;
+    char *s, *e;
+    char buff[2];
+
+    if (p->retained && !force) {;
+        if (p->name) { printf("<%s>", p->name); }
+        else { printf("<anon>"); }
+        return;
+    }
+
+    if (p->type == MPC_TYPE_UNDEFINED) { printf("<?>"); }
+    if (p->type == MPC_TYPE_PASS)   { printf("<:>"); }
+    if (p->type == MPC_TYPE_FAIL)   { printf("<!>"); }
+    if (p->type == MPC_TYPE_LIFT)   { printf("<#>"); }
+    if (p->type == MPC_TYPE_STATE)  { printf("<S>"); }
+    if (p->type == MPC_TYPE_CUT)    { printf("~"); }
+    if (p->type == MPC_TYPE_ANCHOR) { printf("<@>"); }
+    if (p->type == MPC_TYPE_EXPECT) {
+        printf("%s", p->data.expect.m);
+        /*mpc_print_unretained(p->msg.expect.x, 0);*/
+    }
+
+    if (p->type == MPC_TYPE_ANY) { printf("<.>"); }
+    if (p->type == MPC_TYPE_SATISFY) { printf("<f>"); }
+    if (p->type == MPC_TYPE_TOKEN) { printf("<token %i>", (unsigned char)p->data.single.x - 1); }
+
+    if (p->type == MPC_TYPE_SINGLE) {
+        buff[0] = p->data.single.x; buff[1] = '\0';
+        s = mpcf_escape_new(
+                buff,
+                mpc_escape_input_c,
+                mpc_escape_output_c);
+        printf("'%s'", s);
+        free(s);
+    }
+
+    if (p->type == MPC_TYPE_RANGE) {
+        buff[0] = p->data.range.x; buff[1] = '\0';
+        s = mpcf_escape_new(
+                buff,
+                mpc_escape_input_c,
+                mpc_escape_output_c);
+        buff[0] = p->data.range.y; buff[1] = '\0';
+        e = mpcf_escape_new(
+                buff,
+                mpc_escape_input_c,
+                mpc_escape_output_c);
+        printf("[%s-%s]", s, e);
+        free(s);
+        free(e);
+    }
+
+    if (p->type == MPC_TYPE_ONEOF) {
+        s = mpcf_escape_new(
+                p->data.string.x,
+                mpc_escape_input_c,
+                mpc_escape_output_c);
+        printf("[%s]", s);
+        free(s);
+    }
+
+    if (p->type == MPC_TYPE_NONEOF) {
+        s = mpcf_escape_new(
+                p->data.string.x,
+                mpc_escape_input_c,
+                mpc_escape_output_c);
+        printf("[^%s]", s);
+        free(s);
+    }
+
+    if (p->type == MPC_TYPE_STRING) {
+        s = mpcf_escape_new(
+                p->data.string.x,
+                mpc_escape_input_c,
+                mpc_escape_output_c);
+        printf("\"%s\"", s);
+        free(s);
+    }
+
+    if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
+    if (p->type == MPC_TYPE_SKIP)     { mpc_print_unretained(p->data.apply.x, 0); }
+    if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
+    if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+    if (p->type == MPC_TYPE_REGEX)    { mpc_print_unretained(p->data.regex.x, 0); }
+
+    if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
+    if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
+
+    if (p->type == MPC_TYPE_MANY)  { mpc_print_unretained(p->data.repeat.x, 0); printf("*"); }
+    if (p->type == MPC_TYPE_MANY1) { mpc_print_unretained(p->data.repeat.x, 0); printf("+"); }
+    if (p->type == MPC_TYPE_COUNT) { mpc_print_unretained(p->data.repeat.x, 0); printf("{%i}", p->data.repeat.n); }
+
+    if (p->type == MPC_TYPE_OR) {
+        printf("(");
+        for(i = 0; i < p->data.or.n-1; i++) {
+            mpc_print_unretained(p->data.or.xs[i], 0);
+            printf(" | ");
+        }
+        mpc_print_unretained(p->data.or.xs[p->data.or.n-1], 0);
+        printf(")");
+    }
+
+    if (p->type == MPC_TYPE_AND) {
+        printf("(");
+        for(i = 0; i < p->data.and.n-1; i++) {
+            mpc_print_unretained(p->data.and.xs[i], 0);
+            printf(" ");
+        }
+        mpc_print_unretained(p->data.and.xs[p->data.and.n-1], 0);
+        printf(")");
+    }
+
+    if (p->type == MPC_TYPE_EXPR) {
+        printf("(");
+        mpc_print_unretained(p->data.expr.xs[0], 0);
+        for(i = 0; i < p->data.expr.n; i++) {
+            printf(p->data.expr.ps[i] % 2 ? " %%right " : " %%left ");
+            mpc_print_unretained(p->data.expr.xs[i+1], 0);
+        }
+        printf(")");
+    }
+
+    if (p->type == MPC_TYPE_CHECK) {
+        mpc_print_unretained(p->data.check.x, 0);
+        printf("->?");
+    }
+    if (p->type == MPC_TYPE_CHECK_WITH) {
+        mpc_print_unretained(p->data.check_with.x, 0);
+        printf("->?");
+    }
+
+}
+
+void mpc_print(mpc_parser_t *p) {
+    mpc_print_unretained(p, 1);
+    printf("\n");
+}
+
+/*
+** Testing
+*/
+
+/*
+** These functions are slightly unwieldy and
+** also the whole of the testing suite for mpc
+** mpc is pretty shaky.
+**
+** It could do with a lot more tests and more
+** precision. Currently I am only really testing
+** changes off of the examples.
+**
+*/
+
+int mpc_test_fail(mpc_parser_t *p, const char *s, const void *d,
+                  int(*tester)(const void*, const void*),
+                  mpc_dtor_t destructor,
+                  void(*printer)(const void*)) {
+    mpc_result_t r;
+    (void) printer;
+    if (mpc_parse("<test>", s, p, &r)) {
+
+        if (tester(r.output, d)) {
+            destructor(r.output);
+            return 0;
+        } else {
+            destructor(r.output);
+            return 1;
+        }
+
+    } else {
+        mpc_err_delete(r.error);
+        return 1;
+    }
+
+}
+
+int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
+                  int(*tester)(const void*, const void*),
+                  mpc_dtor_t destructor,
+                  void(*printer)(const void*)) {
+
+    mpc_result_t r;
+    if (mpc_parse("<test>", s, p, &r)) {
+
+        if (tester(r.output, d)) {
+            destructor(r.output);
+            return 1;
+        } else {
+            printf("Got "); printer(r.output); printf("\n");
+            printf("Expected "); printer(d); printf("\n");
+            destructor(r.output);
+            return 0;
+        }
+
+    } else {
+        mpc_err_print(r.error);
+        mpc_err_delete(r.error);
+        return 0;
+
+    }
+
+}
+
+
+/*
+** AST
+*/
+
+/*
+** An arena hands out memory from the front of its
+** newest block. Requests too large to share a block
+** get one of their own, placed behind the newest so
+** it can keep being used. Everything is aligned for
+** any type.
+*/
+
+enum {
+    MPC_AST_ARENA_BLOCK = 65536
+};
+
+typedef union {
+    void *p;
+    double d;
+    long l;
+} mpc_ast_arena_align_t;
+
+typedef struct mpc_ast_arena_block_t {
+    struct mpc_ast_arena_block_t *next;
+    size_t size;
+    size_t used;
+} mpc_ast_arena_block_t;
+
+struct mpc_ast_arena_t {
+    mpc_ast_arena_block_t *blocks;
+};
+
+static size_t mpc_ast_arena_round(size_t n) {
+    size_t a = sizeof(mpc_ast_arena_align_t);
+    return (n + a - 1) / a * a;
+}
+
+mpc_ast_arena_t *mpc_ast_arena_new(void) {
+    mpc_ast_arena_t *x = malloc(sizeof(mpc_ast_arena_t));
+    x->blocks = NULL;
+    return x;
+}
+
+void mpc_ast_arena_free(mpc_ast_arena_t *x) {
+    mpc_ast_arena_block_t *b, *n;
+    if (x == NULL) { return; }
+    for (b = x->blocks; b; b = n) {
+        n = b->next;
+        free(b);
+    }
+    free(x);
+}
+
+static void *mpc_ast_arena_alloc(mpc_ast_arena_t *x, size_t n) {
+
+    mpc_ast_arena_block_t *b;
+    size_t head = mpc_ast_arena_round(sizeof(mpc_ast_arena_block_t));
+
+    n = mpc_ast_arena_round(n);
+
+    if (x->blocks && x->blocks->used + n <= x->blocks->size) {
+        b = x->blocks;
+    } else {
+        b = malloc(head + (n > MPC_AST_ARENA_BLOCK / 4 ? n : MPC_AST_ARENA_BLOCK));
+        b->size = n > MPC_AST_ARENA_BLOCK / 4 ? n : MPC_AST_ARENA_BLOCK;
+        b->used = 0;
+        if (x->blocks && n > MPC_AST_ARENA_BLOCK / 4) {
+            b->next = x->blocks->next;
+            x->blocks->next = b;
+        } else {
+            b->next = x->blocks;
+            x->blocks = b;
+        }
+    }
+
+    b->used += n;
+    return (char*)b + head + b->used - n;
+}
+
+static char *mpc_ast_arena_string(mpc_ast_arena_t *x, const char *s, size_t n) {
+    char *r = mpc_ast_arena_alloc(x, n);
+    memcpy(r, s, strlen(s) + 1 < n ? strlen(s) + 1 : n);
+    return r;
+}
+
+/* Gives a tag room for `n` bytes, keeping what fits */
+static char *mpc_ast_tag_resize(mpc_ast_t *a, size_t n) {
+    if (a->arena) { return mpc_ast_arena_string(a->arena, a->tag, n); }
+    return realloc(a->tag, n);
+}
+
+void mpc_ast_delete(mpc_ast_t *a) {
+
+    int i;
+
+    if (a == NULL || a->arena) { return; }
+
+    for (i = 0; i < a->children_num; i++) {
+        mpc_ast_delete(a->children[i]);
+    }
+
+    free(a->children);
+    free(a->tag);
+    free(a->contents);
+    free(a);
+
+}
+
+static void mpc_ast_delete_no_children(mpc_ast_t *a) {
+    if (a->arena) { return; }
+    free(a->children);
+    free(a->tag);
+    free(a->contents);
+    free(a);
+}
+
+mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+
+    mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+
+    a->tag = malloc(strlen(tag) + 1);
+    strcpy(a->tag, tag);
+
+    a->contents = malloc(strlen(contents) + 1);
+    strcpy(a->contents, contents);
+
+    a->state = mpc_state_new();
+
+    a->children_num = 0;
+    a->children = NULL;
+    a->arena = NULL;
+    a->tag_ids = 0;
+    return a;
+
+}
+
+/* A node and both of its strings in one piece of the arena */
+static mpc_ast_t *mpc_ast_new_in(mpc_ast_arena_t *x, const char *tag, const char *contents) {
+
+    mpc_ast_t *a;
+    size_t head = mpc_ast_arena_round(sizeof(mpc_ast_t));
+    size_t tag_len = strlen(tag) + 1;
+
+    if (x == NULL) { return mpc_ast_new(tag, contents); }
+
+    a = mpc_ast_arena_alloc(x, head + tag_len + strlen(contents) + 1);
+    a->tag = (char*)a + head;
+    a->contents = a->tag + tag_len;
+    strcpy(a->tag, tag);
+    strcpy(a->contents, contents);
+
+    a->state = mpc_state_new();
+
+    a->children_num = 0;
+    a->children = NULL;
+    a->arena = x;
+    a->tag_ids = 0;
+    return a;
+}
+
+mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
+
+    mpc_ast_t *a = mpc_ast_new(tag, "");
+
+    int i;
+    va_list va;
+    va_start(va, tag);
+
+    for (i = 0; i < n; i++) {
+        mpc_ast_add_child(a, va_arg(va, mpc_ast_t*));
+    }
+
+    va_end(va);
+
+    return a;
+
+}
+
+mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
+
+    mpc_ast_t *r;
+
+    if (a == NULL) { return a; }
+    if (a->children_num == 0) { return a; }
+    if (a->children_num == 1) { return a; }
+
+    r = mpc_ast_new_in(a->arena, ">", "");
+    mpc_ast_add_child(r, a);
+    return r;
+}
+
+int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
+
+    int i;
+
+    if (strcmp(a->tag, b->tag) != 0) { return 0; }
+    if (strcmp(a->contents, b->contents) != 0) { return 0; }
+    if (a->children_num != b->children_num) { return 0; }
+
+    for (i = 0; i < a->children_num; i++) {
+        if (!mpc_ast_eq(a->children[i], b->children[i])) { return 0; }
+    }
+
+    return 1;
+}
+
+mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+    mpc_ast_t **children;
+    r->children_num++;
+    if (r->arena) {
+        children = mpc_ast_arena_alloc(r->arena, sizeof(mpc_ast_t*) * r->children_num);
+        if (r->children_num > 1) { memcpy(children, r->children, sizeof(mpc_ast_t*) * (r->children_num-1)); }
+        r->children = children;
+    } else {
+        r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
+    }
+    r->children[r->children_num-1] = a;
+    return r;
+}
+
+mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
+    if (a == NULL) { return a; }
+    a->tag = mpc_ast_tag_resize(a, strlen(t) + 1 + strlen(a->tag) + 1);
+    memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
+    memmove(a->tag, t, strlen(t));
+    memmove(a->tag + strlen(t), "|", 1);
+    return a;
+}
+
+mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
+    if (a == NULL) { return a; }
+    a->tag = mpc_ast_tag_resize(a, (strlen(t)-1) + strlen(a->tag) + 1);
+    memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
+    memmove(a->tag, t, (strlen(t)-1));
+    return a;
+}
+
+mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
+    a->tag = mpc_ast_tag_resize(a, strlen(t) + 1);
+    strcpy(a->tag, t);
+    a->tag_ids = 0;
+    return a;
+}
+
+/* Bit zero, unused by any ID, marks a rule given -1 */
+mpc_ast_t *mpc_ast_add_tag_id(mpc_ast_t *a, int id) {
+    if (a == NULL || id < -1 || id == 0 || id > MPC_TAG_MAX) { return a; }
+    a->tag_ids |= id < 0 ? 1UL : 1UL << id;
+    return a;
+}
+
+int mpc_ast_has_tag(mpc_ast_t *a, int id) {
+    if (id < 1 || id > MPC_TAG_MAX) { return 0; }
+    return (a->tag_ids >> id) & 1;
+}
+
+static int mpc_tag_ids_rule_id(unsigned long ids) {
+    int id;
+    for (id = MPC_TAG_RULE; id <= MPC_TAG_MAX; id++) {
+        if ((ids >> id) & 1) { return id; }
+    }
+    return (ids & 1) ? -1 : 0;
+}
+
+int mpc_ast_rule_id(mpc_ast_t *a) {
+    return mpc_tag_ids_rule_id(a->tag_ids);
+}
+
+mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
+    if (a == NULL) { return a; }
+    a->state = s;
+    return a;
+}
+
+static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
+
+    int i;
+
+    if (a == NULL) {
+        fprintf(fp, "NULL\n");
+        return;
+    }
+
+    for (i = 0; i < d; i++) { fprintf(fp, "  "); }
+
+    if (strlen(a->contents)) {
+        fprintf(fp, "%s:%lu:%lu '%s'\n", a->tag,
+                (long unsigned int)(a->state.row+1),
+                (long unsigned int)(a->state.col+1),
+                a->contents);
+    } else {
+        fprintf(fp, "%s \n", a->tag);
+    }
+
+    for (i = 0; i < a->children_num; i++) {
+        mpc_ast_print_depth(a->children[i], d+1, fp);
+    }
+
+}
+
+void mpc_ast_print(mpc_ast_t *a) {
+    mpc_ast_print_depth(a, 0, stdout);
+}
+
+void mpc_ast_print_to(mpc_ast_t *a, FILE *fp) {
+    mpc_ast_print_depth(a, 0, fp);
+}
+
+int mpc_ast_get_index(mpc_ast_t *ast, const char *tag) {
+    return mpc_ast_get_index_lb(ast, tag, 0);
+}
+
+int mpc_ast_get_index_lb(mpc_ast_t *ast, const char *tag, int lb) {
+    int i;
+
+    for(i=lb; i<ast->children_num; i++) {
+        if(strcmp(ast->children[i]->tag, tag) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+mpc_ast_t *mpc_ast_get_child(mpc_ast_t *ast, const char *tag) {
+    return mpc_ast_get_child_lb(ast, tag, 0);
+}
+
+mpc_ast_t *mpc_ast_get_child_lb(mpc_ast_t *ast, const char *tag, int lb) {
+    int i;
+
+    for(i=lb; i<ast->children_num; i++) {
+        if(strcmp(ast->children[i]->tag, tag) == 0) {
+            return ast->children[i];
+        }
+    }
+
+    return NULL;
+}
+
+mpc_ast_trav_t *mpc_ast_traverse_start(mpc_ast_t *ast,
+                                       mpc_ast_trav_order_t order)
+{
+    mpc_ast_trav_t *trav, *n_trav;
+    mpc_ast_t *cnode = ast;
+
+    /* Create the traversal structure */
+    trav = malloc(sizeof(mpc_ast_trav_t));
+    trav->curr_node = cnode;
+    trav->parent = NULL;
+    trav->curr_child = 0;
+    trav->order = order;
+
+    /* Get start node */
+    switch(order) {
+        case mpc_ast_trav_order_pre:
+            /* Nothing else is needed for pre order start */
+            break;
+
+        case mpc_ast_trav_order_post:
+            while(cnode->children_num > 0) {
+                cnode = cnode->children[0];
+
+                n_trav = malloc(sizeof(mpc_ast_trav_t));
+                n_trav->curr_node = cnode;
+                n_trav->parent = trav;
+                n_trav->curr_child = 0;
+                n_trav->order = order;
+
+                trav = n_trav;
+            }
+
+            break;
+
+        default:
+            /* Unreachable, but compiler complaints */
+            break;
+    }
+
+    return trav;
+}
+
+mpc_ast_t *mpc_ast_traverse_next(mpc_ast_trav_t **trav) {
+    mpc_ast_trav_t *n_trav, *to_free;
+    mpc_ast_t *ret = NULL;
+    int cchild;
+
+    /* The end of traversal was reached */
+    if(*trav == NULL) return NULL;
+
+    switch((*trav)->order) {
+        case mpc_ast_trav_order_pre:
+            ret = (*trav)->curr_node;
+
+            /* If there aren't any more children, go up */
+            while(*trav != NULL &&
+                  (*trav)->curr_child >= (*trav)->curr_node->children_num)
+            {
+                to_free = *trav;
+                *trav = (*trav)->parent;
+                free(to_free);
+            }
+
+            /* If trav is NULL, the end was reached */
+            if(*trav == NULL) {
+                break;
+            }
+
+            /* Go to next child */
+            n_trav = malloc(sizeof(mpc_ast_trav_t));
+
+            cchild = (*trav)->curr_child;
+            n_trav->curr_node = (*trav)->curr_node->children[cchild];
+            n_trav->parent = *trav;
+            n_trav->curr_child = 0;
+            n_trav->order = (*trav)->order;
+
+            (*trav)->curr_child++;
+            *trav = n_trav;
+
+            break;
+
+        case mpc_ast_trav_order_post:
+            ret = (*trav)->curr_node;
+
+            /* Move up tree to the parent If the parent doesn't have any more nodes,
+             * then this is the current node. If it does, move down to its left most
+             * child. Also, free the previous traversal node */
+            to_free = *trav;
+            *trav = (*trav)->parent;
+            free(to_free);
+
+            if(*trav == NULL)
+                break;
+
+            /* Next child */
+            (*trav)->curr_child++;
+
+            /* If there aren't any more children, this is the next node */
+            if((*trav)->curr_child >= (*trav)->curr_node->children_num) {
+                break;
+            }
+
+            /* If there are still more children, find the leftmost child from this
+             * node */
+            while((*trav)->curr_node->children_num > 0) {
+                n_trav = malloc(sizeof(mpc_ast_trav_t));
+
+                cchild = (*trav)->curr_child;
+                n_trav->curr_node = (*trav)->curr_node->children[cchild];
+                n_trav->parent = *trav;
+                n_trav->curr_child = 0;
+                n_trav->order = (*trav)->order;
+
+                *trav = n_trav;
+            }
+
+        default:
+            /* Unreachable, but compiler complaints */
+            break;
+    }
+
+    return ret;
+}
+
+void mpc_ast_traverse_free(mpc_ast_trav_t **trav) {
+    mpc_ast_trav_t *n_trav;
+
+    /* Go through parents until all are free */
+    while(*trav != NULL) {
+        n_trav = (*trav)->parent;
+        free(*trav);
+        *trav = n_trav;
+    }
+}
+
+/*
+** For pre and post order each frame is a node along
+** the path from the root and the next of its children
+** to visit, or -1 before the node itself is visited.
+** For level order the frames from `head` to `num` are
+** a queue of nodes still to visit, which is moved back
+** to the start when it reaches the end.
+*/
+
+static void mpc_ast_iter_push(mpc_ast_iter_t *it, mpc_ast_t *a) {
+
+    mpc_ast_iter_frame_t *stack;
+
+    if (it->num == it->max && it->head > 0) {
+        memmove(it->stack, it->stack + it->head, sizeof(mpc_ast_iter_frame_t) * (it->num - it->head));
+        it->num -= it->head;
+        it->head = 0;
+    }
+
+    if (it->num == it->max) {
+        it->max = it->max ? it->max * 2 : 32;
+        if (it->owned) {
+            it->stack = realloc(it->stack, sizeof(mpc_ast_iter_frame_t) * it->max);
+        } else {
+            stack = malloc(sizeof(mpc_ast_iter_frame_t) * it->max);
+            if (it->num) { memcpy(stack, it->stack, sizeof(mpc_ast_iter_frame_t) * it->num); }
+            it->stack = stack;
+            it->owned = 1;
+        }
+    }
+
+    it->stack[it->num].node = a;
+    it->stack[it->num].child = -1;
+    it->num++;
+}
+
+void mpc_ast_iter_init(mpc_ast_iter_t *it, mpc_ast_t *a, mpc_ast_trav_order_t order, mpc_ast_iter_frame_t *stack, int max) {
+    it->order = order;
+    it->head = 0;
+    it->num = 0;
+    it->max = stack ? max : 0;
+    it->owned = 0;
+    it->stack = stack;
+    if (a) { mpc_ast_iter_push(it, a); }
+}
+
+mpc_ast_t *mpc_ast_iter_next(mpc_ast_iter_t *it) {
+
+    int i;
+    mpc_ast_t *a;
+    mpc_ast_iter_frame_t *f;
+
+    if (it->order == mpc_ast_trav_order_level) {
+        if (it->head == it->num) { return NULL; }
+        a = it->stack[it->head++].node;
+        for (i = 0; i < a->children_num; i++) {
+            mpc_ast_iter_push(it, a->children[i]);
+        }
+        return a;
+    }
+
+    while (it->num > 0) {
+
+        f = &it->stack[it->num-1];
+
+        if (f->child < 0) {
+            f->child = 0;
+            if (it->order == mpc_ast_trav_order_pre) { return f->node; }
+        }
+
+        if (f->child < f->node->children_num) {
+            mpc_ast_iter_push(it, f->node->children[f->child++]);
+            continue;
+        }
+
+        it->num--;
+        if (it->order == mpc_ast_trav_order_post) { return f->node; }
+    }
+
+    return NULL;
+}
+
+void mpc_ast_iter_free(mpc_ast_iter_t *it) {
+    if (it->owned) { free(it->stack); }
+    it->owned = 0;
+    it->stack = NULL;
+    it->head = 0;
+    it->num = 0;
+    it->max = 0;
+}
+
+enum {
+    MPC_AST_WALK_STACK = 64
+};
+
+int mpc_ast_walk(mpc_ast_t *a, mpc_ast_trav_order_t order, mpc_ast_walk_t f, void *d) {
+
+    mpc_ast_iter_frame_t stack[MPC_AST_WALK_STACK];
+    mpc_ast_iter_t it;
+    mpc_ast_t *n;
+    int x = 1;
+
+    mpc_ast_iter_init(&it, a, order, stack, MPC_AST_WALK_STACK);
+    while (x && (n = mpc_ast_iter_next(&it))) {
+        x = f(n, d);
+    }
+    mpc_ast_iter_free(&it);
+
+    return x;
+}
+
+/*
+** The children are counted first so that the array
+** is made once at its final size. Without an arena
+** the new root goes in the arena of its children,
+** if they have one.
+*/
+
+static mpc_ast_t *mpc_ast_fold(mpc_ast_arena_t *x, int n, mpc_ast_t **as) {
+
+    int i, j, k;
+    mpc_ast_t *r;
+
+    if (n == 0) { return NULL; }
+    if (n == 1) { return as[0]; }
+    if (n == 2 && as[1] == NULL) { return as[0]; }
+    if (n == 2 && as[0] == NULL) { return as[1]; }
+
+    for (k = 0, i = 0; i < n; i++) {
+        if (as[i] == NULL) { continue; }
+        if (x == NULL) { x = as[i]->arena; }
+        k += as[i]->children_num >= 2 ? as[i]->children_num : 1;
+    }
+
+    r = mpc_ast_new_in(x, ">", "");
+    r->children = x ? mpc_ast_arena_alloc(x, sizeof(mpc_ast_t*) * k) : malloc(sizeof(mpc_ast_t*) * k);
+
+    for (i = 0; i < n; i++) {
+
+        if (as[i] == NULL) { continue; }
+
+        if        (as[i]->children_num == 0) {
+            r->children[r->children_num++] = as[i];
+        } else if (as[i]->children_num == 1) {
+            r->children[r->children_num++] = mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag);
+            as[i]->children[0]->tag_ids |= as[i]->tag_ids;
+            mpc_ast_delete_no_children(as[i]);
+        } else {
+            for (j = 0; j < as[i]->children_num; j++) {
+                r->children[r->children_num++] = as[i]->children[j];
+            }
+            mpc_ast_delete_no_children(as[i]);
+        }
+
+    }
+
+    if (r->children_num) {
+        r->state = r->children[0]->state;
+    } else {
+        if (!x) { free(r->children); }
+        r->children = NULL;
+    }
+
+    return r;
+}
+
+mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
+    return mpc_ast_fold(NULL, n, (mpc_ast_t**)xs);
+}
+
+mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
+    mpc_ast_t *a = mpc_ast_new("", c);
+    free(c);
+    return a;
+}
+
+mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs) {
+    mpc_state_t *s = ((mpc_state_t**)xs)[0];
+    mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
+    (void)n;
+    a = mpc_ast_state(a, *s);
+    free(s);
+    return a;
+}
+
+mpc_parser_t *mpca_state(mpc_parser_t *a) {
+    return mpc_and(2, mpcf_state_ast, mpc_state(), a, free);
+}
+
+mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t) {
+    return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag, (void*)t);
+}
+
+mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
+    return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
+}
+
+mpc_parser_t *mpca_root(mpc_parser_t *a) {
+    return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
+}
+
+mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpc_not(a, (mpc_dtor_t)mpc_ast_delete); }
+mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
+mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
+mpc_parser_t *mpca_many1(mpc_parser_t *a) { return mpc_many1(mpcf_fold_ast, a); }
+mpc_parser_t *mpca_count(int n, mpc_parser_t *a) { return mpc_count(n, mpcf_fold_ast, a, (mpc_dtor_t)mpc_ast_delete); }
+
+mpc_parser_t *mpca_or(int n, ...) {
+
+    int i;
+    va_list va;
+
+    mpc_parser_t *p = mpc_undefined();
+
+    p->type = MPC_TYPE_OR;
+    p->data.or.n = n;
+    p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+
+    va_start(va, n);
+    for (i = 0; i < n; i++) {
+        p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+    }
+    va_end(va);
+
+    return p;
+
+}
+
+mpc_parser_t *mpca_and(int n, ...) {
+
+    int i;
+    va_list va;
+
+    mpc_parser_t *p = mpc_undefined();
+
+    p->type = MPC_TYPE_AND;
+    p->data.and.n = n;
+    p->data.and.f = mpcf_fold_ast;
+    p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
+    p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+
+    va_start(va, n);
+    for (i = 0; i < n; i++) {
+        p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+    }
+    for (i = 0; i < (n-1); i++) {
+        p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete;
+    }
+    va_end(va);
+
+    return p;
+}
+
+/*
+** Operands which are already a group, such as a
+** nested level of the expression, are given a root
+** so the fold keeps them as one child.
+*/
+
+static mpc_val_t *mpcf_fold_ast_expr(int n, mpc_val_t **xs) {
+    int i;
+    for (i = 0; i < n; i++) { xs[i] = mpc_ast_add_root(xs[i]); }
+    return mpcf_fold_ast(n, xs);
+}
+
+mpc_parser_t *mpca_expr(int n, mpc_parser_t *a, ...) {
+    mpc_parser_t *p;
+    va_list va;
+    va_start(va, a);
+    p = mpc_expr_va(n, mpcf_fold_ast_expr, a, (mpc_dtor_t)mpc_ast_delete, va);
+    va_end(va);
+    return p;
+}
+
+mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
+
+/*
+** Grammar Parser
+*/
+
+/*
+** This is another interesting bootstrapping.
+**
+** Having a general purpose AST type allows
+** users to specify the grammar alone and
+** let all fold rules be automatically taken
+** care of by existing functions.
+**
+** You don't get to control the type spat
+** out but this means you can make a nice
+** parser to take in some grammar in nice
+** syntax and spit out a parser that works.
+**
+** The grammar for this looks surprisingly
+** like regex but the main difference is that
+** it is now whitespace insensitive and the
+** base type takes literals of some form.
+*/
+
+/*
+**
+**  ### Grammar Grammar
+**
+**      <grammar> : (<term> "|" <grammar>) | <term>
+**
+**      <term> : <factor>*
+**
+**      <factor> : <base>
+**               | <base> "*"
+**               | <base> "+"
+**               | <base> "?"
+**               | <base> "{" <digits> "}"
+**
+**      <base> : "<" (<digits> | <ident>) ">"
+**             | <string_lit>
+**             | <char_lit>
+**             | <regex_lit> <regex_mode>
+**             | "(" <grammar> ")"
+**
+**  A `~` after a factor is a cut. Once the factor
+**  has matched, the parse is committed to it up to
+**  the innermost enclosing choice or rule: no other
+**  alternative of that choice is tried and a failure
+**  past the cut fails the whole choice or rule, which
+**  the parsers around it can then backtrack over.
+*/
+
+/*
+** Parsers referenced by a grammar come from `va`,
+** from `array`, or with `create` set are made on
+** demand. Every parser taken so far is kept in
+** `parsers`, and those with a name are also kept
+** in `table`, an open addressing hash table, so a
+** reference resolves without scanning the list.
+*/
+
+typedef struct {
+    va_list *va;
+    mpc_parser_t **array;
+    int array_num;
+    int array_pos;
+    int done;
+    int create;
+    int parsers_num;
+    int parsers_max;
+    mpc_parser_t **parsers;
+    int table_max;
+    mpc_parser_t **table;
+    int flags;
+} mpca_grammar_st_t;
+
+static void mpca_grammar_st_init(mpca_grammar_st_t *st, int flags, va_list *va, int n, mpc_parser_t **array) {
+    st->va = va;
+    st->array = array;
+    st->array_num = n;
+    st->array_pos = 0;
+    st->done = 0;
+    st->create = 0;
+    st->parsers_num = 0;
+    st->parsers_max = 0;
+    st->parsers = NULL;
+    st->table_max = 0;
+    st->table = NULL;
+    st->flags = flags;
+}
+
+static void mpca_grammar_st_free(mpca_grammar_st_t *st) {
+    free(st->parsers);
+    free(st->table);
+}
+
+static mpc_parser_t *mpca_grammar_lookup(mpca_grammar_st_t *st, const char *x) {
+    unsigned long i;
+    if (st->table_max == 0) { return NULL; }
+    i = mpc_hash(x) & (st->table_max-1);
+    while (st->table[i]) {
+        if (strcmp(st->table[i]->name, x) == 0) { return st->table[i]; }
+        i = (i+1) & (st->table_max-1);
+    }
+    return NULL;
+}
+
+static void mpca_grammar_insert(mpca_grammar_st_t *st, mpc_parser_t *p) {
+
+    int j;
+    unsigned long i;
+    mpc_parser_t **old;
+
+    /* Keep the table at most half full */
+    if ((st->parsers_num+1) * 2 > st->table_max) {
+        old = st->table;
+        st->table_max = st->table_max ? st->table_max * 2 : 64;
+        st->table = calloc(st->table_max, sizeof(mpc_parser_t*));
+        for (j = 0; j < st->parsers_num; j++) {
+            if (st->parsers[j]->name == NULL) { continue; }
+            if (mpca_grammar_lookup(st, st->parsers[j]->name)) { continue; }
+            i = mpc_hash(st->parsers[j]->name) & (st->table_max-1);
+            while (st->table[i]) { i = (i+1) & (st->table_max-1); }
+            st->table[i] = st->parsers[j];
+        }
+        free(old);
+    }
+
+    /* The first parser with a given name wins */
+    if (p->name && mpca_grammar_lookup(st, p->name) == NULL) {
+        i = mpc_hash(p->name) & (st->table_max-1);
+        while (st->table[i]) { i = (i+1) & (st->table_max-1); }
+        st->table[i] = p;
+    }
+}
+
+static void mpca_grammar_push(mpca_grammar_st_t *st, mpc_parser_t *p) {
+    mpca_grammar_insert(st, p);
+    if (st->parsers_num == st->parsers_max) {
+        st->parsers_max = st->parsers_max ? st->parsers_max * 2 : 16;
+        st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_max);
+    }
+    st->parsers[st->parsers_num++] = p;
+}
+
+static mpc_parser_t *mpca_grammar_next(mpca_grammar_st_t *st) {
+
+    mpc_parser_t *p;
+
+    if (st->done) { return NULL; }
+
+    if (st->va) {
+        p = va_arg(*st->va, mpc_parser_t*);
+    } else {
+        p = st->array_pos < st->array_num ? st->array[st->array_pos++] : NULL;
+    }
+
+    if (p == NULL) { st->done = 1; return NULL; }
+
+    mpca_grammar_push(st, p);
+    return p;
+}
+
+static mpc_val_t *mpcaf_grammar_or(int n, mpc_val_t **xs) {
+    (void) n;
+    if (xs[1] == NULL) { return xs[0]; }
+    else { return mpca_or(2, xs[0], xs[1]); }
+}
+
+static mpc_val_t *mpcaf_grammar_and(int n, mpc_val_t **xs) {
+    int i;
+    mpc_parser_t *p = mpc_pass();
+    for (i = 0; i < n; i++) {
+        if (xs[i] != NULL) { p = mpca_and(2, p, xs[i]); }
+    }
+    return p;
+}
+
+static mpc_val_t *mpcaf_grammar_repeat(int n, mpc_val_t **xs) {
+    int num;
+    (void) n;
+    if (xs[1] == NULL) { return xs[0]; }
+    switch(((char*)xs[1])[0])
+    {
+        case '*': { free(xs[1]); return mpca_many(xs[0]); }; break;
+        case '+': { free(xs[1]); return mpca_many1(xs[0]); }; break;
+        case '?': { free(xs[1]); return mpca_maybe(xs[0]); }; break;
+        case '!': { free(xs[1]); return mpca_not(xs[0]); }; break;
+        case '~': { free(xs[1]); return mpca_and(2, xs[0], mpc_cut()); }; break;
+        default:
+            num = *((int*)xs[1]);
+            free(xs[1]);
+    }
+    return mpca_count(num, xs[0]);
+}
+
+/*
+** Operator tiers follow a term as `%left` or
+** `%right` and an operator, from the loosest
+** binding to the tightest, as in yacc.
+*/
+
+typedef struct {
+    int assoc;
+    mpc_parser_t *op;
+} mpca_tier_t;
+
+static mpc_val_t *mpcaf_grammar_tier(int n, mpc_val_t **xs) {
+    mpca_tier_t *tier = malloc(sizeof(mpca_tier_t));
+    tier->assoc = strcmp(xs[1], "right") == 0 ? MPC_ASSOC_RIGHT : MPC_ASSOC_LEFT;
+    tier->op = xs[2];
+    (void) n;
+    free(xs[0]);
+    free(xs[1]);
+    return tier;
+}
+
+static mpc_val_t *mpcaf_grammar_tiers(int n, mpc_val_t **xs) {
+    int i;
+    mpca_tier_t **tiers;
+    if (n == 0) { return NULL; }
+    tiers = malloc(sizeof(mpca_tier_t*) * (n+1));
+    for (i = 0; i < n; i++) { tiers[i] = xs[i]; }
+    tiers[n] = NULL;
+    return tiers;
+}
+
+static mpc_val_t *mpcaf_grammar_term(int n, mpc_val_t **xs) {
+
+    int i, num;
+    mpc_parser_t *p, **ops;
+    int *precs, *assocs;
+    mpca_tier_t **tiers = xs[1];
+
+    (void) n;
+    if (tiers == NULL) { return xs[0]; }
+
+    for (num = 0; tiers[num]; num++);
+    ops = malloc(sizeof(mpc_parser_t*) * num);
+    precs = malloc(sizeof(int) * num);
+    assocs = malloc(sizeof(int) * num);
+
+    for (i = 0; i < num; i++) {
+        ops[i] = tiers[i]->op;
+        precs[i] = i;
+        assocs[i] = tiers[i]->assoc;
+        free(tiers[i]);
+    }
+
+    p = mpc_expr_table(num, mpcf_fold_ast_expr, xs[0], (mpc_dtor_t)mpc_ast_delete, ops, precs, assocs);
+    free(tiers);
+    free(ops);
+    free(precs);
+    free(assocs);
+    return p;
+}
+
+static mpc_parser_t *mpca_grammar_term(mpc_parser_t *Factor, mpc_parser_t *Base) {
+    return mpc_and(2, mpcaf_grammar_term,
+                   mpc_many1(mpcaf_grammar_and, Factor),
+                   mpc_many(mpcaf_grammar_tiers, mpc_and(3, mpcaf_grammar_tier,
+                       mpc_char('%'), mpc_tok(mpc_or(2, mpc_string("left"), mpc_string("right"))), Base,
+                       free, free)),
+                   mpc_soft_delete);
+}
+
+/*
+** The `MPCA_LANG_NO_*` optimiser flags line up
+** with the `MPC_OPTIMISE_NO_*` ones.
+*/
+
+static void mpca_grammar_optimise(mpca_grammar_st_t *st, mpc_parser_t *p) {
+    mpc_optimise_mode(p, (st->flags / MPCA_LANG_NO_FUSE)
+        & (MPC_OPTIMISE_NO_FUSE | MPC_OPTIMISE_NO_INLINE | MPC_OPTIMISE_NO_FACTOR));
+}
+
+/*
+** With `MPCA_LANG_NO_STATE` the position of each
+** element is not captured. This saves an extra
+** `and` node, a state allocation and a fold for
+** every token, at the cost of `mpc_ast_t.state`
+** always being zero.
+*/
+
+static mpc_parser_t *mpca_grammar_state(mpca_grammar_st_t *st, mpc_parser_t *a) {
+    return (st->flags & MPCA_LANG_NO_STATE) ? a : mpca_state(a);
+}
+
+/* Tags made here also set the tag's ID on each node */
+static mpc_parser_t *mpca_grammar_tag_id(mpc_parser_t *a, int id) {
+    a->data.apply_to.id = id;
+    return a;
+}
+
+static int mpca_grammar_rule_id(mpca_grammar_st_t *st, mpc_parser_t *p) {
+    int i;
+    if (st->flags & MPCA_LANG_NO_RULE_IDS) { return 0; }
+    for (i = 0; i < st->parsers_num; i++) {
+        if (st->parsers[i] == p) { return MPC_TAG_RULE + i <= MPC_TAG_MAX ? MPC_TAG_RULE + i : -1; }
+    }
+    return 0;
+}
+
+static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
+    mpca_grammar_st_t *st = s;
+    char *y = mpcf_unescape(x);
+    mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
+    free(y);
+    return mpca_grammar_state(st, mpca_grammar_tag_id(mpca_tag(mpc_apply(p, mpcf_str_ast), "string"), MPC_TAG_STRING));
+}
+
+static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
+    mpca_grammar_st_t *st = s;
+    char *y = mpcf_unescape(x);
+    mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
+    free(y);
+    return mpca_grammar_state(st, mpca_grammar_tag_id(mpca_tag(mpc_apply(p, mpcf_str_ast), "char"), MPC_TAG_CHAR));
+}
+
+static mpc_val_t *mpcaf_fold_regex(int n, mpc_val_t **xs) {
+    char *y = xs[0];
+    char *m = xs[1];
+    mpca_grammar_st_t *st = xs[2];
+    mpc_parser_t *p;
+    int mode = MPC_RE_DEFAULT;
+
+    (void)n;
+    if (strchr(m, 'm')) { mode |= MPC_RE_MULTILINE; }
+    if (strchr(m, 's')) { mode |= MPC_RE_DOTALL; }
+    y = mpcf_unescape_regex(y);
+    p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re_mode(y, mode) : mpc_tok(mpc_re_mode(y, mode));
+    free(y);
+    free(m);
+
+    return mpca_grammar_state(st, mpca_grammar_tag_id(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"), MPC_TAG_REGEX));
+}
+
+/* Should this just use `isdigit` instead? */
+static int is_number(const char* s) {
+    size_t i;
+    for (i = 0; i < strlen(s); i++) { if (!strchr("0123456789", s[i])) { return 0; } }
+    return 1;
+}
+
+static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
+
+    int i;
+    mpc_parser_t *p;
+
+    /* Case of Number */
+    if (is_number(x)) {
+
+        if (st->create) { return mpc_failf("No Parser in position %s!", x); }
+
+        i = strtol(x, NULL, 10);
+
+        while (st->parsers_num <= i) {
+            if (mpca_grammar_next(st) == NULL) {
+                return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
+            }
+        }
+
+        return st->parsers[i];
+
+        /* Case of Identifier */
+    } else {
+
+        /* Search Existing Parsers */
+        p = mpca_grammar_lookup(st, x);
+        if (p) { return p; }
+
+        /* Without a list of parsers every new name is a new rule */
+        if (st->create) {
+            p = mpc_new(x);
+            mpca_grammar_push(st, p);
+            return p;
+        }
+
+        /* Search New Parsers */
+        while (1) {
+            p = mpca_grammar_next(st);
+            if (p == NULL || p->name == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
+            if (strcmp(p->name, x) == 0) { return p; }
+        }
+
+    }
 
-    buffer = realloc(buffer, strlen(buffer) + 1);
-    p->data.fail.m = buffer;
-    return p;
+}
 
+static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
+
+    mpca_grammar_st_t *st = s;
+    mpc_parser_t *p = mpca_grammar_find_parser(x, st);
+    free(x);
+
+    if (p->name) {
+        return mpca_grammar_state(st, mpca_root(
+            mpca_grammar_tag_id(mpca_add_tag(p, p->name), mpca_grammar_rule_id(st, p))));
+    } else {
+        return mpca_grammar_state(st, mpca_root(p));
+    }
 }
 
-mpc_parser_t *mpc_lift_val(mpc_val_t *x) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_LIFT_VAL;
-    p->data.lift.x = x;
-    return p;
+mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
+
+    char *err_msg;
+    mpc_parser_t *err_out;
+    mpc_result_t r;
+    mpc_parser_t *GrammarTotal, *Grammar, *Term, *Factor, *Base;
+
+    GrammarTotal = mpc_new("grammar_total");
+    Grammar = mpc_new("grammar");
+    Term = mpc_new("term");
+    Factor = mpc_new("factor");
+    Base = mpc_new("base");
+
+    mpc_define(GrammarTotal,
+               mpc_predictive(mpc_total(Grammar, mpc_soft_delete))
+    );
+
+    mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
+                                Term,
+                                mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
+                                mpc_soft_delete
+    ));
+
+    mpc_define(Term, mpca_grammar_term(Factor, Base));
+
+    mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
+                               Base,
+                               mpc_or(7,
+                                      mpc_sym("*"),
+                                      mpc_sym("+"),
+                                      mpc_sym("?"),
+                                      mpc_sym("!"),
+                                      mpc_sym("~"),
+                                      mpc_tok_brackets(mpc_int(), free),
+                                      mpc_pass()),
+                               mpc_soft_delete
+    ));
+
+    mpc_define(Base, mpc_or(5,
+                            mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
+                            mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
+                            mpc_tok(mpc_and(3, mpcaf_fold_regex, mpc_regex_lit(), mpc_many(mpcf_strfold, mpc_oneof("ms")), mpc_lift_val(st), free, free)),
+                            mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
+                            mpc_tok_parens(Grammar, mpc_soft_delete)
+    ));
+
+    mpc_optimise(GrammarTotal);
+    mpc_optimise(Grammar);
+    mpc_optimise(Factor);
+    mpc_optimise(Term);
+    mpc_optimise(Base);
+
+    if(!mpc_parse("<mpc_grammar_compiler>", grammar, GrammarTotal, &r)) {
+        err_msg = mpc_err_string(r.error);
+        err_out = mpc_failf("Invalid Grammar: %s", err_msg);
+        mpc_err_delete(r.error);
+        free(err_msg);
+        r.output = err_out;
+    }
+
+    mpc_cleanup(5, GrammarTotal, Grammar, Term, Factor, Base);
+
+    mpca_grammar_optimise(st, r.output);
+
+    return (st->flags & MPCA_LANG_PREDICTIVE) ? mpc_predictive(r.output) : r.output;
+
 }
 
-mpc_parser_t *mpc_lift(mpc_ctor_t lf) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_LIFT;
-    p->data.lift.lf = lf;
-    return p;
+mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...) {
+    mpca_grammar_st_t st;
+    mpc_parser_t *res;
+    va_list va;
+    va_start(va, grammar);
+
+    mpca_grammar_st_init(&st, flags, &va, 0, NULL);
+
+    res = mpca_grammar_st(grammar, &st);
+    mpca_grammar_st_free(&st);
+    va_end(va);
+    return res;
 }
 
-mpc_parser_t *mpc_anchor(int(*f)(char,char)) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_ANCHOR;
-    p->data.anchor.f = f;
-    return mpc_expect(p, "anchor");
+typedef struct {
+    char *ident;
+    char *name;
+    mpc_parser_t *grammar;
+} mpca_stmt_t;
+
+static mpc_val_t *mpca_stmt_afold(int n, mpc_val_t **xs) {
+    mpca_stmt_t *stmt = malloc(sizeof(mpca_stmt_t));
+    stmt->ident = ((char**)xs)[0];
+    stmt->name = ((char**)xs)[1];
+    stmt->grammar = ((mpc_parser_t**)xs)[3];
+    (void) n;
+    free(((char**)xs)[2]);
+    free(((char**)xs)[4]);
+
+    return stmt;
 }
 
-mpc_parser_t *mpc_state(void) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_STATE;
-    return p;
+static mpc_val_t *mpca_stmt_fold(int n, mpc_val_t **xs) {
+
+    int i;
+    mpca_stmt_t **stmts = malloc(sizeof(mpca_stmt_t*) * (n+1));
+
+    for (i = 0; i < n; i++) {
+        stmts[i] = xs[i];
+    }
+    stmts[n] = NULL;
+
+    return stmts;
 }
 
-mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_EXPECT;
-    p->data.expect.x = a;
-    p->data.expect.m = malloc(strlen(expected) + 1);
-    strcpy(p->data.expect.m, expected);
-    return p;
+static void mpca_stmt_list_delete(mpc_val_t *x) {
+
+    mpca_stmt_t **stmts = x;
+
+    while(*stmts) {
+        mpca_stmt_t *stmt = *stmts;
+        free(stmt->ident);
+        free(stmt->name);
+        mpc_soft_delete(stmt->grammar);
+        free(stmt);
+        stmts++;
+    }
+    free(x);
+
 }
 
-/*
-** As `snprintf` is not ANSI standard this
-** function `mpc_expectf` should be considered
-** unsafe.
-**
-** You have a few options if this is going to be
-** trouble.
-**
-** - Ensure the format string does not exceed
-**   the buffer length using precision specifiers
-**   such as `%.512s`.
-**
-** - Patch this function in your code base to
-**   use `snprintf` or whatever variant your
-**   system supports.
-**
-** - Avoid it altogether.
-**
-*/
+static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
 
-mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
-    va_list va;
-    char *buffer;
+    mpca_grammar_st_t *st = s;
+    mpca_stmt_t *stmt;
+    mpca_stmt_t **stmts = x;
+    mpc_parser_t *left;
 
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_EXPECT;
+    while(*stmts) {
+        stmt = *stmts;
+        left = mpca_grammar_find_parser(stmt->ident, st);
+        if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
+        if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+        mpca_grammar_optimise(st, stmt->grammar);
+        mpc_define(left, stmt->grammar);
+        free(stmt->ident);
+        free(stmt->name);
+        free(stmt);
+        stmts++;
+    }
+
+    free(x);
+
+    return NULL;
+}
+
+static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
+
+    mpc_result_t r;
+    mpc_err_t *e;
+    mpc_parser_t *Lang, *Stmt, *Grammar, *Term, *Factor, *Base;
+
+    Lang    = mpc_new("lang");
+    Stmt    = mpc_new("stmt");
+    Grammar = mpc_new("grammar");
+    Term    = mpc_new("term");
+    Factor  = mpc_new("factor");
+    Base    = mpc_new("base");
+
+    mpc_define(Lang, mpc_apply_to(
+            mpc_total(mpc_predictive(mpc_many(mpca_stmt_fold, Stmt)), mpca_stmt_list_delete),
+            mpca_stmt_list_apply_to, st
+    ));
+
+    mpc_define(Stmt, mpc_and(5, mpca_stmt_afold,
+                             mpc_tok(mpc_ident()), mpc_maybe(mpc_tok(mpc_string_lit())), mpc_sym(":"), Grammar, mpc_sym(";"),
+                             free, free, free, mpc_soft_delete
+    ));
+
+    mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
+                                Term,
+                                mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
+                                mpc_soft_delete
+    ));
+
+    mpc_define(Term, mpca_grammar_term(Factor, Base));
+
+    mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
+                               Base,
+                               mpc_or(7,
+                                      mpc_sym("*"),
+                                      mpc_sym("+"),
+                                      mpc_sym("?"),
+                                      mpc_sym("!"),
+                                      mpc_sym("~"),
+                                      mpc_tok_brackets(mpc_int(), free),
+                                      mpc_pass()),
+                               mpc_soft_delete
+    ));
+
+    mpc_define(Base, mpc_or(5,
+                            mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
+                            mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
+                            mpc_tok(mpc_and(3, mpcaf_fold_regex, mpc_regex_lit(), mpc_many(mpcf_strfold, mpc_oneof("ms")), mpc_lift_val(st), free, free)),
+                            mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
+                            mpc_tok_parens(Grammar, mpc_soft_delete)
+    ));
+
+    mpc_optimise(Lang);
+    mpc_optimise(Stmt);
+    mpc_optimise(Grammar);
+    mpc_optimise(Term);
+    mpc_optimise(Factor);
+    mpc_optimise(Base);
 
-    va_start(va, fmt);
-    buffer = malloc(2048);
-    if (!buffer) {
-        return NULL;
+    if (!mpc_parse_input(i, Lang, &r)) {
+        e = r.error;
+    } else {
+        e = NULL;
     }
-    vsprintf(buffer, fmt, va);
-    va_end(va);
-
-    buffer = realloc(buffer, strlen(buffer) + 1);
-    p->data.expect.x = a;
-    p->data.expect.m = buffer;
-    return p;
-}
 
-/*
-** Basic Parsers
-*/
+    mpc_cleanup(6, Lang, Stmt, Grammar, Term, Factor, Base);
 
-mpc_parser_t *mpc_any(void) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_ANY;
-    return mpc_expect(p, "any character");
+    return e;
 }
 
-mpc_parser_t *mpc_char(char c) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_SINGLE;
-    p->data.single.x = c;
-    return mpc_expectf(p, "'%c'", c);
-}
+mpc_err_t *mpca_lang_file(int flags, FILE *f, ...) {
+    mpca_grammar_st_t st;
+    mpc_input_t *i;
+    mpc_err_t *err;
 
-mpc_parser_t *mpc_range(char s, char e) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_RANGE;
-    p->data.range.x = s;
-    p->data.range.y = e;
-    return mpc_expectf(p, "character between '%c' and '%c'", s, e);
-}
+    va_list va;
+    va_start(va, f);
 
-mpc_parser_t *mpc_oneof(const char *s) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_ONEOF;
-    p->data.string.x = malloc(strlen(s) + 1);
-    strcpy(p->data.string.x, s);
-    return mpc_expectf(p, "one of '%s'", s);
-}
+    mpca_grammar_st_init(&st, flags, &va, 0, NULL);
 
-mpc_parser_t *mpc_noneof(const char *s) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_NONEOF;
-    p->data.string.x = malloc(strlen(s) + 1);
-    strcpy(p->data.string.x, s);
-    return mpc_expectf(p, "none of '%s'", s);
+    i = mpc_input_new_file("<mpca_lang_file>", f);
+    err = mpca_lang_st(i, &st);
+    mpc_input_delete(i);
 
+    mpca_grammar_st_free(&st);
+    va_end(va);
+    return err;
 }
 
-mpc_parser_t *mpc_satisfy(int(*f)(char)) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_SATISFY;
-    p->data.satisfy.f = f;
-    return mpc_expectf(p, "character satisfying function %p", f);
-}
+mpc_err_t *mpca_lang_pipe(int flags, FILE *p, ...) {
+    mpca_grammar_st_t st;
+    mpc_input_t *i;
+    mpc_err_t *err;
 
-mpc_parser_t *mpc_string(const char *s) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_STRING;
-    p->data.string.x = malloc(strlen(s) + 1);
-    strcpy(p->data.string.x, s);
-    return mpc_expectf(p, "\"%s\"", s);
-}
+    va_list va;
+    va_start(va, p);
 
-/*
-** Core Parsers
-*/
+    mpca_grammar_st_init(&st, flags, &va, 0, NULL);
 
-mpc_parser_t *mpc_apply(mpc_parser_t *a, mpc_apply_t f) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_APPLY;
-    p->data.apply.x = a;
-    p->data.apply.f = f;
-    return p;
-}
+    i = mpc_input_new_pipe("<mpca_lang_pipe>", p);
+    err = mpca_lang_st(i, &st);
+    mpc_input_delete(i);
 
-mpc_parser_t *mpc_apply_to(mpc_parser_t *a, mpc_apply_to_t f, void *x) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_APPLY_TO;
-    p->data.apply_to.x = a;
-    p->data.apply_to.f = f;
-    p->data.apply_to.d = x;
-    return p;
+    mpca_grammar_st_free(&st);
+    va_end(va);
+    return err;
 }
 
-mpc_parser_t *mpc_check(mpc_parser_t *a, mpc_dtor_t da, mpc_check_t f, const char *e) {
-    mpc_parser_t  *p = mpc_undefined();
-    p->type = MPC_TYPE_CHECK;
-    p->data.check.x = a;
-    p->data.check.dx = da;
-    p->data.check.f = f;
-    p->data.check.e = malloc(strlen(e) + 1);
-    strcpy(p->data.check.e, e);
-    return p;
-}
+mpc_err_t *mpca_lang(int flags, const char *language, ...) {
 
-mpc_parser_t *mpc_check_with(mpc_parser_t *a, mpc_dtor_t da, mpc_check_with_t f, void *x, const char *e) {
-    mpc_parser_t  *p = mpc_undefined();
-    p->type = MPC_TYPE_CHECK_WITH;
-    p->data.check_with.x = a;
-    p->data.check_with.dx = da;
-    p->data.check_with.f = f;
-    p->data.check_with.d = x;
-    p->data.check_with.e = malloc(strlen(e) + 1);
-    strcpy(p->data.check_with.e, e);
-    return p;
-}
+    mpca_grammar_st_t st;
+    mpc_input_t *i;
+    mpc_err_t *err;
 
-mpc_parser_t *mpc_checkf(mpc_parser_t *a, mpc_dtor_t da, mpc_check_t f, const char *fmt, ...) {
     va_list va;
-    char *buffer;
-    mpc_parser_t *p;
+    va_start(va, language);
 
-    va_start(va, fmt);
-    buffer = malloc(2048);
-    vsprintf(buffer, fmt, va);
-    va_end(va);
+    mpca_grammar_st_init(&st, flags, &va, 0, NULL);
 
-    p = mpc_check(a, da, f, buffer);
-    free(buffer);
+    i = mpc_input_new_string("<mpca_lang>", language);
+    err = mpca_lang_st(i, &st);
+    mpc_input_delete(i);
 
-    return p;
+    mpca_grammar_st_free(&st);
+    va_end(va);
+    return err;
 }
 
-mpc_parser_t *mpc_check_withf(mpc_parser_t *a, mpc_dtor_t da, mpc_check_with_t f, void *x, const char *fmt, ...) {
+mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
+
+    mpca_grammar_st_t st;
+    mpc_input_t *i;
+    mpc_err_t *err;
+
     va_list va;
-    char *buffer;
-    mpc_parser_t *p;
 
-    va_start(va, fmt);
-    buffer = malloc(2048);
-    vsprintf(buffer, fmt, va);
-    va_end(va);
+    FILE *f = fopen(filename, "rb");
 
-    p = mpc_check_with(a, da, f, x, buffer);
-    free(buffer);
+    if (f == NULL) {
+        err = mpc_err_file(filename, "Unable to open file!");
+        return err;
+    }
 
-    return p;
-}
+    va_start(va, filename);
 
-mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_PREDICT;
-    p->data.predict.x = a;
-    return p;
-}
+    mpca_grammar_st_init(&st, flags, &va, 0, NULL);
 
-mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_NOT;
-    p->data.not.x = a;
-    p->data.not.dx = da;
-    p->data.not.lf = lf;
-    return p;
-}
+    i = mpc_input_new_file(filename, f);
+    err = mpca_lang_st(i, &st);
+    mpc_input_delete(i);
 
-mpc_parser_t *mpc_not(mpc_parser_t *a, mpc_dtor_t da) {
-    return mpc_not_lift(a, da, mpcf_ctor_null);
-}
+    mpca_grammar_st_free(&st);
+    va_end(va);
 
-mpc_parser_t *mpc_maybe_lift(mpc_parser_t *a, mpc_ctor_t lf) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_MAYBE;
-    p->data.not.x = a;
-    p->data.not.lf = lf;
-    return p;
-}
+    fclose(f);
 
-mpc_parser_t *mpc_maybe(mpc_parser_t *a) {
-    return mpc_maybe_lift(a, mpcf_ctor_null);
+    return err;
 }
 
-mpc_parser_t *mpc_many(mpc_fold_t f, mpc_parser_t *a) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_MANY;
-    p->data.repeat.x = a;
-    p->data.repeat.f = f;
-    return p;
-}
+mpc_err_t *mpca_lang_array(int flags, const char *language, int n, mpc_parser_t **parsers) {
 
-mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_MANY1;
-    p->data.repeat.x = a;
-    p->data.repeat.f = f;
-    return p;
-}
+    mpca_grammar_st_t st;
+    mpc_input_t *i;
+    mpc_err_t *err;
 
-mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_COUNT;
-    p->data.repeat.n = n;
-    p->data.repeat.f = f;
-    p->data.repeat.x = a;
-    p->data.repeat.dx = da;
-    return p;
-}
+    mpca_grammar_st_init(&st, flags, NULL, n, parsers);
 
-mpc_parser_t *mpc_or(int n, ...) {
+    i = mpc_input_new_string("<mpca_lang_array>", language);
+    err = mpca_lang_st(i, &st);
+    mpc_input_delete(i);
 
-    int i;
-    va_list va;
+    mpca_grammar_st_free(&st);
+    return err;
+}
 
-    mpc_parser_t *p = mpc_undefined();
+static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
 
-    p->type = MPC_TYPE_OR;
-    p->data.or.n = n;
-    p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+    int i, total;
 
-    va_start(va, n);
-    for (i = 0; i < n; i++) {
-        p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
-    }
-    va_end(va);
+    if (p->retained && !force) { return 0; }
 
-    return p;
-}
+    if (p->type == MPC_TYPE_EXPECT) { return 1 + mpc_nodecount_unretained(p->data.expect.x, 0); }
 
-mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
+    if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
+    if (p->type == MPC_TYPE_SKIP)     { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
+    if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
+    if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+    if (p->type == MPC_TYPE_REGEX)    { return 1 + mpc_nodecount_unretained(p->data.regex.x, 0); }
 
-    int i;
-    va_list va;
+    if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
+    if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
 
-    mpc_parser_t *p = mpc_undefined();
+    if (p->type == MPC_TYPE_NOT)   { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
+    if (p->type == MPC_TYPE_MAYBE) { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
 
-    p->type = MPC_TYPE_AND;
-    p->data.and.n = n;
-    p->data.and.f = f;
-    p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
-    p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+    if (p->type == MPC_TYPE_MANY)  { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+    if (p->type == MPC_TYPE_MANY1) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+    if (p->type == MPC_TYPE_COUNT) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
 
-    va_start(va, f);
-    for (i = 0; i < n; i++) {
-        p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+    if (p->type == MPC_TYPE_OR) {
+        total = 1;
+        for(i = 0; i < p->data.or.n; i++) {
+            total += mpc_nodecount_unretained(p->data.or.xs[i], 0);
+        }
+        return total;
     }
-    for (i = 0; i < (n-1); i++) {
-        p->data.and.dxs[i] = va_arg(va, mpc_dtor_t);
+
+    if (p->type == MPC_TYPE_AND) {
+        total = 1;
+        for(i = 0; i < p->data.and.n; i++) {
+            total += mpc_nodecount_unretained(p->data.and.xs[i], 0);
+        }
+        return total;
     }
-    va_end(va);
 
-    return p;
+    if (p->type == MPC_TYPE_EXPR) {
+        total = 1;
+        for(i = 0; i <= p->data.expr.n; i++) {
+            total += mpc_nodecount_unretained(p->data.expr.xs[i], 0);
+        }
+        return total;
+    }
+
+    return 1;
+
+}
+
+void mpc_stats(mpc_parser_t* p) {
+    printf("Stats\n");
+    printf("=====\n");
+    printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
 }
 
 /*
-** Common Parsers
+** Analysis
+**
+** Looks for the places in a grammar where parsing
+** goes over the same input again and again. For
+** every node the bytes it can begin with, and if
+** it can match nothing, are found together, going
+** round until nothing changes so that rules which
+** refer to themselves settle. These are the sets
+** `mpc_re_first` finds but seen through rules too,
+** and on a token input they are the token kinds.
+**
+** Repetition never gives back input it has read,
+** so nested repetition only goes wrong when its
+** body can match nothing, and then it never ends.
+** The real backtracking is in `or`, where each
+** alternative that can begin the same way is tried
+** on the same input, once per level of nesting if
+** the rule refers to itself. An alternative which
+** can fail after reading without bound (through a
+** repetition or recursion) costs O(n) a try.
+** Regexes with an automaton never backtrack so
+** their insides are left out.
+**
+** Alternatives which only overlap cost a fixed
+** number of tries at a position, so they are
+** reported as bounded. Only the rest are severe
+** and counted: repetition which never ends, tries
+** which multiply with nesting, and tries which can
+** each read the whole input.
 */
 
-mpc_parser_t *mpc_soi(void) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_SOI;
-    return mpc_expect(p, "start of input");
-}
+enum {
+    MPC_ANALYSE_QUIET     = 1,
+    MPC_ANALYSE_VISITING  = 2,
+    MPC_ANALYSE_NULLABLE  = 4,
+    MPC_ANALYSE_UNBOUNDED = 8,
+    MPC_ANALYSE_RISKY     = 16
+};
 
-mpc_parser_t *mpc_eoi(void) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_EOI;
-    return mpc_expect(p, "end of input");
+typedef struct {
+    int num;
+    int max;
+    mpc_parser_t **nodes;
+    mpc_parser_t **owners;
+    int **kids;
+    int *kids_num;
+    char *flags;
+    mpc_re_set_t *first;
+    int severe;
+} mpc_analyse_t;
+
+static int mpc_analyse_find(mpc_analyse_t *a, mpc_parser_t *p) {
+    int j;
+    for (j = 0; j < a->num; j++) {
+        if (a->nodes[j] == p) { return j; }
+    }
+    return -1;
 }
 
-static int mpc_boundary_anchor(char prev, char next) {
-    const char* word = "abcdefghijklmnopqrstuvwxyz"
-                       "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-                       "0123456789_";
-    if ( strchr(word, next) &&  prev == '\0') { return 1; }
-    if ( strchr(word, prev) &&  next == '\0') { return 1; }
-    if ( strchr(word, next) && !strchr(word, prev)) { return 1; }
-    if (!strchr(word, next) &&  strchr(word, prev)) { return 1; }
-    return 0;
-}
+static int mpc_analyse_collect(mpc_analyse_t *a, mpc_parser_t *p, mpc_parser_t *owner, int quiet) {
 
-static int mpc_boundary_newline_anchor(char prev, char next) {
-    (void)next;
-    return prev == '\n';
-}
+    int j, k, n;
+    mpc_parser_t **xs;
 
-mpc_parser_t *mpc_boundary(void) { return mpc_expect(mpc_anchor(mpc_boundary_anchor), "word boundary"); }
-mpc_parser_t *mpc_boundary_newline(void) { return mpc_expect(mpc_anchor(mpc_boundary_newline_anchor), "start of newline"); }
+    if (p->retained) {
+        j = mpc_analyse_find(a, p);
+        if (j >= 0) {
+            /* A rule reached again while still inside it is recursive */
+            if (a->flags[j] & MPC_ANALYSE_VISITING) { a->flags[j] |= MPC_ANALYSE_UNBOUNDED; }
+            return j;
+        }
+        owner = p;
+    } else if (p->name) {
+        /* An inlined copy of a rule stands for it */
+        owner = p;
+    }
 
-mpc_parser_t *mpc_whitespace(void) { return mpc_expect(mpc_oneof(" \f\n\r\t\v"), "whitespace"); }
-mpc_parser_t *mpc_whitespaces(void) { return mpc_expect(mpc_many(mpcf_strfold, mpc_whitespace()), "spaces"); }
-mpc_parser_t *mpc_blank(void) { return mpc_expect(mpc_apply(mpc_whitespaces(), mpcf_free), "whitespace"); }
+    if (a->num == a->max) {
+        a->max = a->max * 2;
+        a->nodes    = realloc(a->nodes,    sizeof(mpc_parser_t*) * a->max);
+        a->owners   = realloc(a->owners,   sizeof(mpc_parser_t*) * a->max);
+        a->kids     = realloc(a->kids,     sizeof(int*) * a->max);
+        a->kids_num = realloc(a->kids_num, sizeof(int) * a->max);
+        a->flags    = realloc(a->flags,    a->max);
+    }
 
-mpc_parser_t *mpc_newline(void) { return mpc_expect(mpc_char('\n'), "newline"); }
-mpc_parser_t *mpc_tab(void) { return mpc_expect(mpc_char('\t'), "tab"); }
-mpc_parser_t *mpc_escape(void) { return mpc_and(2, mpcf_strfold, mpc_char('\\'), mpc_any(), free); }
+    j = a->num++;
+    a->nodes[j] = p;
+    a->owners[j] = owner;
+    a->flags[j] = (char)(quiet | MPC_ANALYSE_VISITING);
 
-mpc_parser_t *mpc_digit(void) { return mpc_expect(mpc_oneof("0123456789"), "digit"); }
-mpc_parser_t *mpc_hexdigit(void) { return mpc_expect(mpc_oneof("0123456789ABCDEFabcdef"), "hex digit"); }
-mpc_parser_t *mpc_octdigit(void) { return mpc_expect(mpc_oneof("01234567"), "oct digit"); }
-mpc_parser_t *mpc_digits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_digit()), "digits"); }
-mpc_parser_t *mpc_hexdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_hexdigit()), "hex digits"); }
-mpc_parser_t *mpc_octdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_octdigit()), "oct digits"); }
+    if (p->type == MPC_TYPE_REGEX && p->data.regex.states > 0) { quiet = MPC_ANALYSE_QUIET; }
 
-mpc_parser_t *mpc_lower(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyz"), "lowercase letter"); }
-mpc_parser_t *mpc_upper(void) { return mpc_expect(mpc_oneof("ABCDEFGHIJKLMNOPQRSTUVWXYZ"), "uppercase letter"); }
-mpc_parser_t *mpc_alpha(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"), "letter"); }
-mpc_parser_t *mpc_underscore(void) { return mpc_expect(mpc_char('_'), "underscore"); }
-mpc_parser_t *mpc_alphanum(void) { return mpc_expect(mpc_or(3, mpc_alpha(), mpc_digit(), mpc_underscore()), "alphanumeric"); }
+    n = mpc_optimise_children(p, &xs);
+    a->kids[j] = n ? malloc(sizeof(int) * n) : NULL;
+    a->kids_num[j] = n;
 
-mpc_parser_t *mpc_int(void) { return mpc_expect(mpc_apply(mpc_digits(), mpcf_int), "integer"); }
-mpc_parser_t *mpc_hex(void) { return mpc_expect(mpc_apply(mpc_hexdigits(), mpcf_hex), "hexadecimal"); }
-mpc_parser_t *mpc_oct(void) { return mpc_expect(mpc_apply(mpc_octdigits(), mpcf_oct), "octadecimal"); }
-mpc_parser_t *mpc_number(void) { return mpc_expect(mpc_or(3, mpc_int(), mpc_hex(), mpc_oct()), "number"); }
+    for (k = 0; k < n; k++) {
+        /* Regexes compiled from the same pattern share one parser */
+        if (p->type == MPC_TYPE_REGEX && p->data.regex.body
+        &&  (a->kids[j][k] = mpc_analyse_find(a, xs[k])) >= 0) { continue; }
+        a->kids[j][k] = mpc_analyse_collect(a, xs[k], owner, quiet);
+    }
 
-mpc_parser_t *mpc_real(void) {
+    a->flags[j] &= ~MPC_ANALYSE_VISITING;
+    return j;
+}
 
-    /* [+-]?\d+(\.\d+)?([eE][+-]?[0-9]+)? */
+/* Recomputes one node from its children, returning if it changed */
+static int mpc_analyse_update(mpc_analyse_t *a, int j) {
 
-    mpc_parser_t *p0, *p1, *p2, *p30, *p31, *p32, *p3;
+    int k, c, n, nullable, unbounded;
+    char flags;
+    int *kids = a->kids[j];
+    mpc_parser_t *p = a->nodes[j];
+    mpc_re_set_t first;
 
-    p0 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
-    p1 = mpc_digits();
-    p2 = mpc_maybe_lift(mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_digits(), free), mpcf_ctor_str);
-    p30 = mpc_oneof("eE");
-    p31 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
-    p32 = mpc_digits();
-    p3 = mpc_maybe_lift(mpc_and(3, mpcf_strfold, p30, p31, p32, free, free), mpcf_ctor_str);
+    memset(&first, 0, sizeof(mpc_re_set_t));
+    n = a->kids_num[j];
+    nullable = 0;
 
-    return mpc_expect(mpc_and(4, mpcf_strfold, p0, p1, p2, p3, free, free, free), "real");
+    switch (p->type) {
 
-}
+        case MPC_TYPE_ANY:
+        case MPC_TYPE_SINGLE:
+        case MPC_TYPE_RANGE:
+        case MPC_TYPE_ONEOF:
+        case MPC_TYPE_NONEOF:
+        case MPC_TYPE_SATISFY:
+            for (c = 1; c < 256; c++) {
+                if (mpc_re_build_match(p, (char)c)) { mpc_re_set_add(&first, c); }
+            }
+            break;
 
-mpc_parser_t *mpc_float(void) {
-    return mpc_expect(mpc_apply(mpc_real(), mpcf_float), "float");
-}
+        case MPC_TYPE_STRING:
+            if (p->data.string.x[0] == '\0') { nullable = 1; break; }
+            mpc_re_set_add(&first, (unsigned char)p->data.string.x[0]);
+            break;
 
-mpc_parser_t *mpc_char_lit(void) {
-    return mpc_expect(mpc_between(mpc_or(2, mpc_escape(), mpc_any()), free, "'", "'"), "char");
-}
+        case MPC_TYPE_TOKEN:
+            mpc_re_set_add(&first, (unsigned char)p->data.single.x);
+            break;
 
-mpc_parser_t *mpc_string_lit(void) {
-    mpc_parser_t *strchar = mpc_or(2, mpc_escape(), mpc_noneof("\""));
-    return mpc_expect(mpc_between(mpc_many(mpcf_strfold, strchar), free, "\"", "\""), "string");
-}
+        case MPC_TYPE_PASS:
+        case MPC_TYPE_LIFT:
+        case MPC_TYPE_LIFT_VAL:
+        case MPC_TYPE_ANCHOR:
+        case MPC_TYPE_STATE:
+        case MPC_TYPE_SOI:
+        case MPC_TYPE_EOI:
+        case MPC_TYPE_CUT:
+        case MPC_TYPE_NOT:
+            nullable = 1;
+            break;
 
-mpc_parser_t *mpc_regex_lit(void) {
-    mpc_parser_t *regexchar = mpc_or(2, mpc_escape(), mpc_noneof("/"));
-    return mpc_expect(mpc_between(mpc_many(mpcf_strfold, regexchar), free, "/", "/"), "regex");
-}
+        case MPC_TYPE_MAYBE:
+        case MPC_TYPE_MANY:
+            first = a->first[kids[0]];
+            nullable = 1;
+            break;
 
-mpc_parser_t *mpc_ident(void) {
-    mpc_parser_t *p0, *p1;
-    p0 = mpc_or(2, mpc_alpha(), mpc_underscore());
-    p1 = mpc_many(mpcf_strfold, mpc_alphanum());
-    return mpc_and(2, mpcf_strfold, p0, p1, free);
-}
+        case MPC_TYPE_COUNT:
+            first = a->first[kids[0]];
+            nullable = p->data.repeat.n == 0 || a->flags[kids[0]] & MPC_ANALYSE_NULLABLE;
+            break;
 
-/*
-** Useful Parsers
-*/
+        case MPC_TYPE_OR:
+            for (k = 0; k < n; k++) {
+                mpc_re_set_union(&first, &a->first[kids[k]]);
+                if (a->flags[kids[k]] & MPC_ANALYSE_NULLABLE) { nullable = 1; }
+            }
+            break;
 
-mpc_parser_t *mpc_startwith(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_soi(), a, mpcf_dtor_null); }
-mpc_parser_t *mpc_endwith(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(2, mpcf_fst, a, mpc_eoi(), da); }
-mpc_parser_t *mpc_whole(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(3, mpcf_snd, mpc_soi(), a, mpc_eoi(), mpcf_dtor_null, da); }
+        case MPC_TYPE_AND:
+            for (nullable = 1, k = 0; k < n && nullable; k++) {
+                mpc_re_set_union(&first, &a->first[kids[k]]);
+                nullable = a->flags[kids[k]] & MPC_ANALYSE_NULLABLE;
+            }
+            break;
 
-mpc_parser_t *mpc_stripl(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_blank(), a, mpcf_dtor_null); }
-mpc_parser_t *mpc_stripr(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
-mpc_parser_t *mpc_strip(mpc_parser_t *a) { return mpc_and(3, mpcf_snd, mpc_blank(), a, mpc_blank(), mpcf_dtor_null, mpcf_dtor_null); }
-mpc_parser_t *mpc_tok(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
-mpc_parser_t *mpc_sym(const char *s) { return mpc_tok(mpc_string(s)); }
+        default:
+            /* Anything else begins the way its first child does */
+            if (n > 0) {
+                first = a->first[kids[0]];
+                nullable = a->flags[kids[0]] & MPC_ANALYSE_NULLABLE;
+            }
+            break;
+    }
 
-mpc_parser_t *mpc_total(mpc_parser_t *a, mpc_dtor_t da) { return mpc_whole(mpc_strip(a), da); }
+    flags = a->flags[j];
+    if (nullable) { flags |= MPC_ANALYSE_NULLABLE; }
+    if (p->type == MPC_TYPE_MANY || p->type == MPC_TYPE_MANY1) { flags |= MPC_ANALYSE_UNBOUNDED; }
 
-mpc_parser_t *mpc_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
-    return mpc_and(3, mpcf_snd_free,
-                   mpc_string(o), a, mpc_string(c),
-                   free, ad);
-}
+    for (k = 0; k < n; k++) {
+        flags |= a->flags[kids[k]] & (MPC_ANALYSE_UNBOUNDED | MPC_ANALYSE_RISKY);
+    }
 
-mpc_parser_t *mpc_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "(", ")"); }
-mpc_parser_t *mpc_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "<", ">"); }
-mpc_parser_t *mpc_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_between(a, ad, "{", "}"); }
-mpc_parser_t *mpc_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_between(a, ad, "[", "]"); }
+    /* Risky if it can fail after reading without bound */
+    for (unbounded = 0, k = 0; p->type == MPC_TYPE_AND && k < n; k++) {
+        if (unbounded && !mpc_parse_infallible(p->data.and.xs[k], 0)) { flags |= MPC_ANALYSE_RISKY; }
+        if (a->flags[kids[k]] & MPC_ANALYSE_UNBOUNDED) { unbounded = 1; }
+    }
 
-mpc_parser_t *mpc_tok_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
-    return mpc_and(3, mpcf_snd_free,
-                   mpc_sym(o), mpc_tok(a), mpc_sym(c),
-                   free, ad);
-}
+    if ((p->type == MPC_TYPE_CHECK || p->type == MPC_TYPE_CHECK_WITH)
+    &&  a->flags[kids[0]] & MPC_ANALYSE_UNBOUNDED) { flags |= MPC_ANALYSE_RISKY; }
 
-mpc_parser_t *mpc_tok_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "(", ")"); }
-mpc_parser_t *mpc_tok_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "<", ">"); }
-mpc_parser_t *mpc_tok_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_tok_between(a, ad, "{", "}"); }
-mpc_parser_t *mpc_tok_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_tok_between(a, ad, "[", "]"); }
+    mpc_re_set_union(&first, &a->first[j]);
 
-/*
-** Regular Expression Parsers
-*/
+    if (flags == a->flags[j]
+    &&  memcmp(&first, &a->first[j], sizeof(mpc_re_set_t)) == 0) { return 0; }
 
-/*
-** So here is a cute bootstrapping.
-**
-** I'm using the previously defined
-** mpc constructs and functions to
-** parse the user regex string and
-** construct a parser from it.
-**
-** As it turns out lots of the standard
-** mpc functions look a lot like `fold`
-** functions and so can be used indirectly
-** by many of the parsing functions to build
-** a parser directly - as we are parsing.
-**
-** This is certainly something that
-** would be less elegant/interesting
-** in a two-phase parser which first
-** builds an AST and then traverses it
-** to generate the object.
-**
-** This whole thing acts as a great
-** case study for how trivial it can be
-** to write a great parser in a few
-** lines of code using mpc.
-*/
+    a->first[j] = first;
+    a->flags[j] = flags;
+    return 1;
+}
 
-/*
-**
-**  ### Regular Expression Grammar
-**
-**      <regex> : <term> | (<term> "|" <regex>)
-**
-**      <term> : <factor>*
-**
-**      <factor> : <base>
-**               | <base> "*"
-**               | <base> "+"
-**               | <base> "?"
-**               | <base> "{" <digits> "}"
-**
-**      <base> : <char>
-**             | "\" <char>
-**             | "(" <regex> ")"
-**             | "[" <range> "]"
-*/
+/* If `j` can reach the rule `r`, marking what's been seen in `seen` */
+static int mpc_analyse_reaches(mpc_analyse_t *a, int j, int r, char *seen) {
+    int k;
+    for (k = 0; k < a->kids_num[j]; k++) {
+        if (a->kids[j][k] == r) { return 1; }
+        if (seen[a->kids[j][k]]) { continue; }
+        seen[a->kids[j][k]] = 1;
+        if (mpc_analyse_reaches(a, a->kids[j][k], r, seen)) { return 1; }
+    }
+    return 0;
+}
 
-static mpc_val_t *mpcf_re_or(int n, mpc_val_t **xs) {
-    (void) n;
-    if (xs[1] == NULL) { return xs[0]; }
-    else { return mpc_or(2, xs[0], xs[1]); }
+static void mpc_analyse_report(mpc_analyse_t *a, int j, int severe, const char *fmt, ...) {
+
+    va_list va;
+    mpc_parser_t *owner = a->owners[j];
+
+    printf("%s: ", owner && owner->name ? owner->name : "<anonymous>");
+    va_start(va, fmt);
+    vprintf(fmt, va);
+    va_end(va);
+    printf("\n");
+    if (severe) { a->severe++; }
 }
 
-static mpc_val_t *mpcf_re_and(int n, mpc_val_t **xs) {
-    int i;
-    mpc_parser_t *p = mpc_lift(mpcf_ctor_str);
-    for (i = 0; i < n; i++) {
-        p = mpc_and(2, mpcf_strfold, p, xs[i], free);
+static void mpc_analyse_or(mpc_analyse_t *a, int j, char *seen) {
+
+    int c, k, l, r, x, y, tries, most, nested, risky;
+    int *kids = a->kids[j];
+    int n = a->kids_num[j];
+    char buffer[4];
+
+    /* The first pair of alternatives which can begin the same way */
+    for (x = 0, y = -1; x < n && y < 0; x++) {
+        for (l = x+1; l < n; l++) {
+            if ((a->flags[kids[x]] & MPC_ANALYSE_NULLABLE)
+            ||  !mpc_re_set_disjoint(&a->first[kids[x]], &a->first[kids[l]])) { y = l; break; }
+        }
+    }
+    if (y < 0) { return; }
+    x--;
+
+    /* The most alternatives tried on any one byte */
+    for (most = 0, c = 1; c < 256; c++) {
+        for (tries = 0, k = 0; k < n; k++) {
+            if ((a->flags[kids[k]] & MPC_ANALYSE_NULLABLE)
+            ||  mpc_re_set_has(&a->first[kids[k]], c)) { tries++; }
+        }
+        if (tries > most) { most = tries; }
     }
-    return p;
-}
 
-static mpc_val_t *mpcf_re_repeat(int n, mpc_val_t **xs) {
-    int num;
-    (void) n;
-    if (xs[1] == NULL) { return xs[0]; }
-    switch(((char*)xs[1])[0])
-    {
-        case '*': { free(xs[1]); return mpc_many(mpcf_strfold, xs[0]); }; break;
-        case '+': { free(xs[1]); return mpc_many1(mpcf_strfold, xs[0]); }; break;
-        case '?': { free(xs[1]); return mpc_maybe_lift(xs[0], mpcf_ctor_str); }; break;
-        default:
-            num = *(int*)xs[1];
-            free(xs[1]);
+    /* Tries multiply when the alternative leads back into the rule */
+    r = a->owners[j] ? mpc_analyse_find(a, a->owners[j]) : -1;
+    nested = r >= 0 && (kids[x] == r || mpc_analyse_reaches(a, kids[x], r, seen));
+    risky = a->flags[kids[x]] & MPC_ANALYSE_RISKY;
+
+    for (c = 1; c < 256; c++) {
+        if (mpc_re_set_has(&a->first[kids[x]], c) && mpc_re_set_has(&a->first[kids[y]], c)) { break; }
     }
 
-    return mpc_count(num, mpcf_strfold, xs[0], free);
+    if (c == 256) {
+        mpc_analyse_report(a, j, nested || risky, "alternative %i can match nothing so %i is tried after it",
+            x+1, y+1);
+    } else {
+        mpc_analyse_report(a, j, nested || risky, "alternatives %i and %i can both begin with %s",
+            x+1, y+1, mpc_err_char_unescape((char)c, buffer));
+    }
+
+    if (nested) {
+        printf("    exponential: up to %i tries at a position, %i^d for a rule nested d deep\n", most, most);
+    } else {
+        printf("    bounded: up to %i tries at a position\n", most);
+    }
+
+    if (risky) {
+        printf("    linear: alternative %i can fail after reading unbounded input, O(n) a try and O(n^2) when repeated\n", x+1);
+    }
 }
 
-static mpc_parser_t *mpc_re_escape_char(char c) {
-    switch (c) {
-        case 'a': return mpc_char('\a');
-        case 'f': return mpc_char('\f');
-        case 'n': return mpc_char('\n');
-        case 'r': return mpc_char('\r');
-        case 't': return mpc_char('\t');
-        case 'v': return mpc_char('\v');
-        case 'b': return mpc_and(2, mpcf_snd, mpc_boundary(), mpc_lift(mpcf_ctor_str), free);
-        case 'B': return mpc_not_lift(mpc_boundary(), free, mpcf_ctor_str);
-        case 'A': return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
-        case 'Z': return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free);
-        case 'd': return mpc_digit();
-        case 'D': return mpc_not_lift(mpc_digit(), free, mpcf_ctor_str);
-        case 's': return mpc_whitespace();
-        case 'S': return mpc_not_lift(mpc_whitespace(), free, mpcf_ctor_str);
-        case 'w': return mpc_alphanum();
-        case 'W': return mpc_not_lift(mpc_alphanum(), free, mpcf_ctor_str);
-        default: return NULL;
+/*
+** Inlined copies of a rule keep its name, so each
+** would report the rule's hazards over again. Only
+** the rule is reported, or the first copy when the
+** rule itself is never reached.
+*/
+
+static int mpc_analyse_copy(mpc_analyse_t *a, mpc_parser_t *owner) {
+
+    int k, before = 1;
+
+    if (owner == NULL || owner->retained) { return 0; }
+
+    for (k = 0; k < a->num; k++) {
+        if (a->nodes[k] == owner) { before = 0; continue; }
+        if (a->nodes[k]->name && strcmp(a->nodes[k]->name, owner->name) == 0
+        &&  (before || a->nodes[k]->retained)) { return 1; }
     }
+
+    return 0;
 }
 
-static mpc_val_t *mpcf_re_escape(mpc_val_t *x, void* data) {
+static void mpc_analyse_run(mpc_analyse_t *a) {
 
-    int mode = *((int*)data);
-    char *s = x;
+    int j, changed;
+    char *seen;
     mpc_parser_t *p;
 
-    /* Any Character */
-    if (s[0] == '.') {
-        free(s);
-        if (mode & MPC_RE_DOTALL) {
-            return mpc_any();
-        } else {
-            return mpc_expect(mpc_noneof("\n"), "any character except a newline");
+    a->first = calloc(a->num, sizeof(mpc_re_set_t));
+    seen = malloc(a->num);
+
+    do {
+        for (changed = 0, j = a->num-1; j >= 0; j--) {
+            changed = mpc_analyse_update(a, j) || changed;
         }
-    }
+    } while (changed);
 
-    /* Start of Input */
-    if (s[0] == '^') {
-        free(s);
-        if (mode & MPC_RE_MULTILINE) {
-            return mpc_and(2, mpcf_snd, mpc_or(2, mpc_soi(), mpc_boundary_newline()), mpc_lift(mpcf_ctor_str), free);
-        } else {
-            return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
+    for (j = 0; j < a->num; j++) {
+
+        p = a->nodes[j];
+        if (a->flags[j] & MPC_ANALYSE_QUIET) { continue; }
+        if (mpc_analyse_copy(a, a->owners[j])) { continue; }
+
+        if ((p->type == MPC_TYPE_MANY || p->type == MPC_TYPE_MANY1)
+        &&  a->flags[a->kids[j][0]] & MPC_ANALYSE_NULLABLE) {
+            mpc_analyse_report(a, j, 1, "repeated parser can match nothing");
+            printf("    unbounded: the repetition never ends once it does\n");
         }
-    }
 
-    /* End of Input */
-    if (s[0] == '$') {
-        free(s);
-        if (mode & MPC_RE_MULTILINE) {
-            return mpc_or(2,
-                          mpc_newline(),
-                          mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free));
-        } else {
-            return mpc_or(2,
-                          mpc_and(2, mpcf_fst, mpc_newline(), mpc_eoi(), free),
-                          mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free));
+        if (p->type == MPC_TYPE_OR) {
+            memset(seen, 0, a->num);
+            mpc_analyse_or(a, j, seen);
         }
     }
 
-    /* Regex Escape */
-    if (s[0] == '\\') {
-        p = mpc_re_escape_char(s[1]);
-        p = (p == NULL) ? mpc_char(s[1]) : p;
-        free(s);
-        return p;
-    }
+    free(seen);
+}
 
-    /* Regex Standard */
-    p = mpc_char(s[0]);
-    free(s);
-    return p;
+static void mpc_analyse_init(mpc_analyse_t *a) {
+    a->num = 0;
+    a->max = 32;
+    a->nodes    = malloc(sizeof(mpc_parser_t*) * a->max);
+    a->owners   = malloc(sizeof(mpc_parser_t*) * a->max);
+    a->kids     = malloc(sizeof(int*) * a->max);
+    a->kids_num = malloc(sizeof(int) * a->max);
+    a->flags    = malloc(a->max);
+    a->first    = NULL;
+    a->severe   = 0;
 }
 
-static const char *mpc_re_range_escape_char(char c) {
-    switch (c) {
-        case '-': return "-";
-        case 'a': return "\a";
-        case 'f': return "\f";
-        case 'n': return "\n";
-        case 'r': return "\r";
-        case 't': return "\t";
-        case 'v': return "\v";
-        case 'b': return "\b";
-        case 'd': return "0123456789";
-        case 's': return " \f\n\r\t\v";
-        case 'w': return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
-        default: return NULL;
-    }
+static void mpc_analyse_free(mpc_analyse_t *a) {
+    int j;
+    for (j = 0; j < a->num; j++) { free(a->kids[j]); }
+    free(a->nodes);
+    free(a->owners);
+    free(a->kids);
+    free(a->kids_num);
+    free(a->flags);
+    free(a->first);
 }
 
-static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+int mpc_analyse(mpc_parser_t *p) {
+    mpc_analyse_t a;
+    mpc_analyse_init(&a);
+    mpc_analyse_collect(&a, p, NULL, 0);
+    mpc_analyse_run(&a);
+    mpc_analyse_free(&a);
+    return a.severe;
+}
 
-    mpc_parser_t *out;
-    size_t i, j;
-    size_t start, end;
-    const char *tmp = NULL;
-    const char *s = x;
-    int comp = s[0] == '^' ? 1 : 0;
-    char *range = calloc(1,1);
+mpc_err_t *mpca_analyse(int flags, const char *grammar, int *hazards) {
 
-    if (s[0] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
-    if (s[0] == '^' &&
-        s[1] == '\0') { free(range); free(x); return mpc_fail("Invalid Regex Range Expression"); }
+    int i;
+    mpca_grammar_st_t st;
+    mpc_input_t *in;
+    mpc_err_t *err;
+    mpc_analyse_t a;
 
-    for (i = comp; i < strlen(s); i++){
+    /* Tag IDs don't change the analysis, and any number of rules can be checked */
+    mpca_grammar_st_init(&st, flags | MPCA_LANG_NO_RULE_IDS, NULL, 0, NULL);
+    st.create = 1;
 
-        /* Regex Range Escape */
-        if (s[i] == '\\') {
-            tmp = mpc_re_range_escape_char(s[i+1]);
-            if (tmp != NULL) {
-                range = realloc(range, strlen(range) + strlen(tmp) + 1);
-                strcat(range, tmp);
-            } else {
-                range = realloc(range, strlen(range) + 1 + 1);
-                range[strlen(range) + 1] = '\0';
-                range[strlen(range) + 0] = s[i+1];
-            }
-            i++;
-        }
+    in = mpc_input_new_string("<mpca_analyse>", grammar);
+    err = mpca_lang_st(in, &st);
+    mpc_input_delete(in);
 
-            /* Regex Range...Range */
-        else if (s[i] == '-') {
-            if (s[i+1] == '\0' || i == 0) {
-                range = realloc(range, strlen(range) + strlen("-") + 1);
-                strcat(range, "-");
-            } else {
-                start = s[i-1]+1;
-                end = s[i+1]-1;
-                for (j = start; j <= end; j++) {
-                    range = realloc(range, strlen(range) + 1 + 1 + 1);
-                    range[strlen(range) + 1] = '\0';
-                    range[strlen(range) + 0] = (char)j;
-                }
-            }
-        }
+    *hazards = 0;
 
-            /* Regex Range Normal */
-        else {
-            range = realloc(range, strlen(range) + 1 + 1);
-            range[strlen(range) + 1] = '\0';
-            range[strlen(range) + 0] = s[i];
+    if (err == NULL) {
+        mpc_analyse_init(&a);
+        for (i = 0; i < st.parsers_num; i++) {
+            mpc_analyse_collect(&a, st.parsers[i], NULL, 0);
         }
-
+        mpc_analyse_run(&a);
+        mpc_analyse_free(&a);
+        *hazards = a.severe;
     }
 
-    out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+    for (i = 0; i < st.parsers_num; i++) { mpc_undefine(st.parsers[i]); }
+    for (i = 0; i < st.parsers_num; i++) { mpc_delete(st.parsers[i]); }
+    mpca_grammar_st_free(&st);
 
-    free(x);
-    free(range);
+    return err;
+}
 
-    return out;
+/*
+** A profile is reported against the same walk the
+** analysis does, which gives the rule each node is
+** part of. The cost of a node is the time spent in
+** it when that was taken, and otherwise the number
+** of times it was tried. A rule's cost is that of
+** all of its nodes together.
+*/
+
+enum {
+    MPC_PROFILE_REPORT_NODES = 20
+};
+
+typedef struct {
+    double cost;
+    mpc_parser_t *p;
+    mpc_parser_t *rule;
+    long tried;
+    mpc_profile_node_t counts;
+} mpc_profile_row_t;
+
+static const char *mpc_profile_types[] = {
+    "undefined", "pass", "fail", "lift", "lift_val", "expect", "anchor", "state",
+    "any", "char", "oneof", "noneof", "range", "satisfy", "string",
+    "apply", "apply_to", "predict", "not", "maybe", "many", "many1", "count",
+    "or", "and", "check", "check_with", "soi", "eoi", "cut", "skip", "regex",
+    "expr", "token"
+};
+
+static int mpc_profile_cmp(const void *a, const void *b) {
+    const mpc_profile_row_t *x = a, *y = b;
+    return x->cost < y->cost ? 1 : x->cost > y->cost ? -1 : 0;
 }
 
-mpc_parser_t *mpc_re(const char *re) {
-    return mpc_re_mode(re, MPC_RE_DEFAULT);
+static const char *mpc_profile_name(mpc_parser_t *p) {
+    return p && p->name ? p->name : "<anonymous>";
 }
 
-mpc_parser_t *mpc_re_mode(const char *re, int mode) {
+static void mpc_profile_describe(mpc_parser_t *p, FILE *f) {
+    switch (p->type) {
+        case MPC_TYPE_EXPECT: fprintf(f, "%-12s %-20.20s", "expect", p->data.expect.m); break;
+        case MPC_TYPE_STRING:
+        case MPC_TYPE_ONEOF:
+        case MPC_TYPE_NONEOF:
+            fprintf(f, "%-12s %-20.20s", mpc_profile_types[(int)p->type], p->data.string.x);
+            break;
+        case MPC_TYPE_SINGLE: fprintf(f, "%-12s %-20c", "char", p->data.single.x); break;
+        default:
+            fprintf(f, "%-12s %-20.20s", mpc_profile_types[(int)p->type], p->name ? p->name : "");
+            break;
+    }
+}
 
-    char *err_msg;
-    mpc_parser_t *err_out;
-    mpc_result_t r;
-    mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose;
+/* The row of a rule, which inlined copies share with it by name */
+static int mpc_profile_rule(mpc_profile_row_t *rules, int num, mpc_parser_t *rule) {
+    int k;
+    for (k = 0; k < num; k++) {
+        if (rules[k].rule == rule) { return k; }
+        if ((!rule->retained || !rules[k].rule->retained) && rule->name && rules[k].rule->name
+        &&  strcmp(rule->name, rules[k].rule->name) == 0) { return k; }
+    }
+    return -1;
+}
 
-    Regex  = mpc_new("regex");
-    Term   = mpc_new("term");
-    Factor = mpc_new("factor");
-    Base   = mpc_new("base");
-    Range  = mpc_new("range");
+static void mpc_profile_heading(int timed, FILE *f) {
+    fprintf(f, " %10s %10s %10s %10s %12s%s\n", "calls", "succeeded", "failed", "rewound", "bytes",
+        timed ? "  time (ms)" : "");
+}
 
-    mpc_define(Regex, mpc_and(2, mpcf_re_or,
-                              Term,
-                              mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_char('|'), Regex, free)),
-                              (mpc_dtor_t)mpc_delete
-    ));
+static void mpc_profile_counts(const mpc_profile_node_t *n, int timed, FILE *f) {
+    fprintf(f, " %10li %10li %10li %10li %12li", n->calls, n->successes, n->failures, n->rewinds, n->bytes);
+    if (timed) { fprintf(f, " %10.2f", n->time > 0 ? 1000.0 * n->time : 0.0); }
+    fprintf(f, "\n");
+}
 
-    mpc_define(Term, mpc_many(mpcf_re_and, Factor));
+void mpc_profile_report(mpc_profile_t *x, mpc_parser_t *p, FILE *f) {
 
-    mpc_define(Factor, mpc_and(2, mpcf_re_repeat,
-                               Base,
-                               mpc_or(5,
-                                      mpc_char('*'), mpc_char('+'), mpc_char('?'),
-                                      mpc_brackets(mpc_int(), free),
-                                      mpc_pass()),
-                               (mpc_dtor_t)mpc_delete
-    ));
+    int j, k, rules_num, nodes_num;
+    int timed = x->flags & MPC_PROFILE_TIME;
+    mpc_analyse_t a;
+    mpc_parser_t *rule;
+    mpc_profile_node_t *n;
+    mpc_profile_row_t *nodes, *rules;
 
-    mpc_define(Base, mpc_or(4,
-                            mpc_parens(Regex, (mpc_dtor_t)mpc_delete),
-                            mpc_squares(Range, (mpc_dtor_t)mpc_delete),
-                            mpc_apply_to(mpc_escape(), mpcf_re_escape, &mode),
-                            mpc_apply_to(mpc_noneof(")|"), mpcf_re_escape, &mode)
-    ));
+    mpc_analyse_init(&a);
+    mpc_analyse_collect(&a, p, NULL, 0);
 
-    mpc_define(Range, mpc_apply(
-            mpc_many(mpcf_strfold, mpc_or(2, mpc_escape(), mpc_noneof("]"))),
-            mpcf_re_range
-    ));
+    nodes = calloc(a.num, sizeof(mpc_profile_row_t));
+    rules = calloc(a.num, sizeof(mpc_profile_row_t));
+    nodes_num = 0;
+    rules_num = 0;
 
-    RegexEnclose = mpc_whole(mpc_predictive(Regex), (mpc_dtor_t)mpc_delete);
+    /* Each rule, and `p` itself if it isn't one */
+    for (j = 0; j < a.num; j++) {
+        if (a.owners[j] != a.nodes[j] && j > 0) { continue; }
+        k = mpc_profile_rule(rules, rules_num, a.nodes[j]);
+        if (k < 0) { k = rules_num++; rules[k].rule = a.nodes[j]; }
+        n = mpc_profile_slot(x->nodes, x->slots, a.nodes[j]);
+        if (n->p == NULL) { continue; }
+        rules[k].counts.calls     += n->calls;
+        rules[k].counts.successes += n->successes;
+        rules[k].counts.failures  += n->failures;
+        rules[k].counts.rewinds   += n->rewinds;
+        rules[k].counts.bytes     += n->bytes;
+    }
 
-    mpc_optimise(RegexEnclose);
-    mpc_optimise(Regex);
-    mpc_optimise(Term);
-    mpc_optimise(Factor);
-    mpc_optimise(Base);
-    mpc_optimise(Range);
+    for (j = 0; j < a.num; j++) {
 
-    if(!mpc_parse("<mpc_re_compiler>", re, RegexEnclose, &r)) {
-        err_msg = mpc_err_string(r.error);
-        err_out = mpc_failf("Invalid Regex: %s", err_msg);
-        mpc_err_delete(r.error);
-        free(err_msg);
-        r.output = err_out;
+        n = mpc_profile_slot(x->nodes, x->slots, a.nodes[j]);
+        if (n->p == NULL) { continue; }
+
+        rule = a.owners[j] ? a.owners[j] : a.nodes[0];
+        nodes[nodes_num].counts = *n;
+        nodes[nodes_num].p = a.nodes[j];
+        nodes[nodes_num].rule = rule;
+        nodes[nodes_num].cost = timed ? (double)n->time : (double)n->calls;
+        nodes_num++;
+
+        k = mpc_profile_rule(rules, rules_num, rule);
+        if (k >= 0) {
+            rules[k].tried += n->calls;
+            rules[k].counts.time += n->time;
+        }
+    }
+
+    for (k = 0; k < rules_num; k++) {
+        rules[k].cost = timed ? (double)rules[k].counts.time : (double)rules[k].tried;
     }
 
-    mpc_cleanup(6, RegexEnclose, Regex, Term, Factor, Base, Range);
+    qsort(nodes, nodes_num, sizeof(mpc_profile_row_t), mpc_profile_cmp);
+    qsort(rules, rules_num, sizeof(mpc_profile_row_t), mpc_profile_cmp);
 
-    mpc_optimise(r.output);
+    fprintf(f, "Profile\n");
+    fprintf(f, "=======\n\n");
+
+    fprintf(f, "%-20s %12s", "rule", "nodes tried");
+    mpc_profile_heading(timed, f);
+    for (k = 0; k < rules_num; k++) {
+        fprintf(f, "%-20.20s %12li", mpc_profile_name(rules[k].rule), rules[k].tried);
+        mpc_profile_counts(&rules[k].counts, timed, f);
+    }
 
-    return r.output;
+    fprintf(f, "\n%-20s %-33s", "rule", "node");
+    mpc_profile_heading(timed, f);
+    for (j = 0; j < nodes_num && j < MPC_PROFILE_REPORT_NODES; j++) {
+        fprintf(f, "%-20.20s ", mpc_profile_name(nodes[j].rule));
+        mpc_profile_describe(nodes[j].p, f);
+        mpc_profile_counts(&nodes[j].counts, timed, f);
+    }
 
+    free(nodes);
+    free(rules);
+    mpc_analyse_free(&a);
 }
 
 /*
-** Common Fold Functions
+** The fusion passes below must leave both the
+** output and the error of a parser unchanged.
+**
+** Bare characters (without an `expect`) never
+** produce an error message of their own, so they
+** can be merged freely. Where errors are already
+** suppressed by an enclosing `expect` or `not`
+** every inner `expect` is redundant, which in turn
+** exposes more bare characters to merge.
 */
 
-void mpcf_dtor_null(mpc_val_t *x) { (void) x; return; }
-
-mpc_val_t *mpcf_ctor_null(void) { return NULL; }
-mpc_val_t *mpcf_ctor_str(void) { return calloc(1, 1); }
-mpc_val_t *mpcf_free(mpc_val_t *x) { free(x); return NULL; }
-
-mpc_val_t *mpcf_int(mpc_val_t *x) {
-    int *y = malloc(sizeof(int));
-    *y = strtol(x, NULL, 10);
-    free(x);
-    return y;
+static void mpc_optimise_replace(mpc_parser_t *p, mpc_parser_t *t) {
+    char *name = p->name;
+    char retained = p->retained;
+    free(t->name);
+    memcpy(p, t, sizeof(mpc_parser_t));
+    p->name = name;
+    p->retained = retained;
+    free(t);
+}
+
+static int mpc_optimise_char(mpc_parser_t *p) {
+    if (p->retained) { return 0; }
+    if (p->type == MPC_TYPE_SINGLE) { return p->data.single.x != '\0'; }
+    if (p->type == MPC_TYPE_RANGE)  { return p->data.range.x != '\0' && p->data.range.x <= p->data.range.y; }
+    if (p->type == MPC_TYPE_ONEOF)  { return 1; }
+    return 0;
 }
 
-mpc_val_t *mpcf_hex(mpc_val_t *x) {
-    int *y = malloc(sizeof(int));
-    *y = strtol(x, NULL, 16);
-    free(x);
-    return y;
-}
+static int mpc_optimise_fuse_string(mpc_parser_t *p) {
 
-mpc_val_t *mpcf_oct(mpc_val_t *x) {
-    int *y = malloc(sizeof(int));
-    *y = strtol(x, NULL, 8);
-    free(x);
-    return y;
-}
+    int i, j, k, l;
+    mpc_parser_t **xs = p->data.and.xs;
+    char *x;
 
-mpc_val_t *mpcf_float(mpc_val_t *x) {
-    float *y = malloc(sizeof(float));
-    *y = strtod(x, NULL);
-    free(x);
-    return y;
-}
+    for (i = 0; i < p->data.and.n; i++) {
 
-mpc_val_t *mpcf_strtriml(mpc_val_t *x) {
-    char *s = x;
-    while (isspace((unsigned char)*s)) {
-        memmove(s, s+1, strlen(s));
-    }
-    return s;
-}
+        for (j = i; j < p->data.and.n
+                && !xs[j]->retained && xs[j]->type == MPC_TYPE_SINGLE
+                && xs[j]->data.single.x != '\0'; j++);
 
-mpc_val_t *mpcf_strtrimr(mpc_val_t *x) {
-    char *s = x;
-    size_t l = strlen(s);
-    while (l > 0 && isspace((unsigned char)s[l-1])) {
-        s[l-1] = '\0'; l--;
-    }
-    return s;
-}
+        if (j - i < 2) { continue; }
 
-mpc_val_t *mpcf_strtrim(mpc_val_t *x) {
-    return mpcf_strtriml(mpcf_strtrimr(x));
-}
+        x = malloc(j - i + 1);
+        for (k = i; k < j; k++) { x[k-i] = xs[k]->data.single.x; }
+        x[j-i] = '\0';
 
-static const char mpc_escape_input_c[]  = {
-        '\a', '\b', '\f', '\n', '\r',
-        '\t', '\v', '\\', '\'', '\"', '\0'};
+        for (k = i+1; k < j; k++) { mpc_delete(xs[k]); }
+        xs[i]->type = MPC_TYPE_STRING;
+        xs[i]->data.string.x = x;
 
-static const char *mpc_escape_output_c[] = {
-        "\\a", "\\b", "\\f", "\\n", "\\r", "\\t",
-        "\\v", "\\\\", "\\'", "\\\"", "\\0", NULL};
+        l = p->data.and.n - j;
+        memmove(xs + i + 1, xs + j, l * sizeof(mpc_parser_t*));
+        if (l > 1) {
+            memmove(p->data.and.dxs + i + 1, p->data.and.dxs + j, (l - 1) * sizeof(mpc_dtor_t));
+        }
+        p->data.and.n -= j - i - 1;
 
-static const char mpc_escape_input_raw_re[] = { '/' };
-static const char *mpc_escape_output_raw_re[] = { "\\/", NULL };
+        return 1;
+    }
 
-static const char mpc_escape_input_raw_cstr[] = { '"' };
-static const char *mpc_escape_output_raw_cstr[] = { "\\\"", NULL };
+    return 0;
+}
 
-static const char mpc_escape_input_raw_cchar[] = { '\'' };
-static const char *mpc_escape_output_raw_cchar[] = { "\\'", NULL };
+static int mpc_optimise_fuse_oneof(mpc_parser_t *p) {
 
-static mpc_val_t *mpcf_escape_new(mpc_val_t *x, const char *input, const char **output) {
+    int i, j, k, l;
+    mpc_parser_t **xs = p->data.or.xs;
+    char *x;
+    char set[256];
 
-    int i;
-    int found;
-    char buff[2];
-    char *s = x;
-    char *y = calloc(1, 1);
+    for (i = 0; i < p->data.or.n; i++) {
 
-    while (*s) {
+        for (j = i; j < p->data.or.n && mpc_optimise_char(xs[j]); j++);
 
-        i = 0;
-        found = 0;
+        if (j - i < 2) { continue; }
 
-        while (output[i]) {
-            if (*s == input[i]) {
-                y = realloc(y, strlen(y) + strlen(output[i]) + 1);
-                strcat(y, output[i]);
-                found = 1;
-                break;
+        memset(set, 0, sizeof(set));
+        for (k = i; k < j; k++) {
+            switch (xs[k]->type) {
+                case MPC_TYPE_SINGLE: set[(unsigned char)xs[k]->data.single.x] = 1; break;
+                case MPC_TYPE_RANGE:
+                    for (l = (unsigned char)xs[k]->data.range.x; l <= (unsigned char)xs[k]->data.range.y; l++) {
+                        set[l] = 1;
+                    }
+                    break;
+                case MPC_TYPE_ONEOF:
+                    for (x = xs[k]->data.string.x; *x; x++) { set[(unsigned char)*x] = 1; }
+                    break;
             }
-            i++;
         }
 
-        if (!found) {
-            y = realloc(y, strlen(y) + 2);
-            buff[0] = *s; buff[1] = '\0';
-            strcat(y, buff);
+        x = malloc(sizeof(set));
+        for (k = 1, l = 0; k < 256; k++) {
+            if (set[k]) { x[l++] = (char)k; }
         }
+        x[l] = '\0';
 
-        s++;
-    }
+        for (k = i; k < j; k++) { mpc_delete(xs[k]); }
+        xs[i] = mpc_undefined();
+        xs[i]->type = MPC_TYPE_ONEOF;
+        xs[i]->data.string.x = x;
 
+        l = p->data.or.n - j;
+        memmove(xs + i + 1, xs + j, l * sizeof(mpc_parser_t*));
+        p->data.or.n -= j - i - 1;
 
-    return y;
+        return 1;
+    }
+
+    return 0;
 }
 
-static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, const char *input, const char **output) {
+/*
+** A pure matcher only ever outputs the input it
+** has matched, or nothing. When that output is
+** thrown away straight after it can be run in a
+** mode which skips building it at all.
+*/
+
+static int mpc_optimise_pure(mpc_parser_t *p) {
 
     int i;
-    int found = 0;
-    char buff[2];
-    char *s = x;
-    char *y = calloc(1, 1);
 
-    while (*s) {
+    if (p->retained) { return 0; }
 
-        i = 0;
-        found = 0;
+    switch (p->type) {
 
-        while (output[i]) {
-            if ((*(s+0)) == output[i][0] &&
-                (*(s+1)) == output[i][1]) {
-                y = realloc(y, strlen(y) + 1 + 1);
-                buff[0] = input[i]; buff[1] = '\0';
-                strcat(y, buff);
-                found = 1;
-                s++;
-                break;
+        case MPC_TYPE_PASS:
+        case MPC_TYPE_ANY:
+        case MPC_TYPE_SINGLE:
+        case MPC_TYPE_ONEOF:
+        case MPC_TYPE_NONEOF:
+        case MPC_TYPE_RANGE:
+        case MPC_TYPE_SATISFY:
+        case MPC_TYPE_STRING:
+        case MPC_TYPE_ANCHOR:
+        case MPC_TYPE_SOI:
+        case MPC_TYPE_EOI:
+        case MPC_TYPE_SKIP:
+        case MPC_TYPE_TOKEN:
+            return 1;
+
+        case MPC_TYPE_EXPECT:
+            return mpc_optimise_pure(p->data.expect.x);
+
+        case MPC_TYPE_REGEX:
+            return mpc_optimise_pure(p->data.regex.x);
+
+        case MPC_TYPE_APPLY:
+            return p->data.apply.f == mpcf_free && mpc_optimise_pure(p->data.apply.x);
+
+        case MPC_TYPE_NOT:
+            if (p->data.not.dx != free) { return 0; }
+            /* fallthrough */
+        case MPC_TYPE_MAYBE:
+            return (p->data.not.lf == mpcf_ctor_str || p->data.not.lf == mpcf_ctor_null)
+                && mpc_optimise_pure(p->data.not.x);
+
+        case MPC_TYPE_COUNT:
+            if (p->data.repeat.dx != free) { return 0; }
+            /* fallthrough */
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+            return p->data.repeat.f == mpcf_strfold && mpc_optimise_pure(p->data.repeat.x);
+
+        case MPC_TYPE_OR:
+            for (i = 0; i < p->data.or.n; i++) {
+                if (!mpc_optimise_pure(p->data.or.xs[i])) { return 0; }
             }
-            i++;
-        }
+            return 1;
 
-        if (!found) {
-            y = realloc(y, strlen(y) + 1 + 1);
-            buff[0] = *s; buff[1] = '\0';
-            strcat(y, buff);
-        }
+        case MPC_TYPE_AND:
+            if (p->data.and.f != mpcf_strfold) { return 0; }
+            for (i = 0; i < p->data.and.n; i++) {
+                if (!mpc_optimise_pure(p->data.and.xs[i])) { return 0; }
+            }
+            for (i = 0; i < p->data.and.n-1; i++) {
+                if (p->data.and.dxs[i] != free) { return 0; }
+            }
+            return 1;
 
-        if (*s == '\0') { break; }
-        else { s++; }
+        default: return 0;
     }
+}
 
-    return y;
+static void mpc_optimise_unretained(mpc_parser_t *p, int force, int quiet, int flags);
 
-}
+/*
+** Helper rules which are small, already defined
+** and don't refer to any other rule are copied
+** into the places they are used. This removes an
+** indirection and lets the passes below work
+** across the rule boundary. Because they are
+** copies, redefining such a rule afterwards won't
+** affect parsers already optimised. A copy keeps
+** the rule's name, though not retained, so that
+** profiles, traces and the analysis still put its
+** work down to the rule.
+*/
 
-mpc_val_t *mpcf_escape(mpc_val_t *x) {
-    mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_c, mpc_escape_output_c);
-    free(x);
-    return y;
-}
+enum {
+    MPC_OPTIMISE_INLINE_MAX = 16
+};
 
-mpc_val_t *mpcf_unescape(mpc_val_t *x) {
-    mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_c, mpc_escape_output_c);
-    free(x);
-    return y;
+static int mpc_optimise_children(mpc_parser_t *p, mpc_parser_t ***xs) {
+    switch (p->type) {
+        case MPC_TYPE_EXPECT:     *xs = &p->data.expect.x;     return 1;
+        case MPC_TYPE_APPLY:
+        case MPC_TYPE_SKIP:       *xs = &p->data.apply.x;      return 1;
+        case MPC_TYPE_APPLY_TO:   *xs = &p->data.apply_to.x;   return 1;
+        case MPC_TYPE_CHECK:      *xs = &p->data.check.x;      return 1;
+        case MPC_TYPE_CHECK_WITH: *xs = &p->data.check_with.x; return 1;
+        case MPC_TYPE_PREDICT:    *xs = &p->data.predict.x;    return 1;
+        case MPC_TYPE_REGEX:      *xs = &p->data.regex.x;      return 1;
+        case MPC_TYPE_NOT:
+        case MPC_TYPE_MAYBE:      *xs = &p->data.not.x;        return 1;
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+        case MPC_TYPE_COUNT:      *xs = &p->data.repeat.x;     return 1;
+        case MPC_TYPE_OR:         *xs = p->data.or.xs;         return p->data.or.n;
+        case MPC_TYPE_AND:        *xs = p->data.and.xs;        return p->data.and.n;
+        case MPC_TYPE_EXPR:       *xs = p->data.expr.xs;       return p->data.expr.n+1;
+        default:                  *xs = NULL;                  return 0;
+    }
 }
 
-mpc_val_t *mpcf_escape_regex(mpc_val_t *x) {
-    mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
-    free(x);
-    return y;
+static int mpc_optimise_leaf(mpc_parser_t *p, int force) {
+    int i, n;
+    mpc_parser_t **xs;
+    if (p->retained && !force) { return 0; }
+    if (p->type == MPC_TYPE_CUT) { return 0; }
+    n = mpc_optimise_children(p, &xs);
+    for (i = 0; i < n; i++) {
+        if (!mpc_optimise_leaf(xs[i], 0)) { return 0; }
+    }
+    return 1;
 }
 
-mpc_val_t *mpcf_unescape_regex(mpc_val_t *x) {
-    mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
-    free(x);
-    return y;
+static int mpc_optimise_inlinable(mpc_parser_t *p) {
+    return p->retained
+        && p->type != MPC_TYPE_UNDEFINED
+        && mpc_nodecount_unretained(p, 1) <= MPC_OPTIMISE_INLINE_MAX
+        && mpc_optimise_leaf(p, 1);
 }
 
-mpc_val_t *mpcf_escape_string_raw(mpc_val_t *x) {
-    mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
-    free(x);
-    return y;
+static mpc_parser_t *mpc_optimise_inline(mpc_parser_t *p) {
+    mpc_parser_t *t;
+    p->retained = 0;
+    t = mpc_copy(p);
+    p->retained = 1;
+    return t;
 }
 
-mpc_val_t *mpcf_unescape_string_raw(mpc_val_t *x) {
-    mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
-    free(x);
-    return y;
+/*
+** Alternatives that start with the same element
+** are factored so it is only parsed once:
+**
+**     a b | a c    =>    a (b | c)
+**
+** In a PEG the prefix can only ever match in one
+** way so this doesn't change what is accepted.
+** The prefix must be a self-contained copy in each
+** alternative (no rules or cuts) to compare them.
+**
+** To keep the AST identical the remainders are
+** folded the same way they would have been in the
+** original sequence, except that an empty result
+** is dropped rather than kept as an empty node.
+**
+** The factored sequence stays inside a choice even
+** when it is the only alternative left. A failing
+** choice leaves its error to the alternatives while
+** a sequence hands back its own, which a repetition
+** or count around it would reword.
+*/
+
+static mpc_val_t *mpcf_fold_ast_rest(int n, mpc_val_t **xs) {
+    mpc_ast_t *a = mpcf_fold_ast(n, xs);
+    if (a && a->children_num == 0 && strcmp(a->tag, ">") == 0) {
+        mpc_ast_delete(a);
+        return NULL;
+    }
+    return a;
 }
 
-mpc_val_t *mpcf_escape_char_raw(mpc_val_t *x) {
-    mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
-    free(x);
-    return y;
+static int mpc_optimise_seq(mpc_parser_t *p) {
+    return p->type == MPC_TYPE_AND && !p->retained
+        && (p->data.and.f == mpcf_fold_ast || p->data.and.f == mpcf_fold_ast_rest);
 }
 
-mpc_val_t *mpcf_unescape_char_raw(mpc_val_t *x) {
-    mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
-    free(x);
-    return y;
+static mpc_parser_t *mpc_optimise_head(mpc_parser_t *p) {
+    return mpc_optimise_seq(p) ? p->data.and.xs[0] : p;
 }
 
-mpc_val_t *mpcf_null(int n, mpc_val_t** xs) { (void) n; (void) xs; return NULL; }
-mpc_val_t *mpcf_fst(int n, mpc_val_t **xs) { (void) n; return xs[0]; }
-mpc_val_t *mpcf_snd(int n, mpc_val_t **xs) { (void) n; return xs[1]; }
-mpc_val_t *mpcf_trd(int n, mpc_val_t **xs) { (void) n; return xs[2]; }
+static int mpc_optimise_equal(mpc_parser_t *a, mpc_parser_t *b) {
 
-static mpc_val_t *mpcf_nth_free(int n, mpc_val_t **xs, int x) {
-    int i;
-    for (i = 0; i < n; i++) {
-        if (i != x) { free(xs[i]); }
-    }
-    return xs[x];
-}
+    int i, n;
+    mpc_parser_t **xs, **ys;
 
-mpc_val_t *mpcf_fst_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 0); }
-mpc_val_t *mpcf_snd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 1); }
-mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2); }
-mpc_val_t *mpcf_all_free(int n, mpc_val_t** xs) {
-    int i;
+    if (a->retained || b->retained) { return 0; }
+    if (a->type != b->type) { return 0; }
+
+    switch (a->type) {
+        case MPC_TYPE_PASS:
+        case MPC_TYPE_STATE:
+        case MPC_TYPE_ANY:
+        case MPC_TYPE_SOI:
+        case MPC_TYPE_EOI:      return 1;
+        case MPC_TYPE_SINGLE:
+        case MPC_TYPE_TOKEN:    return a->data.single.x == b->data.single.x;
+        case MPC_TYPE_RANGE:    return a->data.range.x == b->data.range.x && a->data.range.y == b->data.range.y;
+        case MPC_TYPE_ONEOF:
+        case MPC_TYPE_NONEOF:
+        case MPC_TYPE_STRING:   return strcmp(a->data.string.x, b->data.string.x) == 0;
+        case MPC_TYPE_SATISFY:  return a->data.satisfy.f == b->data.satisfy.f;
+        case MPC_TYPE_ANCHOR:   return a->data.anchor.f == b->data.anchor.f;
+        case MPC_TYPE_LIFT:     return a->data.lift.lf == b->data.lift.lf;
+        case MPC_TYPE_LIFT_VAL: return a->data.lift.x == b->data.lift.x;
+        case MPC_TYPE_EXPECT:   if (strcmp(a->data.expect.m, b->data.expect.m) != 0) { return 0; } break;
+        case MPC_TYPE_APPLY:
+        case MPC_TYPE_SKIP:     if (a->data.apply.f != b->data.apply.f) { return 0; } break;
+        case MPC_TYPE_APPLY_TO:
+            if (a->data.apply_to.f != b->data.apply_to.f
+            ||  a->data.apply_to.d != b->data.apply_to.d
+            ||  a->data.apply_to.id != b->data.apply_to.id) { return 0; }
+            break;
+        case MPC_TYPE_PREDICT:  break;
+        case MPC_TYPE_REGEX:
+            if (a->data.regex.body && a->data.regex.body == b->data.regex.body) { return 1; }
+            if (a->data.regex.states  != b->data.regex.states
+            ||  a->data.regex.classes != b->data.regex.classes
+            ||  a->data.regex.flags   != b->data.regex.flags
+            ||  memcmp(a->data.regex.t, b->data.regex.t, mpc_re_dfa_size(&a->data.regex)) != 0) { return 0; }
+            break;
+        case MPC_TYPE_NOT:
+        case MPC_TYPE_MAYBE:
+            if (a->data.not.lf != b->data.not.lf
+            ||  a->data.not.dx != b->data.not.dx) { return 0; }
+            break;
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+        case MPC_TYPE_COUNT:
+            if (a->data.repeat.f  != b->data.repeat.f
+            ||  a->data.repeat.n  != b->data.repeat.n
+            ||  a->data.repeat.dx != b->data.repeat.dx) { return 0; }
+            break;
+        case MPC_TYPE_OR:
+            if (a->data.or.n != b->data.or.n) { return 0; }
+            break;
+        case MPC_TYPE_AND:
+            if (a->data.and.n != b->data.and.n
+            ||  a->data.and.f != b->data.and.f) { return 0; }
+            for (i = 0; i < a->data.and.n-1; i++) {
+                if (a->data.and.dxs[i] != b->data.and.dxs[i]) { return 0; }
+            }
+            break;
+        case MPC_TYPE_EXPR:
+            if (a->data.expr.n  != b->data.expr.n
+            ||  a->data.expr.f  != b->data.expr.f
+            ||  a->data.expr.dx != b->data.expr.dx
+            ||  memcmp(a->data.expr.ps, b->data.expr.ps, a->data.expr.n) != 0) { return 0; }
+            break;
+        default: return 0;
+    }
+
+    n = mpc_optimise_children(a, &xs);
+    mpc_optimise_children(b, &ys);
     for (i = 0; i < n; i++) {
-        free(xs[i]);
+        if (!mpc_optimise_equal(xs[i], ys[i])) { return 0; }
     }
-    return NULL;
+
+    return 1;
 }
 
-mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
-    int i;
-    size_t l = 0;
+static mpc_parser_t *mpc_optimise_rest(mpc_parser_t *p, int keep) {
 
-    if (n == 0) { return calloc(1, 1); }
+    mpc_parser_t *t;
 
-    for (i = 0; i < n; i++) { l += strlen(xs[i]); }
+    if (!mpc_optimise_seq(p)) {
+        if (!keep) { mpc_delete(p); }
+        return mpc_pass();
+    }
 
-    xs[0] = realloc(xs[0], l + 1);
+    if (!keep) { mpc_delete(p->data.and.xs[0]); }
 
-    for (i = 1; i < n; i++) {
-        strcat(xs[0], xs[i]); free(xs[i]);
+    if (p->data.and.n == 2) {
+        t = p->data.and.xs[1];
+        free(p->data.and.xs); free(p->data.and.dxs); free(p->name); free(p);
+        return t;
     }
 
-    return xs[0];
+    p->data.and.n--;
+    p->data.and.f = mpcf_fold_ast_rest;
+    memmove(p->data.and.xs, p->data.and.xs + 1, p->data.and.n * sizeof(mpc_parser_t*));
+    return p;
 }
 
-/*
-** Printing
-*/
+static int mpc_optimise_factor(mpc_parser_t *p, int quiet, int flags) {
 
-static void mpc_print_unretained(mpc_parser_t *p, int force) {
+    int i, j, k;
+    mpc_parser_t **xs = p->data.or.xs;
+    mpc_parser_t *head, *o, *a;
 
-    /* TODO: Print Everything Escaped */
+    for (i = 0; i < p->data.or.n; i++) {
 
-    int i;
-    char *s, *e;
-    char buff[2];
+        if (xs[i]->retained) { continue; }
 
-    if (p->retained && !force) {;
-        if (p->name) { printf("<%s>", p->name); }
-        else { printf("<anon>"); }
-        return;
-    }
+        head = mpc_optimise_head(xs[i]);
+        if (!mpc_optimise_leaf(head, 0)) { continue; }
 
-    if (p->type == MPC_TYPE_UNDEFINED) { printf("<?>"); }
-    if (p->type == MPC_TYPE_PASS)   { printf("<:>"); }
-    if (p->type == MPC_TYPE_FAIL)   { printf("<!>"); }
-    if (p->type == MPC_TYPE_LIFT)   { printf("<#>"); }
-    if (p->type == MPC_TYPE_STATE)  { printf("<S>"); }
-    if (p->type == MPC_TYPE_ANCHOR) { printf("<@>"); }
-    if (p->type == MPC_TYPE_EXPECT) {
-        printf("%s", p->data.expect.m);
-        /*mpc_print_unretained(p->msg.expect.x, 0);*/
-    }
+        for (j = i+1; j < p->data.or.n
+                && !xs[j]->retained
+                && mpc_optimise_equal(head, mpc_optimise_head(xs[j])); j++);
 
-    if (p->type == MPC_TYPE_ANY) { printf("<.>"); }
-    if (p->type == MPC_TYPE_SATISFY) { printf("<f>"); }
+        if (j - i < 2) { continue; }
 
-    if (p->type == MPC_TYPE_SINGLE) {
-        buff[0] = p->data.single.x; buff[1] = '\0';
-        s = mpcf_escape_new(
-                buff,
-                mpc_escape_input_c,
-                mpc_escape_output_c);
-        printf("'%s'", s);
-        free(s);
+        /* Only sequences show the alternatives build asts */
+        for (k = i; k < j && !mpc_optimise_seq(xs[k]); k++);
+        if (k == j) { continue; }
+
+        o = mpc_undefined();
+        o->type = MPC_TYPE_OR;
+        o->data.or.n = j - i;
+        o->data.or.xs = malloc(sizeof(mpc_parser_t*) * (j - i));
+        for (k = i; k < j; k++) {
+            o->data.or.xs[k-i] = mpc_optimise_rest(xs[k], k == i);
+        }
+
+        mpc_optimise_unretained(o, 0, quiet, flags);
+        a = mpca_and(2, head, o);
+
+        xs[i] = a;
+        memmove(xs + i + 1, xs + j, (p->data.or.n - j) * sizeof(mpc_parser_t*));
+        p->data.or.n -= j - i - 1;
+
+        return 1;
     }
 
-    if (p->type == MPC_TYPE_RANGE) {
-        buff[0] = p->data.range.x; buff[1] = '\0';
-        s = mpcf_escape_new(
-                buff,
-                mpc_escape_input_c,
-                mpc_escape_output_c);
-        buff[0] = p->data.range.y; buff[1] = '\0';
-        e = mpcf_escape_new(
-                buff,
-                mpc_escape_input_c,
-                mpc_escape_output_c);
-        printf("[%s-%s]", s, e);
-        free(s);
-        free(e);
+    return 0;
+}
+
+static void mpc_optimise_unretained(mpc_parser_t *p, int force, int quiet, int flags) {
+
+    int i, n, m;
+    mpc_parser_t *t, **xs;
+
+    if (p->frozen) { return; }
+    if (p->retained && !force) { return; }
+
+    /* Regexes are optimised once when compiled and may be shared */
+    if (p->type == MPC_TYPE_REGEX) { return; }
+
+    /* Inline small rules */
+
+    if (!(flags & MPC_OPTIMISE_NO_INLINE)) {
+        n = mpc_optimise_children(p, &xs);
+        for (i = 0; i < n; i++) {
+            if (mpc_optimise_inlinable(xs[i])) { xs[i] = mpc_optimise_inline(xs[i]); }
+        }
     }
 
-    if (p->type == MPC_TYPE_ONEOF) {
-        s = mpcf_escape_new(
-                p->data.string.x,
-                mpc_escape_input_c,
-                mpc_escape_output_c);
-        printf("[%s]", s);
-        free(s);
+    /* Optimise Subexpressions */
+
+    if (p->type == MPC_TYPE_EXPECT)     { mpc_optimise_unretained(p->data.expect.x, 0, 1, flags); }
+    if (p->type == MPC_TYPE_APPLY)      { mpc_optimise_unretained(p->data.apply.x, 0, quiet, flags); }
+    if (p->type == MPC_TYPE_APPLY_TO)   { mpc_optimise_unretained(p->data.apply_to.x, 0, quiet, flags); }
+    if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0, quiet, flags); }
+    if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0, quiet, flags); }
+    if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0, quiet, flags); }
+    if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0, 1, flags); }
+    if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0, quiet, flags); }
+    if (p->type == MPC_TYPE_MANY)       { mpc_optimise_unretained(p->data.repeat.x, 0, quiet, flags); }
+    if (p->type == MPC_TYPE_MANY1)      { mpc_optimise_unretained(p->data.repeat.x, 0, quiet, flags); }
+    if (p->type == MPC_TYPE_COUNT)      { mpc_optimise_unretained(p->data.repeat.x, 0, quiet, flags); }
+
+    if (p->type == MPC_TYPE_OR) {
+        for(i = 0; i < p->data.or.n; i++) {
+            mpc_optimise_unretained(p->data.or.xs[i], 0, quiet, flags);
+        }
     }
 
-    if (p->type == MPC_TYPE_NONEOF) {
-        s = mpcf_escape_new(
-                p->data.string.x,
-                mpc_escape_input_c,
-                mpc_escape_output_c);
-        printf("[^%s]", s);
-        free(s);
+    if (p->type == MPC_TYPE_AND) {
+        for(i = 0; i < p->data.and.n; i++) {
+            mpc_optimise_unretained(p->data.and.xs[i], 0, quiet, flags);
+        }
     }
 
-    if (p->type == MPC_TYPE_STRING) {
-        s = mpcf_escape_new(
-                p->data.string.x,
-                mpc_escape_input_c,
-                mpc_escape_output_c);
-        printf("\"%s\"", s);
-        free(s);
+    if (p->type == MPC_TYPE_EXPR) {
+        for(i = 0; i <= p->data.expr.n; i++) {
+            mpc_optimise_unretained(p->data.expr.xs[i], 0, quiet, flags);
+        }
     }
 
-    if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
-    if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
-    if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+    /* Perform optimisations */
 
-    if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
-    if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
+    while (1) {
 
-    if (p->type == MPC_TYPE_MANY)  { mpc_print_unretained(p->data.repeat.x, 0); printf("*"); }
-    if (p->type == MPC_TYPE_MANY1) { mpc_print_unretained(p->data.repeat.x, 0); printf("+"); }
-    if (p->type == MPC_TYPE_COUNT) { mpc_print_unretained(p->data.repeat.x, 0); printf("{%i}", p->data.repeat.n); }
+        /* Merge rhs `or` */
+        if (p->type == MPC_TYPE_OR
+            &&  p->data.or.xs[p->data.or.n-1]->type == MPC_TYPE_OR
+            && !p->data.or.xs[p->data.or.n-1]->retained) {
+            t = p->data.or.xs[p->data.or.n-1];
+            n = p->data.or.n; m = t->data.or.n;
+            p->data.or.n = n + m - 1;
+            p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
+            memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
+            free(t->data.or.xs); free(t->name); free(t);
+            continue;
+        }
+
+        /* Merge lhs `or` */
+        if (p->type == MPC_TYPE_OR
+            &&  p->data.or.xs[0]->type == MPC_TYPE_OR
+            && !p->data.or.xs[0]->retained) {
+            t = p->data.or.xs[0];
+            n = p->data.or.n; m = t->data.or.n;
+            p->data.or.n = n + m - 1;
+            p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
+            memmove(p->data.or.xs + m, p->data.or.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
+            memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
+            free(t->data.or.xs); free(t->name); free(t);
+            continue;
+        }
+
+        /* Remove ast `pass` */
+        if (p->type == MPC_TYPE_AND
+            &&  p->data.and.n == 2
+            &&  p->data.and.xs[0]->type == MPC_TYPE_PASS
+            && !p->data.and.xs[0]->retained
+            &&  p->data.and.f == mpcf_fold_ast) {
+            t = p->data.and.xs[1];
+            mpc_delete(p->data.and.xs[0]);
+            free(p->data.and.xs); free(p->data.and.dxs); free(p->name);
+            memcpy(p, t, sizeof(mpc_parser_t));
+            free(t);
+            continue;
+        }
+
+        /* Merge ast lhs `and` */
+        if (p->type == MPC_TYPE_AND
+            &&  p->data.and.f == mpcf_fold_ast
+            &&  p->data.and.xs[0]->type == MPC_TYPE_AND
+            && !p->data.and.xs[0]->retained
+            &&  p->data.and.xs[0]->data.and.f == mpcf_fold_ast) {
+            t = p->data.and.xs[0];
+            n = p->data.and.n; m = t->data.and.n;
+            p->data.and.n = n + m - 1;
+            p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m - 1));
+            p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
+            memmove(p->data.and.xs + m, p->data.and.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
+            memmove(p->data.and.xs, t->data.and.xs, m * sizeof(mpc_parser_t*));
+            for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete; }
+            free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
+            continue;
+        }
+
+        /* Merge ast rhs `and` */
+        if (p->type == MPC_TYPE_AND
+            &&  p->data.and.f == mpcf_fold_ast
+            &&  p->data.and.xs[p->data.and.n-1]->type == MPC_TYPE_AND
+            && !p->data.and.xs[p->data.and.n-1]->retained
+            &&  p->data.and.xs[p->data.and.n-1]->data.and.f == mpcf_fold_ast) {
+            t = p->data.and.xs[p->data.and.n-1];
+            n = p->data.and.n; m = t->data.and.n;
+            p->data.and.n = n + m - 1;
+            p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m -1));
+            p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
+            memmove(p->data.and.xs + n - 1, t->data.and.xs, m * sizeof(mpc_parser_t*));
+            for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete; }
+            free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
+            continue;
+        }
+
+        /* Remove re `lift` */
+        if (p->type == MPC_TYPE_AND
+            &&  p->data.and.n == 2
+            &&  p->data.and.xs[0]->type == MPC_TYPE_LIFT
+            &&  p->data.and.xs[0]->data.lift.lf == mpcf_ctor_str
+            && !p->data.and.xs[0]->retained
+            &&  p->data.and.f == mpcf_strfold) {
+            t = p->data.and.xs[1];
+            mpc_delete(p->data.and.xs[0]);
+            free(p->data.and.xs); free(p->data.and.dxs); free(p->name);
+            memcpy(p, t, sizeof(mpc_parser_t));
+            free(t);
+            continue;
+        }
+
+        /* Merge re lhs `and` */
+        if (p->type == MPC_TYPE_AND
+            &&  p->data.and.f == mpcf_strfold
+            &&  p->data.and.xs[0]->type == MPC_TYPE_AND
+            && !p->data.and.xs[0]->retained
+            &&  p->data.and.xs[0]->data.and.f == mpcf_strfold) {
+            t = p->data.and.xs[0];
+            n = p->data.and.n; m = t->data.and.n;
+            p->data.and.n = n + m - 1;
+            p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m - 1));
+            p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
+            memmove(p->data.and.xs + m, p->data.and.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
+            memmove(p->data.and.xs, t->data.and.xs, m * sizeof(mpc_parser_t*));
+            for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = free; }
+            free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
+            continue;
+        }
+
+        /* Merge re rhs `and` */
+        if (p->type == MPC_TYPE_AND
+            &&  p->data.and.f == mpcf_strfold
+            &&  p->data.and.xs[p->data.and.n-1]->type == MPC_TYPE_AND
+            && !p->data.and.xs[p->data.and.n-1]->retained
+            &&  p->data.and.xs[p->data.and.n-1]->data.and.f == mpcf_strfold) {
+            t = p->data.and.xs[p->data.and.n-1];
+            n = p->data.and.n; m = t->data.and.n;
+            p->data.and.n = n + m - 1;
+            p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m -1));
+            p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
+            memmove(p->data.and.xs + n - 1, t->data.and.xs, m * sizeof(mpc_parser_t*));
+            for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = free; }
+            free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
+            continue;
+        }
+
+        /* Factor common prefixes out of ast `or` */
+        if (!(flags & MPC_OPTIMISE_NO_FACTOR)
+            &&  p->type == MPC_TYPE_OR
+            &&  mpc_optimise_factor(p, quiet, flags)) {
+            continue;
+        }
+
+        /* Remove `expect` where errors are suppressed */
+        if (!(flags & MPC_OPTIMISE_NO_FUSE)
+            &&  quiet
+            &&  p->type == MPC_TYPE_EXPECT
+            && !p->data.expect.x->retained) {
+            t = p->data.expect.x;
+            free(p->data.expect.m);
+            mpc_optimise_replace(p, t);
+            continue;
+        }
+
+        /* Fuse `single` runs in re `and` into `string` */
+        if (!(flags & MPC_OPTIMISE_NO_FUSE)
+            &&  p->type == MPC_TYPE_AND
+            &&  p->data.and.f == mpcf_strfold
+            &&  mpc_optimise_fuse_string(p)) {
+            if (p->data.and.n == 1) {
+                t = p->data.and.xs[0];
+                free(p->data.and.xs); free(p->data.and.dxs);
+                mpc_optimise_replace(p, t);
+            }
+            continue;
+        }
 
-    if (p->type == MPC_TYPE_OR) {
-        printf("(");
-        for(i = 0; i < p->data.or.n-1; i++) {
-            mpc_print_unretained(p->data.or.xs[i], 0);
-            printf(" | ");
+        /* Fuse character `or` into `oneof` */
+        if (!(flags & MPC_OPTIMISE_NO_FUSE)
+            &&  p->type == MPC_TYPE_OR
+            &&  mpc_optimise_fuse_oneof(p)) {
+            if (p->data.or.n == 1) {
+                t = p->data.or.xs[0];
+                free(p->data.or.xs);
+                mpc_optimise_replace(p, t);
+            }
+            continue;
         }
-        mpc_print_unretained(p->data.or.xs[p->data.or.n-1], 0);
-        printf(")");
-    }
 
-    if (p->type == MPC_TYPE_AND) {
-        printf("(");
-        for(i = 0; i < p->data.and.n-1; i++) {
-            mpc_print_unretained(p->data.and.xs[i], 0);
-            printf(" ");
+        /* Skip output of pure matchers */
+        if (!(flags & MPC_OPTIMISE_NO_FUSE)
+            &&  p->type == MPC_TYPE_APPLY
+            &&  p->data.apply.f == mpcf_free
+            &&  mpc_optimise_pure(p->data.apply.x)) {
+            p->type = MPC_TYPE_SKIP;
+            continue;
         }
-        mpc_print_unretained(p->data.and.xs[p->data.and.n-1], 0);
-        printf(")");
-    }
 
-    if (p->type == MPC_TYPE_CHECK) {
-        mpc_print_unretained(p->data.check.x, 0);
-        printf("->?");
-    }
-    if (p->type == MPC_TYPE_CHECK_WITH) {
-        mpc_print_unretained(p->data.check_with.x, 0);
-        printf("->?");
+        return;
+
     }
 
 }
 
-void mpc_print(mpc_parser_t *p) {
-    mpc_print_unretained(p, 1);
-    printf("\n");
+void mpc_optimise(mpc_parser_t *p) {
+    mpc_save_hash_forget();
+    mpc_optimise_unretained(p, 1, 0, MPC_OPTIMISE_DEFAULT);
 }
 
-/*
-** Testing
-*/
+void mpc_optimise_mode(mpc_parser_t *p, int flags) {
+    mpc_save_hash_forget();
+    mpc_optimise_unretained(p, 1, 0, flags);
+}
 
 /*
-** These functions are slightly unwieldy and
-** also the whole of the testing suite for mpc
-** mpc is pretty shaky.
+** Freezing
 **
-** It could do with a lot more tests and more
-** precision. Currently I am only really testing
-** changes off of the examples.
+** A frozen parser is a copy of everything reachable
+** from a parser placed in a single allocation. The
+** nodes come first, in the order a depth first walk
+** visits them, so a parser and the children it tries
+** first tend to share cache lines. The child arrays
+** follow, and the strings (names and error messages),
+** which are only touched on failure, go last along
+** with any regex automaton tables.
 **
+** Rules can refer to themselves so retained parsers
+** are looked up before being copied again. Unretained
+** parsers always have exactly one parent. The index
+** of each node is found through an open addressed
+** table keyed on its address, holding the index plus
+** one so that zero marks an empty slot.
 */
 
-int mpc_test_fail(mpc_parser_t *p, const char *s, const void *d,
-                  int(*tester)(const void*, const void*),
-                  mpc_dtor_t destructor,
-                  void(*printer)(const void*)) {
-    mpc_result_t r;
-    (void) printer;
-    if (mpc_parse("<test>", s, p, &r)) {
+typedef struct {
+    int nodes_num;
+    int nodes_max;
+    mpc_parser_t **nodes;
+    int slots;
+    int *index;
+    size_t ptrs_num;
+    size_t dtors_num;
+    size_t chars_num;
+    mpc_parser_t *arena;
+    mpc_parser_t **ptrs;
+    mpc_dtor_t *dtors;
+    char *chars;
+    int copied;
+} mpc_freeze_t;
 
-        if (tester(r.output, d)) {
-            destructor(r.output);
-            return 0;
-        } else {
-            destructor(r.output);
-            return 1;
-        }
+enum {
+    MPC_FREEZE_NODES_MIN = 32
+};
 
-    } else {
-        mpc_err_delete(r.error);
-        return 1;
-    }
+static void mpc_freeze_init(mpc_freeze_t *f) {
+    f->nodes_num = 0;
+    f->nodes_max = MPC_FREEZE_NODES_MIN;
+    f->nodes = malloc(sizeof(mpc_parser_t*) * f->nodes_max);
+    f->slots = MPC_FREEZE_NODES_MIN * 2;
+    f->index = calloc(f->slots, sizeof(int));
+    f->ptrs_num = 0;
+    f->dtors_num = 0;
+    f->chars_num = 0;
+    f->copied = 0;
+}
 
+static void mpc_freeze_free(mpc_freeze_t *f) {
+    free(f->nodes);
+    free(f->index);
 }
 
-int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
-                  int(*tester)(const void*, const void*),
-                  mpc_dtor_t destructor,
-                  void(*printer)(const void*)) {
+static int *mpc_freeze_slot(mpc_freeze_t *f, mpc_parser_t *p) {
+    unsigned long h = (unsigned long)(size_t)p;
+    int j = (int)(((h >> 4) * 2654435761UL) & (unsigned long)(f->slots-1));
+    while (f->index[j] && f->nodes[f->index[j]-1] != p) { j = (j+1) & (f->slots-1); }
+    return &f->index[j];
+}
 
-    mpc_result_t r;
-    if (mpc_parse("<test>", s, p, &r)) {
+/* The index of `p` if it is one of the first `n` nodes, or -1 */
+static int mpc_freeze_find(mpc_freeze_t *f, mpc_parser_t *p, int n) {
+    int i = *mpc_freeze_slot(f, p) - 1;
+    return i < n ? i : -1;
+}
 
-        if (tester(r.output, d)) {
-            destructor(r.output);
-            return 1;
-        } else {
-            printf("Got "); printer(r.output); printf("\n");
-            printf("Expected "); printer(d); printf("\n");
-            destructor(r.output);
-            return 0;
-        }
+static void mpc_freeze_add(mpc_freeze_t *f, mpc_parser_t *p) {
 
-    } else {
-        mpc_err_print(r.error);
-        mpc_err_delete(r.error);
-        return 0;
+    int j, *slot;
+
+    if (f->nodes_num == f->nodes_max) {
+        f->nodes_max = f->nodes_max * 2;
+        f->nodes = realloc(f->nodes, sizeof(mpc_parser_t*) * f->nodes_max);
+    }
 
+    /* Keep the table at most half full */
+    if ((f->nodes_num + 1) * 2 > f->slots) {
+        free(f->index);
+        f->slots *= 2;
+        f->index = calloc(f->slots, sizeof(int));
+        for (j = 0; j < f->nodes_num; j++) {
+            slot = mpc_freeze_slot(f, f->nodes[j]);
+            if (*slot == 0) { *slot = j + 1; }
+        }
     }
 
+    f->nodes[f->nodes_num++] = p;
+    slot = mpc_freeze_slot(f, p);
+    if (*slot == 0) { *slot = f->nodes_num; }
 }
 
+static size_t mpc_freeze_strlen(const char *s) {
+    return s ? strlen(s) + 1 : 0;
+}
 
-/*
-** AST
-*/
+/* Tags are the only `apply_to` whose data is known, a string */
+static int mpc_freeze_tag(mpc_parser_t *p) {
+    return p->type == MPC_TYPE_APPLY_TO
+        && (p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_tag
+        ||  p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_add_tag
+        ||  p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_add_root_tag);
+}
 
-void mpc_ast_delete(mpc_ast_t *a) {
+static void mpc_freeze_collect(mpc_freeze_t *f, mpc_parser_t *p) {
 
-    int i;
+    int i, n;
+    mpc_parser_t **xs;
 
-    if (a == NULL) { return; }
+    if (p->retained && mpc_freeze_find(f, p, f->nodes_num) >= 0) { return; }
 
-    for (i = 0; i < a->children_num; i++) {
-        mpc_ast_delete(a->children[i]);
+    mpc_freeze_add(f, p);
+    f->chars_num += mpc_freeze_strlen(p->name);
+
+    switch (p->type) {
+        case MPC_TYPE_FAIL:       f->chars_num += mpc_freeze_strlen(p->data.fail.m);       break;
+        case MPC_TYPE_ONEOF:
+        case MPC_TYPE_NONEOF:
+        case MPC_TYPE_STRING:     f->chars_num += mpc_freeze_strlen(p->data.string.x);     break;
+        case MPC_TYPE_EXPECT:     f->chars_num += mpc_freeze_strlen(p->data.expect.m);     break;
+        case MPC_TYPE_CHECK:      f->chars_num += mpc_freeze_strlen(p->data.check.e);      break;
+        case MPC_TYPE_CHECK_WITH: f->chars_num += mpc_freeze_strlen(p->data.check_with.e); break;
+        case MPC_TYPE_APPLY_TO:
+            if (mpc_freeze_tag(p)) { f->chars_num += mpc_freeze_strlen(p->data.apply_to.d); }
+            break;
+        case MPC_TYPE_REGEX:      f->chars_num += mpc_re_dfa_size(&p->data.regex);         break;
+        case MPC_TYPE_OR:         f->ptrs_num  += p->data.or.n;                            break;
+        case MPC_TYPE_AND:
+            f->ptrs_num  += p->data.and.n;
+            f->dtors_num += p->data.and.n-1;
+            break;
+        case MPC_TYPE_EXPR:
+            f->ptrs_num  += p->data.expr.n+1;
+            f->chars_num += p->data.expr.n;
+            break;
+        default: break;
     }
 
-    free(a->children);
-    free(a->tag);
-    free(a->contents);
-    free(a);
+    /* Regexes compiled from the same pattern share one parser */
+    if (p->type == MPC_TYPE_REGEX && p->data.regex.body
+    &&  mpc_freeze_find(f, p->data.regex.x, f->nodes_num) >= 0) { return; }
+
+    n = mpc_optimise_children(p, &xs);
+    for (i = 0; i < n; i++) { mpc_freeze_collect(f, xs[i]); }
 
 }
 
-static void mpc_ast_delete_no_children(mpc_ast_t *a) {
-    free(a->children);
-    free(a->tag);
-    free(a->contents);
-    free(a);
+static char *mpc_freeze_string(mpc_freeze_t *f, const char *s) {
+    char *x;
+    if (s == NULL) { return NULL; }
+    x = f->chars;
+    strcpy(x, s);
+    f->chars += strlen(s) + 1;
+    return x;
 }
 
-mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+static mpc_parser_t *mpc_freeze_copy(mpc_freeze_t *f, mpc_parser_t *p) {
 
-    mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+    int i, n;
+    mpc_parser_t *q, **xs;
 
-    a->tag = malloc(strlen(tag) + 1);
-    strcpy(a->tag, tag);
+    /* Visited in the same order as collected */
+    if (p->retained) {
+        i = mpc_freeze_find(f, p, f->copied);
+        if (i >= 0) { return f->arena + i; }
+    }
 
-    a->contents = malloc(strlen(contents) + 1);
-    strcpy(a->contents, contents);
+    q = f->arena + f->copied++;
+    q->type = p->type;
+    q->retained = p->retained;
+    q->frozen = 1;
+    q->data = p->data;
+    q->name = mpc_freeze_string(f, p->name);
 
-    a->state = mpc_state_new();
+    switch (p->type) {
 
-    a->children_num = 0;
-    a->children = NULL;
-    return a;
+        case MPC_TYPE_FAIL: q->data.fail.m = mpc_freeze_string(f, p->data.fail.m); break;
 
-}
+        case MPC_TYPE_ONEOF:
+        case MPC_TYPE_NONEOF:
+        case MPC_TYPE_STRING:
+            q->data.string.x = mpc_freeze_string(f, p->data.string.x);
+            break;
 
-mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
+        case MPC_TYPE_EXPECT:     q->data.expect.m = mpc_freeze_string(f, p->data.expect.m);         break;
+        case MPC_TYPE_CHECK:      q->data.check.e = mpc_freeze_string(f, p->data.check.e);           break;
+        case MPC_TYPE_CHECK_WITH: q->data.check_with.e = mpc_freeze_string(f, p->data.check_with.e); break;
 
-    mpc_ast_t *a = mpc_ast_new(tag, "");
+        case MPC_TYPE_APPLY_TO:
+            if (mpc_freeze_tag(p)) { q->data.apply_to.d = mpc_freeze_string(f, p->data.apply_to.d); }
+            break;
 
-    int i;
-    va_list va;
-    va_start(va, tag);
+        case MPC_TYPE_REGEX:
+            q->data.regex.body = NULL;
+            q->data.regex.t = (unsigned char*)f->chars;
+            f->chars += mpc_re_dfa_size(&p->data.regex);
+            memcpy(q->data.regex.t, p->data.regex.t, mpc_re_dfa_size(&p->data.regex));
+            break;
 
-    for (i = 0; i < n; i++) {
-        mpc_ast_add_child(a, va_arg(va, mpc_ast_t*));
+        case MPC_TYPE_OR:
+            q->data.or.xs = f->ptrs;
+            f->ptrs += p->data.or.n;
+            memcpy(q->data.or.xs, p->data.or.xs, sizeof(mpc_parser_t*) * p->data.or.n);
+            break;
+
+        case MPC_TYPE_AND:
+            q->data.and.xs = f->ptrs;
+            f->ptrs += p->data.and.n;
+            memcpy(q->data.and.xs, p->data.and.xs, sizeof(mpc_parser_t*) * p->data.and.n);
+            q->data.and.dxs = f->dtors;
+            f->dtors += p->data.and.n-1;
+            memcpy(q->data.and.dxs, p->data.and.dxs, sizeof(mpc_dtor_t) * (p->data.and.n-1));
+            break;
+
+        case MPC_TYPE_EXPR:
+            q->data.expr.xs = f->ptrs;
+            f->ptrs += p->data.expr.n+1;
+            memcpy(q->data.expr.xs, p->data.expr.xs, sizeof(mpc_parser_t*) * (p->data.expr.n+1));
+            q->data.expr.ps = (unsigned char*)f->chars;
+            f->chars += p->data.expr.n;
+            memcpy(q->data.expr.ps, p->data.expr.ps, p->data.expr.n);
+            break;
+
+        default: break;
     }
 
-    va_end(va);
+    if (p->type == MPC_TYPE_REGEX && p->data.regex.body) {
+        i = mpc_freeze_find(f, p->data.regex.x, f->copied);
+        if (i >= 0) { q->data.regex.x = f->arena + i; return q; }
+    }
 
-    return a;
+    n = mpc_optimise_children(q, &xs);
+    for (i = 0; i < n; i++) { xs[i] = mpc_freeze_copy(f, xs[i]); }
+
+    return q;
 
 }
 
-mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
+static void mpc_freeze_block(mpc_freeze_t *f) {
 
-    mpc_ast_t *r;
+    char *block = malloc(
+        sizeof(mpc_parser_t)  * f->nodes_num +
+        sizeof(mpc_parser_t*) * f->ptrs_num  +
+        sizeof(mpc_dtor_t)    * f->dtors_num +
+        f->chars_num);
 
-    if (a == NULL) { return a; }
-    if (a->children_num == 0) { return a; }
-    if (a->children_num == 1) { return a; }
+    f->arena = (mpc_parser_t*)block;
+    f->ptrs  = (mpc_parser_t**)(f->arena + f->nodes_num);
+    f->dtors = (mpc_dtor_t*)(f->ptrs + f->ptrs_num);
+    f->chars = (char*)(f->dtors + f->dtors_num);
 
-    r = mpc_ast_new(">", "");
-    mpc_ast_add_child(r, a);
-    return r;
 }
 
-int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
+mpc_parser_t *mpc_freeze(mpc_parser_t *p) {
 
-    int i;
+    mpc_freeze_t f;
 
-    if (strcmp(a->tag, b->tag) != 0) { return 0; }
-    if (strcmp(a->contents, b->contents) != 0) { return 0; }
-    if (a->children_num != b->children_num) { return 0; }
+    mpc_freeze_init(&f);
+    mpc_freeze_collect(&f, p);
+    mpc_freeze_block(&f);
+    mpc_freeze_copy(&f, p);
+    mpc_freeze_free(&f);
+    return f.arena;
 
-    for (i = 0; i < a->children_num; i++) {
-        if (!mpc_ast_eq(a->children[i], b->children[i])) { return 0; }
-    }
+}
 
-    return 1;
+
+/*
+** Saving and Loading
+**
+** A parser is saved as a list of nodes in the same
+** order `mpc_freeze` lays them out, so loading just
+** fills in a frozen block. Children are written as
+** node indices and functions as their position in
+** the table below. Only the functions mpc itself
+** uses can be saved, so new entries must always be
+** added to the end of the table.
+*/
+
+typedef void(*mpc_func_t)(void);
+
+/*
+** Each function also has the name generated code
+** calls it by. Functions private to mpc have a copy
+** of the same name in the generated code, or no
+** name if they can't appear in a grammar.
+*/
+
+typedef struct {
+    mpc_func_t f;
+    const char *name;
+} mpc_func_entry_t;
+
+static const mpc_func_entry_t mpc_save_funcs[] = {
+    { NULL, NULL },
+    { (mpc_func_t)free,                        "free" },
+    { (mpc_func_t)mpcf_dtor_null,              "mpcf_dtor_null" },
+    { (mpc_func_t)mpc_soft_delete,             NULL },
+    { (mpc_func_t)mpc_ast_delete,              "mpc_ast_delete" },
+    { (mpc_func_t)mpcf_ctor_null,              "mpcf_ctor_null" },
+    { (mpc_func_t)mpcf_ctor_str,               "mpcf_ctor_str" },
+    { (mpc_func_t)mpcf_free,                   "mpcf_free" },
+    { (mpc_func_t)mpcf_int,                    "mpcf_int" },
+    { (mpc_func_t)mpcf_hex,                    "mpcf_hex" },
+    { (mpc_func_t)mpcf_oct,                    "mpcf_oct" },
+    { (mpc_func_t)mpcf_float,                  "mpcf_float" },
+    { (mpc_func_t)mpcf_strtriml,               "mpcf_strtriml" },
+    { (mpc_func_t)mpcf_strtrimr,               "mpcf_strtrimr" },
+    { (mpc_func_t)mpcf_strtrim,                "mpcf_strtrim" },
+    { (mpc_func_t)mpcf_escape,                 "mpcf_escape" },
+    { (mpc_func_t)mpcf_escape_regex,           "mpcf_escape_regex" },
+    { (mpc_func_t)mpcf_escape_string_raw,      "mpcf_escape_string_raw" },
+    { (mpc_func_t)mpcf_escape_char_raw,        "mpcf_escape_char_raw" },
+    { (mpc_func_t)mpcf_unescape,               "mpcf_unescape" },
+    { (mpc_func_t)mpcf_unescape_regex,         "mpcf_unescape_regex" },
+    { (mpc_func_t)mpcf_unescape_string_raw,    "mpcf_unescape_string_raw" },
+    { (mpc_func_t)mpcf_unescape_char_raw,      "mpcf_unescape_char_raw" },
+    { (mpc_func_t)mpcf_null,                   "mpcf_null" },
+    { (mpc_func_t)mpcf_fst,                    "mpcf_fst" },
+    { (mpc_func_t)mpcf_snd,                    "mpcf_snd" },
+    { (mpc_func_t)mpcf_trd,                    "mpcf_trd" },
+    { (mpc_func_t)mpcf_fst_free,               "mpcf_fst_free" },
+    { (mpc_func_t)mpcf_snd_free,               "mpcf_snd_free" },
+    { (mpc_func_t)mpcf_trd_free,               "mpcf_trd_free" },
+    { (mpc_func_t)mpcf_all_free,               "mpcf_all_free" },
+    { (mpc_func_t)mpcf_strfold,                "mpcf_strfold" },
+    { (mpc_func_t)mpcf_str_ast,                "mpcf_str_ast" },
+    { (mpc_func_t)mpcf_state_ast,              "mpcf_state_ast" },
+    { (mpc_func_t)mpcf_fold_ast,               "mpcf_fold_ast" },
+    { (mpc_func_t)mpcf_fold_ast_rest,          "mpcg_fold_ast_rest" },
+    { (mpc_func_t)mpc_ast_add_root,            "mpc_ast_add_root" },
+    { (mpc_func_t)mpc_ast_tag,                 "mpc_ast_tag" },
+    { (mpc_func_t)mpc_ast_add_tag,             "mpc_ast_add_tag" },
+    { (mpc_func_t)mpc_ast_add_root_tag,        "mpc_ast_add_root_tag" },
+    { (mpc_func_t)mpc_boundary_anchor,         "mpcg_boundary_anchor" },
+    { (mpc_func_t)mpc_boundary_newline_anchor, "mpcg_boundary_newline_anchor" },
+    { (mpc_func_t)mpcf_fold_ast_expr,          "mpcg_fold_ast_expr" }
+};
+
+enum {
+    MPC_SAVE_FUNCS_NUM = sizeof(mpc_save_funcs) / sizeof(mpc_func_entry_t),
+    MPC_SAVE_VERSION   = 2
+};
+
+static const char mpc_save_magic[4] = { 'm', 'p', 'c', MPC_SAVE_VERSION };
+
+typedef struct {
+    FILE *f;
+    mpc_freeze_t nodes;
+    int error;
+    unsigned long hash;
+} mpc_save_t;
+
+static void mpc_save_byte(mpc_save_t *s, int x) {
+    s->hash = ((s->hash ^ (unsigned long)(x & 0xFF)) * 16777619UL) & 0xFFFFFFFFUL;
+    if (s->f) { fputc(x & 0xFF, s->f); }
 }
 
-mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
-    r->children_num++;
-    r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
-    r->children[r->children_num-1] = a;
-    return r;
+static void mpc_save_int(mpc_save_t *s, unsigned long x) {
+    mpc_save_byte(s, (int)(x >>  0));
+    mpc_save_byte(s, (int)(x >>  8));
+    mpc_save_byte(s, (int)(x >> 16));
+    mpc_save_byte(s, (int)(x >> 24));
 }
 
-mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
-    if (a == NULL) { return a; }
-    a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
-    memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
-    memmove(a->tag, t, strlen(t));
-    memmove(a->tag + strlen(t), "|", 1);
-    return a;
+static void mpc_save_string(mpc_save_t *s, const char *x) {
+    const char *c;
+    if (x == NULL) { mpc_save_int(s, 0); return; }
+    mpc_save_int(s, strlen(x) + 1);
+    for (c = x; *c; c++) { s->hash = ((s->hash ^ (unsigned char)*c) * 16777619UL) & 0xFFFFFFFFUL; }
+    if (s->f) { fwrite(x, 1, strlen(x), s->f); }
+}
+
+static void mpc_save_func(mpc_save_t *s, mpc_func_t x) {
+    int i;
+    for (i = 0; i < MPC_SAVE_FUNCS_NUM; i++) {
+        if (mpc_save_funcs[i].f == x) { mpc_save_int(s, i); return; }
+    }
+    s->error = 1;
+}
+
+static void mpc_save_node(mpc_save_t *s, mpc_parser_t *x) {
+    mpc_save_int(s, mpc_freeze_find(&s->nodes, x, s->nodes.nodes_num));
 }
 
-mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
-    if (a == NULL) { return a; }
-    a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
-    memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
-    memmove(a->tag, t, (strlen(t)-1));
-    return a;
-}
+static void mpc_save_parser(mpc_save_t *s, mpc_parser_t *p) {
+
+    int i;
+
+    mpc_save_byte(s, p->type);
+    mpc_save_byte(s, p->retained);
+    mpc_save_string(s, p->name);
+
+    switch (p->type) {
+
+        case MPC_TYPE_FAIL: mpc_save_string(s, p->data.fail.m); break;
+
+        case MPC_TYPE_LIFT: mpc_save_func(s, (mpc_func_t)p->data.lift.lf); break;
+        case MPC_TYPE_LIFT_VAL: if (p->data.lift.x) { s->error = 1; } break;
+
+        case MPC_TYPE_EXPECT:
+            mpc_save_node(s, p->data.expect.x);
+            mpc_save_string(s, p->data.expect.m);
+            break;
+
+        case MPC_TYPE_ANCHOR:  mpc_save_func(s, (mpc_func_t)p->data.anchor.f); break;
+        case MPC_TYPE_SATISFY: mpc_save_func(s, (mpc_func_t)p->data.satisfy.f); break;
+
+        case MPC_TYPE_SINGLE:
+        case MPC_TYPE_TOKEN: mpc_save_byte(s, p->data.single.x); break;
+        case MPC_TYPE_RANGE:
+            mpc_save_byte(s, p->data.range.x);
+            mpc_save_byte(s, p->data.range.y);
+            break;
+
+        case MPC_TYPE_ONEOF:
+        case MPC_TYPE_NONEOF:
+        case MPC_TYPE_STRING:
+            mpc_save_string(s, p->data.string.x);
+            break;
+
+        case MPC_TYPE_APPLY:
+        case MPC_TYPE_SKIP:
+            mpc_save_node(s, p->data.apply.x);
+            mpc_save_func(s, (mpc_func_t)p->data.apply.f);
+            break;
+
+        /* Only tags, whose data is a string, can be saved */
+        case MPC_TYPE_APPLY_TO:
+            if (!mpc_freeze_tag(p)) {
+                s->error = 1;
+                break;
+            }
+            mpc_save_node(s, p->data.apply_to.x);
+            mpc_save_func(s, (mpc_func_t)p->data.apply_to.f);
+            mpc_save_string(s, p->data.apply_to.d);
+            mpc_save_int(s, p->data.apply_to.id);
+            break;
+
+        case MPC_TYPE_PREDICT: mpc_save_node(s, p->data.predict.x); break;
+
+        case MPC_TYPE_REGEX:
+            mpc_save_node(s, p->data.regex.x);
+            mpc_save_int(s, p->data.regex.states);
+            mpc_save_int(s, p->data.regex.classes);
+            mpc_save_int(s, p->data.regex.flags);
+            mpc_save_int(s, p->data.regex.depth);
+            if (s->f) { fwrite(p->data.regex.t, 1, mpc_re_dfa_size(&p->data.regex), s->f); }
+            break;
+
+        case MPC_TYPE_NOT:
+        case MPC_TYPE_MAYBE:
+            mpc_save_node(s, p->data.not.x);
+            mpc_save_func(s, (mpc_func_t)p->data.not.dx);
+            mpc_save_func(s, (mpc_func_t)p->data.not.lf);
+            break;
+
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+        case MPC_TYPE_COUNT:
+            mpc_save_int(s, p->data.repeat.n);
+            mpc_save_func(s, (mpc_func_t)p->data.repeat.f);
+            mpc_save_node(s, p->data.repeat.x);
+            mpc_save_func(s, (mpc_func_t)p->data.repeat.dx);
+            break;
+
+        case MPC_TYPE_OR:
+            mpc_save_int(s, p->data.or.n);
+            for (i = 0; i < p->data.or.n; i++) { mpc_save_node(s, p->data.or.xs[i]); }
+            break;
+
+        case MPC_TYPE_AND:
+            mpc_save_int(s, p->data.and.n);
+            mpc_save_func(s, (mpc_func_t)p->data.and.f);
+            for (i = 0; i < p->data.and.n;   i++) { mpc_save_node(s, p->data.and.xs[i]); }
+            for (i = 0; i < p->data.and.n-1; i++) { mpc_save_func(s, (mpc_func_t)p->data.and.dxs[i]); }
+            break;
 
-mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
-    a->tag = realloc(a->tag, strlen(t) + 1);
-    strcpy(a->tag, t);
-    return a;
-}
+        case MPC_TYPE_EXPR:
+            mpc_save_int(s, p->data.expr.n);
+            mpc_save_func(s, (mpc_func_t)p->data.expr.f);
+            mpc_save_func(s, (mpc_func_t)p->data.expr.dx);
+            for (i = 0; i <= p->data.expr.n; i++) { mpc_save_node(s, p->data.expr.xs[i]); }
+            if (s->f) { fwrite(p->data.expr.ps, 1, p->data.expr.n, s->f); }
+            break;
+
+        /* Check functions are always user defined */
+        case MPC_TYPE_CHECK:
+        case MPC_TYPE_CHECK_WITH:
+            s->error = 1;
+            break;
+
+        default: break;
+    }
 
-mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
-    if (a == NULL) { return a; }
-    a->state = s;
-    return a;
 }
 
-static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
+/* Goes through everything without a file, to check it can be saved */
+static void mpc_save_check(mpc_save_t *s, mpc_parser_t *p) {
 
     int i;
 
-    if (a == NULL) {
-        fprintf(fp, "NULL\n");
-        return;
-    }
+    s->f = NULL;
+    s->error = 0;
+    s->hash = 2166136261UL;
 
-    for (i = 0; i < d; i++) { fprintf(fp, "  "); }
+    mpc_freeze_init(&s->nodes);
+    mpc_freeze_collect(&s->nodes, p);
 
-    if (strlen(a->contents)) {
-        fprintf(fp, "%s:%lu:%lu '%s'\n", a->tag,
-                (long unsigned int)(a->state.row+1),
-                (long unsigned int)(a->state.col+1),
-                a->contents);
-    } else {
-        fprintf(fp, "%s \n", a->tag);
+    for (i = 0; i < s->nodes.nodes_num; i++) {
+        mpc_save_parser(s, s->nodes.nodes[i]);
     }
+}
 
-    for (i = 0; i < a->children_num; i++) {
-        mpc_ast_print_depth(a->children[i], d+1, fp);
+/*
+** Hashing a grammar means going over all of it, so
+** the last few hashes are kept by parser. Anything
+** which changes a parser in place moves on the
+** generation, which makes every kept hash stale, as
+** a change to one rule changes all those using it.
+*/
+
+enum { MPC_SAVE_HASHES = 16 };
+
+typedef struct {
+    mpc_parser_t *p;
+    unsigned long gen;
+    unsigned long hash;
+    int ok;
+} mpc_save_hash_t;
+
+static mpc_lock_t mpc_save_hash_lock = MPC_LOCK_INIT;
+static mpc_save_hash_t mpc_save_hashes[MPC_SAVE_HASHES];
+static unsigned long mpc_save_hash_gen = 1;
+
+static void mpc_save_hash_forget(void) {
+    mpc_lock(&mpc_save_hash_lock);
+    mpc_save_hash_gen++;
+    mpc_unlock(&mpc_save_hash_lock);
+}
+
+/* A hash of what would be saved, if the parser can be */
+static int mpc_save_hash(mpc_parser_t *p, unsigned long *hash) {
+
+    mpc_save_t s;
+    mpc_save_hash_t *h = &mpc_save_hashes[((size_t)p / sizeof(mpc_parser_t)) % MPC_SAVE_HASHES];
+    unsigned long gen;
+
+    mpc_lock(&mpc_save_hash_lock);
+    gen = mpc_save_hash_gen;
+    if (h->p == p && h->gen == gen) {
+        *hash = h->hash;
+        mpc_unlock(&mpc_save_hash_lock);
+        return h->ok;
     }
+    mpc_unlock(&mpc_save_hash_lock);
 
-}
+    mpc_save_check(&s, p);
+    mpc_freeze_free(&s.nodes);
+    *hash = s.hash;
 
-void mpc_ast_print(mpc_ast_t *a) {
-    mpc_ast_print_depth(a, 0, stdout);
-}
+    mpc_lock(&mpc_save_hash_lock);
+    h->p = p;
+    h->gen = gen;
+    h->hash = s.hash;
+    h->ok = !s.error;
+    mpc_unlock(&mpc_save_hash_lock);
 
-void mpc_ast_print_to(mpc_ast_t *a, FILE *fp) {
-    mpc_ast_print_depth(a, 0, fp);
+    return !s.error;
 }
 
-int mpc_ast_get_index(mpc_ast_t *ast, const char *tag) {
-    return mpc_ast_get_index_lb(ast, tag, 0);
-}
+int mpc_save(mpc_parser_t *p, FILE *f) {
 
-int mpc_ast_get_index_lb(mpc_ast_t *ast, const char *tag, int lb) {
     int i;
+    mpc_save_t s;
 
-    for(i=lb; i<ast->children_num; i++) {
-        if(strcmp(ast->children[i]->tag, tag) == 0) {
-            return i;
-        }
+    /* Check everything can be saved before writing anything */
+    mpc_save_check(&s, p);
+
+    if (s.error) {
+        mpc_freeze_free(&s.nodes);
+        return 0;
     }
 
-    return -1;
-}
+    s.f = f;
+    fwrite(mpc_save_magic, 1, sizeof(mpc_save_magic), f);
+    mpc_save_int(&s, s.nodes.nodes_num);
+    mpc_save_int(&s, s.nodes.ptrs_num);
+    mpc_save_int(&s, s.nodes.dtors_num);
+    mpc_save_int(&s, s.nodes.chars_num);
+
+    for (i = 0; i < s.nodes.nodes_num; i++) {
+        mpc_save_parser(&s, s.nodes.nodes[i]);
+    }
+
+    mpc_freeze_free(&s.nodes);
+    return !ferror(f);
 
-mpc_ast_t *mpc_ast_get_child(mpc_ast_t *ast, const char *tag) {
-    return mpc_ast_get_child_lb(ast, tag, 0);
 }
 
-mpc_ast_t *mpc_ast_get_child_lb(mpc_ast_t *ast, const char *tag, int lb) {
-    int i;
+/*
+** Loading checks every count, index and function
+** against what the header promised so a damaged
+** file is rejected rather than parsed with.
+*/
 
-    for(i=lb; i<ast->children_num; i++) {
-        if(strcmp(ast->children[i]->tag, tag) == 0) {
-            return ast->children[i];
-        }
-    }
+typedef struct {
+    FILE *f;
+    mpc_freeze_t nodes;
+    char *chars_end;
+    int error;
+} mpc_load_t;
+
+static int mpc_load_byte(mpc_load_t *l) {
+    int c = fgetc(l->f);
+    if (c == EOF) { l->error = 1; return 0; }
+    return c;
+}
+
+static unsigned long mpc_load_int(mpc_load_t *l) {
+    unsigned long x = 0;
+    x |= (unsigned long)mpc_load_byte(l) <<  0;
+    x |= (unsigned long)mpc_load_byte(l) <<  8;
+    x |= (unsigned long)mpc_load_byte(l) << 16;
+    x |= (unsigned long)mpc_load_byte(l) << 24;
+    return x;
+}
 
-    return NULL;
+/* A tag ID of -1 was saved as all four bytes set */
+static int mpc_load_tag_id(mpc_load_t *l) {
+    unsigned long x = mpc_load_int(l);
+    if (x == 0xFFFFFFFFUL) { return -1; }
+    if (x > MPC_TAG_MAX) { l->error = 1; return 0; }
+    return (int)x;
 }
 
-mpc_ast_trav_t *mpc_ast_traverse_start(mpc_ast_t *ast,
-                                       mpc_ast_trav_order_t order)
-{
-    mpc_ast_trav_t *trav, *n_trav;
-    mpc_ast_t *cnode = ast;
+static char *mpc_load_string(mpc_load_t *l) {
+    char *x;
+    unsigned long n = mpc_load_int(l);
+    if (l->error || n == 0) { return NULL; }
+    if (n > (unsigned long)(l->chars_end - l->nodes.chars)) { l->error = 1; return NULL; }
+    x = l->nodes.chars;
+    if (fread(x, 1, n-1, l->f) != n-1) { l->error = 1; return NULL; }
+    x[n-1] = '\0';
+    l->nodes.chars += n;
+    return x;
+}
 
-    /* Create the traversal structure */
-    trav = malloc(sizeof(mpc_ast_trav_t));
-    trav->curr_node = cnode;
-    trav->parent = NULL;
-    trav->curr_child = 0;
-    trav->order = order;
+static mpc_func_t mpc_load_func(mpc_load_t *l) {
+    unsigned long i = mpc_load_int(l);
+    if (i >= MPC_SAVE_FUNCS_NUM) { l->error = 1; return NULL; }
+    return mpc_save_funcs[i].f;
+}
 
-    /* Get start node */
-    switch(order) {
-        case mpc_ast_trav_order_pre:
-            /* Nothing else is needed for pre order start */
-            break;
+static mpc_parser_t *mpc_load_node(mpc_load_t *l) {
+    unsigned long i = mpc_load_int(l);
+    if (i >= (unsigned long)l->nodes.nodes_num) { l->error = 1; return l->nodes.arena; }
+    return l->nodes.arena + i;
+}
 
-        case mpc_ast_trav_order_post:
-            while(cnode->children_num > 0) {
-                cnode = cnode->children[0];
+static unsigned char *mpc_load_regex(mpc_load_t *l, mpc_pdata_regex_t *d) {
 
-                n_trav = malloc(sizeof(mpc_ast_trav_t));
-                n_trav->curr_node = cnode;
-                n_trav->parent = trav;
-                n_trav->curr_child = 0;
-                n_trav->order = order;
+    size_t j, n;
+    unsigned char *t;
 
-                trav = n_trav;
-            }
+    if (l->error
+    ||  (d->states != 0 && (d->states < 2 || d->states > 255))
+    ||  (d->states != 0 && (d->classes < 1 || d->classes > 256))
+    ||  (d->states == 0 && d->classes != 0)
+    ||  d->flags < 0 || d->flags > 31 || d->depth < 1) { l->error = 1; return NULL; }
 
-            break;
+    n = mpc_re_dfa_size(d);
+    if (n > (size_t)(l->chars_end - l->nodes.chars)) { l->error = 1; return NULL; }
+    t = (unsigned char*)l->nodes.chars;
+    if (fread(t, 1, n, l->f) != n) { l->error = 1; return NULL; }
+    l->nodes.chars += n;
 
-        default:
-            /* Unreachable, but compiler complaints */
-            break;
-    }
+    if (d->states == 0) { return t; }
 
-    return trav;
+    for (j = 32; j < 32 + 256; j++) {
+        if (t[j] >= d->classes) { l->error = 1; return NULL; }
+    }
+    for (j = 32 + 256 + d->states; j < n; j++) {
+        if (t[j] >= d->states) { l->error = 1; return NULL; }
+    }
+    return t;
 }
 
-mpc_ast_t *mpc_ast_traverse_next(mpc_ast_trav_t **trav) {
-    mpc_ast_trav_t *n_trav, *to_free;
-    mpc_ast_t *ret = NULL;
-    int cchild;
+static int mpc_load_children(mpc_load_t *l, size_t n, size_t *used, size_t max) {
+    if (n == 0 || n > max - *used) { l->error = 1; return 0; }
+    *used += n;
+    return 1;
+}
 
-    /* The end of traversal was reached */
-    if(*trav == NULL) return NULL;
+static void mpc_load_parser(mpc_load_t *l, mpc_parser_t *p, size_t *ptrs, size_t *dtors) {
 
-    switch((*trav)->order) {
-        case mpc_ast_trav_order_pre:
-            ret = (*trav)->curr_node;
+    int i;
 
-            /* If there aren't any more children, go up */
-            while(*trav != NULL &&
-                  (*trav)->curr_child >= (*trav)->curr_node->children_num)
-            {
-                to_free = *trav;
-                *trav = (*trav)->parent;
-                free(to_free);
-            }
+    p->type = mpc_load_byte(l);
+    p->retained = mpc_load_byte(l);
+    p->frozen = 1;
+    p->name = mpc_load_string(l);
 
-            /* If trav is NULL, the end was reached */
-            if(*trav == NULL) {
-                break;
-            }
+    switch (p->type) {
 
-            /* Go to next child */
-            n_trav = malloc(sizeof(mpc_ast_trav_t));
+        case MPC_TYPE_UNDEFINED:
+        case MPC_TYPE_PASS:
+        case MPC_TYPE_STATE:
+        case MPC_TYPE_ANY:
+        case MPC_TYPE_SOI:
+        case MPC_TYPE_EOI:
+        case MPC_TYPE_CUT:
+            break;
 
-            cchild = (*trav)->curr_child;
-            n_trav->curr_node = (*trav)->curr_node->children[cchild];
-            n_trav->parent = *trav;
-            n_trav->curr_child = 0;
-            n_trav->order = (*trav)->order;
+        case MPC_TYPE_FAIL: p->data.fail.m = mpc_load_string(l); break;
 
-            (*trav)->curr_child++;
-            *trav = n_trav;
+        case MPC_TYPE_LIFT: p->data.lift.lf = (mpc_ctor_t)mpc_load_func(l); break;
+        case MPC_TYPE_LIFT_VAL: p->data.lift.x = NULL; break;
 
+        case MPC_TYPE_EXPECT:
+            p->data.expect.x = mpc_load_node(l);
+            p->data.expect.m = mpc_load_string(l);
             break;
 
-        case mpc_ast_trav_order_post:
-            ret = (*trav)->curr_node;
-
-            /* Move up tree to the parent If the parent doesn't have any more nodes,
-             * then this is the current node. If it does, move down to its left most
-             * child. Also, free the previous traversal node */
-            to_free = *trav;
-            *trav = (*trav)->parent;
-            free(to_free);
-
-            if(*trav == NULL)
-                break;
+        case MPC_TYPE_ANCHOR:  p->data.anchor.f = (int(*)(char,char))mpc_load_func(l); break;
+        case MPC_TYPE_SATISFY: p->data.satisfy.f = (int(*)(char))mpc_load_func(l);    break;
 
-            /* Next child */
-            (*trav)->curr_child++;
+        case MPC_TYPE_SINGLE:
+        case MPC_TYPE_TOKEN: p->data.single.x = (char)mpc_load_byte(l); break;
+        case MPC_TYPE_RANGE:
+            p->data.range.x = (char)mpc_load_byte(l);
+            p->data.range.y = (char)mpc_load_byte(l);
+            break;
 
-            /* If there aren't any more children, this is the next node */
-            if((*trav)->curr_child >= (*trav)->curr_node->children_num) {
-                break;
-            }
+        case MPC_TYPE_ONEOF:
+        case MPC_TYPE_NONEOF:
+        case MPC_TYPE_STRING:
+            p->data.string.x = mpc_load_string(l);
+            if (p->data.string.x == NULL) { l->error = 1; }
+            break;
 
-            /* If there are still more children, find the leftmost child from this
-             * node */
-            while((*trav)->curr_node->children_num > 0) {
-                n_trav = malloc(sizeof(mpc_ast_trav_t));
+        case MPC_TYPE_APPLY:
+        case MPC_TYPE_SKIP:
+            p->data.apply.x = mpc_load_node(l);
+            p->data.apply.f = (mpc_apply_t)mpc_load_func(l);
+            break;
 
-                cchild = (*trav)->curr_child;
-                n_trav->curr_node = (*trav)->curr_node->children[cchild];
-                n_trav->parent = *trav;
-                n_trav->curr_child = 0;
-                n_trav->order = (*trav)->order;
+        case MPC_TYPE_APPLY_TO:
+            p->data.apply_to.x = mpc_load_node(l);
+            p->data.apply_to.f = (mpc_apply_to_t)mpc_load_func(l);
+            p->data.apply_to.d = mpc_load_string(l);
+            p->data.apply_to.id = mpc_load_tag_id(l);
+            break;
 
-                *trav = n_trav;
-            }
+        case MPC_TYPE_PREDICT: p->data.predict.x = mpc_load_node(l); break;
 
-        default:
-            /* Unreachable, but compiler complaints */
+        case MPC_TYPE_REGEX:
+            p->data.regex.body = NULL;
+            p->data.regex.x = mpc_load_node(l);
+            p->data.regex.states = (int)mpc_load_int(l);
+            p->data.regex.classes = (int)mpc_load_int(l);
+            p->data.regex.flags = (int)mpc_load_int(l);
+            p->data.regex.depth = (int)mpc_load_int(l);
+            p->data.regex.t = mpc_load_regex(l, &p->data.regex);
             break;
-    }
 
-    return ret;
-}
+        case MPC_TYPE_NOT:
+        case MPC_TYPE_MAYBE:
+            p->data.not.x = mpc_load_node(l);
+            p->data.not.dx = (mpc_dtor_t)mpc_load_func(l);
+            p->data.not.lf = (mpc_ctor_t)mpc_load_func(l);
+            break;
 
-void mpc_ast_traverse_free(mpc_ast_trav_t **trav) {
-    mpc_ast_trav_t *n_trav;
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+        case MPC_TYPE_COUNT:
+            p->data.repeat.n = (int)mpc_load_int(l);
+            p->data.repeat.f = (mpc_fold_t)mpc_load_func(l);
+            p->data.repeat.x = mpc_load_node(l);
+            p->data.repeat.dx = (mpc_dtor_t)mpc_load_func(l);
+            break;
 
-    /* Go through parents until all are free */
-    while(*trav != NULL) {
-        n_trav = (*trav)->parent;
-        free(*trav);
-        *trav = n_trav;
-    }
-}
+        case MPC_TYPE_OR:
+            p->data.or.n = (int)mpc_load_int(l);
+            p->data.or.xs = l->nodes.ptrs;
+            if (!mpc_load_children(l, p->data.or.n, ptrs, l->nodes.ptrs_num)) { break; }
+            l->nodes.ptrs += p->data.or.n;
+            for (i = 0; i < p->data.or.n; i++) { p->data.or.xs[i] = mpc_load_node(l); }
+            break;
 
-mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
+        case MPC_TYPE_AND:
+            p->data.and.n = (int)mpc_load_int(l);
+            p->data.and.f = (mpc_fold_t)mpc_load_func(l);
+            p->data.and.xs = l->nodes.ptrs;
+            p->data.and.dxs = l->nodes.dtors;
+            if (!mpc_load_children(l, p->data.and.n, ptrs, l->nodes.ptrs_num)) { break; }
+            if (p->data.and.n > 1
+            && !mpc_load_children(l, p->data.and.n-1, dtors, l->nodes.dtors_num)) { break; }
+            l->nodes.ptrs += p->data.and.n;
+            l->nodes.dtors += p->data.and.n-1;
+            for (i = 0; i < p->data.and.n;   i++) { p->data.and.xs[i] = mpc_load_node(l); }
+            for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = (mpc_dtor_t)mpc_load_func(l); }
+            break;
 
-    int i, j;
-    mpc_ast_t** as = (mpc_ast_t**)xs;
-    mpc_ast_t *r;
+        case MPC_TYPE_EXPR:
+            p->data.expr.n = (int)mpc_load_int(l);
+            p->data.expr.f = (mpc_fold_t)mpc_load_func(l);
+            p->data.expr.dx = (mpc_dtor_t)mpc_load_func(l);
+            p->data.expr.xs = l->nodes.ptrs;
+            p->data.expr.ps = (unsigned char*)l->nodes.chars;
+            if (l->error || p->data.expr.n < 0 || p->data.expr.n > MPC_EXPR_OPS_MAX
+            ||  (size_t)p->data.expr.n > (size_t)(l->chars_end - l->nodes.chars)) { l->error = 1; break; }
+            if (!mpc_load_children(l, p->data.expr.n+1, ptrs, l->nodes.ptrs_num)) { break; }
+            l->nodes.ptrs += p->data.expr.n+1;
+            l->nodes.chars += p->data.expr.n;
+            for (i = 0; i <= p->data.expr.n; i++) { p->data.expr.xs[i] = mpc_load_node(l); }
+            if (fread(p->data.expr.ps, 1, p->data.expr.n, l->f) != (size_t)p->data.expr.n) { l->error = 1; break; }
+            for (i = 0; i < p->data.expr.n; i++) {
+                if (p->data.expr.ps[i] / 2 >= p->data.expr.n) { l->error = 1; }
+            }
+            break;
 
-    if (n == 0) { return NULL; }
-    if (n == 1) { return xs[0]; }
-    if (n == 2 && xs[1] == NULL) { return xs[0]; }
-    if (n == 2 && xs[0] == NULL) { return xs[1]; }
+        default: l->error = 1; break;
+    }
 
-    r = mpc_ast_new(">", "");
+}
 
-    for (i = 0; i < n; i++) {
+mpc_parser_t *mpc_load(FILE *f) {
 
-        if (as[i] == NULL) { continue; }
+    int i;
+    char magic[sizeof(mpc_save_magic)];
+    size_t ptrs = 0, dtors = 0;
+    long start, end;
+    mpc_load_t l;
+
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic)
+    ||  memcmp(magic, mpc_save_magic, sizeof(magic)) != 0) { return NULL; }
+
+    l.f = f;
+    l.error = 0;
+    l.nodes.nodes_num = (int)mpc_load_int(&l);
+    l.nodes.ptrs_num  = mpc_load_int(&l);
+    l.nodes.dtors_num = mpc_load_int(&l);
+    l.nodes.chars_num = mpc_load_int(&l);
+
+    if (l.error || l.nodes.nodes_num <= 0) { return NULL; }
+
+    /* Every node, child and string takes some space in the file */
+    start = ftell(f);
+    if (start >= 0 && fseek(f, 0, SEEK_END) == 0) {
+        end = ftell(f);
+        fseek(f, start, SEEK_SET);
+        if ((unsigned long)(end - start) / 6 < (unsigned long)l.nodes.nodes_num
+        ||  (unsigned long)(end - start) / 4 < l.nodes.ptrs_num + l.nodes.dtors_num
+        ||  (unsigned long)(end - start)     < l.nodes.chars_num) { return NULL; }
+    }
 
-        if        (as[i] && as[i]->children_num == 0) {
-            mpc_ast_add_child(r, as[i]);
-        } else if (as[i] && as[i]->children_num == 1) {
-            mpc_ast_add_child(r, mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag));
-            mpc_ast_delete_no_children(as[i]);
-        } else if (as[i] && as[i]->children_num >= 2) {
-            for (j = 0; j < as[i]->children_num; j++) {
-                mpc_ast_add_child(r, as[i]->children[j]);
-            }
-            mpc_ast_delete_no_children(as[i]);
-        }
+    mpc_freeze_block(&l.nodes);
+    if (l.nodes.arena == NULL) { return NULL; }
+    l.chars_end = l.nodes.chars + l.nodes.chars_num;
 
+    for (i = 0; i < l.nodes.nodes_num && !l.error; i++) {
+        mpc_load_parser(&l, l.nodes.arena + i, &ptrs, &dtors);
     }
 
-    if (r->children_num) {
-        r->state = r->children[0]->state;
+    if (l.error) {
+        free(l.nodes.arena);
+        return NULL;
     }
 
-    return r;
-}
-
-mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
-    mpc_ast_t *a = mpc_ast_new("", c);
-    free(c);
-    return a;
-}
-
-mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs) {
-    mpc_state_t *s = ((mpc_state_t**)xs)[0];
-    mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
-    (void)n;
-    a = mpc_ast_state(a, *s);
-    free(s);
-    return a;
-}
+    return l.nodes.arena;
 
-mpc_parser_t *mpca_state(mpc_parser_t *a) {
-    return mpc_and(2, mpcf_state_ast, mpc_state(), a, free);
 }
 
-mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t) {
-    return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag, (void*)t);
-}
+/*
+** AST Saving
+**
+** Everything is gathered in memory first so that the
+** string table, which comes before the nodes, can be
+** written in one go. Tags repeat on almost every node
+** so each is stored once, found through a small hash
+** table of offsets. Contents are stored as they come.
+*/
 
-mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
-    return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
+enum {
+    MPC_AST_SAVE_VERSION = 1,
+    MPC_AST_SAVE_FIELDS  = 8
+};
+
+static const char mpc_ast_save_magic[4] = { 'm', 'p', 'a', MPC_AST_SAVE_VERSION };
+
+typedef struct {
+    int nodes_num;
+    int nodes_max;
+    unsigned long *nodes;
+    size_t chars_num;
+    size_t chars_max;
+    char *chars;
+    int tags_num;
+    int tags_max;
+    size_t *tags;
+} mpc_ast_save_t;
+
+static size_t mpc_ast_save_chars(mpc_ast_save_t *s, const char *x) {
+    size_t n = strlen(x) + 1;
+    while (s->chars_num + n > s->chars_max) {
+        s->chars_max = s->chars_max * 2;
+        s->chars = realloc(s->chars, s->chars_max);
+    }
+    memcpy(s->chars + s->chars_num, x, n);
+    s->chars_num += n;
+    return s->chars_num - n;
 }
 
-mpc_parser_t *mpca_root(mpc_parser_t *a) {
-    return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
+static size_t *mpc_ast_save_tag_slot(mpc_ast_save_t *s, const char *t) {
+    unsigned long i = mpc_hash(t) & (s->tags_max-1);
+    while (s->tags[i] && strcmp(s->chars + s->tags[i] - 1, t) != 0) {
+        i = (i+1) & (s->tags_max-1);
+    }
+    return &s->tags[i];
 }
 
-mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpc_not(a, (mpc_dtor_t)mpc_ast_delete); }
-mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
-mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
-mpc_parser_t *mpca_many1(mpc_parser_t *a) { return mpc_many1(mpcf_fold_ast, a); }
-mpc_parser_t *mpca_count(int n, mpc_parser_t *a) { return mpc_count(n, mpcf_fold_ast, a, (mpc_dtor_t)mpc_ast_delete); }
+static size_t mpc_ast_save_tag(mpc_ast_save_t *s, const char *t) {
 
-mpc_parser_t *mpca_or(int n, ...) {
+    int j;
+    size_t *slot, *old;
+
+    /* Offsets are kept plus one so that zero is empty */
+    if ((s->tags_num+1) * 2 > s->tags_max) {
+        old = s->tags;
+        s->tags_max = s->tags_max * 2;
+        s->tags = calloc(s->tags_max, sizeof(size_t));
+        for (j = 0; j < s->tags_max / 2; j++) {
+            if (old[j]) { *mpc_ast_save_tag_slot(s, s->chars + old[j] - 1) = old[j]; }
+        }
+        free(old);
+    }
 
-    int i;
-    va_list va;
+    slot = mpc_ast_save_tag_slot(s, t);
+    if (*slot == 0) {
+        *slot = mpc_ast_save_chars(s, t) + 1;
+        s->tags_num++;
+    }
+    return *slot - 1;
+}
 
-    mpc_parser_t *p = mpc_undefined();
+/* Adds the subtree at `a` and returns its count of nodes */
+static int mpc_ast_save_node(mpc_ast_save_t *s, mpc_ast_t *a) {
 
-    p->type = MPC_TYPE_OR;
-    p->data.or.n = n;
-    p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+    int i, n = s->nodes_num++;
+    unsigned long *x;
+    size_t tag, contents;
 
-    va_start(va, n);
-    for (i = 0; i < n; i++) {
-        p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+    if (s->nodes_num > s->nodes_max) {
+        s->nodes_max = s->nodes_max * 2;
+        s->nodes = realloc(s->nodes, sizeof(unsigned long) * MPC_AST_SAVE_FIELDS * s->nodes_max);
     }
-    va_end(va);
 
-    return p;
+    tag = mpc_ast_save_tag(s, a->tag);
+    contents = mpc_ast_save_chars(s, a->contents);
 
-}
+    x = s->nodes + n * MPC_AST_SAVE_FIELDS;
+    x[0] = tag;
+    x[1] = contents;
+    x[2] = a->tag_ids;
+    x[3] = a->state.pos;
+    x[4] = a->state.row;
+    x[5] = a->state.col;
+    x[6] = a->children_num;
 
-mpc_parser_t *mpca_and(int n, ...) {
+    for (i = 0; i < a->children_num; i++) {
+        mpc_ast_save_node(s, a->children[i]);
+    }
 
-    int i;
-    va_list va;
+    /* The records may have moved while adding the children */
+    s->nodes[n * MPC_AST_SAVE_FIELDS + 7] = s->nodes_num - n;
+    return s->nodes_num - n;
+}
 
-    mpc_parser_t *p = mpc_undefined();
+static void mpc_ast_save_int(FILE *f, unsigned long x) {
+    fputc((int)(x >>  0) & 0xFF, f);
+    fputc((int)(x >>  8) & 0xFF, f);
+    fputc((int)(x >> 16) & 0xFF, f);
+    fputc((int)(x >> 24) & 0xFF, f);
+}
 
-    p->type = MPC_TYPE_AND;
-    p->data.and.n = n;
-    p->data.and.f = mpcf_fold_ast;
-    p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
-    p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+int mpc_ast_save(mpc_ast_t *a, FILE *f) {
 
-    va_start(va, n);
-    for (i = 0; i < n; i++) {
-        p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
-    }
-    for (i = 0; i < (n-1); i++) {
-        p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete;
+    int i;
+    mpc_ast_save_t s;
+
+    if (a == NULL) { return 0; }
+
+    s.nodes_num = 0;
+    s.nodes_max = 64;
+    s.nodes = malloc(sizeof(unsigned long) * MPC_AST_SAVE_FIELDS * s.nodes_max);
+    s.chars_num = 0;
+    s.chars_max = 1024;
+    s.chars = malloc(s.chars_max);
+    s.tags_num = 0;
+    s.tags_max = 64;
+    s.tags = calloc(s.tags_max, sizeof(size_t));
+
+    mpc_ast_save_node(&s, a);
+
+    fwrite(mpc_ast_save_magic, 1, sizeof(mpc_ast_save_magic), f);
+    mpc_ast_save_int(f, s.nodes_num);
+    mpc_ast_save_int(f, s.chars_num);
+    fwrite(s.chars, 1, s.chars_num, f);
+    for (i = 0; i < s.nodes_num * MPC_AST_SAVE_FIELDS; i++) {
+        mpc_ast_save_int(f, s.nodes[i]);
     }
-    va_end(va);
 
-    return p;
+    free(s.nodes);
+    free(s.chars);
+    free(s.tags);
+    return !ferror(f);
 }
 
-mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
+static unsigned long mpc_ast_load_int(const unsigned char *b) {
+    return (unsigned long)b[0]
+        | ((unsigned long)b[1] <<  8)
+        | ((unsigned long)b[2] << 16)
+        | ((unsigned long)b[3] << 24);
+}
 
-/*
-** Grammar Parser
-*/
+static unsigned long mpc_ast_load_field(const unsigned char *nodes, unsigned long i, int field) {
+    return mpc_ast_load_int(nodes + (i * MPC_AST_SAVE_FIELDS + field) * 4);
+}
 
 /*
-** This is another interesting bootstrapping.
-**
-** Having a general purpose AST type allows
-** users to specify the grammar alone and
-** let all fold rules be automatically taken
-** care of by existing functions.
-**
-** You don't get to control the type spat
-** out but this means you can make a nice
-** parser to take in some grammar in nice
-** syntax and spit out a parser that works.
-**
-** The grammar for this looks surprisingly
-** like regex but the main difference is that
-** it is now whitespace insensitive and the
-** base type takes literals of some form.
+** Every offset and count is checked before any node
+** is made, so a damaged file gives `NULL` and never
+** a partial tree. Each node's children must exactly
+** cover the nodes of its subtree.
 */
 
-/*
-**
-**  ### Grammar Grammar
-**
-**      <grammar> : (<term> "|" <grammar>) | <term>
-**
-**      <term> : <factor>*
-**
-**      <factor> : <base>
-**               | <base> "*"
-**               | <base> "+"
-**               | <base> "?"
-**               | <base> "{" <digits> "}"
-**
-**      <base> : "<" (<digits> | <ident>) ">"
-**             | <string_lit>
-**             | <char_lit>
-**             | <regex_lit> <regex_mode>
-**             | "(" <grammar> ")"
-*/
+static int mpc_ast_load_check(const unsigned char *nodes, unsigned long n, const char *chars, unsigned long chars_num) {
 
-typedef struct {
-    va_list *va;
-    int parsers_num;
-    mpc_parser_t **parsers;
-    int flags;
-} mpca_grammar_st_t;
+    unsigned long i, j, k, c, size;
 
-static mpc_val_t *mpcaf_grammar_or(int n, mpc_val_t **xs) {
-    (void) n;
-    if (xs[1] == NULL) { return xs[0]; }
-    else { return mpca_or(2, xs[0], xs[1]); }
-}
+    if (chars_num == 0 || chars[chars_num-1] != '\0') { return 0; }
+    if (mpc_ast_load_field(nodes, 0, 7) != n) { return 0; }
 
-static mpc_val_t *mpcaf_grammar_and(int n, mpc_val_t **xs) {
-    int i;
-    mpc_parser_t *p = mpc_pass();
     for (i = 0; i < n; i++) {
-        if (xs[i] != NULL) { p = mpca_and(2, p, xs[i]); }
+        if (mpc_ast_load_field(nodes, i, 0) >= chars_num
+        ||  mpc_ast_load_field(nodes, i, 1) >= chars_num) { return 0; }
+        size = mpc_ast_load_field(nodes, i, 7);
+        k = mpc_ast_load_field(nodes, i, 6);
+        if (size == 0 || size > n - i || k >= size) { return 0; }
+        for (j = i + 1, c = 0; c < k; c++) {
+            if (j >= i + size) { return 0; }
+            if (mpc_ast_load_field(nodes, j, 7) == 0
+            ||  mpc_ast_load_field(nodes, j, 7) > i + size - j) { return 0; }
+            j += mpc_ast_load_field(nodes, j, 7);
+        }
+        if (j != i + size) { return 0; }
     }
-    return p;
-}
 
-static mpc_val_t *mpcaf_grammar_repeat(int n, mpc_val_t **xs) {
-    int num;
-    (void) n;
-    if (xs[1] == NULL) { return xs[0]; }
-    switch(((char*)xs[1])[0])
-    {
-        case '*': { free(xs[1]); return mpca_many(xs[0]); }; break;
-        case '+': { free(xs[1]); return mpca_many1(xs[0]); }; break;
-        case '?': { free(xs[1]); return mpca_maybe(xs[0]); }; break;
-        case '!': { free(xs[1]); return mpca_not(xs[0]); }; break;
-        default:
-            num = *((int*)xs[1]);
-            free(xs[1]);
-    }
-    return mpca_count(num, xs[0]);
+    return 1;
 }
 
-static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
-    mpca_grammar_st_t *st = s;
-    char *y = mpcf_unescape(x);
-    mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
-    free(y);
-    return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "string"));
-}
+enum { MPC_AST_SAVE_HEAD = sizeof(mpc_ast_save_magic) + 8 };
 
-static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
-    mpca_grammar_st_t *st = s;
-    char *y = mpcf_unescape(x);
-    mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
-    free(y);
-    return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "char"));
+/* Checks the header and gives the counts in it */
+static int mpc_ast_load_head(const unsigned char *head, unsigned long *n, unsigned long *chars_num) {
+    if (memcmp(head, mpc_ast_save_magic, sizeof(mpc_ast_save_magic)) != 0) { return 0; }
+    *n = mpc_ast_load_int(head + sizeof(mpc_ast_save_magic));
+    *chars_num = mpc_ast_load_int(head + sizeof(mpc_ast_save_magic) + 4);
+    return *n != 0 && *n <= ((size_t)-1 - *chars_num) / (MPC_AST_SAVE_FIELDS * 4 + sizeof(mpc_ast_t*));
 }
 
-static mpc_val_t *mpcaf_fold_regex(int n, mpc_val_t **xs) {
-    char *y = xs[0];
-    char *m = xs[1];
-    mpca_grammar_st_t *st = xs[2];
-    mpc_parser_t *p;
-    int mode = MPC_RE_DEFAULT;
+/* Makes the subtree of `n` nodes at `first`, with its strings in `chars` */
+static mpc_ast_t *mpc_ast_load_nodes(const unsigned char *nodes, unsigned long first, unsigned long n, char *chars, mpc_ast_arena_t *x) {
 
-    (void)n;
-    if (strchr(m, 'm')) { mode |= MPC_RE_MULTILINE; }
-    if (strchr(m, 's')) { mode |= MPC_RE_DOTALL; }
-    y = mpcf_unescape_regex(y);
-    p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re_mode(y, mode) : mpc_tok(mpc_re_mode(y, mode));
-    free(y);
-    free(m);
+    unsigned long i, j, c, k;
+    mpc_ast_t **as, *a, *r;
 
-    return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"));
-}
+    as = malloc(sizeof(mpc_ast_t*) * n);
+    if (as == NULL) { return NULL; }
 
-/* Should this just use `isdigit` instead? */
-static int is_number(const char* s) {
-    size_t i;
-    for (i = 0; i < strlen(s); i++) { if (!strchr("0123456789", s[i])) { return 0; } }
-    return 1;
+    for (i = 0; i < n; i++) {
+        if (x) {
+            a = mpc_ast_arena_alloc(x, sizeof(mpc_ast_t));
+            a->tag = chars + mpc_ast_load_field(nodes, first + i, 0);
+            a->contents = chars + mpc_ast_load_field(nodes, first + i, 1);
+            a->arena = x;
+        } else {
+            a = mpc_ast_new(chars + mpc_ast_load_field(nodes, first + i, 0), chars + mpc_ast_load_field(nodes, first + i, 1));
+        }
+        a->state = mpc_state_new();
+        a->state.pos = (long)mpc_ast_load_field(nodes, first + i, 3);
+        a->state.row = (long)mpc_ast_load_field(nodes, first + i, 4);
+        a->state.col = (long)mpc_ast_load_field(nodes, first + i, 5);
+        a->tag_ids = mpc_ast_load_field(nodes, first + i, 2) & ((2UL << MPC_TAG_MAX) - 1);
+        a->children_num = (int)mpc_ast_load_field(nodes, first + i, 6);
+        a->children = NULL;
+        as[i] = a;
+    }
+
+    for (i = 0; i < n; i++) {
+        k = as[i]->children_num;
+        if (k == 0) { continue; }
+        as[i]->children = x ? mpc_ast_arena_alloc(x, sizeof(mpc_ast_t*) * k) : malloc(sizeof(mpc_ast_t*) * k);
+        for (j = i + 1, c = 0; c < k; c++) {
+            as[i]->children[c] = as[j];
+            j += mpc_ast_load_field(nodes, first + j, 7);
+        }
+    }
+
+    r = as[0];
+    free(as);
+    return r;
 }
 
-static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
+mpc_ast_t *mpc_ast_load(FILE *f, mpc_ast_arena_t *x) {
 
-    int i;
-    mpc_parser_t *p;
+    unsigned char head[MPC_AST_SAVE_HEAD];
+    unsigned char *b;
+    unsigned long n, chars_num;
+    long start, end;
+    char *chars;
+    const unsigned char *nodes;
+    mpc_ast_t *r;
 
-    /* Case of Number */
-    if (is_number(x)) {
+    if (fread(head, 1, sizeof(head), f) != sizeof(head)
+    ||  !mpc_ast_load_head(head, &n, &chars_num)) { return NULL; }
 
-        i = strtol(x, NULL, 10);
+    /* Don't trust the counts further than the file goes */
+    start = ftell(f);
+    if (start >= 0 && fseek(f, 0, SEEK_END) == 0) {
+        end = ftell(f);
+        fseek(f, start, SEEK_SET);
+        if ((unsigned long)(end - start) < chars_num + n * MPC_AST_SAVE_FIELDS * 4) { return NULL; }
+    }
 
-        while (st->parsers_num <= i) {
-            st->parsers_num++;
-            st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
-            st->parsers[st->parsers_num-1] = va_arg(*st->va, mpc_parser_t*);
-            if (st->parsers[st->parsers_num-1] == NULL) {
-                return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
-            }
-        }
+    /* In an arena the strings stay where they're read */
+    b = x ? mpc_ast_arena_alloc(x, chars_num + n * MPC_AST_SAVE_FIELDS * 4)
+          : malloc(chars_num + n * MPC_AST_SAVE_FIELDS * 4);
+    if (b == NULL) { return NULL; }
+    chars = (char*)b;
+    nodes = b + chars_num;
 
-        return st->parsers[st->parsers_num-1];
+    if (fread(b, 1, chars_num + n * MPC_AST_SAVE_FIELDS * 4, f) != chars_num + n * MPC_AST_SAVE_FIELDS * 4
+    ||  !mpc_ast_load_check(nodes, n, chars, chars_num)) {
+        if (!x) { free(b); }
+        return NULL;
+    }
 
-        /* Case of Identifier */
-    } else {
+    r = mpc_ast_load_nodes(nodes, 0, n, chars, x);
+    if (!x) { free(b); }
+    return r;
+}
 
-        /* Search Existing Parsers */
-        for (i = 0; i < st->parsers_num; i++) {
-            mpc_parser_t *q = st->parsers[i];
-            if (q == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
-            if (q->name && strcmp(q->name, x) == 0) { return q; }
-        }
+/*
+** AST Views
+**
+** The file is mapped into memory where the system
+** has `mmap` and read in whole where it doesn't. It
+** is checked once on opening, as by `mpc_ast_load`,
+** so after that a node is read straight from its
+** record with nothing to make.
+*/
 
-        /* Search New Parsers */
-        while (1) {
+struct mpc_ast_view_t {
+    unsigned char *b;
+    size_t size;
+    unsigned long nodes_num;
+    unsigned long chars_num;
+    const char *chars;
+    const unsigned char *nodes;
+};
+
+static mpc_ast_view_t *mpc_ast_view_map(const char *filename) {
+
+    mpc_ast_view_t *v;
+#ifndef _WIN32
+    int fd;
+    struct stat st;
+    void *m;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) { return NULL; }
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) { close(fd); return NULL; }
+    m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) { return NULL; }
+
+    v = calloc(1, sizeof(mpc_ast_view_t));
+    v->b = m;
+    v->size = (size_t)st.st_size;
+#else
+    FILE *f;
+    long size;
+
+    f = fopen(filename, "rb");
+    if (f == NULL) { return NULL; }
+    if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) <= 0) { fclose(f); return NULL; }
+    rewind(f);
+
+    v = calloc(1, sizeof(mpc_ast_view_t));
+    v->b = malloc((size_t)size);
+    v->size = (size_t)size;
+    if (fread(v->b, 1, v->size, f) != v->size) {
+        fclose(f);
+        free(v->b);
+        free(v);
+        return NULL;
+    }
+    fclose(f);
+#endif
 
-            p = va_arg(*st->va, mpc_parser_t*);
+    return v;
+}
 
-            st->parsers_num++;
-            st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
-            st->parsers[st->parsers_num-1] = p;
+/* Finds the saved AST starting `offset` bytes into the file */
+static int mpc_ast_view_read(mpc_ast_view_t *v, size_t offset) {
 
-            if (p == NULL || p->name == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
-            if (p->name && strcmp(p->name, x) == 0) { return p; }
+    unsigned long n, chars_num;
 
-        }
+    if (v->size < offset || v->size - offset < MPC_AST_SAVE_HEAD
+    ||  !mpc_ast_load_head(v->b + offset, &n, &chars_num)) { return 0; }
+    if (v->size - offset - MPC_AST_SAVE_HEAD < chars_num + n * MPC_AST_SAVE_FIELDS * 4) { return 0; }
+
+    v->chars = (const char*)(v->b + offset + MPC_AST_SAVE_HEAD);
+    v->nodes = v->b + offset + MPC_AST_SAVE_HEAD + chars_num;
+    if (!mpc_ast_load_check(v->nodes, n, v->chars, chars_num)) { return 0; }
+
+    v->nodes_num = n;
+    v->chars_num = chars_num;
+    return 1;
+}
 
+mpc_ast_view_t *mpc_ast_view_open(const char *filename) {
+    mpc_ast_view_t *v = mpc_ast_view_map(filename);
+    if (v && !mpc_ast_view_read(v, 0)) {
+        mpc_ast_view_close(v);
+        return NULL;
     }
+    return v;
+}
 
+void mpc_ast_view_close(mpc_ast_view_t *v) {
+#ifndef _WIN32
+    munmap(v->b, v->size);
+#else
+    free(v->b);
+#endif
+    free(v);
 }
 
-static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
+long mpc_ast_view_nodes_num(const mpc_ast_view_t *v) {
+    return (long)v->nodes_num;
+}
 
-    mpca_grammar_st_t *st = s;
-    mpc_parser_t *p = mpca_grammar_find_parser(x, st);
-    free(x);
+const char *mpc_ast_view_tag(const mpc_ast_view_t *v, long i) {
+    return v->chars + mpc_ast_load_field(v->nodes, i, 0);
+}
 
-    if (p->name) {
-        return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
-    } else {
-        return mpca_state(mpca_root(p));
-    }
+const char *mpc_ast_view_contents(const mpc_ast_view_t *v, long i) {
+    return v->chars + mpc_ast_load_field(v->nodes, i, 1);
 }
 
-mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
+mpc_state_t mpc_ast_view_state(const mpc_ast_view_t *v, long i) {
+    mpc_state_t s = mpc_state_new();
+    s.pos = (long)mpc_ast_load_field(v->nodes, i, 3);
+    s.row = (long)mpc_ast_load_field(v->nodes, i, 4);
+    s.col = (long)mpc_ast_load_field(v->nodes, i, 5);
+    return s;
+}
 
-    char *err_msg;
-    mpc_parser_t *err_out;
-    mpc_result_t r;
-    mpc_parser_t *GrammarTotal, *Grammar, *Term, *Factor, *Base;
+int mpc_ast_view_rule_id(const mpc_ast_view_t *v, long i) {
+    return mpc_tag_ids_rule_id(mpc_ast_load_field(v->nodes, i, 2));
+}
 
-    GrammarTotal = mpc_new("grammar_total");
-    Grammar = mpc_new("grammar");
-    Term = mpc_new("term");
-    Factor = mpc_new("factor");
-    Base = mpc_new("base");
+int mpc_ast_view_children_num(const mpc_ast_view_t *v, long i) {
+    return (int)mpc_ast_load_field(v->nodes, i, 6);
+}
 
-    mpc_define(GrammarTotal,
-               mpc_predictive(mpc_total(Grammar, mpc_soft_delete))
-    );
+long mpc_ast_view_next(const mpc_ast_view_t *v, long i) {
+    return i + (long)mpc_ast_load_field(v->nodes, i, 7);
+}
 
-    mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
-                                Term,
-                                mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
-                                mpc_soft_delete
-    ));
+/* Outside an arena each node copies its own strings */
+mpc_ast_t *mpc_ast_view_load(const mpc_ast_view_t *v, long i, mpc_ast_arena_t *x) {
+    char *chars = (char*)v->chars;
+    if (x) {
+        chars = mpc_ast_arena_alloc(x, v->chars_num);
+        memcpy(chars, v->chars, v->chars_num);
+    }
+    return mpc_ast_load_nodes(v->nodes, i, mpc_ast_load_field(v->nodes, i, 7), chars, x);
+}
+
+/*
+** AST Cache
+**
+** A cached AST is found by a hash of the grammar,
+** made by saving it without a file, and a hash of the
+** input. Its file starts with the input itself, its
+** length and then its bytes, so that a clash of names
+** is caught, and then has the AST as `mpc_ast_save`
+** writes it. A hit opens the file as a view and loads
+** the AST straight from that. New files are written
+** under a name of their own, from the process ID and
+** a count, and renamed so a reader never sees half of
+** one and writers never share one. A loaded AST was
+** never parsed so `stats` is left zeroed.
+*/
 
-    mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+static long mpc_ast_cache_count = 0;
+static mpc_lock_t mpc_ast_cache_lock = MPC_LOCK_INIT;
 
-    mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
-                               Base,
-                               mpc_or(6,
-                                      mpc_sym("*"),
-                                      mpc_sym("+"),
-                                      mpc_sym("?"),
-                                      mpc_sym("!"),
-                                      mpc_tok_brackets(mpc_int(), free),
-                                      mpc_pass()),
-                               mpc_soft_delete
-    ));
+static void mpc_ast_cache_temp(char *temp, const char *path) {
+    long n, pid;
+    mpc_lock(&mpc_ast_cache_lock);
+    n = mpc_ast_cache_count++;
+    mpc_unlock(&mpc_ast_cache_lock);
+#ifdef _WIN32
+    pid = (long)_getpid();
+#else
+    pid = (long)getpid();
+#endif
+    sprintf(temp, "%s.%ld.%ld.tmp", path, pid, n);
+}
 
-    mpc_define(Base, mpc_or(5,
-                            mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
-                            mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
-                            mpc_tok(mpc_and(3, mpcaf_fold_regex, mpc_regex_lit(), mpc_many(mpcf_strfold, mpc_oneof("ms")), mpc_lift_val(st), free, free)),
-                            mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
-                            mpc_tok_parens(Grammar, mpc_soft_delete)
-    ));
+static mpc_ast_t *mpc_ast_cache_load(const char *path, const char *string, unsigned long len, mpc_ast_arena_t *x) {
 
-    mpc_optimise(GrammarTotal);
-    mpc_optimise(Grammar);
-    mpc_optimise(Factor);
-    mpc_optimise(Term);
-    mpc_optimise(Base);
+    mpc_ast_view_t *v;
+    mpc_ast_t *a = NULL;
 
-    if(!mpc_parse("<mpc_grammar_compiler>", grammar, GrammarTotal, &r)) {
-        err_msg = mpc_err_string(r.error);
-        err_out = mpc_failf("Invalid Grammar: %s", err_msg);
-        mpc_err_delete(r.error);
-        free(err_msg);
-        r.output = err_out;
+    v = mpc_ast_view_map(path);
+    if (v == NULL) { return NULL; }
+
+    if (v->size >= 4 && mpc_ast_load_int(v->b) == len
+    &&  v->size - 4 >= len && memcmp(v->b + 4, string, len) == 0
+    &&  mpc_ast_view_read(v, 4 + len)) {
+        a = mpc_ast_view_load(v, 0, x);
     }
 
-    mpc_cleanup(5, GrammarTotal, Grammar, Term, Factor, Base);
+    mpc_ast_view_close(v);
+    return a;
+}
 
-    mpc_optimise(r.output);
+static int mpc_parse_cached(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r, const mpc_parse_opts_t *opts) {
 
-    return (st->flags & MPCA_LANG_PREDICTIVE) ? mpc_predictive(r.output) : r.output;
+    int x, saved;
+    unsigned long grammar, hash, len;
+    char *path, *temp;
+    FILE *f;
+    mpc_ast_t *a;
+    mpc_parse_opts_t o = *opts;
 
-}
+    o.ast_cache = NULL;
+    if (!mpc_save_hash(p, &grammar)) { return mpc_parse_ex(filename, string, p, r, &o); }
 
-mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...) {
-    mpca_grammar_st_t st;
-    mpc_parser_t *res;
-    va_list va;
-    va_start(va, grammar);
+    hash = 2166136261UL;
+    for (len = 0; string[len]; len++) {
+        hash = ((hash ^ (unsigned char)string[len]) * 16777619UL) & 0xFFFFFFFFUL;
+    }
 
-    st.va = &va;
-    st.parsers_num = 0;
-    st.parsers = NULL;
-    st.flags = flags;
+    path = malloc(strlen(opts->ast_cache) + 32);
+    temp = malloc(strlen(opts->ast_cache) + 80);
+    sprintf(path, "%s/%08lx%08lx.ast", opts->ast_cache, grammar, hash);
 
-    res = mpca_grammar_st(grammar, &st);
-    free(st.parsers);
-    va_end(va);
-    return res;
+    a = mpc_ast_cache_load(path, string, len, opts->ast_arena);
+    if (a) {
+        if (opts->stats) { memset(opts->stats, 0, sizeof(mpc_parse_stats_t)); }
+        r->output = a;
+        free(path);
+        free(temp);
+        return 1;
+    }
+
+    x = mpc_parse_ex(filename, string, p, r, &o);
+
+    if (x && r->output) {
+        mpc_ast_cache_temp(temp, path);
+        f = fopen(temp, "wb");
+        if (f) {
+            mpc_ast_save_int(f, len);
+            fwrite(string, 1, len, f);
+            saved = mpc_ast_save(r->output, f);
+            if (fclose(f) != 0) { saved = 0; }
+            /* Some systems won't rename over an existing file */
+            if (saved && rename(temp, path) != 0) {
+                remove(path);
+                saved = rename(temp, path) == 0;
+            }
+            if (!saved) { remove(temp); }
+        }
+    }
+
+    free(path);
+    free(temp);
+    return x;
 }
 
+/*
+** Code Generation
+**
+** `mpca_gen` compiles a grammar into C. Every parser
+** becomes a function doing what `mpc_parse_run` does
+** for that one node, including marks, cuts and the
+** depth limit, so a generated parser accepts exactly
+** the same input and builds exactly the same AST. The
+** dispatch on type, the memory pool and the error
+** tracking are gone and character tests are written
+** out in full. The functions are all static so the C
+** compiler is free to fold them into the rules that
+** call them.
+**
+** Errors are the slow path. When a generated parser
+** fails the input is parsed again by the interpreter,
+** built from the same grammar, which reports it.
+*/
+
+enum {
+    MPC_GEN_ADVANCE  = 1 << 0,
+    MPC_GEN_CHAR     = 1 << 1,
+    MPC_GEN_STRING   = 1 << 2,
+    MPC_GEN_MARK     = 1 << 3,
+    MPC_GEN_COMMIT   = 1 << 4,
+    MPC_GEN_VALS     = 1 << 5,
+    MPC_GEN_BOUNDARY = 1 << 6,
+    MPC_GEN_NEWLINE  = 1 << 7,
+    MPC_GEN_REST     = 1 << 8,
+    MPC_GEN_EXPR     = 1 << 9,
+    MPC_GEN_EXPR_AST = 1 << 10
+};
+
 typedef struct {
-    char *ident;
-    char *name;
-    mpc_parser_t *grammar;
-} mpca_stmt_t;
+    int uses;
+    const char **lines;
+} mpc_gen_section_t;
+
+static const char *mpc_gen_input[] = {
+    "typedef struct {",
+    "    mpc_state_t state;",
+    "    char last;",
+    "} mpcg_mark_t;",
+    "",
+    "typedef struct {",
+    "    const char *string;",
+    "    mpc_state_t state;",
+    "    char last;",
+    "    int backtrack;",
+    "    int marks;",
+    "    int marks_cut;",
+    "    int cut;",
+    "} mpcg_input_t;",
+    "",
+    "enum { MPCG_MAX_DEPTH = 1000, MPCG_VALS_MIN = 4 };",
+    "",
+    NULL
+};
 
-static mpc_val_t *mpca_stmt_afold(int n, mpc_val_t **xs) {
-    mpca_stmt_t *stmt = malloc(sizeof(mpca_stmt_t));
-    stmt->ident = ((char**)xs)[0];
-    stmt->name = ((char**)xs)[1];
-    stmt->grammar = ((mpc_parser_t**)xs)[3];
-    (void) n;
-    free(((char**)xs)[2]);
-    free(((char**)xs)[4]);
+static const char *mpc_gen_advance[] = {
+    "static void mpcg_advance(mpcg_input_t *i) {",
+    "    char c = i->string[i->state.pos];",
+    "    i->last = c;",
+    "    i->state.pos++;",
+    "    i->state.col++;",
+    "    if (c == '\\n') { i->state.col = 0; i->state.row++; }",
+    "}",
+    "",
+    NULL
+};
 
-    return stmt;
-}
+static const char *mpc_gen_char[] = {
+    "static char *mpcg_char(char c) {",
+    "    char *x = malloc(2);",
+    "    x[0] = c;",
+    "    x[1] = '\\0';",
+    "    return x;",
+    "}",
+    "",
+    NULL
+};
 
-static mpc_val_t *mpca_stmt_fold(int n, mpc_val_t **xs) {
+static const char *mpc_gen_string[] = {
+    "static int mpcg_string(mpcg_input_t *i, const char *x, size_t n) {",
+    "    size_t j;",
+    "    if (strncmp(i->string + i->state.pos, x, n) == 0) {",
+    "        for (j = 0; j < n; j++) { mpcg_advance(i); }",
+    "        return 1;",
+    "    }",
+    "    if (i->backtrack < 1) {",
+    "        for (j = 0; i->string[i->state.pos] == x[j]; j++) { mpcg_advance(i); }",
+    "    }",
+    "    return 0;",
+    "}",
+    "",
+    "static char *mpcg_copy(const char *x, size_t n) {",
+    "    char *y = malloc(n + 1);",
+    "    memcpy(y, x, n + 1);",
+    "    return y;",
+    "}",
+    "",
+    NULL
+};
 
-    int i;
-    mpca_stmt_t **stmts = malloc(sizeof(mpca_stmt_t*) * (n+1));
+static const char *mpc_gen_mark[] = {
+    "static void mpcg_mark(mpcg_input_t *i, mpcg_mark_t *m) {",
+    "    if (i->backtrack < 1) { return; }",
+    "    i->marks++;",
+    "    m->state = i->state;",
+    "    m->last = i->last;",
+    "}",
+    "",
+    "static void mpcg_unmark(mpcg_input_t *i) {",
+    "    if (i->backtrack < 1) { return; }",
+    "    i->marks--;",
+    "    if (i->marks_cut > i->marks) { i->marks_cut = i->marks; }",
+    "}",
+    "",
+    "static void mpcg_rewind(mpcg_input_t *i, mpcg_mark_t *m) {",
+    "    if (i->backtrack < 1) { return; }",
+    "    if (i->marks <= i->marks_cut) { i->cut = 1; }",
+    "    i->state = m->state;",
+    "    i->last = m->last;",
+    "    mpcg_unmark(i);",
+    "}",
+    "",
+    NULL
+};
 
-    for (i = 0; i < n; i++) {
-        stmts[i] = xs[i];
-    }
-    stmts[n] = NULL;
+static const char *mpc_gen_commit[] = {
+    "static void mpcg_commit(mpcg_input_t *i) {",
+    "    if (i->backtrack < 1 || i->marks == 0) { return; }",
+    "    i->marks_cut = i->marks;",
+    "}",
+    "",
+    "typedef struct {",
+    "    mpc_state_t state;",
+    "    char last;",
+    "    int cut;",
+    "    int marks_cut;",
+    "} mpcg_scope_t;",
+    "",
+    "static void mpcg_scope(mpcg_input_t *i, mpcg_scope_t *s) {",
+    "    s->state = i->state;",
+    "    s->last = i->last;",
+    "    s->cut = i->cut;",
+    "    s->marks_cut = i->marks_cut;",
+    "}",
+    "",
+    "static int mpcg_unscope(mpcg_input_t *i, mpcg_scope_t *s, int r) {",
+    "    if (!r && i->cut && !s->cut) {",
+    "        i->state = s->state;",
+    "        i->last = s->last;",
+    "    }",
+    "    i->cut = s->cut;",
+    "    i->marks_cut = s->marks_cut;",
+    "    return r;",
+    "}",
+    "",
+    NULL
+};
 
-    return stmts;
-}
+static const char *mpc_gen_vals[] = {
+    "typedef struct {",
+    "    int num;",
+    "    int max;",
+    "    mpc_val_t **xs;",
+    "    mpc_val_t *stk[MPCG_VALS_MIN];",
+    "} mpcg_vals_t;",
+    "",
+    "static void mpcg_vals_init(mpcg_vals_t *v) {",
+    "    v->num = 0;",
+    "    v->max = MPCG_VALS_MIN;",
+    "    v->xs = v->stk;",
+    "}",
+    "",
+    "static void mpcg_vals_push(mpcg_vals_t *v, mpc_val_t *x) {",
+    "    if (v->num == v->max) {",
+    "        v->max = v->max + v->max / 2;",
+    "        if (v->xs == v->stk) {",
+    "            v->xs = malloc(sizeof(mpc_val_t*) * v->max);",
+    "            memcpy(v->xs, v->stk, sizeof(mpc_val_t*) * v->num);",
+    "        } else {",
+    "            v->xs = realloc(v->xs, sizeof(mpc_val_t*) * v->max);",
+    "        }",
+    "    }",
+    "    v->xs[v->num++] = x;",
+    "}",
+    "",
+    "static void mpcg_vals_free(mpcg_vals_t *v) {",
+    "    if (v->xs != v->stk) { free(v->xs); }",
+    "}",
+    "",
+    NULL
+};
 
-static void mpca_stmt_list_delete(mpc_val_t *x) {
+static const char *mpc_gen_boundary[] = {
+    "static int mpcg_boundary_anchor(char prev, char next) {",
+    "    const char* word = \"abcdefghijklmnopqrstuvwxyz\"",
+    "                       \"ABCDEFGHIJKLMNOPQRSTUVWXYZ\"",
+    "                       \"0123456789_\";",
+    "    if ( strchr(word, next) &&  prev == '\\0') { return 1; }",
+    "    if ( strchr(word, prev) &&  next == '\\0') { return 1; }",
+    "    if ( strchr(word, next) && !strchr(word, prev)) { return 1; }",
+    "    if (!strchr(word, next) &&  strchr(word, prev)) { return 1; }",
+    "    return 0;",
+    "}",
+    "",
+    NULL
+};
 
-    mpca_stmt_t **stmts = x;
+static const char *mpc_gen_newline[] = {
+    "static int mpcg_boundary_newline_anchor(char prev, char next) {",
+    "    (void)next;",
+    "    return prev == '\\n';",
+    "}",
+    "",
+    NULL
+};
 
-    while(*stmts) {
-        mpca_stmt_t *stmt = *stmts;
-        free(stmt->ident);
-        free(stmt->name);
-        mpc_soft_delete(stmt->grammar);
-        free(stmt);
-        stmts++;
+static const char *mpc_gen_rest[] = {
+    "static mpc_val_t *mpcg_fold_ast_rest(int n, mpc_val_t **xs) {",
+    "    mpc_ast_t *a = mpcf_fold_ast(n, xs);",
+    "    if (a && a->children_num == 0 && strcmp(a->tag, \">\") == 0) {",
+    "        mpc_ast_delete(a);",
+    "        return NULL;",
+    "    }",
+    "    return a;",
+    "}",
+    "",
+    NULL
+};
+
+static const char *mpc_gen_expr[] = {
+    "typedef int (*mpcg_parser_t)(mpcg_input_t*, mpc_val_t**, int);",
+    "",
+    "static void mpcg_expr_fold(mpcg_vals_t *v, int k, mpc_fold_t f) {",
+    "    mpc_val_t *x = f ? f(v->num - k, v->xs + k) : NULL;",
+    "    v->num = k;",
+    "    mpcg_vals_push(v, x);",
+    "}",
+    "",
+    "static int mpcg_expr(mpcg_input_t *i, mpc_val_t **o, int depth, int n, const mpcg_parser_t *xs,",
+    "                     const unsigned char *ps, mpc_fold_t f, mpc_dtor_t d) {",
+    "    int j, k, ok = 1;",
+    "    int fs_num = 0, fs_max = MPCG_VALS_MIN, fs_stk[MPCG_VALS_MIN], *fs = fs_stk;",
+    "    mpc_val_t *x, *y;",
+    "    mpcg_mark_t m;",
+    "    mpcg_vals_t v;",
+    "    if (!xs[0](i, &x, depth+1)) { return 0; }",
+    "    mpcg_vals_init(&v);",
+    "    mpcg_vals_push(&v, x);",
+    "    while (1) {",
+    "        mpcg_mark(i, &m);",
+    "        for (j = 1; j <= n; j++) {",
+    "            if (xs[j](i, &x, depth+1)) { break; }",
+    "            if (i->cut) { j = n + 1; break; }",
+    "        }",
+    "        if (j > n) {",
+    "            mpcg_unmark(i);",
+    "            if (i->cut) { ok = 0; }",
+    "            break;",
+    "        }",
+    "        if (!xs[0](i, &y, depth+1)) {",
+    "            mpcg_rewind(i, &m);",
+    "            if (d) { d(x); }",
+    "            if (i->cut) { ok = 0; }",
+    "            break;",
+    "        }",
+    "        mpcg_unmark(i);",
+    "        while (fs_num > 0 && fs[fs_num-1] % 256 / 2 > ps[j-1] / 2) {",
+    "            mpcg_expr_fold(&v, fs[--fs_num] / 256, f);",
+    "        }",
+    "        if (fs_num == 0 || fs[fs_num-1] % 256 / 2 != ps[j-1] / 2 || ps[j-1] % 2) {",
+    "            if (fs_num == fs_max) {",
+    "                fs_max = fs_max * 2;",
+    "                if (fs == fs_stk) {",
+    "                    fs = malloc(sizeof(int) * fs_max);",
+    "                    memcpy(fs, fs_stk, sizeof(int) * fs_num);",
+    "                } else {",
+    "                    fs = realloc(fs, sizeof(int) * fs_max);",
+    "                }",
+    "            }",
+    "            fs[fs_num++] = (v.num - 1) * 256 + ps[j-1];",
+    "        }",
+    "        mpcg_vals_push(&v, x);",
+    "        mpcg_vals_push(&v, y);",
+    "    }",
+    "    if (ok) {",
+    "        while (fs_num > 0) { mpcg_expr_fold(&v, fs[--fs_num] / 256, f); }",
+    "        *o = v.xs[0];",
+    "    } else if (d) {",
+    "        for (k = 0; k < v.num; k++) { d(v.xs[k]); }",
+    "    }",
+    "    mpcg_vals_free(&v);",
+    "    if (fs != fs_stk) { free(fs); }",
+    "    return ok;",
+    "}",
+    "",
+    NULL
+};
+
+static const char *mpc_gen_expr_ast[] = {
+    "static mpc_val_t *mpcg_fold_ast_expr(int n, mpc_val_t **xs) {",
+    "    int i;",
+    "    for (i = 0; i < n; i++) { xs[i] = mpc_ast_add_root(xs[i]); }",
+    "    return mpcf_fold_ast(n, xs);",
+    "}",
+    "",
+    NULL
+};
+
+static const mpc_gen_section_t mpc_gen_sections[] = {
+    { 0,                mpc_gen_input    },
+    { MPC_GEN_ADVANCE,  mpc_gen_advance  },
+    { MPC_GEN_CHAR,     mpc_gen_char     },
+    { MPC_GEN_STRING,   mpc_gen_string   },
+    { MPC_GEN_MARK,     mpc_gen_mark     },
+    { MPC_GEN_COMMIT,   mpc_gen_commit   },
+    { MPC_GEN_VALS,     mpc_gen_vals     },
+    { MPC_GEN_BOUNDARY, mpc_gen_boundary },
+    { MPC_GEN_NEWLINE,  mpc_gen_newline  },
+    { MPC_GEN_REST,     mpc_gen_rest     },
+    { MPC_GEN_EXPR,     mpc_gen_expr     },
+    { MPC_GEN_EXPR_AST, mpc_gen_expr_ast },
+    { 0,                NULL             }
+};
+
+typedef struct {
+    FILE *f;
+    mpc_freeze_t nodes;
+    char *skips;
+    int uses;
+    int cuts;
+    int error;
+} mpc_gen_t;
+
+static const char *mpc_gen_func(mpc_gen_t *g, mpc_func_t x) {
+    int i;
+    for (i = 1; i < MPC_SAVE_FUNCS_NUM; i++) {
+        if (mpc_save_funcs[i].f == x && mpc_save_funcs[i].name) {
+            if (x == (mpc_func_t)mpcf_fold_ast_rest)          { g->uses |= MPC_GEN_REST; }
+            if (x == (mpc_func_t)mpcf_fold_ast_expr)          { g->uses |= MPC_GEN_EXPR_AST; }
+            if (x == (mpc_func_t)mpc_boundary_anchor)         { g->uses |= MPC_GEN_BOUNDARY; }
+            if (x == (mpc_func_t)mpc_boundary_newline_anchor) { g->uses |= MPC_GEN_NEWLINE; }
+            return mpc_save_funcs[i].name;
+        }
     }
-    free(x);
+    g->error = 1;
+    return "NULL";
+}
 
+static void mpc_gen_name(mpc_gen_t *g, mpc_parser_t *p) {
+    if (p->retained && p->name) {
+        fprintf(g->f, "mpcg_rule_%s", p->name);
+    } else {
+        fprintf(g->f, "mpcg_node_%i", mpc_freeze_find(&g->nodes, p, g->nodes.nodes_num));
+    }
 }
 
-static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
+/*
+** When the grammar has cuts every choice and rule is
+** a scope for them, as in `mpc_parse_run`. A rule that
+** isn't a choice gets its body under another name and
+** is itself just the scope around it.
+*/
 
-    mpca_grammar_st_t *st = s;
-    mpca_stmt_t *stmt;
-    mpca_stmt_t **stmts = x;
-    mpc_parser_t *left;
+static int mpc_gen_scoped(mpc_gen_t *g, mpc_parser_t *p) {
+    return g->cuts && p->name && p->type != MPC_TYPE_OR;
+}
 
-    while(*stmts) {
-        stmt = *stmts;
-        left = mpca_grammar_find_parser(stmt->ident, st);
-        if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
-        if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
-        mpc_optimise(stmt->grammar);
-        mpc_define(left, stmt->grammar);
-        free(stmt->ident);
-        free(stmt->name);
-        free(stmt);
-        stmts++;
+static void mpc_gen_body_name(mpc_gen_t *g, mpc_parser_t *p) {
+    fprintf(g->f, "mpcg_body_");
+    if (p->retained && p->name) {
+        fprintf(g->f, "rule_%s", p->name);
+    } else {
+        fprintf(g->f, "node_%i", mpc_freeze_find(&g->nodes, p, g->nodes.nodes_num));
     }
+}
 
-    free(x);
+static void mpc_gen_call(mpc_gen_t *g, mpc_parser_t *p, const char *o) {
+    mpc_gen_name(g, p);
+    fprintf(g->f, "(i, %s, depth+1)", o);
+}
 
-    return NULL;
+static void mpc_gen_char_lit(mpc_gen_t *g, char c) {
+    if (c == '\'' || c == '\\') { fprintf(g->f, "'\\%c'", c); }
+    else if (c >= ' ' && c <= '~') { fprintf(g->f, "'%c'", c); }
+    else { fprintf(g->f, "'\\%03o'", (unsigned char)c); }
 }
 
-static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
+static void mpc_gen_string_lit(mpc_gen_t *g, const char *s) {
+    fputc('"', g->f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') { fprintf(g->f, "\\%c", *s); }
+        else if (*s >= ' ' && *s <= '~') { fputc(*s, g->f); }
+        else { fprintf(g->f, "\\%03o", (unsigned char)*s); }
+    }
+    fputc('"', g->f);
+}
+
+static void mpc_gen_cases(mpc_gen_t *g, const char *s) {
+    char seen[256];
+    memset(seen, 0, sizeof(seen));
+    for (; *s; s++) {
+        if (seen[(unsigned char)*s]) { continue; }
+        seen[(unsigned char)*s] = 1;
+        fprintf(g->f, "        case ");
+        mpc_gen_char_lit(g, *s);
+        fprintf(g->f, ":\n");
+    }
+}
 
-    mpc_result_t r;
-    mpc_err_t *e;
-    mpc_parser_t *Lang, *Stmt, *Grammar, *Term, *Factor, *Base;
+/*
+** Children of `skip` parsers produce no output. A
+** regex may share its parser with others so that
+** always produces output, dropped by the regex.
+*/
+static void mpc_gen_skips(mpc_gen_t *g, mpc_parser_t *p, int skip, int force) {
+    int i, n;
+    mpc_parser_t **xs;
+    if (p->retained && !force) { return; }
+    g->skips[mpc_freeze_find(&g->nodes, p, g->nodes.nodes_num)] = (char)skip;
+    if (p->type == MPC_TYPE_SKIP) { skip = 1; }
+    if (p->type == MPC_TYPE_REGEX && p->data.regex.body) { skip = 0; }
+    n = mpc_optimise_children(p, &xs);
+    for (i = 0; i < n; i++) { mpc_gen_skips(g, xs[i], skip, 0); }
+}
 
-    Lang    = mpc_new("lang");
-    Stmt    = mpc_new("stmt");
-    Grammar = mpc_new("grammar");
-    Term    = mpc_new("term");
-    Factor  = mpc_new("factor");
-    Base    = mpc_new("base");
+static void mpc_gen_primitive(mpc_gen_t *g, mpc_parser_t *p, int skip) {
 
-    mpc_define(Lang, mpc_apply_to(
-            mpc_total(mpc_predictive(mpc_many(mpca_stmt_fold, Stmt)), mpca_stmt_list_delete),
-            mpca_stmt_list_apply_to, st
-    ));
+    FILE *f = g->f;
 
-    mpc_define(Stmt, mpc_and(5, mpca_stmt_afold,
-                             mpc_tok(mpc_ident()), mpc_maybe(mpc_tok(mpc_string_lit())), mpc_sym(":"), Grammar, mpc_sym(";"),
-                             free, free, free, mpc_soft_delete
-    ));
+    fprintf(f, "    char c = i->string[i->state.pos];\n");
+    fprintf(f, "    if (depth == MPCG_MAX_DEPTH || c == '\\0') { return 0; }\n");
 
-    mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
-                                Term,
-                                mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
-                                mpc_soft_delete
-    ));
+    switch (p->type) {
+        case MPC_TYPE_SINGLE:
+            fprintf(f, "    if (c != ");
+            mpc_gen_char_lit(g, p->data.single.x);
+            fprintf(f, ") { return 0; }\n");
+            break;
+        case MPC_TYPE_RANGE:
+            fprintf(f, "    if (c < ");
+            mpc_gen_char_lit(g, p->data.range.x);
+            fprintf(f, " || c > ");
+            mpc_gen_char_lit(g, p->data.range.y);
+            fprintf(f, ") { return 0; }\n");
+            break;
+        case MPC_TYPE_ONEOF:
+            fprintf(f, "    switch (c) {\n");
+            mpc_gen_cases(g, p->data.string.x);
+            fprintf(f, "            break;\n        default: return 0;\n    }\n");
+            break;
+        case MPC_TYPE_NONEOF:
+            fprintf(f, "    switch (c) {\n");
+            mpc_gen_cases(g, p->data.string.x);
+            fprintf(f, "            return 0;\n        default: break;\n    }\n");
+            break;
+        default: break;
+    }
 
-    mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+    fprintf(f, "    mpcg_advance(i);\n");
+    if (skip) { fprintf(f, "    *o = NULL;\n"); }
+    else { fprintf(f, "    *o = mpcg_char(c);\n"); g->uses |= MPC_GEN_CHAR; }
+    fprintf(f, "    return 1;\n");
+    g->uses |= MPC_GEN_ADVANCE;
+}
 
-    mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
-                               Base,
-                               mpc_or(6,
-                                      mpc_sym("*"),
-                                      mpc_sym("+"),
-                                      mpc_sym("?"),
-                                      mpc_sym("!"),
-                                      mpc_tok_brackets(mpc_int(), free),
-                                      mpc_pass()),
-                               mpc_soft_delete
-    ));
+static void mpc_gen_repeat(mpc_gen_t *g, mpc_parser_t *p, int skip) {
 
-    mpc_define(Base, mpc_or(5,
-                            mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
-                            mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
-                            mpc_tok(mpc_and(3, mpcaf_fold_regex, mpc_regex_lit(), mpc_many(mpcf_strfold, mpc_oneof("ms")), mpc_lift_val(st), free, free)),
-                            mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
-                            mpc_tok_parens(Grammar, mpc_soft_delete)
-    ));
+    FILE *f = g->f;
+    mpc_dtor_t d = mpc_parse_fold_dtor(p->data.repeat.f);
 
-    mpc_optimise(Lang);
-    mpc_optimise(Stmt);
-    mpc_optimise(Grammar);
-    mpc_optimise(Term);
-    mpc_optimise(Factor);
-    mpc_optimise(Base);
+    if (skip && p->type != MPC_TYPE_COUNT) {
+        fprintf(f, "    int n = 0;\n    mpc_val_t *x;\n");
+        fprintf(f, "    if (depth == MPCG_MAX_DEPTH) { return 0; }\n");
+        fprintf(f, "    while (");
+        mpc_gen_call(g, p->data.repeat.x, "&x");
+        fprintf(f, ") { n++; }\n");
+        fprintf(f, "    if (i->cut%s) { return 0; }\n", p->type == MPC_TYPE_MANY1 ? " || n == 0" : "");
+        fprintf(f, "    *o = NULL;\n    return 1;\n");
+        return;
+    }
 
-    if (!mpc_parse_input(i, Lang, &r)) {
-        e = r.error;
-    } else {
-        e = NULL;
+    g->uses |= MPC_GEN_VALS;
+    fprintf(f, "    int k;\n    mpc_val_t *x;\n    mpcg_vals_t v;\n");
+    fprintf(f, "    if (depth == MPCG_MAX_DEPTH) { return 0; }\n");
+    fprintf(f, "    mpcg_vals_init(&v);\n");
+    fprintf(f, "    while (");
+    mpc_gen_call(g, p->data.repeat.x, "&x");
+    fprintf(f, ") {\n        mpcg_vals_push(&v, x);\n");
+    if (p->type == MPC_TYPE_COUNT) {
+        fprintf(f, "        if (v.num == %i) { break; }\n", p->data.repeat.n);
     }
+    fprintf(f, "    }\n");
 
-    mpc_cleanup(6, Lang, Stmt, Grammar, Term, Factor, Base);
+    if (p->type == MPC_TYPE_COUNT) {
+        fprintf(f, "    if (v.num != %i) {\n", p->data.repeat.n);
+        d = skip ? NULL : p->data.repeat.dx;
+    } else {
+        fprintf(f, "    if (i->cut%s) {\n", p->type == MPC_TYPE_MANY1 ? " || v.num == 0" : "");
+        if (skip) { d = NULL; }
+    }
+    if (d) {
+        fprintf(f, "        for (k = 0; k < v.num; k++) { %s(v.xs[k]); }\n", mpc_gen_func(g, (mpc_func_t)d));
+    } else if (!skip && p->type != MPC_TYPE_COUNT && p->data.repeat.dx) {
+        fprintf(f, "        (void)k;\n        if (v.num > 0) { %s(%s(v.num, v.xs)); }\n",
+            mpc_gen_func(g, (mpc_func_t)p->data.repeat.dx), mpc_gen_func(g, (mpc_func_t)p->data.repeat.f));
+    } else {
+        fprintf(f, "        (void)k;\n");
+    }
+    fprintf(f, "        mpcg_vals_free(&v);\n        return 0;\n    }\n");
 
-    return e;
+    if (skip) { fprintf(f, "    *o = NULL;\n"); }
+    else { fprintf(f, "    *o = %s(v.num, v.xs);\n", mpc_gen_func(g, (mpc_func_t)p->data.repeat.f)); }
+    fprintf(f, "    mpcg_vals_free(&v);\n    return 1;\n");
 }
 
-mpc_err_t *mpca_lang_file(int flags, FILE *f, ...) {
-    mpca_grammar_st_t st;
-    mpc_input_t *i;
-    mpc_err_t *err;
+static void mpc_gen_and(mpc_gen_t *g, mpc_parser_t *p, int skip) {
 
-    va_list va;
-    va_start(va, f);
+    int j, k;
+    char out[32];
+    FILE *f = g->f;
 
-    st.va = &va;
-    st.parsers_num = 0;
-    st.parsers = NULL;
-    st.flags = flags;
+    g->uses |= MPC_GEN_MARK;
+    fprintf(f, "    mpcg_mark_t m;\n    mpc_val_t *xs[%i];\n", p->data.and.n);
+    fprintf(f, "    if (depth == MPCG_MAX_DEPTH) { return 0; }\n");
+    fprintf(f, "    mpcg_mark(i, &m);\n");
 
-    i = mpc_input_new_file("<mpca_lang_file>", f);
-    err = mpca_lang_st(i, &st);
-    mpc_input_delete(i);
+    for (j = 0; j < p->data.and.n; j++) {
+        sprintf(out, "&xs[%i]", j);
+        fprintf(f, "    if (!");
+        mpc_gen_call(g, p->data.and.xs[j], out);
+        fprintf(f, ") {\n        mpcg_rewind(i, &m);\n");
+        for (k = 0; k < j && !skip; k++) {
+            if (p->data.and.dxs[k] == NULL) { continue; }
+            fprintf(f, "        %s(xs[%i]);\n", mpc_gen_func(g, (mpc_func_t)p->data.and.dxs[k]), k);
+        }
+        fprintf(f, "        return 0;\n    }\n");
+    }
 
-    free(st.parsers);
-    va_end(va);
-    return err;
+    fprintf(f, "    mpcg_unmark(i);\n");
+    if (skip) { fprintf(f, "    *o = NULL;\n"); }
+    else { fprintf(f, "    *o = %s(%i, xs);\n", mpc_gen_func(g, (mpc_func_t)p->data.and.f), p->data.and.n); }
+    fprintf(f, "    return 1;\n");
 }
 
-mpc_err_t *mpca_lang_pipe(int flags, FILE *p, ...) {
-    mpca_grammar_st_t st;
-    mpc_input_t *i;
-    mpc_err_t *err;
+static void mpc_gen_expr_table(mpc_gen_t *g, mpc_parser_t *p, int skip) {
 
-    va_list va;
-    va_start(va, p);
+    int j;
+    FILE *f = g->f;
 
-    st.va = &va;
-    st.parsers_num = 0;
-    st.parsers = NULL;
-    st.flags = flags;
+    g->uses |= MPC_GEN_EXPR | MPC_GEN_MARK | MPC_GEN_VALS;
+    fprintf(f, "    static const mpcg_parser_t xs[] = { ");
+    for (j = 0; j <= p->data.expr.n; j++) {
+        if (j) { fprintf(f, ", "); }
+        mpc_gen_name(g, p->data.expr.xs[j]);
+    }
+    fprintf(f, " };\n    static const unsigned char ps[] = { ");
+    for (j = 0; j < p->data.expr.n; j++) { fprintf(f, "%s%i", j ? ", " : "", p->data.expr.ps[j]); }
+    fprintf(f, "%s };\n", p->data.expr.n ? "" : "0");
+    fprintf(f, "    return depth != MPCG_MAX_DEPTH && mpcg_expr(i, o, depth, %i, xs, ps, ", p->data.expr.n);
+    if (skip) { fprintf(f, "NULL, NULL);\n"); return; }
+    fprintf(f, "%s, ", mpc_gen_func(g, (mpc_func_t)p->data.expr.f));
+    if (p->data.expr.dx) { fprintf(f, "(mpc_dtor_t)%s);\n", mpc_gen_func(g, (mpc_func_t)p->data.expr.dx)); }
+    else { fprintf(f, "NULL);\n"); }
+}
 
-    i = mpc_input_new_pipe("<mpca_lang_pipe>", p);
-    err = mpca_lang_st(i, &st);
-    mpc_input_delete(i);
+static void mpc_gen_parser(mpc_gen_t *g, mpc_parser_t *p, int skip) {
 
-    free(st.parsers);
-    va_end(va);
-    return err;
-}
+    int j;
+    FILE *f = g->f;
 
-mpc_err_t *mpca_lang(int flags, const char *language, ...) {
+    fprintf(f, "static int ");
+    if (mpc_gen_scoped(g, p)) { mpc_gen_body_name(g, p); } else { mpc_gen_name(g, p); }
+    fprintf(f, "(mpcg_input_t *i, mpc_val_t **o, int depth) {\n");
+
+    switch (p->type) {
+
+        case MPC_TYPE_ANY:
+        case MPC_TYPE_SINGLE:
+        case MPC_TYPE_RANGE:
+        case MPC_TYPE_ONEOF:
+        case MPC_TYPE_NONEOF:
+            mpc_gen_primitive(g, p, skip);
+            break;
+
+        case MPC_TYPE_STRING:
+            g->uses |= MPC_GEN_STRING | MPC_GEN_ADVANCE;
+            fprintf(f, "    if (depth == MPCG_MAX_DEPTH) { return 0; }\n");
+            fprintf(f, "    if (!mpcg_string(i, ");
+            mpc_gen_string_lit(g, p->data.string.x);
+            fprintf(f, ", %lu)) { return 0; }\n", (unsigned long)strlen(p->data.string.x));
+            if (skip) { fprintf(f, "    *o = NULL;\n"); }
+            else {
+                fprintf(f, "    *o = mpcg_copy(");
+                mpc_gen_string_lit(g, p->data.string.x);
+                fprintf(f, ", %lu);\n", (unsigned long)strlen(p->data.string.x));
+            }
+            fprintf(f, "    return 1;\n");
+            break;
 
-    mpca_grammar_st_t st;
-    mpc_input_t *i;
-    mpc_err_t *err;
+        case MPC_TYPE_ANCHOR:
+            fprintf(f, "    if (depth == MPCG_MAX_DEPTH) { return 0; }\n");
+            fprintf(f, "    *o = NULL;\n");
+            fprintf(f, "    return %s(i->last, i->string[i->state.pos]);\n",
+                mpc_gen_func(g, (mpc_func_t)p->data.anchor.f));
+            break;
 
-    va_list va;
-    va_start(va, language);
+        case MPC_TYPE_SOI:
+            fprintf(f, "    if (depth == MPCG_MAX_DEPTH) { return 0; }\n");
+            fprintf(f, "    *o = NULL;\n    return i->last == '\\0';\n");
+            break;
 
-    st.va = &va;
-    st.parsers_num = 0;
-    st.parsers = NULL;
-    st.flags = flags;
+        case MPC_TYPE_EOI:
+            fprintf(f, "    if (depth == MPCG_MAX_DEPTH) { return 0; }\n");
+            fprintf(f, "    *o = NULL;\n");
+            fprintf(f, "    if (i->state.term || i->string[i->state.pos] != '\\0') { return 0; }\n");
+            fprintf(f, "    i->state.term = 1;\n    return 1;\n");
+            break;
 
-    i = mpc_input_new_string("<mpca_lang>", language);
-    err = mpca_lang_st(i, &st);
-    mpc_input_delete(i);
+        case MPC_TYPE_PASS:
+            fprintf(f, "    (void)i;\n    (void)depth;\n    *o = NULL;\n    return 1;\n");
+            break;
 
-    free(st.parsers);
-    va_end(va);
-    return err;
-}
+        case MPC_TYPE_LIFT:
+            fprintf(f, "    (void)i;\n    if (depth == MPCG_MAX_DEPTH) { return 0; }\n");
+            fprintf(f, "    *o = %s();\n    return 1;\n", mpc_gen_func(g, (mpc_func_t)p->data.lift.lf));
+            break;
 
-mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
+        case MPC_TYPE_LIFT_VAL:
+            if (p->data.lift.x) { g->error = 1; }
+            fprintf(f, "    (void)i;\n    if (depth == MPCG_MAX_DEPTH) { return 0; }\n");
+            fprintf(f, "    *o = NULL;\n    return 1;\n");
+            break;
 
-    mpca_grammar_st_t st;
-    mpc_input_t *i;
-    mpc_err_t *err;
+        case MPC_TYPE_STATE:
+            fprintf(f, "    mpc_state_t *s;\n");
+            fprintf(f, "    if (depth == MPCG_MAX_DEPTH) { return 0; }\n");
+            fprintf(f, "    s = malloc(sizeof(mpc_state_t));\n");
+            fprintf(f, "    *s = i->state;\n    *o = s;\n    return 1;\n");
+            break;
 
-    va_list va;
+        case MPC_TYPE_CUT:
+            g->uses |= MPC_GEN_COMMIT;
+            fprintf(f, "    if (depth == MPCG_MAX_DEPTH) { return 0; }\n");
+            fprintf(f, "    mpcg_commit(i);\n    *o = NULL;\n    return 1;\n");
+            break;
 
-    FILE *f = fopen(filename, "rb");
+        case MPC_TYPE_APPLY:
+        case MPC_TYPE_SKIP:
+            fprintf(f, "    if (depth == MPCG_MAX_DEPTH || !");
+            mpc_gen_call(g, p->data.apply.x, "o");
+            fprintf(f, ") { return 0; }\n");
+            if (p->type == MPC_TYPE_SKIP) { fprintf(f, "    *o = NULL;\n"); }
+            else if (!skip) { fprintf(f, "    *o = %s(*o);\n", mpc_gen_func(g, (mpc_func_t)p->data.apply.f)); }
+            fprintf(f, "    return 1;\n");
+            break;
 
-    if (f == NULL) {
-        err = mpc_err_file(filename, "Unable to open file!");
-        return err;
-    }
+        case MPC_TYPE_APPLY_TO:
+            if (!mpc_freeze_tag(p)) { g->error = 1; }
+            fprintf(f, "    if (depth == MPCG_MAX_DEPTH || !");
+            mpc_gen_call(g, p->data.apply_to.x, "o");
+            fprintf(f, ") { return 0; }\n");
+            fprintf(f, "    *o = %s(*o, ", mpc_gen_func(g, (mpc_func_t)p->data.apply_to.f));
+            mpc_gen_string_lit(g, p->data.apply_to.d ? p->data.apply_to.d : "");
+            fprintf(f, ");\n");
+            if (p->data.apply_to.id) { fprintf(f, "    *o = mpc_ast_add_tag_id(*o, %d);\n", p->data.apply_to.id); }
+            fprintf(f, "    return 1;\n");
+            break;
 
-    va_start(va, filename);
+        case MPC_TYPE_EXPECT:
+            fprintf(f, "    return depth != MPCG_MAX_DEPTH && ");
+            mpc_gen_call(g, p->data.expect.x, "o");
+            fprintf(f, ";\n");
+            break;
 
-    st.va = &va;
-    st.parsers_num = 0;
-    st.parsers = NULL;
-    st.flags = flags;
+        case MPC_TYPE_REGEX:
+            if (skip && p->data.regex.body) {
+                fprintf(f, "    if (depth == MPCG_MAX_DEPTH || !");
+                mpc_gen_call(g, p->data.regex.x, "o");
+                fprintf(f, ") { return 0; }\n    free(*o);\n    *o = NULL;\n    return 1;\n");
+                break;
+            }
+            fprintf(f, "    return depth != MPCG_MAX_DEPTH && ");
+            mpc_gen_call(g, p->data.regex.x, "o");
+            fprintf(f, ";\n");
+            break;
 
-    i = mpc_input_new_file(filename, f);
-    err = mpca_lang_st(i, &st);
-    mpc_input_delete(i);
+        case MPC_TYPE_PREDICT:
+            fprintf(f, "    int r;\n");
+            fprintf(f, "    if (depth == MPCG_MAX_DEPTH) { return 0; }\n");
+            fprintf(f, "    i->backtrack--;\n    r = ");
+            mpc_gen_call(g, p->data.predict.x, "o");
+            fprintf(f, ";\n    i->backtrack++;\n    return r;\n");
+            break;
 
-    free(st.parsers);
-    va_end(va);
+        case MPC_TYPE_NOT:
+            g->uses |= MPC_GEN_MARK;
+            fprintf(f, "    mpcg_mark_t m;\n    mpc_val_t *x;\n");
+            fprintf(f, "    if (depth == MPCG_MAX_DEPTH) { return 0; }\n");
+            fprintf(f, "    mpcg_mark(i, &m);\n    if (");
+            mpc_gen_call(g, p->data.not.x, "&x");
+            fprintf(f, ") {\n        mpcg_rewind(i, &m);\n");
+            if (!skip && p->data.not.dx) {
+                fprintf(f, "        %s(x);\n", mpc_gen_func(g, (mpc_func_t)p->data.not.dx));
+            }
+            fprintf(f, "        return 0;\n    }\n    mpcg_unmark(i);\n");
+            fprintf(f, "    if (i->cut) { return 0; }\n");
+            if (skip) { fprintf(f, "    *o = NULL;\n"); }
+            else { fprintf(f, "    *o = %s();\n", mpc_gen_func(g, (mpc_func_t)p->data.not.lf)); }
+            fprintf(f, "    return 1;\n");
+            break;
 
-    fclose(f);
+        case MPC_TYPE_MAYBE:
+            fprintf(f, "    if (depth == MPCG_MAX_DEPTH) { return 0; }\n    if (");
+            mpc_gen_call(g, p->data.not.x, "o");
+            fprintf(f, ") { return 1; }\n    if (i->cut) { return 0; }\n");
+            if (skip) { fprintf(f, "    *o = NULL;\n"); }
+            else { fprintf(f, "    *o = %s();\n", mpc_gen_func(g, (mpc_func_t)p->data.not.lf)); }
+            fprintf(f, "    return 1;\n");
+            break;
 
-    return err;
-}
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+        case MPC_TYPE_COUNT:
+            mpc_gen_repeat(g, p, skip);
+            break;
 
-static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
+        case MPC_TYPE_OR:
+            if (g->cuts && p->data.or.n > 0) {
+                g->uses |= MPC_GEN_COMMIT;
+                fprintf(f, "    mpcg_scope_t s;\n");
+                fprintf(f, "    if (depth == MPCG_MAX_DEPTH) { return 0; }\n");
+                fprintf(f, "    mpcg_scope(i, &s);\n");
+                for (j = 0; j < p->data.or.n; j++) {
+                    fprintf(f, "    if (");
+                    mpc_gen_call(g, p->data.or.xs[j], "o");
+                    fprintf(f, ") { return mpcg_unscope(i, &s, 1); }\n");
+                    fprintf(f, "    if (i->cut) { return mpcg_unscope(i, &s, 0); }\n");
+                }
+                fprintf(f, "    return mpcg_unscope(i, &s, 0);\n");
+                break;
+            }
+            fprintf(f, "    if (depth == MPCG_MAX_DEPTH) { return 0; }\n");
+            if (p->data.or.n == 0) { fprintf(f, "    (void)i;\n    *o = NULL;\n    return 1;\n"); break; }
+            for (j = 0; j < p->data.or.n; j++) {
+                fprintf(f, "    if (");
+                mpc_gen_call(g, p->data.or.xs[j], "o");
+                fprintf(f, ") { return 1; }\n    if (i->cut) { return 0; }\n");
+            }
+            fprintf(f, "    return 0;\n");
+            break;
 
-    int i, total;
+        case MPC_TYPE_AND:
+            if (p->data.and.n == 0) {
+                fprintf(f, "    (void)i;\n    if (depth == MPCG_MAX_DEPTH) { return 0; }\n");
+                fprintf(f, "    *o = NULL;\n    return 1;\n");
+                break;
+            }
+            mpc_gen_and(g, p, skip);
+            break;
 
-    if (p->retained && !force) { return 0; }
+        case MPC_TYPE_EXPR:
+            mpc_gen_expr_table(g, p, skip);
+            break;
 
-    if (p->type == MPC_TYPE_EXPECT) { return 1 + mpc_nodecount_unretained(p->data.expect.x, 0); }
+        /* Undefined, failing and user defined parsers */
+        default:
+            if (p->type != MPC_TYPE_UNDEFINED && p->type != MPC_TYPE_FAIL) { g->error = 1; }
+            fprintf(f, "    (void)i;\n    (void)o;\n    (void)depth;\n    return 0;\n");
+            break;
+    }
 
-    if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
-    if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
-    if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+    fprintf(f, "}\n\n");
 
-    if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
-    if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
+    if (mpc_gen_scoped(g, p)) {
+        g->uses |= MPC_GEN_COMMIT;
+        fprintf(f, "static int ");
+        mpc_gen_name(g, p);
+        fprintf(f, "(mpcg_input_t *i, mpc_val_t **o, int depth) {\n");
+        fprintf(f, "    mpcg_scope_t s;\n    mpcg_scope(i, &s);\n    return mpcg_unscope(i, &s, ");
+        mpc_gen_body_name(g, p);
+        fprintf(f, "(i, o, depth));\n}\n\n");
+    }
+}
 
-    if (p->type == MPC_TYPE_NOT)   { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
-    if (p->type == MPC_TYPE_MAYBE) { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
+static void mpc_gen_lines(FILE *f, const char **lines) {
+    for (; *lines; lines++) { fprintf(f, "%s\n", *lines); }
+}
 
-    if (p->type == MPC_TYPE_MANY)  { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
-    if (p->type == MPC_TYPE_MANY1) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
-    if (p->type == MPC_TYPE_COUNT) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+static void mpc_gen_flags(FILE *f, int flags) {
 
-    if (p->type == MPC_TYPE_OR) {
-        total = 1;
-        for(i = 0; i < p->data.or.n; i++) {
-            total += mpc_nodecount_unretained(p->data.or.xs[i], 0);
-        }
-        return total;
-    }
+    int i, n = 0;
+    static const char *names[] = {
+        "MPCA_LANG_PREDICTIVE", "MPCA_LANG_WHITESPACE_SENSITIVE", "MPCA_LANG_NO_STATE",
+        "MPCA_LANG_NO_FUSE", "MPCA_LANG_NO_INLINE", "MPCA_LANG_NO_FACTOR", "MPCA_LANG_NO_RULE_IDS"
+    };
 
-    if (p->type == MPC_TYPE_AND) {
-        total = 1;
-        for(i = 0; i < p->data.and.n; i++) {
-            total += mpc_nodecount_unretained(p->data.and.xs[i], 0);
-        }
-        return total;
+    for (i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+        if (flags & (1 << i)) { fprintf(f, n++ ? " | %s" : "%s", names[i]); }
     }
 
-    return 1;
-
+    if (n == 0) { fprintf(f, "MPCA_LANG_DEFAULT"); }
 }
 
-void mpc_stats(mpc_parser_t* p) {
-    printf("Stats\n");
-    printf("=====\n");
-    printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
-}
+static void mpc_gen_source(mpc_gen_t *g, FILE *f, const char *prefix, int flags, const char *grammar, mpca_grammar_st_t *st) {
 
-static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
+    int i, c;
+    const mpc_gen_section_t *sec;
+    FILE *body = tmpfile();
 
-    int i, n, m;
-    mpc_parser_t *t;
+    g->cuts = 0;
+    for (i = 0; i < g->nodes.nodes_num; i++) {
+        if (g->nodes.nodes[i]->type == MPC_TYPE_CUT) { g->cuts = 1; }
+    }
 
-    if (p->retained && !force) { return; }
+    /* Parsers are written first as they decide which helpers are needed */
+    g->f = body;
+    for (i = 0; i < g->nodes.nodes_num; i++) {
+        mpc_gen_parser(g, g->nodes.nodes[i], g->skips[i]);
+    }
+    g->f = f;
 
-    /* Optimise Subexpressions */
+    fprintf(f, "/* Generated by mpca_gen. Do not edit. */\n\n");
+    fprintf(f, "#include <stdlib.h>\n#include <string.h>\n#include \"mpc.h\"\n\n");
+    fprintf(f, "#ifndef _WIN32\n#include <pthread.h>\n#endif\n\n");
 
-    if (p->type == MPC_TYPE_EXPECT)     { mpc_optimise_unretained(p->data.expect.x, 0); }
-    if (p->type == MPC_TYPE_APPLY)      { mpc_optimise_unretained(p->data.apply.x, 0); }
-    if (p->type == MPC_TYPE_APPLY_TO)   { mpc_optimise_unretained(p->data.apply_to.x, 0); }
-    if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0); }
-    if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0); }
-    if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0); }
-    if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0); }
-    if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0); }
-    if (p->type == MPC_TYPE_MANY)       { mpc_optimise_unretained(p->data.repeat.x, 0); }
-    if (p->type == MPC_TYPE_MANY1)      { mpc_optimise_unretained(p->data.repeat.x, 0); }
-    if (p->type == MPC_TYPE_COUNT)      { mpc_optimise_unretained(p->data.repeat.x, 0); }
+    for (sec = mpc_gen_sections; sec->lines; sec++) {
+        if (sec->uses == 0 || (g->uses & sec->uses)) { mpc_gen_lines(f, sec->lines); }
+    }
 
-    if (p->type == MPC_TYPE_OR) {
-        for(i = 0; i < p->data.or.n; i++) {
-            mpc_optimise_unretained(p->data.or.xs[i], 0);
-        }
+    for (i = 0; i < g->nodes.nodes_num; i++) {
+        fprintf(f, "static int ");
+        mpc_gen_name(g, g->nodes.nodes[i]);
+        fprintf(f, "(mpcg_input_t *i, mpc_val_t **o, int depth);\n");
     }
+    fprintf(f, "\n");
+
+    rewind(body);
+    while ((c = fgetc(body)) != EOF) { fputc(c, f); }
+    fclose(body);
+
+    /* Failures are parsed again by the interpreter for the error */
+    fprintf(f, "static const char *mpcg_grammar =\n");
+    while (*grammar) {
+        const char *end = strchr(grammar, '\n');
+        size_t n = end ? (size_t)(end - grammar + 1) : strlen(grammar);
+        char *line = malloc(n + 1);
+        memcpy(line, grammar, n);
+        line[n] = '\0';
+        fprintf(f, "    ");
+        mpc_gen_string_lit(g, line);
+        fprintf(f, "\n");
+        free(line);
+        grammar += n;
+    }
+    fprintf(f, "    \"\";\n\n");
+
+    /* The interpreted grammar is built on the first failure and kept */
+    fprintf(f, "static mpc_parser_t *mpcg_parsers[%i];\nstatic int mpcg_built = 0;\n", st->parsers_num);
+    fprintf(f, "#ifndef _WIN32\nstatic pthread_mutex_t mpcg_lock = PTHREAD_MUTEX_INITIALIZER;\n#endif\n\n");
+
+    fprintf(f, "static void mpcg_delete(void) {\n    int k;\n");
+    fprintf(f, "    for (k = 0; k < %i; k++) { mpc_undefine(mpcg_parsers[k]); }\n", st->parsers_num);
+    fprintf(f, "    for (k = 0; k < %i; k++) { mpc_delete(mpcg_parsers[k]); }\n", st->parsers_num);
+    fprintf(f, "    mpcg_built = 0;\n}\n\n");
+
+    fprintf(f, "static mpc_err_t *mpcg_build(void) {\n    mpc_err_t *e = NULL;\n");
+    fprintf(f, "#ifndef _WIN32\n    pthread_mutex_lock(&mpcg_lock);\n#endif\n");
+    fprintf(f, "    if (!mpcg_built) {\n");
+    for (i = 0; i < st->parsers_num; i++) {
+        fprintf(f, "        mpcg_parsers[%i] = mpc_new(", i);
+        mpc_gen_string_lit(g, st->parsers[i]->name);
+        fprintf(f, ");\n");
+    }
+    fprintf(f, "        e = mpca_lang(");
+    mpc_gen_flags(f, flags);
+    fprintf(f, ", mpcg_grammar");
+    for (i = 0; i < st->parsers_num; i++) { fprintf(f, ", mpcg_parsers[%i]", i); }
+    fprintf(f, ", NULL);\n");
+    fprintf(f, "        mpcg_built = 1;\n        if (e) { mpcg_delete(); }\n    }\n");
+    fprintf(f, "#ifndef _WIN32\n    pthread_mutex_unlock(&mpcg_lock);\n#endif\n");
+    fprintf(f, "    return e;\n}\n\n");
+
+    fprintf(f, "static int mpcg_fallback(const char *filename, const char *string, int rule, mpc_result_t *r) {\n");
+    fprintf(f, "    mpc_err_t *e = mpcg_build();\n");
+    fprintf(f, "    if (e) { r->error = e; return 0; }\n");
+    fprintf(f, "    return mpc_parse(filename, string, mpcg_parsers[rule], r);\n}\n\n");
+
+    fprintf(f, "void %s_cleanup(void) {\n", prefix);
+    fprintf(f, "#ifndef _WIN32\n    pthread_mutex_lock(&mpcg_lock);\n#endif\n");
+    fprintf(f, "    if (mpcg_built) { mpcg_delete(); }\n");
+    fprintf(f, "#ifndef _WIN32\n    pthread_mutex_unlock(&mpcg_lock);\n#endif\n}\n");
+
+    for (i = 0; i < st->parsers_num; i++) {
+        if (st->parsers[i]->type == MPC_TYPE_UNDEFINED) { continue; }
+        fprintf(f, "\nint %s_%s(const char *filename, const char *string, mpc_result_t *r) {\n", prefix, st->parsers[i]->name);
+        fprintf(f, "    mpcg_input_t i;\n    mpc_val_t *x;\n");
+        fprintf(f, "    i.string = string;\n");
+        fprintf(f, "    i.state.pos = 0;\n    i.state.row = 0;\n    i.state.col = 0;\n    i.state.term = 0;\n");
+        fprintf(f, "    i.last = '\\0';\n    i.backtrack = 1;\n    i.marks = 0;\n    i.marks_cut = 0;\n    i.cut = 0;\n");
+        fprintf(f, "    if (mpcg_rule_%s(&i, &x, 0)) {\n", st->parsers[i]->name);
+        fprintf(f, "        r->output = x;\n        return 1;\n    }\n");
+        fprintf(f, "    return mpcg_fallback(filename, string, %i, r);\n}\n", i);
+    }
+}
 
-    if (p->type == MPC_TYPE_AND) {
-        for(i = 0; i < p->data.and.n; i++) {
-            mpc_optimise_unretained(p->data.and.xs[i], 0);
-        }
+static void mpc_gen_header(FILE *f, const char *prefix, mpca_grammar_st_t *st) {
+
+    int i;
+    const char *c;
+
+    fprintf(f, "/* Generated by mpca_gen. Do not edit. */\n\n");
+    fprintf(f, "#ifndef ");
+    for (c = prefix; *c; c++) { fputc(toupper((unsigned char)*c), f); }
+    fprintf(f, "_H\n#define ");
+    for (c = prefix; *c; c++) { fputc(toupper((unsigned char)*c), f); }
+    fprintf(f, "_H\n\n#include \"mpc.h\"\n\n");
+
+    for (i = 0; i < st->parsers_num; i++) {
+        if (st->parsers[i]->type == MPC_TYPE_UNDEFINED) { continue; }
+        fprintf(f, "int %s_%s(const char *filename, const char *string, mpc_result_t *r);\n",
+            prefix, st->parsers[i]->name);
     }
 
-    /* Perform optimisations */
+    fprintf(f, "\n/* Frees the grammar kept to give the errors of failed parses */\n");
+    fprintf(f, "void %s_cleanup(void);\n", prefix);
+    fprintf(f, "\n#endif\n");
+}
 
-    while (1) {
+mpc_err_t *mpca_gen(int flags, const char *grammar, const char *prefix, FILE *source, FILE *header) {
 
-        /* Merge rhs `or` */
-        if (p->type == MPC_TYPE_OR
-            &&  p->data.or.xs[p->data.or.n-1]->type == MPC_TYPE_OR
-            && !p->data.or.xs[p->data.or.n-1]->retained) {
-            t = p->data.or.xs[p->data.or.n-1];
-            n = p->data.or.n; m = t->data.or.n;
-            p->data.or.n = n + m - 1;
-            p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
-            memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
-            free(t->data.or.xs); free(t->name); free(t);
-            continue;
-        }
+    int i;
+    mpca_grammar_st_t st;
+    mpc_input_t *in;
+    mpc_err_t *err;
+    mpc_gen_t g;
 
-        /* Merge lhs `or` */
-        if (p->type == MPC_TYPE_OR
-            &&  p->data.or.xs[0]->type == MPC_TYPE_OR
-            && !p->data.or.xs[0]->retained) {
-            t = p->data.or.xs[0];
-            n = p->data.or.n; m = t->data.or.n;
-            p->data.or.n = n + m - 1;
-            p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
-            memmove(p->data.or.xs + m, p->data.or.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
-            memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
-            free(t->data.or.xs); free(t->name); free(t);
-            continue;
-        }
+    mpca_grammar_st_init(&st, flags, NULL, 0, NULL);
+    st.create = 1;
 
-        /* Remove ast `pass` */
-        if (p->type == MPC_TYPE_AND
-            &&  p->data.and.n == 2
-            &&  p->data.and.xs[0]->type == MPC_TYPE_PASS
-            && !p->data.and.xs[0]->retained
-            &&  p->data.and.f == mpcf_fold_ast) {
-            t = p->data.and.xs[1];
-            mpc_delete(p->data.and.xs[0]);
-            free(p->data.and.xs); free(p->data.and.dxs); free(p->name);
-            memcpy(p, t, sizeof(mpc_parser_t));
-            free(t);
-            continue;
-        }
+    in = mpc_input_new_string("<mpca_gen>", grammar);
+    err = mpca_lang_st(in, &st);
+    mpc_input_delete(in);
 
-        /* Merge ast lhs `and` */
-        if (p->type == MPC_TYPE_AND
-            &&  p->data.and.f == mpcf_fold_ast
-            &&  p->data.and.xs[0]->type == MPC_TYPE_AND
-            && !p->data.and.xs[0]->retained
-            &&  p->data.and.xs[0]->data.and.f == mpcf_fold_ast) {
-            t = p->data.and.xs[0];
-            n = p->data.and.n; m = t->data.and.n;
-            p->data.and.n = n + m - 1;
-            p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m - 1));
-            p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
-            memmove(p->data.and.xs + m, p->data.and.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
-            memmove(p->data.and.xs, t->data.and.xs, m * sizeof(mpc_parser_t*));
-            for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete; }
-            free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
-            continue;
-        }
+    if (err == NULL) {
 
-        /* Merge ast rhs `and` */
-        if (p->type == MPC_TYPE_AND
-            &&  p->data.and.f == mpcf_fold_ast
-            &&  p->data.and.xs[p->data.and.n-1]->type == MPC_TYPE_AND
-            && !p->data.and.xs[p->data.and.n-1]->retained
-            &&  p->data.and.xs[p->data.and.n-1]->data.and.f == mpcf_fold_ast) {
-            t = p->data.and.xs[p->data.and.n-1];
-            n = p->data.and.n; m = t->data.and.n;
-            p->data.and.n = n + m - 1;
-            p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m -1));
-            p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
-            memmove(p->data.and.xs + n - 1, t->data.and.xs, m * sizeof(mpc_parser_t*));
-            for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete; }
-            free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
-            continue;
-        }
+        g.f = NULL;
+        g.uses = 0;
+        g.error = 0;
+        mpc_freeze_init(&g.nodes);
 
-        /* Remove re `lift` */
-        if (p->type == MPC_TYPE_AND
-            &&  p->data.and.n == 2
-            &&  p->data.and.xs[0]->type == MPC_TYPE_LIFT
-            &&  p->data.and.xs[0]->data.lift.lf == mpcf_ctor_str
-            && !p->data.and.xs[0]->retained
-            &&  p->data.and.f == mpcf_strfold) {
-            t = p->data.and.xs[1];
-            mpc_delete(p->data.and.xs[0]);
-            free(p->data.and.xs); free(p->data.and.dxs); free(p->name);
-            memcpy(p, t, sizeof(mpc_parser_t));
-            free(t);
-            continue;
+        for (i = 0; i < st.parsers_num; i++) {
+            mpc_freeze_collect(&g.nodes, st.parsers[i]);
         }
 
-        /* Merge re lhs `and` */
-        if (p->type == MPC_TYPE_AND
-            &&  p->data.and.f == mpcf_strfold
-            &&  p->data.and.xs[0]->type == MPC_TYPE_AND
-            && !p->data.and.xs[0]->retained
-            &&  p->data.and.xs[0]->data.and.f == mpcf_strfold) {
-            t = p->data.and.xs[0];
-            n = p->data.and.n; m = t->data.and.n;
-            p->data.and.n = n + m - 1;
-            p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m - 1));
-            p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
-            memmove(p->data.and.xs + m, p->data.and.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
-            memmove(p->data.and.xs, t->data.and.xs, m * sizeof(mpc_parser_t*));
-            for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = free; }
-            free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
-            continue;
+        g.skips = calloc(g.nodes.nodes_num, 1);
+        for (i = 0; i < st.parsers_num; i++) {
+            mpc_gen_skips(&g, st.parsers[i], 0, 1);
         }
 
-        /* Merge re rhs `and` */
-        if (p->type == MPC_TYPE_AND
-            &&  p->data.and.f == mpcf_strfold
-            &&  p->data.and.xs[p->data.and.n-1]->type == MPC_TYPE_AND
-            && !p->data.and.xs[p->data.and.n-1]->retained
-            &&  p->data.and.xs[p->data.and.n-1]->data.and.f == mpcf_strfold) {
-            t = p->data.and.xs[p->data.and.n-1];
-            n = p->data.and.n; m = t->data.and.n;
-            p->data.and.n = n + m - 1;
-            p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m -1));
-            p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
-            memmove(p->data.and.xs + n - 1, t->data.and.xs, m * sizeof(mpc_parser_t*));
-            for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = free; }
-            free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t);
-            continue;
-        }
+        mpc_gen_source(&g, source, prefix, flags, grammar, &st);
+        if (header) { mpc_gen_header(header, prefix, &st); }
 
-        return;
+        if (g.error) { err = mpc_err_file("<mpca_gen>", "Grammar uses functions which can't be generated!"); }
 
+        free(g.skips);
+        mpc_freeze_free(&g.nodes);
     }
 
-}
+    for (i = 0; i < st.parsers_num; i++) { mpc_undefine(st.parsers[i]); }
+    for (i = 0; i < st.parsers_num; i++) { mpc_delete(st.parsers[i]); }
+    mpca_grammar_st_free(&st);
 
-void mpc_optimise(mpc_parser_t *p) {
-    mpc_optimise_unretained(p, 1);
+    return err;
 }
-
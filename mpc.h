@@ -71,6 +71,165 @@ int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/*
+** Parse Budget
+**
+** Any limit left as zero is unbounded. Steps count
+** every parser entered, bytes count every character
+** consumed (again after backtracking) and time is
+** the wall time in seconds the parse has taken.
+** Running out fails the parse with the failure
+** "Parse budget exhausted!". From then on every
+** parser fails, even `mpc_many` and `mpc_maybe`, so
+** no partial result is ever returned. A value whose
+** destructor was given as `mpcf_dtor_null` because
+** what follows it can't fail, as `mpc_tok` does, is
+** dropped without being freed.
+** A `profile`, if given, is filled in as it parses,
+** and a `trace` file is written with a begin and an
+** end event for each named rule the parse enters, as
+** Chrome trace event JSON which trace viewers such
+** as Perfetto show as a flame chart. The end event
+** gives the position, if the rule matched and the
+** bytes it read (or gave back on failure).
+** If `stats` is given it is set to the counts below
+** once the parse is done. An `ast_arena` is where the
+** AST is built (see AST Arenas below). Given an
+** `ast_cache` directory, the AST of an input already
+** parsed with the same grammar is loaded from there
+** instead, through a view of the file, and new ones
+** are saved there (see AST Saving and AST Views
+** below). This is only for parsers which give
+** an `mpc_ast_t`, and only happens if the grammar can
+** be saved with `mpc_save`. When the AST is loaded
+** `stats` is zeroed, as nothing was parsed, and the
+** other options have no effect.
+*/
+
+struct mpc_profile_t;
+typedef struct mpc_profile_t mpc_profile_t;
+
+struct mpc_ast_arena_t;
+typedef struct mpc_ast_arena_t mpc_ast_arena_t;
+
+/*
+** Counts which every parse keeps. `marks` is the
+** backtracking points made and `rewinds` those
+** which were gone back to. `depth` is the deepest
+** parser nesting, which fails the parse at 1000.
+** Small allocations come from a pool of 512 slots
+** per parse (`pool_hits`) and fall back on `malloc`
+** once it is full (`pool_misses`); larger ones
+** always use `malloc` (`heap`). `errors` counts the
+** errors built and `bytes` the characters read,
+** again after backtracking.
+*/
+
+typedef struct {
+    long marks;
+    long rewinds;
+    int depth;
+    long pool_hits;
+    long pool_misses;
+    long heap;
+    long errors;
+    long bytes;
+} mpc_parse_stats_t;
+
+typedef struct {
+    long max_steps;
+    long max_bytes;
+    double max_time;
+    mpc_profile_t *profile;
+    FILE *trace;
+    mpc_parse_stats_t *stats;
+    mpc_ast_arena_t *ast_arena;
+    const char *ast_cache;
+} mpc_parse_opts_t;
+
+int mpc_parse_ex(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r, const mpc_parse_opts_t *opts);
+
+/*
+** Profiling
+**
+** Counts, for every parser node, how many times it
+** was tried, succeeded and failed, how many of those
+** failures gave back input, and the bytes read inside
+** it. With `MPC_PROFILE_TIME` the time spent in each
+** node, less its children and the cost of reading
+** the monotonic clock, is taken as well, which slows
+** parsing down a little. Inlined copies of a rule
+** keep its name, so are counted as that rule rather
+** than the one they were copied into. Counts add up
+** over every parse the profile is given to, which
+** must not run at the same time. `mpc_profile_report`
+** prints the nodes reachable from `p` by cost and the
+** totals for each named rule. Without a profile
+** nothing is kept.
+*/
+
+enum {
+    MPC_PROFILE_DEFAULT = 0,
+    MPC_PROFILE_TIME    = 1
+};
+
+mpc_profile_t *mpc_profile_new(int flags);
+void mpc_profile_delete(mpc_profile_t *x);
+void mpc_profile_report(mpc_profile_t *x, mpc_parser_t *p, FILE *f);
+
+/*
+** Parses `p` repeatedly until the end of `pipe`,
+** passing each result on to `f` which takes
+** ownership of it. Stops early if `f` returns
+** zero. On failure `r` holds the error. An item
+** which consumes no input would be parsed forever,
+** so after passing it to `f` this fails with the
+** error "Parser consumed no input!".
+*/
+
+typedef int(*mpc_each_t)(mpc_val_t*,void*);
+
+int mpc_parse_each(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_each_t f, void *d, mpc_result_t *r);
+
+/*
+** Parsing never modifies a parser, so a finished
+** grammar can be shared between threads. This
+** parses each of `n` strings into `rs`, storing
+** whether it succeeded in `oks`, using up to
+** `threads` threads. Returns the number of
+** successful parses.
+*/
+
+int mpc_parse_many(const char *filename, const char **strings, int n, mpc_parser_t *p, mpc_result_t *rs, int *oks, int threads);
+
+/*
+** Token Input
+**
+** A lexer is built from `n` pairs of flags and a
+** pattern, either a literal string or a regex with
+** `MPC_LEX_REGEX`. The kind of a token is its index
+** in the table. Input is split into the longest
+** match at each point, dropping kinds marked with
+** `MPC_LEX_SKIP`, before `p` is run over the tokens.
+** Only `mpc_token` and the combinators are of use
+** then. It outputs the text of a token of `kind`.
+** At most 255 kinds are supported.
+*/
+
+enum {
+    MPC_LEX_LITERAL = 0,
+    MPC_LEX_REGEX   = 1,
+    MPC_LEX_SKIP    = 2
+};
+
+struct mpc_lexer_t;
+typedef struct mpc_lexer_t mpc_lexer_t;
+
+mpc_lexer_t *mpc_lexer_new(int n, ...);
+void mpc_lexer_delete(mpc_lexer_t *l);
+mpc_parser_t *mpc_token(const mpc_lexer_t *l, int kind);
+int mpc_parse_tokens(const char *filename, const char *string, const mpc_lexer_t *l, mpc_parser_t *p, mpc_result_t *r);
+
 /*
 ** Function Types
 */
@@ -120,6 +279,7 @@ mpc_parser_t *mpc_lift(mpc_ctor_t f);
 mpc_parser_t *mpc_lift_val(mpc_val_t *x);
 mpc_parser_t *mpc_anchor(int(*f)(char,char));
 mpc_parser_t *mpc_state(void);
+mpc_parser_t *mpc_cut(void);
 
 /*
 ** Combinator Parsers
@@ -148,6 +308,24 @@ mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
 
+/*
+** Parses operands `a` separated by infix operators.
+** Takes `n` triples of operator parser, precedence
+** and associativity. Higher precedences bind more
+** tightly. Each run of operators at one level is
+** folded once with `f`, operands and operators in
+** order, so `1 + 2 - 3` gives a single fold of
+** five. On failure values are deleted with `da`.
+** At most 127 operators are supported.
+*/
+
+enum {
+    MPC_ASSOC_LEFT  = 0,
+    MPC_ASSOC_RIGHT = 1
+};
+
+mpc_parser_t *mpc_expr(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da, ...);
+
 /*
 ** Common Parsers
 */
@@ -276,6 +454,15 @@ enum {
 mpc_parser_t *mpc_re(const char *re);
 mpc_parser_t *mpc_re_mode(const char *re, int mode);
 
+/*
+** Regexes are compiled with a grammar for each mode,
+** built the first time it is needed and then kept.
+** `mpc_re_cleanup` frees them. Regexes already made
+** don't use them, and later ones build them again.
+*/
+
+void mpc_re_cleanup(void);
+
 /*
 ** AST
 */
@@ -286,6 +473,8 @@ typedef struct mpc_ast_t {
     mpc_state_t state;
     int children_num;
     struct mpc_ast_t** children;
+    mpc_ast_arena_t *arena;
+    unsigned long tag_ids;
 } mpc_ast_t;
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
@@ -308,7 +497,8 @@ mpc_ast_t *mpc_ast_get_child_lb(mpc_ast_t *ast, const char *tag, int lb);
 
 typedef enum {
     mpc_ast_trav_order_pre,
-    mpc_ast_trav_order_post
+    mpc_ast_trav_order_post,
+    mpc_ast_trav_order_level
 } mpc_ast_trav_order_t;
 
 typedef struct mpc_ast_trav_t {
@@ -325,11 +515,143 @@ mpc_ast_t *mpc_ast_traverse_next(mpc_ast_trav_t **trav);
 
 void mpc_ast_traverse_free(mpc_ast_trav_t **trav);
 
+/*
+** Iterators walk an AST in pre, post or level order
+** without allocating per node. They keep a stack of
+** frames, or for level order a queue, in `stack` if
+** one is given and moving to a growing allocation of
+** their own if it's too small, which `mpc_ast_iter_free`
+** releases. `mpc_ast_walk` calls `f` on every node in
+** order, with a stack of 64 frames of its own, and
+** stops early if `f` returns zero, then returning zero.
+** The older `mpc_ast_traverse_start` has no level order.
+*/
+
+typedef struct {
+    mpc_ast_t *node;
+    int child;
+} mpc_ast_iter_frame_t;
+
+typedef struct {
+    mpc_ast_trav_order_t order;
+    int head;
+    int num;
+    int max;
+    int owned;
+    mpc_ast_iter_frame_t *stack;
+} mpc_ast_iter_t;
+
+typedef int(*mpc_ast_walk_t)(mpc_ast_t*,void*);
+
+void mpc_ast_iter_init(mpc_ast_iter_t *it, mpc_ast_t *a, mpc_ast_trav_order_t order, mpc_ast_iter_frame_t *stack, int max);
+mpc_ast_t *mpc_ast_iter_next(mpc_ast_iter_t *it);
+void mpc_ast_iter_free(mpc_ast_iter_t *it);
+
+int mpc_ast_walk(mpc_ast_t *a, mpc_ast_trav_order_t order, mpc_ast_walk_t f, void *d);
+
 /*
 ** Warning: This function currently doesn't test for equality of the `state` member!
 */
 int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b);
 
+/*
+** Tag IDs
+**
+** Next to its tag string each node has a set of tag
+** IDs, one bit each in `tag_ids`, so readers can test
+** for a rule without searching the string. Grammars
+** from `mpca_lang` tag `string`, `char` and `regex`
+** with the IDs below, and the parsers passed in with
+** `MPC_TAG_RULE` onwards in the order given. IDs stop
+** at `MPC_TAG_MAX`, and the rules past it are given
+** -1 instead, while `MPCA_LANG_NO_RULE_IDS` gives no
+** rule anything. `mpc_ast_rule_id` gives the lowest
+** rule ID a node has, -1 if it was made only by rules
+** past `MPC_TAG_MAX`, or zero if no rule tagged it. A
+** node made by one rule and passed up through others
+** has the IDs of all of them, so when rules are given
+** innermost first this is the rule which made it.
+*/
+
+enum {
+    MPC_TAG_STRING = 1,
+    MPC_TAG_CHAR   = 2,
+    MPC_TAG_REGEX  = 3,
+    MPC_TAG_RULE   = 4,
+    MPC_TAG_MAX    = 31
+};
+
+int mpc_ast_has_tag(mpc_ast_t *a, int id);
+int mpc_ast_rule_id(mpc_ast_t *a);
+mpc_ast_t *mpc_ast_add_tag_id(mpc_ast_t *a, int id);
+
+/*
+** AST Arenas
+**
+** Parsing with an `ast_arena` builds the AST in it:
+** nodes, strings and child arrays are all taken from
+** a few large blocks, and everything built there is
+** freed at once by `mpc_ast_arena_free`. The functions
+** above still work on these nodes, with any new node
+** or string coming from the same arena, except that
+** `mpc_ast_delete` leaves them alone. Nodes made with
+** `mpc_ast_new` shouldn't be put in an arena tree.
+*/
+
+mpc_ast_arena_t *mpc_ast_arena_new(void);
+void mpc_ast_arena_free(mpc_ast_arena_t *x);
+
+/*
+** AST Saving
+**
+** `mpc_ast_save` writes an AST to a file and
+** `mpc_ast_load` reads it back, into `x` if it's an
+** arena. The file is flat. A four byte header, the
+** count of nodes and the size of the string table are
+** followed by the strings and then, in preorder, one
+** record per node of eight numbers: the offsets of its
+** tag and contents in the string table, its tag IDs,
+** position, row and column, its count of children and
+** the count of nodes in its subtree. All numbers are
+** four byte little endian. A node's first child is the
+** next record and each child after is found by skipping
+** the subtree before. Damaged files load as `NULL`.
+*/
+
+int mpc_ast_save(mpc_ast_t *a, FILE *f);
+mpc_ast_t *mpc_ast_load(FILE *f, mpc_ast_arena_t *x);
+
+/*
+** AST Views
+**
+** A saved AST can also be read where it is, without
+** making any nodes. `mpc_ast_view_open` opens a file
+** written by `mpc_ast_save`, mapped into memory where
+** the system allows, or gives `NULL` if it's damaged.
+** Nodes are numbered in preorder with the root as
+** zero. A node's first child is the one after it and
+** `mpc_ast_view_next` skips its subtree to give its
+** next sibling. The strings given point into the view
+** and last until it's closed. `mpc_ast_view_load`
+** makes the subtree at a node into an AST, into `x`
+** if it's an arena.
+*/
+
+struct mpc_ast_view_t;
+typedef struct mpc_ast_view_t mpc_ast_view_t;
+
+mpc_ast_view_t *mpc_ast_view_open(const char *filename);
+void mpc_ast_view_close(mpc_ast_view_t *v);
+
+long mpc_ast_view_nodes_num(const mpc_ast_view_t *v);
+const char *mpc_ast_view_tag(const mpc_ast_view_t *v, long i);
+const char *mpc_ast_view_contents(const mpc_ast_view_t *v, long i);
+mpc_state_t mpc_ast_view_state(const mpc_ast_view_t *v, long i);
+int mpc_ast_view_rule_id(const mpc_ast_view_t *v, long i);
+int mpc_ast_view_children_num(const mpc_ast_view_t *v, long i);
+long mpc_ast_view_next(const mpc_ast_view_t *v, long i);
+mpc_ast_t *mpc_ast_view_load(const mpc_ast_view_t *v, long i, mpc_ast_arena_t *x);
+
 mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **as);
 mpc_val_t *mpcf_str_ast(mpc_val_t *c);
 mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs);
@@ -349,11 +671,17 @@ mpc_parser_t *mpca_count(int n, mpc_parser_t *a);
 
 mpc_parser_t *mpca_or(int n, ...);
 mpc_parser_t *mpca_and(int n, ...);
+mpc_parser_t *mpca_expr(int n, mpc_parser_t *a, ...);
 
 enum {
     MPCA_LANG_DEFAULT              = 0,
     MPCA_LANG_PREDICTIVE           = 1,
-    MPCA_LANG_WHITESPACE_SENSITIVE = 2
+    MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+    MPCA_LANG_NO_STATE             = 4,
+    MPCA_LANG_NO_FUSE              = 8,
+    MPCA_LANG_NO_INLINE            = 16,
+    MPCA_LANG_NO_FACTOR            = 32,
+    MPCA_LANG_NO_RULE_IDS          = 64
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -363,6 +691,69 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_pipe(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
+/*
+** Like `mpca_lang` but takes the parsers as an
+** array of `n` rather than a NULL terminated list,
+** for grammars with more rules than fit a call.
+*/
+
+mpc_err_t *mpca_lang_array(int flags, const char *language, int n, mpc_parser_t **parsers);
+
+/*
+** Incremental Parsing
+**
+** Parses `string` as a sequence of items with `p`,
+** which must produce an AST, in the same way as
+** `mpc_parse_each`. The items are kept, and after
+** an edit replacing `deleted` bytes at `pos` with
+** `inserted` only those the edit may have changed
+** are parsed again. Returns 1 if the whole text
+** parses, otherwise `mpc_incr_error` holds the
+** error and only the items before it are given.
+** Items and the error belong to the `mpc_incr_t`
+** and last until the next edit.
+*/
+
+struct mpc_incr_t;
+typedef struct mpc_incr_t mpc_incr_t;
+
+mpc_incr_t *mpc_incr_new(const char *filename, const char *string, mpc_parser_t *p);
+void mpc_incr_delete(mpc_incr_t *x);
+int mpc_incr_edit(mpc_incr_t *x, long pos, long deleted, const char *inserted);
+int mpc_incr_num(mpc_incr_t *x);
+mpc_ast_t *mpc_incr_item(mpc_incr_t *x, int n);
+mpc_err_t *mpc_incr_error(mpc_incr_t *x);
+const char *mpc_incr_string(mpc_incr_t *x);
+
+/*
+** Writes C source for a grammar, with one function
+** `<prefix>_<rule>` per rule which parses like
+** `mpc_parse` with that rule. Used by `mpc-gen`.
+** A failed parse is run again with the grammar
+** built by `mpca_lang` to give its error. That is
+** built on the first failure and kept until
+** `<prefix>_cleanup` is called.
+*/
+
+mpc_err_t *mpca_gen(int flags, const char *grammar, const char *prefix, FILE *source, FILE *header);
+
+/*
+** Reports the places in a grammar which can make
+** parsing slow: alternatives of an `or` which can
+** begin the same way, and repetition of something
+** which can match nothing. Each is printed with the
+** rule it is in and the worst case it can cost.
+** Overlaps which cost a fixed number of tries are
+** only bounded; the number of severe ones, which
+** never end, multiply with nesting, or read the
+** whole input each try, is returned. `mpca_analyse` does
+** the same for every rule of a grammar, and is what
+** `mpc-analyse` runs.
+*/
+
+int mpc_analyse(mpc_parser_t *p);
+mpc_err_t *mpca_analyse(int flags, const char *grammar, int *hazards);
+
 /*
 ** Misc
 */
@@ -370,6 +761,41 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
 void mpc_print(mpc_parser_t *p);
 void mpc_optimise(mpc_parser_t *p);
+
+/*
+** Individual rewrites done by `mpc_optimise` can
+** be turned off, which is useful when debugging.
+*/
+
+enum {
+    MPC_OPTIMISE_DEFAULT   = 0,
+    MPC_OPTIMISE_NO_FUSE   = 1,
+    MPC_OPTIMISE_NO_INLINE = 2,
+    MPC_OPTIMISE_NO_FACTOR = 4
+};
+
+void mpc_optimise_mode(mpc_parser_t *p, int flags);
+
+/*
+** Copies a finished parser into one contiguous block
+** which is faster to parse with. The copy can't be
+** changed, and is released with `mpc_delete`. The
+** original parsers are left untouched.
+*/
+
+mpc_parser_t *mpc_freeze(mpc_parser_t *p);
+
+/*
+** Saves a parser to a file in a compact binary form
+** which `mpc_load` reads back as a frozen parser. This
+** lets a grammar be built once rather than on every
+** start up. Only parsers made from the functions mpc
+** provides itself (such as those from `mpca_lang`) can
+** be saved; `mpc_save` returns 0 for anything else.
+*/
+
+int mpc_save(mpc_parser_t *p, FILE *f);
+mpc_parser_t *mpc_load(FILE *f);
 void mpc_stats(mpc_parser_t *p);
 
 int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
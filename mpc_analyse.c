@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mpc.h"
+#include "mpc_tool.h"
+
+// Reports where an mpca_lang grammar can backtrack heavily.
+//
+//   mpc-analyse <grammar> [flag...]
+//
+// Each hazard is printed with its rule and worst case.
+// Exits with 1 if any are severe, so it can guard a
+// grammar in CI. The flags are the same as mpc-gen's.
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <grammar> [flag...]\n", argv[0]);
+        return 1;
+    }
+
+    int mode = MPCA_LANG_DEFAULT;
+    if (!mpc_tool_flags(argc, argv, 2, &mode)) { return 1; }
+
+    char* grammar = mpc_tool_read_file(argv[1]);
+    if (grammar == NULL) {
+        fprintf(stderr, "%s: unable to read '%s'\n", argv[0], argv[1]);
+        return 1;
+    }
+
+    int hazards;
+    mpc_err_t* err = mpca_analyse(mode, grammar, &hazards);
+    free(grammar);
+
+    if (err) {
+        mpc_err_print(err);
+        mpc_err_delete(err);
+        return 1;
+    }
+
+    if (hazards) {
+        printf("%s: %i severe hazard%s\n", argv[1], hazards, hazards == 1 ? "" : "s");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mpc.h"
+#include "lispish_gen.h"
+
+// Compares the interpreted Lispish grammar against the
+// C code mpc-gen generated from the same grammar file.
+//
+//   mpc-bench [expressions] [rounds]
+
+#ifndef LISPISH_GRAMMAR
+#define LISPISH_GRAMMAR "lispish.mpc"
+#endif
+
+static double now(void) {
+    struct timespec t;
+    timespec_get(&t, TIME_UTC);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Builds an input of nested expressions using every rule.
+static char* make_input(int count) {
+    static const char* items[] = {
+        "(+ 1 2.5 (* 3 -4))", "(max 1 (min 2 3) 4)", "(add 10 (sub 5 2))",
+        "(/ 8 (% 7 3) (^ 2 3))", "(mul (div 9 3) (mod 10 4))", "-12.75",
+    };
+    size_t n = sizeof(items) / sizeof(items[0]);
+    size_t length = 1;
+
+    for (int index = 0; index < count; index++) {
+        length += strlen(items[index % n]) + 1;
+    }
+
+    char* input = malloc(length);
+    char* end = input;
+    for (int index = 0; index < count; index++) {
+        end += sprintf(end, "%s\n", items[index % n]);
+    }
+
+    return input;
+}
+
+int main(int argc, char** argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 20000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 10;
+
+    mpc_parser_t* Number  = mpc_new("number");
+    mpc_parser_t* Symbol  = mpc_new("symbol");
+    mpc_parser_t* Infix   = mpc_new("infix");
+    mpc_parser_t* Builtin = mpc_new("builtin");
+    mpc_parser_t* Sexpr   = mpc_new("sexpr");
+    mpc_parser_t* Expr    = mpc_new("expr");
+    mpc_parser_t* Lispish = mpc_new("lispish");
+
+    // Must match the flags given to mpc-gen in CMakeLists.txt.
+    mpc_err_t* err = mpca_lang_contents(MPCA_LANG_NO_STATE, LISPISH_GRAMMAR,
+        Number, Symbol, Infix, Builtin, Sexpr, Expr, Lispish);
+    if (err) {
+        mpc_err_print(err);
+        mpc_err_delete(err);
+        return 1;
+    }
+
+    char* input = make_input(count);
+    double bytes = (double)strlen(input);
+    double interpreted = 1e9, generated = 1e9;
+    int same = 1;
+
+    for (int round = 0; round < rounds; round++) {
+        mpc_result_t a, b;
+
+        double start = now();
+        int x = mpc_parse("<bench>", input, Lispish, &a);
+        double middle = now();
+        int y = lispish_lispish("<bench>", input, &b);
+        double end = now();
+
+        if (middle - start < interpreted) { interpreted = middle - start; }
+        if (end - middle < generated) { generated = end - middle; }
+
+        if (!x || !y) {
+            fprintf(stderr, "Parse failed\n");
+            return 1;
+        }
+
+        same = same && mpc_ast_eq(a.output, b.output);
+        mpc_ast_delete(a.output);
+        mpc_ast_delete(b.output);
+    }
+
+    printf("%d expressions, %.0f bytes, best of %d\n", count, bytes, rounds);
+    printf("interpreted: %8.2f ms %8.2f MB/s\n", interpreted * 1e3, bytes / interpreted / 1e6);
+    printf("generated:   %8.2f ms %8.2f MB/s\n", generated * 1e3, bytes / generated / 1e6);
+    printf("speedup:     %8.2fx, outputs %s\n", interpreted / generated, same ? "identical" : "DIFFER");
+
+    free(input);
+    mpc_cleanup(7, Number, Symbol, Infix, Builtin, Sexpr, Expr, Lispish);
+    lispish_cleanup();
+
+    return same ? 0 : 1;
+}
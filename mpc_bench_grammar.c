@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mpc.h"
+
+// Times mpca_lang_array on a generated grammar with many
+// rules, each referring to rules defined after it.
+//
+//   mpc-bench-grammar [rules] [rounds]
+
+static double now(void) {
+    struct timespec t;
+    timespec_get(&t, TIME_UTC);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static char* make_grammar(int count) {
+    char* grammar = malloc(count * 64 + 1);
+    char* end = grammar;
+
+    for (int index = 0; index < count - 1; index++) {
+        end += sprintf(end, "r%d : \"k%d\" <r%d>? | /[0-9]+/ <r%d>* ;\n",
+            index, index, index + 1, (index * 7 + 3) % count);
+    }
+    sprintf(end, "r%d : \"end\" ;\n", count - 1);
+
+    return grammar;
+}
+
+int main(int argc, char** argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 2000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+
+    if (count < 1) {
+        fprintf(stderr, "Need at least one rule\n");
+        return 1;
+    }
+
+    char* grammar = make_grammar(count);
+    mpc_parser_t** parsers = malloc(sizeof(mpc_parser_t*) * count);
+    double best = 1e9;
+
+    for (int round = 0; round < rounds; round++) {
+        for (int index = 0; index < count; index++) {
+            char name[32];
+            sprintf(name, "r%d", index);
+            parsers[index] = mpc_new(name);
+        }
+
+        double start = now();
+        mpc_err_t* err = mpca_lang_array(MPCA_LANG_DEFAULT, grammar, count, parsers);
+        double end = now();
+
+        if (err) {
+            mpc_err_print(err);
+            mpc_err_delete(err);
+            return 1;
+        }
+
+        if (end - start < best) { best = end - start; }
+
+        // Every rule but the last must reach "end".
+        mpc_result_t r;
+        if (!mpc_parse("<bench>", "k0 k1 12 end", parsers[0], &r)) {
+            mpc_err_print(r.error);
+            mpc_err_delete(r.error);
+            return 1;
+        }
+        mpc_ast_delete(r.output);
+
+        for (int index = 0; index < count; index++) { mpc_undefine(parsers[index]); }
+        for (int index = 0; index < count; index++) { mpc_delete(parsers[index]); }
+    }
+
+    printf("%d rules, %zu bytes, best of %d\n", count, strlen(grammar), rounds);
+    printf("compile: %8.2f ms %8.2f us/rule\n", best * 1e3, best * 1e6 / count);
+
+    free(parsers);
+    free(grammar);
+
+    return 0;
+}
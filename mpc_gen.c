@@ -0,0 +1,54 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mpc.h"
+#include "mpc_tool.h"
+
+// Compiles an mpca_lang grammar file to C.
+//
+//   mpc-gen <grammar> <prefix> <source.c> <header.h> [flag...]
+//
+// Every rule in the grammar becomes a function
+// `<prefix>_<rule>` taking the same arguments as
+// `mpc_parse`. The flags are the `MPCA_LANG_*`
+// ones in lower case, without the prefix.
+
+int main(int argc, char** argv) {
+    if (argc < 5) {
+        fprintf(stderr, "usage: %s <grammar> <prefix> <source.c> <header.h> [flag...]\n", argv[0]);
+        return 1;
+    }
+
+    int mode = MPCA_LANG_DEFAULT;
+    if (!mpc_tool_flags(argc, argv, 5, &mode)) { return 1; }
+
+    char* grammar = mpc_tool_read_file(argv[1]);
+    if (grammar == NULL) {
+        fprintf(stderr, "%s: unable to read '%s'\n", argv[0], argv[1]);
+        return 1;
+    }
+
+    FILE* source = fopen(argv[3], "w");
+    FILE* header = fopen(argv[4], "w");
+    if (source == NULL || header == NULL) {
+        fprintf(stderr, "%s: unable to write output\n", argv[0]);
+        return 1;
+    }
+
+    mpc_err_t* err = mpca_gen(mode, grammar, argv[2], source, header);
+
+    fclose(source);
+    fclose(header);
+    free(grammar);
+
+    // Don't leave a half written parser around for make to pick up.
+    if (err) {
+        mpc_err_print(err);
+        mpc_err_delete(err);
+        remove(argv[3]);
+        remove(argv[4]);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mpc.h"
+
+// Checks a view of a saved AST reads the same as the tree it
+// was saved from, and that parsing with an ast_cache gives the
+// tree a plain parse does: on a hit, for two inputs whose names
+// in the cache are the same, and once the grammar is redefined.
+//
+//   mpc-test-ast-cache <directory>
+
+static const char* lispish =
+    " number  : /-?[0-9]+/ ;                          "
+    " symbol  : /[a-z]+/ ;                            "
+    " sexpr   : '(' <expr>* ')' ;                     "
+    " expr    : <number> | <symbol> | <sexpr> ;       "
+    " lispish : /^/ <expr>* /$/ ;                     ";
+
+static const char* words =
+    " number  : /[a-z]/ ;                             "
+    " symbol  : /[0-9]/ ;                             "
+    " sexpr   : '{' '}' ;                             "
+    " expr    : <number> | <symbol> | <sexpr> ;       "
+    " lispish : /^/ <expr>* /$/ ;                     ";
+
+static const char* input = "(add 1 (mul 2 -3) (neg 4)) 5";
+
+// Parses once, with the cache if one is given, and says if it was a hit.
+static mpc_ast_t* parse(mpc_parser_t* p, const char* s, const char* cache, int* hit) {
+    mpc_parse_stats_t stats;
+    mpc_parse_opts_t opts;
+    mpc_result_t r;
+    memset(&opts, 0, sizeof(opts));
+    opts.stats = &stats;
+    opts.ast_cache = cache;
+
+    if (!mpc_parse_ex("<test>", s, p, &r, &opts)) {
+        mpc_err_print(r.error);
+        mpc_err_delete(r.error);
+        return NULL;
+    }
+    if (hit) { *hit = stats.bytes == 0; }
+    return r.output;
+}
+
+static int same_node(const mpc_ast_view_t* v, long i, mpc_ast_t* a) {
+    mpc_state_t s = mpc_ast_view_state(v, i);
+    if (strcmp(mpc_ast_view_tag(v, i), a->tag) != 0
+    ||  strcmp(mpc_ast_view_contents(v, i), a->contents) != 0
+    ||  mpc_ast_view_rule_id(v, i) != mpc_ast_rule_id(a)
+    ||  s.pos != a->state.pos || s.row != a->state.row || s.col != a->state.col
+    ||  mpc_ast_view_children_num(v, i) != a->children_num) { return 0; }
+
+    long j = i + 1;
+    for (int c = 0; c < a->children_num; c++) {
+        if (!same_node(v, j, a->children[c])) { return 0; }
+        j = mpc_ast_view_next(v, j);
+    }
+    return j == mpc_ast_view_next(v, i);
+}
+
+static int check_view(mpc_ast_t* a, const char* dir) {
+    char* path = malloc(strlen(dir) + 16);
+    sprintf(path, "%s/view.ast", dir);
+
+    FILE* f = fopen(path, "wb");
+    int saved = f && mpc_ast_save(a, f);
+    if (f) { fclose(f); }
+
+    mpc_ast_view_t* v = saved ? mpc_ast_view_open(path) : NULL;
+    remove(path);
+    free(path);
+    if (v == NULL) {
+        puts("mpc_ast_view_open: could not open a saved AST");
+        return 1;
+    }
+
+    int failures = 0;
+    if (!same_node(v, 0, a)) {
+        puts("mpc_ast_view: the view differs from the AST saved");
+        failures++;
+    }
+
+    // The second child of the root is loaded alone, in and out of an arena.
+    mpc_ast_arena_t* x = mpc_ast_arena_new();
+    mpc_ast_t* b = mpc_ast_view_load(v, mpc_ast_view_next(v, 1), NULL);
+    mpc_ast_t* c = mpc_ast_view_load(v, mpc_ast_view_next(v, 1), x);
+    mpc_ast_view_close(v);
+
+    if (!mpc_ast_eq(b, a->children[1]) || !mpc_ast_eq(c, a->children[1])) {
+        puts("mpc_ast_view_load: the subtree loaded differs from the AST saved");
+        failures++;
+    }
+    mpc_ast_delete(b);
+    mpc_ast_arena_free(x);
+    return failures;
+}
+
+static unsigned long fnv(const char* s) {
+    unsigned long hash = 2166136261UL;
+    for (; *s; s++) { hash = ((hash ^ (unsigned char)*s) * 16777619UL) & 0xFFFFFFFFUL; }
+    return hash;
+}
+
+// Two words with the same FNV-1a hash, which the cache names
+// files by, so each must not be given the other's tree.
+static int check_clash(mpc_parser_t* p, const char* dir) {
+    const char* words[2] = { "ydtrd", "gckxr" };
+    if (fnv(words[0]) != fnv(words[1])) {
+        printf("mpc_parse_ex: \"%s\" and \"%s\" should clash\n", words[0], words[1]);
+        return 1;
+    }
+
+    int failures = 0;
+    for (int w = 0; w < 2; w++) {
+        mpc_ast_t* cached = parse(p, words[w], dir, NULL);
+        mpc_ast_t* plain = parse(p, words[w], NULL, NULL);
+        if (!cached || !plain || !mpc_ast_eq(cached, plain)) {
+            printf("mpc_parse_ex: \"%s\" gave the cached tree of \"%s\"\n", words[w], words[1-w]);
+            failures++;
+        }
+        if (cached) { mpc_ast_delete(cached); }
+        if (plain) { mpc_ast_delete(plain); }
+    }
+    return failures;
+}
+
+// Parses the input with and without the cache, twice over so the second is a hit.
+static int check_cache(mpc_parser_t* p, const char* s, const char* dir, const char* name) {
+    int failures = 0, hit = 0;
+    mpc_ast_t* plain = parse(p, s, NULL, NULL);
+    for (int round = 0; round < 2; round++) {
+        mpc_ast_t* cached = parse(p, s, dir, &hit);
+        if (!plain || !cached || !mpc_ast_eq(cached, plain)) {
+            printf("mpc_parse_ex: \"%s\" gave a different tree from the cache %s\n", s, name);
+            failures++;
+        }
+        if (cached) { mpc_ast_delete(cached); }
+    }
+    if (!hit) {
+        printf("mpc_parse_ex: \"%s\" was not found in the cache %s\n", s, name);
+        failures++;
+    }
+    if (plain) { mpc_ast_delete(plain); }
+    return failures;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: mpc-test-ast-cache <directory>\n");
+        return 1;
+    }
+    const char* dir = argv[1];
+
+    mpc_parser_t* Number = mpc_new("number");
+    mpc_parser_t* Symbol = mpc_new("symbol");
+    mpc_parser_t* Sexpr = mpc_new("sexpr");
+    mpc_parser_t* Expr = mpc_new("expr");
+    mpc_parser_t* Lispish = mpc_new("lispish");
+
+    mpc_err_t* err = mpca_lang(MPCA_LANG_DEFAULT, lispish, Number, Symbol, Sexpr, Expr, Lispish, NULL);
+    if (err) {
+        mpc_err_print(err);
+        mpc_err_delete(err);
+        return 1;
+    }
+
+    int failures = 0;
+    mpc_ast_t* a = parse(Lispish, input, NULL, NULL);
+    if (a) {
+        failures += check_view(a, dir);
+        mpc_ast_delete(a);
+    } else {
+        failures++;
+    }
+    failures += check_cache(Lispish, input, dir, "");
+    failures += check_cache(Lispish, "ab 1", dir, "");
+    failures += check_clash(Lispish, dir);
+
+    // The same rules given other definitions parse "ab 1" differently.
+    mpc_undefine(Number);
+    mpc_undefine(Symbol);
+    mpc_undefine(Sexpr);
+    mpc_undefine(Expr);
+    mpc_undefine(Lispish);
+    err = mpca_lang(MPCA_LANG_DEFAULT, words, Number, Symbol, Sexpr, Expr, Lispish, NULL);
+    if (err) {
+        mpc_err_print(err);
+        mpc_err_delete(err);
+        return 1;
+    }
+    failures += check_cache(Lispish, "ab 1", dir, "once redefined");
+
+    mpc_cleanup(5, Number, Symbol, Sexpr, Expr, Lispish);
+
+    if (failures) { return 1; }
+    puts("mpc_parse_ex: cached trees match the trees parsed");
+    return 0;
+}
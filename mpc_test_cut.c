@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mpc.h"
+
+// Checks a cut only commits the innermost choice or rule it is
+// in, so the choices around it can still backtrack over a rule
+// that failed past its cut. Built with -fsanitize=address where
+// the compiler has it, so what a repetition with a fold of its
+// own had collected when a cut failed it must have been freed.
+
+static const char* grammar =
+    " s   : '(' ~ /[a-z]*/ ')' ;                   "
+    " top : /^/ (<s> 'x' | <s> 'y') /$/ ;          ";
+
+static const struct { const char* input; int ok; } inputs[] = {
+    { "(a)x", 1 }, { "(a)y", 1 }, { "(ab)z", 0 }, { "(a]", 0 }, { "a", 0 },
+};
+
+#define INPUTS (int)(sizeof(inputs) / sizeof(inputs[0]))
+
+// The same as mpcf_strfold, but not one mpc knows the type of.
+static mpc_val_t* concat(int n, mpc_val_t** xs) {
+    size_t l = 0;
+    for (int k = 0; k < n; k++) { l += strlen(xs[k]); }
+    char* y = calloc(l + 1, 1);
+    for (int k = 0; k < n; k++) { strcat(y, xs[k]); free(xs[k]); }
+    return y;
+}
+
+// Hands back its input, which takes it out of the parse's own memory.
+static mpc_val_t* keep(mpc_val_t* x) { return x; }
+
+static int check_repeat(const char* input, int expected) {
+    mpc_parser_t* pair = mpc_and(3, mpcf_fst_free, mpc_char('('), mpc_cut(), mpc_char(')'), free, free);
+    mpc_parser_t* p = mpc_and(2, mpcf_fst, mpc_many(concat, mpc_apply(pair, keep)), mpc_eoi(), free);
+
+    mpc_result_t r;
+    int ok = mpc_parse("<test>", input, p, &r);
+    if (ok) { free(r.output); } else { mpc_err_delete(r.error); }
+    mpc_delete(p);
+
+    if (ok != expected) {
+        printf("mpc_cut: \"%s\" %s, expected it to %s\n", input,
+            ok ? "passed" : "failed", expected ? "pass" : "fail");
+        return 1;
+    }
+    return 0;
+}
+
+int main(void) {
+    mpc_parser_t* S = mpc_new("s");
+    mpc_parser_t* Top = mpc_new("top");
+
+    mpc_err_t* err = mpca_lang(MPCA_LANG_DEFAULT, grammar, S, Top, NULL);
+    if (err) {
+        mpc_err_print(err);
+        mpc_err_delete(err);
+        return 1;
+    }
+
+    int failures = 0;
+    for (int index = 0; index < INPUTS; index++) {
+        mpc_result_t r;
+        int ok = mpc_parse("<test>", inputs[index].input, Top, &r);
+
+        if (ok != inputs[index].ok) {
+            printf("mpc_cut: \"%s\" %s", inputs[index].input, ok ? "passed" : "failed: ");
+            if (!ok) { mpc_err_print_to(r.error, stdout); } else { putchar('\n'); }
+            failures++;
+        }
+        if (ok) { mpc_ast_delete(r.output); } else { mpc_err_delete(r.error); }
+    }
+
+    mpc_cleanup(2, S, Top);
+
+    failures += check_repeat("()()()", 1);
+    failures += check_repeat("()()(x", 0);
+
+    if (failures) { return 1; }
+    puts("mpc_cut: cuts are scoped to their choice or rule");
+    return 0;
+}
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mpc.h"
+
+// Checks a frozen grammar parses the same as the rules it was
+// frozen from, and keeps working once those rules, and the
+// grammars their regexes were compiled with, are deleted.
+// Built with -fsanitize=address where the compiler has it, so
+// anything still pointing into the old rules fails the test.
+
+static const char* grammar =
+    " number  : /-?[0-9]+/ ;                          "
+    " symbol  : '+' | '-' | '*' | '/' ;               "
+    " sexpr   : '(' <expr>* ')' ;                     "
+    " expr    : <number> | <symbol> | <sexpr> ;       "
+    " lispish : /^/ <expr>* /$/ ;                     ";
+
+static const char* inputs[] = {
+    "(+ 1 2 (* 3 -4))", "- 5 (/ 8 2)", "(+ 1", "", "((((1))))", "(1 2))",
+};
+
+#define INPUTS (int)(sizeof(inputs) / sizeof(inputs[0]))
+
+int main(void) {
+    mpc_parser_t* Number = mpc_new("number");
+    mpc_parser_t* Symbol = mpc_new("symbol");
+    mpc_parser_t* Sexpr = mpc_new("sexpr");
+    mpc_parser_t* Expr = mpc_new("expr");
+    mpc_parser_t* Lispish = mpc_new("lispish");
+
+    mpc_err_t* err = mpca_lang(MPCA_LANG_DEFAULT, grammar, Number, Symbol, Sexpr, Expr, Lispish, NULL);
+    if (err) {
+        mpc_err_print(err);
+        mpc_err_delete(err);
+        return 1;
+    }
+
+    mpc_result_t before[INPUTS];
+    int x[INPUTS];
+    for (int index = 0; index < INPUTS; index++) {
+        x[index] = mpc_parse("<test>", inputs[index], Lispish, &before[index]);
+    }
+
+    mpc_parser_t* frozen = mpc_freeze(Lispish);
+    mpc_cleanup(5, Number, Symbol, Sexpr, Expr, Lispish);
+    mpc_re_cleanup();
+
+    int failures = 0;
+    for (int index = 0; index < INPUTS; index++) {
+        mpc_result_t after;
+        int y = mpc_parse("<test>", inputs[index], frozen, &after);
+
+        if (x[index] != y) {
+            printf("mpc_freeze: \"%s\" %s before and %s after\n", inputs[index],
+                x[index] ? "passed" : "failed", y ? "passed" : "failed");
+            failures++;
+        } else if (y && !mpc_ast_eq(before[index].output, after.output)) {
+            printf("mpc_freeze: \"%s\" gave a different tree\n", inputs[index]);
+            failures++;
+        } else if (!y) {
+            char* s = mpc_err_string(before[index].error);
+            char* t = mpc_err_string(after.error);
+            if (strcmp(s, t) != 0) {
+                printf("mpc_freeze: \"%s\" gave %s before and %s after\n", inputs[index], s, t);
+                failures++;
+            }
+            free(s);
+            free(t);
+        }
+
+        if (x[index]) { mpc_ast_delete(before[index].output); } else { mpc_err_delete(before[index].error); }
+        if (y) { mpc_ast_delete(after.output); } else { mpc_err_delete(after.error); }
+    }
+
+    mpc_delete(frozen);
+
+    // Regexes made after a cleanup build the grammars again.
+    mpc_parser_t* re = mpc_re("-?[0-9]+");
+    mpc_result_t r;
+    if (mpc_parse("<test>", "-42", re, &r)) {
+        free(r.output);
+    } else {
+        mpc_err_print(r.error);
+        mpc_err_delete(r.error);
+        failures++;
+    }
+    mpc_delete(re);
+    mpc_re_cleanup();
+
+    if (failures) { return 1; }
+    puts("mpc_freeze: all results match");
+    return 0;
+}
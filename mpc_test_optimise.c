@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mpc.h"
+
+// Checks each rewrite done by mpc_optimise leaves what a parser
+// outputs, and the errors it gives, exactly as they were. Every
+// case is built twice, one copy is optimised, and both parse the
+// same inputs.
+
+typedef mpc_parser_t* (*build_t)(void);
+
+// SINGLE runs become a STRING once the inner expects are dropped.
+static mpc_parser_t* build_string(void) {
+    return mpc_expect(mpc_and(4, mpcf_strfold,
+        mpc_char('a'), mpc_char('b'), mpc_char('c'), mpc_many(mpcf_strfold, mpc_char('d')),
+        free, free, free), "abc");
+}
+
+// Character alternatives become a single ONEOF.
+static mpc_parser_t* build_oneof(void) {
+    return mpc_expect(mpc_many1(mpcf_strfold, mpc_or(4,
+        mpc_char('a'), mpc_range('0', '9'), mpc_oneof("xyz"), mpc_string("end"))), "thing");
+}
+
+// An expect inside an expect or a not is never seen.
+static mpc_parser_t* build_expect(void) {
+    return mpc_and(3, mpcf_strfold,
+        mpc_not_lift(mpc_expect(mpc_char('!'), "bang"), free, mpcf_ctor_str),
+        mpc_expect(mpc_expect(mpc_expect(mpc_oneof("pq"), "inner"), "middle"), "outer"),
+        mpc_expect(mpc_string("rs"), "rs"),
+        free, free);
+}
+
+// Output which is only freed is never built.
+static mpc_parser_t* build_skip(void) {
+    return mpc_and(3, mpcf_snd_free,
+        mpc_apply(mpc_many(mpcf_strfold, mpc_oneof(" \t")), mpcf_free),
+        mpc_string("word"),
+        mpc_apply(mpc_maybe(mpc_char(';')), mpcf_free),
+        free, free);
+}
+
+static const char* inputs[] = {
+    "", "a", "abc", "abcddd", "abx", "7", "a7zend9", "en", "!p", "prs", "qrs", "qr",
+    "word", "  \tword;", " word!", "  ", "x",
+};
+
+static char* describe(int x, mpc_result_t* r) {
+    if (!x) { return mpc_err_string(r->error); }
+    const char* s = r->output ? r->output : "(null)";
+    char* d = malloc(strlen(s) + 3);
+    sprintf(d, "\"%s\"", s);
+    return d;
+}
+
+static void release(int x, mpc_result_t* r) {
+    if (x) { free(r->output); } else { mpc_err_delete(r->error); }
+}
+
+static int check(const char* name, build_t build) {
+    int failures = 0;
+    mpc_parser_t* plain = build();
+    mpc_parser_t* optimised = build();
+    mpc_optimise(optimised);
+
+    for (size_t index = 0; index < sizeof(inputs) / sizeof(inputs[0]); index++) {
+        mpc_result_t a, b;
+        int x = mpc_parse("<test>", inputs[index], plain, &a);
+        int y = mpc_parse("<test>", inputs[index], optimised, &b);
+        char* s = describe(x, &a);
+        char* t = describe(y, &b);
+        if (x != y || strcmp(s, t) != 0) {
+            printf("%s: \"%s\" gave %s before and %s after\n", name, inputs[index], s, t);
+            failures++;
+        }
+        free(s);
+        free(t);
+        release(x, &a);
+        release(y, &b);
+    }
+
+    mpc_delete(plain);
+    mpc_delete(optimised);
+    return failures;
+}
+
+// The same checks through mpca_lang, comparing trees.
+static int check_lang(void) {
+    static const char* grammar =
+        " word    : 'a' 'b' 'c' | /[0-9]+/ | ('x' | 'y' | 'z')+ ;  "
+        " pair    : '(' <word> ',' <word> ')' | '(' <word> ')' ;    "
+        " repeat  : \"ba\" ('a' 'b' | 'a' 'c')+ ;                    "
+        " program : /^/ (<pair> | <word> | <repeat>)* /$/ ;         ";
+    static const char* programs[] = {
+        "abc (12,xy) (z) 3", "(abc,", "ab", "(1,2)(3)", "((", "xyzzy abc ( 4 )",
+        "ba(", "baabac 1", "baa(",
+    };
+    int flags[2] = {
+        MPCA_LANG_NO_FUSE | MPCA_LANG_NO_INLINE | MPCA_LANG_NO_FACTOR, MPCA_LANG_DEFAULT,
+    };
+    mpc_parser_t* parsers[2][4];
+    int failures = 0;
+
+    for (int mode = 0; mode < 2; mode++) {
+        parsers[mode][0] = mpc_new("word");
+        parsers[mode][1] = mpc_new("pair");
+        parsers[mode][2] = mpc_new("repeat");
+        parsers[mode][3] = mpc_new("program");
+        mpc_err_t* err = mpca_lang(flags[mode], grammar,
+            parsers[mode][0], parsers[mode][1], parsers[mode][2], parsers[mode][3], NULL);
+        if (err) {
+            mpc_err_print(err);
+            mpc_err_delete(err);
+            return 1;
+        }
+    }
+
+    for (size_t index = 0; index < sizeof(programs) / sizeof(programs[0]); index++) {
+        mpc_result_t a, b;
+        int x = mpc_parse("<test>", programs[index], parsers[0][3], &a);
+        int y = mpc_parse("<test>", programs[index], parsers[1][3], &b);
+        if (x != y) {
+            printf("mpca_lang: \"%s\" %s before and %s after\n", programs[index],
+                x ? "passed" : "failed", y ? "passed" : "failed");
+            failures++;
+        } else if (x && !mpc_ast_eq(a.output, b.output)) {
+            printf("mpca_lang: \"%s\" gave a different tree\n", programs[index]);
+            failures++;
+        } else if (!x) {
+            char* s = mpc_err_string(a.error);
+            char* t = mpc_err_string(b.error);
+            if (strcmp(s, t) != 0) {
+                printf("mpca_lang: \"%s\" gave %s before and %s after\n", programs[index], s, t);
+                failures++;
+            }
+            free(s);
+            free(t);
+        }
+        if (x) { mpc_ast_delete(a.output); } else { mpc_err_delete(a.error); }
+        if (y) { mpc_ast_delete(b.output); } else { mpc_err_delete(b.error); }
+    }
+
+    for (int mode = 0; mode < 2; mode++) {
+        mpc_cleanup(4, parsers[mode][0], parsers[mode][1], parsers[mode][2], parsers[mode][3]);
+    }
+    return failures;
+}
+
+int main(void) {
+    int failures = 0;
+    failures += check("string", build_string);
+    failures += check("oneof", build_oneof);
+    failures += check("expect", build_expect);
+    failures += check("skip", build_skip);
+    failures += check_lang();
+
+    if (failures) { return 1; }
+    puts("mpc_optimise: all outputs match");
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mpc.h"
+
+// Checks a grammar with more rules than there are tag IDs for
+// compiles with the default flags, gives the rules before
+// MPC_TAG_MAX their IDs and those past it -1, and keeps both
+// once saved and loaded back.
+
+#define RULES 40
+
+static char* make_grammar(void) {
+    char* grammar = malloc(RULES * 48 + 64);
+    char* end = grammar;
+
+    for (int index = 0; index < RULES; index++) {
+        end += sprintf(end, "r%d : \"k%d.\" ;\n", index, index);
+    }
+    end += sprintf(end, "top : /^/ (");
+    for (int index = 0; index < RULES; index++) {
+        end += sprintf(end, index ? " | <r%d>" : "<r%d>", index);
+    }
+    sprintf(end, ")+ /$/ ;\n");
+
+    return grammar;
+}
+
+static int check(const char* name, mpc_parser_t* top) {
+    const int rules[] = { 0, MPC_TAG_MAX - MPC_TAG_RULE, MPC_TAG_MAX - MPC_TAG_RULE + 1, RULES - 1 };
+    const int count = (int)(sizeof(rules) / sizeof(rules[0]));
+    char input[64] = "";
+    for (int index = 0; index < count; index++) {
+        sprintf(input + strlen(input), "k%d. ", rules[index]);
+    }
+
+    mpc_result_t r;
+    if (!mpc_parse("<test>", input, top, &r)) {
+        printf("%s: \"%s\" failed: ", name, input);
+        mpc_err_print_to(r.error, stdout);
+        mpc_err_delete(r.error);
+        return 1;
+    }
+
+    // The root is followed by the tree of each rule in turn.
+    mpc_ast_t* a = r.output;
+    int failures = 0;
+    for (int index = 0; index < count; index++) {
+        int id = MPC_TAG_RULE + rules[index] <= MPC_TAG_MAX ? MPC_TAG_RULE + rules[index] : -1;
+        int got = index + 1 < a->children_num ? mpc_ast_rule_id(a->children[index + 1]) : 0;
+        if (got != id) {
+            printf("%s: r%d has rule ID %d, expected %d\n", name, rules[index], got, id);
+            failures++;
+        }
+    }
+    if (mpc_ast_rule_id(a) != 0) {
+        printf("%s: the root has rule ID %d, expected 0\n", name, mpc_ast_rule_id(a));
+        failures++;
+    }
+
+    mpc_ast_delete(r.output);
+    return failures;
+}
+
+int main(void) {
+    mpc_parser_t* parsers[RULES + 1];
+    for (int index = 0; index < RULES; index++) {
+        char name[16];
+        sprintf(name, "r%d", index);
+        parsers[index] = mpc_new(name);
+    }
+    parsers[RULES] = mpc_new("top");
+
+    char* grammar = make_grammar();
+    mpc_err_t* err = mpca_lang_array(MPCA_LANG_DEFAULT, grammar, RULES + 1, parsers);
+    free(grammar);
+    if (err) {
+        mpc_err_print(err);
+        mpc_err_delete(err);
+        return 1;
+    }
+
+    int failures = check("mpca_lang", parsers[RULES]);
+
+    FILE* f = tmpfile();
+    if (!mpc_save(parsers[RULES], f)) {
+        puts("mpc_save: could not save the grammar");
+        failures++;
+    } else {
+        rewind(f);
+        mpc_parser_t* loaded = mpc_load(f);
+        if (loaded == NULL) {
+            puts("mpc_load: could not load the grammar");
+            failures++;
+        } else {
+            failures += check("mpc_load", loaded);
+            mpc_delete(loaded);
+        }
+    }
+    fclose(f);
+
+    for (int index = 0; index <= RULES; index++) { mpc_undefine(parsers[index]); }
+    for (int index = 0; index <= RULES; index++) { mpc_delete(parsers[index]); }
+
+    if (failures) { return 1; }
+    puts("mpca_lang: rules past MPC_TAG_MAX compile with rule ID -1");
+    return 0;
+}
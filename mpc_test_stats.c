@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mpc.h"
+
+// Checks the stats, profile and trace of a failed parse cover
+// one run of it. An input ending in a character no rule begins
+// with should read the same bytes as the input without it, try
+// the top rule once and trace it once. Also checks a regex
+// counts all it scanned as read, not just what it matched.
+
+static const char* grammar =
+    " number  : /-?[0-9]+/ ;                          "
+    " symbol  : /[a-z]+/ ;                            "
+    " sexpr   : '(' <expr>* ')' ;                     "
+    " expr    : <number> | <symbol> | <sexpr> ;       "
+    " lispish : /^/ <expr>* /$/ ;                     ";
+
+static const char* inputs[][2] = {
+    { "(add 1 2) (mul 3 4) ", "(add 1 2) (mul 3 4) ]" },
+    { "(a (b (c -1)))", "(a (b (c -1)));" },
+    { "", "]" },
+};
+
+#define INPUTS (int)(sizeof(inputs) / sizeof(inputs[0]))
+
+typedef struct {
+    int ok;
+    long bytes;
+    long calls;
+    int begins;
+} run_t;
+
+// Reads back everything written to a temporary file.
+static char* read_back(FILE* f) {
+    long size = ftell(f);
+    char* contents = calloc(size + 1, 1);
+    rewind(f);
+    size_t read = fread(contents, 1, size, f);
+    contents[read] = '\0';
+    fclose(f);
+    return contents;
+}
+
+static run_t run(mpc_parser_t* p, const char* input) {
+    run_t x;
+    mpc_parse_stats_t stats;
+    mpc_parse_opts_t opts;
+    mpc_result_t r;
+    memset(&opts, 0, sizeof(opts));
+    opts.stats = &stats;
+    opts.profile = mpc_profile_new(MPC_PROFILE_DEFAULT);
+    opts.trace = tmpfile();
+
+    x.ok = mpc_parse_ex("<test>", input, p, &r, &opts);
+    if (x.ok) { mpc_ast_delete(r.output); } else { mpc_err_delete(r.error); }
+    x.bytes = stats.bytes;
+
+    // The rules come first in the report, with nodes tried then calls.
+    FILE* f = tmpfile();
+    mpc_profile_report(opts.profile, p, f);
+    char* report = read_back(f);
+    char* row = strstr(report, "\nlispish ");
+    x.calls = -1;
+    if (row) { sscanf(row + 1, "lispish %*d %ld", &x.calls); }
+    free(report);
+
+    char* trace = read_back(opts.trace);
+    x.begins = 0;
+    for (char* s = trace; (s = strstr(s, "{\"name\":\"lispish\",\"ph\":\"B\"")); s++) { x.begins++; }
+    free(trace);
+
+    mpc_profile_delete(opts.profile);
+    return x;
+}
+
+// Both regexes scan all seven letters, though only the second matches.
+static int check_regex(void) {
+    mpc_parser_t* p = mpc_or(2, mpc_re("[a-z]+[0-9]"), mpc_re("[a-z]+"));
+    mpc_parse_stats_t stats;
+    mpc_parse_opts_t opts;
+    mpc_result_t r;
+    memset(&opts, 0, sizeof(opts));
+    opts.stats = &stats;
+
+    int ok = mpc_parse_ex("<test>", "abcdefg", p, &r, &opts);
+    if (ok) { free(r.output); } else { mpc_err_delete(r.error); }
+    mpc_delete(p);
+
+    if (!ok || stats.bytes != 14) {
+        printf("mpc_parse_ex: \"abcdefg\" read %li bytes, expected 14\n", stats.bytes);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void) {
+    mpc_parser_t* Number = mpc_new("number");
+    mpc_parser_t* Symbol = mpc_new("symbol");
+    mpc_parser_t* Sexpr = mpc_new("sexpr");
+    mpc_parser_t* Expr = mpc_new("expr");
+    mpc_parser_t* Lispish = mpc_new("lispish");
+
+    mpc_err_t* err = mpca_lang(MPCA_LANG_DEFAULT, grammar, Number, Symbol, Sexpr, Expr, Lispish, NULL);
+    if (err) {
+        mpc_err_print(err);
+        mpc_err_delete(err);
+        return 1;
+    }
+
+    int failures = 0;
+    for (int index = 0; index < INPUTS; index++) {
+        run_t good = run(Lispish, inputs[index][0]);
+        run_t bad = run(Lispish, inputs[index][1]);
+
+        if (!good.ok || bad.ok) {
+            printf("mpc_parse_ex: \"%s\" or \"%s\" gave the wrong result\n", inputs[index][0], inputs[index][1]);
+            failures++;
+        }
+        if (bad.bytes != good.bytes) {
+            printf("mpc_parse_ex: \"%s\" read %li bytes, expected %li\n", inputs[index][1], bad.bytes, good.bytes);
+            failures++;
+        }
+        if (good.calls != 1 || bad.calls != 1) {
+            printf("mpc_profile: \"%s\" tried lispish %li times, expected 1\n", inputs[index][1], bad.calls);
+            failures++;
+        }
+        if (good.begins != 1 || bad.begins != 1) {
+            printf("mpc_parse_ex: \"%s\" traced lispish %i times, expected 1\n", inputs[index][1], bad.begins);
+            failures++;
+        }
+    }
+
+    mpc_cleanup(5, Number, Symbol, Sexpr, Expr, Lispish);
+
+    failures += check_regex();
+
+    if (failures) { return 1; }
+    puts("mpc_parse_ex: stats, profile and trace cover one run");
+    return 0;
+}
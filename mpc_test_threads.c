@@ -0,0 +1,149 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mpc.h"
+
+// Checks mpc_parse_many gives the same results as parsing
+// one input after another, and that grammars with the same
+// regexes can be built and deleted from several threads at
+// once, as they share compiled regexes through one cache.
+// Built with -fsanitize=thread where the compiler has it.
+
+#define INPUTS 64
+#define THREADS 4
+#define ROUNDS 16
+
+static const char* grammar =
+    " number  : /-?[0-9]+(\\.[0-9]+)?/ ;                    "
+    " word    : /[a-z]+/ ;                                  "
+    " expr    : <number> | <word> | '(' <expr>* ')' ;       "
+    " program : /^/ <expr>* /$/ ;                           ";
+
+static const char* items[] = {
+    "(add 1 2.5 (mul 3 -4))", "(max 1 (min 2 3) 4)", "-12.75", "(a (b (c)))",
+};
+
+static char* make_input(int index) {
+    char* input = malloc(256);
+    int count = 1 + index % 5;
+    input[0] = '\0';
+    for (int item = 0; item < count; item++) {
+        strcat(input, items[(index + item) % 4]);
+        strcat(input, " ");
+    }
+    // Every seventh input has a syntax error.
+    if (index % 7 == 0) { strcat(input, ")"); }
+    return input;
+}
+
+static int same_result(int x, mpc_result_t* a, int y, mpc_result_t* b) {
+    if (x != y) { return 0; }
+    if (x) { return mpc_ast_eq(a->output, b->output); }
+    char* s = mpc_err_string(a->error);
+    char* t = mpc_err_string(b->error);
+    int same = strcmp(s, t) == 0;
+    free(s);
+    free(t);
+    return same;
+}
+
+// Builds, uses and deletes the grammar over and over.
+static void* build_worker(void* data) {
+    int* failed = data;
+    for (int round = 0; round < ROUNDS; round++) {
+        mpc_parser_t* Number = mpc_new("number");
+        mpc_parser_t* Word = mpc_new("word");
+        mpc_parser_t* Expr = mpc_new("expr");
+        mpc_parser_t* Program = mpc_new("program");
+        mpc_parser_t* Re = mpc_re("[a-z]+");
+
+        mpc_err_t* err = mpca_lang(MPCA_LANG_DEFAULT, grammar, Number, Word, Expr, Program, NULL);
+        if (err) {
+            mpc_err_delete(err);
+            *failed = 1;
+        } else {
+            mpc_result_t r;
+            if (mpc_parse("<build>", items[round % 4], Program, &r)) {
+                mpc_ast_delete(r.output);
+            } else {
+                mpc_err_delete(r.error);
+                *failed = 1;
+            }
+        }
+
+        mpc_delete(Re);
+        mpc_cleanup(4, Number, Word, Expr, Program);
+    }
+    return NULL;
+}
+
+int main(void) {
+    int failures = 0;
+
+    mpc_parser_t* Number = mpc_new("number");
+    mpc_parser_t* Word = mpc_new("word");
+    mpc_parser_t* Expr = mpc_new("expr");
+    mpc_parser_t* Program = mpc_new("program");
+
+    mpc_err_t* err = mpca_lang(MPCA_LANG_DEFAULT, grammar, Number, Word, Expr, Program, NULL);
+    if (err) {
+        mpc_err_print(err);
+        mpc_err_delete(err);
+        return 1;
+    }
+
+    const char* inputs[INPUTS];
+    mpc_result_t many[INPUTS], one[INPUTS];
+    int oks[INPUTS], x[INPUTS];
+
+    for (int index = 0; index < INPUTS; index++) {
+        inputs[index] = make_input(index);
+    }
+
+    for (int index = 0; index < INPUTS; index++) {
+        x[index] = mpc_parse("<input>", inputs[index], Program, &one[index]);
+    }
+
+    int passed = mpc_parse_many("<input>", inputs, INPUTS, Program, many, oks, THREADS);
+
+    int expected = 0;
+    for (int index = 0; index < INPUTS; index++) {
+        expected += x[index];
+        if (!same_result(x[index], &one[index], oks[index], &many[index])) {
+            printf("mpc_parse_many: input %d differs from mpc_parse\n", index);
+            failures++;
+        }
+    }
+    if (passed != expected) {
+        printf("mpc_parse_many: %d parses passed, expected %d\n", passed, expected);
+        failures++;
+    }
+
+    for (int index = 0; index < INPUTS; index++) {
+        if (x[index]) { mpc_ast_delete(one[index].output); } else { mpc_err_delete(one[index].error); }
+        if (oks[index]) { mpc_ast_delete(many[index].output); } else { mpc_err_delete(many[index].error); }
+        free((char*)inputs[index]);
+    }
+
+    // The regexes of the grammar above stay in the cache while
+    // these threads add and remove references to them.
+    pthread_t threads[THREADS];
+    int failed[THREADS] = {0};
+    for (int thread = 0; thread < THREADS; thread++) {
+        pthread_create(&threads[thread], NULL, build_worker, &failed[thread]);
+    }
+    for (int thread = 0; thread < THREADS; thread++) {
+        pthread_join(threads[thread], NULL);
+        if (failed[thread]) {
+            printf("mpca_lang: thread %d failed to build or parse\n", thread);
+            failures++;
+        }
+    }
+
+    mpc_cleanup(4, Number, Word, Expr, Program);
+
+    if (failures) { return 1; }
+    puts("mpc_parse_many: all results match");
+    return 0;
+}
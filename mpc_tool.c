@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mpc.h"
+#include "mpc_tool.h"
+
+static const struct {
+    const char* name;
+    int flag;
+} flags[] = {
+    { "predictive",           MPCA_LANG_PREDICTIVE },
+    { "whitespace_sensitive", MPCA_LANG_WHITESPACE_SENSITIVE },
+    { "no_state",             MPCA_LANG_NO_STATE },
+    { "no_fuse",              MPCA_LANG_NO_FUSE },
+    { "no_inline",            MPCA_LANG_NO_INLINE },
+    { "no_factor",            MPCA_LANG_NO_FACTOR },
+    { "no_rule_ids",          MPCA_LANG_NO_RULE_IDS },
+};
+
+char* mpc_tool_read_file(const char* filename) {
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) { return NULL; }
+
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char* contents = malloc(length + 1);
+    size_t read = fread(contents, 1, length, file);
+    contents[read] = '\0';
+    fclose(file);
+
+    return contents;
+}
+
+int mpc_tool_flags(int argc, char** argv, int first, int* mode) {
+    for (int index = first; index < argc; index++) {
+        int found = 0;
+        for (size_t flag = 0; flag < sizeof(flags) / sizeof(flags[0]); flag++) {
+            if (strcmp(argv[index], flags[flag].name) == 0) {
+                *mode |= flags[flag].flag;
+                found = 1;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "%s: unknown flag '%s'\n", argv[0], argv[index]);
+            return 0;
+        }
+    }
+    return 1;
+}
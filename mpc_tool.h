@@ -0,0 +1,15 @@
+#ifndef mpc_tool_h
+#define mpc_tool_h
+
+// What mpc-gen and mpc-analyse share: reading a grammar file and
+// the flags given after it on the command line.
+
+// Reads a whole file into a new string, or returns NULL.
+char* mpc_tool_read_file(const char* filename);
+
+// Adds each flag in argv[first..argc) to *mode. The flags are the
+// MPCA_LANG_* ones in lower case, without the prefix. Returns 0
+// after reporting the first one which isn't known.
+int mpc_tool_flags(int argc, char** argv, int first, int* mode);
+
+#endif
@@ -28,6 +28,10 @@ void add_history(char* unused) { }
 #include <editline/history.h>
 #endif
 
+#ifndef LISPISH_GRAMMAR
+#define LISPISH_GRAMMAR "lispish.mpc"
+#endif
+
 #define ADD "+"
 #define SUB "-"
 #define MUL "*"
@@ -164,30 +168,40 @@ sval* sval_append(sval* fst, sval* snd) {
     return fst;
 }
 
+// Tag IDs of the rules, in the order they're given to mpca_lang.
+// Inner rules come first so mpc_ast_rule_id gives the one that
+// made a node.
+enum {
+    TAG_NUMBER = MPC_TAG_RULE,
+    TAG_SYMBOL,
+    TAG_INFIX,
+    TAG_BUILTIN,
+    TAG_SEXPR,
+    TAG_EXPR,
+    TAG_LISPISH
+};
+
 sval* sval_read(mpc_ast_t* pTree) {
-    // If symbol or number, return the conversion
-    // to that type.
-    if (strstr(pTree->tag, "number")) {
-        return sval_read_num(pTree);
-    }
+    sval* x = NULL;
 
-    if (strstr(pTree->tag, "symbol")){
-        return sval_sym(pTree->contents);
+    switch (mpc_ast_rule_id(pTree)) {
+        // If symbol or number, return the conversion
+        // to that type.
+        case TAG_NUMBER: return sval_read_num(pTree);
+        case TAG_SYMBOL: return sval_sym(pTree->contents);
+
+        // If we're at the root, which has no rule, or
+        // an s-expr then create an empty list.
+        case 0:
+        case TAG_SEXPR:
+            x = sval_sexpr();
+            break;
     }
 
-    // If we're at the root (>) or an s-expr then
-    // create an empty list.
-    sval* x = NULL;
-    if (strcmp(pTree->tag, ">") == 0
-    ||  strstr(pTree->tag, "sexpr"))
-    { x = sval_sexpr(); }
-
-    // Fill this new list with any valid expression within.
+    // Fill this new list with any valid expression within,
+    // skipping the brackets and anchors, which have no rule.
     for (int i = 0; i < pTree->children_num; i++) {
-        if (strcmp(pTree->children[i]->contents, "(") == 0
-        ||  strcmp(pTree->children[i]->contents, ")") == 0
-        ||  strcmp(pTree->children[i]->tag, "regex")  == 0)
-        { continue; }
+        if (mpc_ast_rule_id(pTree->children[i]) == 0) { continue; }
 
         x = sval_append(x, sval_read(pTree->children[i]));
     }
@@ -415,6 +429,17 @@ void sval_println(sval* s) {
     putchar('\n');
 }
 
+// Evaluate and print one top-level expression read from a file.
+// Called by mpc_parse_each as soon as the expression is parsed.
+int sval_eval_each(mpc_val_t* item, void* unused) {
+    (void)unused;
+    sval* evaluated = sval_eval(sval_read(item));
+    sval_println(evaluated);
+    sval_del(evaluated);
+    mpc_ast_delete(item);
+    return 1;
+}
+
 /*
 int number_of_nodes(mpc_ast_t* pTree) {
     // Base case, when there are no children.
@@ -445,19 +470,47 @@ int main(int argc, char** argv) {
     mpc_parser_t* Expr    = mpc_new("expr");
     mpc_parser_t* Lispish = mpc_new("lispish");
 
-    // Define them with the following grammar.
-    // (\.[0-9]+)?
-    mpca_lang(MPCA_LANG_DEFAULT,
-    "                                                          \
-       number   : /-?[0-9]+(\\.[0-9]+)?/ ;                                          \
-       symbol   : '+' | '-' | '*' | '/' | '%' | '^' ;                   \
-       infix    : \"add\" | \"sub\" | \"mul\" | \"div\" | \"mod\" ;     \
-       builtin  : \"min\" | \"max\" ;                                   \
-       sexpr    : '(' <expr>* ')' ;                                     \
-       expr     : <number> | <symbol> | <infix> | <builtin> | <sexpr> ; \
-       lispish  : /^/ <expr>* /$/;                                      \
-    ",
-    Number, Symbol, Infix, Builtin, Sexpr, Expr, Lispish);
+    // Define them with the grammar in lispish.mpc, which mpc-gen and
+    // mpc-bench also read. The reader never looks at node positions,
+    // so skip capturing them.
+    mpc_err_t* err = mpca_lang_contents(MPCA_LANG_NO_STATE, LISPISH_GRAMMAR,
+        Number, Symbol, Infix, Builtin, Sexpr, Expr, Lispish);
+    if (err) {
+        mpc_err_print(err);
+        mpc_err_delete(err);
+        mpc_cleanup(7, Number, Symbol, Infix, Builtin, Sexpr, Expr, Lispish);
+        return 1;
+    }
+
+    // Given files, evaluate every expression in them in turn
+    // instead of starting the REPL. Each expression is handed
+    // over as soon as it is read, so files of any size work.
+    if (argc > 1) {
+        mpc_parser_t* Item = mpc_stripl(Expr);
+        int status = 0;
+
+        for (int index = 1; index < argc; index++) {
+            FILE* file = fopen(argv[index], "r");
+            if (file == NULL) {
+                fprintf(stderr, "Could not open %s\n", argv[index]);
+                status = 1;
+                continue;
+            }
+
+            mpc_result_t res;
+            if (!mpc_parse_each(argv[index], file, Item, sval_eval_each, NULL, &res)) {
+                mpc_err_print(res.error);
+                mpc_err_delete(res.error);
+                status = 1;
+            }
+
+            fclose(file);
+        }
+
+        mpc_delete(Item);
+        mpc_cleanup(7, Number, Symbol, Infix, Builtin, Sexpr, Expr, Lispish);
+        return status;
+    }
 
     // Print out the version info and exit command.
     puts("Lispish Version 0.0.0\n");